@@ -0,0 +1,836 @@
+/*++
+
+Module Name:
+
+    bench.cpp
+
+Abstract:
+
+    Microbenchmarks for the report pipeline: HidP_ParseReportDescriptor,
+    FillDeviceInfo, UnpackReport, UnpackInputReport (the compiled decoder),
+    PackReport and FindKnownHidDevices. Each is reported as nanoseconds and heap
+    allocations per operation so decoder and enumeration changes can be
+    judged with numbers.
+
+    The synthetic cases build devices from the report descriptors below and
+    need the descriptor parser of the hidraw backend; before anything is
+    timed, each is checked against the caps and report lengths it is known
+    to describe, a few malformed descriptors have to be refused, and the
+    compiled decoder has to agree with UnpackReport on every report. The
+    system case enumerates the HID devices actually present and runs the
+    same operations against each of them, so it also works on Windows.
+
+    Allocations are counted by replacing the global operator new; memory
+    the HidP routines allocate outside of it (hid.dll) is not seen.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+#ifdef _WIN32
+#include <wtypes.h>
+#include "hidsdi.h"
+#endif
+#include "hid.h"
+#include "hiddevice.h"
+
+#ifdef _MSC_VER
+#pragma comment(lib, "hid.lib")
+#pragma comment(lib, "setupapi.lib")
+#pragma comment(lib, "cfgmgr32.lib")
+#endif
+
+//
+// Each measurement runs for at least this long and this many operations.
+//
+#define BENCH_MIN_TIME          std::chrono::milliseconds(200)
+#define BENCH_MIN_ITERATIONS    1000
+#define BENCH_REPORT_POOL       256
+
+static ULONGLONG allocationCount;
+
+void* operator new(size_t size)
+{
+    void* block;
+
+    allocationCount++;
+
+    if ((block = malloc(size != 0 ? size : 1)) == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return block;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    allocationCount++;
+    return malloc(size != 0 ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void* block) noexcept
+{
+    free(block);
+}
+
+void operator delete[](void* block) noexcept
+{
+    free(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+    free(block);
+}
+
+void operator delete[](void* block, size_t) noexcept
+{
+    free(block);
+}
+
+#ifndef _WIN32
+//
+// The Alienware consumer control collection: report ID 2, one 16 bit array
+// slot over the consumer page, macro keys at 0x4c-0x4f.
+//
+static const UCHAR consumerDescriptor[] =
+{
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02,
+    0x19, 0x00, 0x2A, 0x3C, 0x02, 0x15, 0x00, 0x26, 0x3C, 0x02,
+    0x95, 0x01, 0x75, 0x10, 0x81, 0x00,
+    0xC0
+};
+
+//
+// Full NKRO keyboard: modifier bitmap, a bitmap over usages 0x00-0xDF and
+// a five LED output report.
+//
+static const UCHAR keyboardDescriptor[] =
+{
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x01,
+    0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+    0x19, 0x00, 0x29, 0xDF, 0x95, 0xE0, 0x81, 0x02,
+    0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x95, 0x05, 0x91, 0x02,
+    0x95, 0x03, 0x91, 0x01,
+    0xC0
+};
+
+//
+// Mouse mixing buttons with signed and physically scaled values.
+//
+static const UCHAR mixedDescriptor[] =
+{
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01,
+    0x95, 0x05, 0x75, 0x01, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x81, 0x01,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0xF8, 0x26, 0xFF, 0x07,
+    0x75, 0x0C, 0x95, 0x02, 0x81, 0x06,
+    0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x35, 0x00, 0x45, 0x64,
+    0x75, 0x08, 0x95, 0x01, 0x81, 0x06,
+    0x09, 0x36, 0x15, 0x00, 0x25, 0x0A, 0x75, 0x05, 0x95, 0x01, 0x81, 0x02,
+    0x75, 0x03, 0x95, 0x01, 0x81, 0x01,
+    0xC0, 0xC0
+};
+
+//
+// A constant pad of 65536 bytes ahead of a consumer array: far more than
+// any report may hold, and more than a USHORT report length can say.
+//
+static const UCHAR oversizedDescriptor[] =
+{
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01,
+    0x75, 0x08, 0x97, 0x00, 0x00, 0x01, 0x00, 0x81, 0x01,
+    0x15, 0x00, 0x26, 0xFF, 0x03, 0x19, 0x00, 0x2A, 0xFF, 0x03,
+    0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+    0xC0
+};
+
+//
+// The consumer collection with its End Collection missing, and with one
+// too many.
+//
+static const UCHAR unclosedDescriptor[] =
+{
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02,
+    0x19, 0x00, 0x2A, 0x3C, 0x02, 0x15, 0x00, 0x26, 0x3C, 0x02,
+    0x95, 0x01, 0x75, 0x10, 0x81, 0x00
+};
+
+static const UCHAR overclosedDescriptor[] =
+{
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02,
+    0x19, 0x00, 0x2A, 0x3C, 0x02, 0x15, 0x00, 0x26, 0x3C, 0x02,
+    0x95, 0x01, 0x75, 0x10, 0x81, 0x00,
+    0xC0, 0xC0
+};
+
+//
+// A Pop with nothing pushed.
+//
+static const UCHAR unbalancedPopDescriptor[] =
+{
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0xA4,
+    0x75, 0x08, 0x95, 0x01, 0xB4, 0xB4,
+    0xC0
+};
+
+//
+// What the parser has to make of each descriptor, as HidP_GetCaps,
+// HidP_GetButtonCaps and HidP_GetValueCaps on Windows would.
+//
+typedef struct _BENCH_CAPS
+{
+    HIDP_REPORT_TYPE    ReportType;
+    bool                IsButton;
+    UCHAR               ReportID;
+    USAGE               UsagePage;
+    USAGE               UsageMin;
+    USAGE               UsageMax;           // UsageMin when not a range
+    USHORT              LinkCollection;
+    USHORT              ReportCount;
+    USHORT              BitSize;            // Values only, as are the ranges
+    LONG                LogicalMin;
+    LONG                LogicalMax;
+    LONG                PhysicalMin;
+    LONG                PhysicalMax;
+} BENCH_CAPS;
+
+typedef struct _BENCH_EXPECTED
+{
+    USAGE               UsagePage;
+    USAGE               Usage;
+    USHORT              ReportByteLength[3];        // Indexed by HIDP_REPORT_TYPE
+    USHORT              NumberDataIndices[3];
+    USHORT              NumberLinkCollectionNodes;
+    const BENCH_CAPS*   Caps;
+    ULONG               NumberCaps;
+} BENCH_EXPECTED;
+
+static const BENCH_CAPS consumerCaps[] =
+{
+    { HidP_Input, true, 2, 0x0C, 0x000, 0x23C, 0, 1, 0, 0, 0, 0, 0 },
+};
+
+static const BENCH_CAPS keyboardCaps[] =
+{
+    { HidP_Input, true, 1, 0x07, 0xE0, 0xE7, 0, 8, 0, 0, 0, 0, 0 },
+    { HidP_Input, true, 1, 0x07, 0x00, 0xDF, 0, 224, 0, 0, 0, 0, 0 },
+    { HidP_Output, true, 1, 0x08, 0x01, 0x05, 0, 5, 0, 0, 0, 0, 0 },
+};
+
+static const BENCH_CAPS mixedCaps[] =
+{
+    { HidP_Input, true, 0, 0x09, 0x01, 0x05, 1, 5, 0, 0, 0, 0, 0 },
+    { HidP_Input, false, 0, 0x01, 0x30, 0x31, 1, 2, 12, -2047, 2047, 0, 0 },
+    { HidP_Input, false, 0, 0x01, 0x38, 0x38, 1, 1, 8, -127, 127, 0, 100 },
+    { HidP_Input, false, 0, 0x01, 0x36, 0x36, 1, 1, 5, 0, 10, 0, 100 },
+};
+
+static const BENCH_EXPECTED consumerExpected =
+{
+    0x0C, 0x01, { 3, 0, 0 }, { 573, 0, 0 }, 1, consumerCaps, sizeof(consumerCaps) / sizeof(consumerCaps[0])
+};
+
+static const BENCH_EXPECTED keyboardExpected =
+{
+    0x01, 0x06, { 30, 2, 0 }, { 232, 5, 0 }, 1, keyboardCaps, sizeof(keyboardCaps) / sizeof(keyboardCaps[0])
+};
+
+static const BENCH_EXPECTED mixedExpected =
+{
+    0x01, 0x02, { 7, 0, 0 }, { 9, 0, 0 }, 2, mixedCaps, sizeof(mixedCaps) / sizeof(mixedCaps[0])
+};
+
+typedef struct _BENCH_DESCRIPTOR
+{
+    const char*             Name;
+    const UCHAR*            Descriptor;
+    ULONG                   DescriptorLength;
+    const BENCH_EXPECTED*   Expected;       // Null when the parser must refuse it
+} BENCH_DESCRIPTOR;
+
+static const BENCH_DESCRIPTOR benchDescriptors[] =
+{
+    { "consumer", consumerDescriptor, sizeof(consumerDescriptor), &consumerExpected },
+    { "nkro-keyboard", keyboardDescriptor, sizeof(keyboardDescriptor), &keyboardExpected },
+    { "mixed", mixedDescriptor, sizeof(mixedDescriptor), &mixedExpected },
+};
+
+static const BENCH_DESCRIPTOR malformedDescriptors[] =
+{
+    { "oversized", oversizedDescriptor, sizeof(oversizedDescriptor), nullptr },
+    { "unclosed", unclosedDescriptor, sizeof(unclosedDescriptor), nullptr },
+    { "overclosed", overclosedDescriptor, sizeof(overclosedDescriptor), nullptr },
+    { "unbalanced-pop", unbalancedPopDescriptor, sizeof(unbalancedPopDescriptor), nullptr },
+};
+#endif
+
+template <typename Operation>
+static void Measure(
+    const char*     CaseName,
+    const char*     OperationName,
+    Operation       Run
+)
+/*++
+RoutineDescription:
+   Run Operation(iteration) until both minimums are met and print the mean
+   time and allocation count per call. Operation may return the time it
+   wants charged, to leave setup and teardown out of the figure, or 0 to
+   be charged the wall time of the call.
+--*/
+{
+    std::chrono::steady_clock::time_point   start = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds                elapsed(0);
+    ULONGLONG                               allocations = allocationCount;
+    ULONGLONG                               iterations = 0;
+
+    while (iterations < BENCH_MIN_ITERATIONS || std::chrono::steady_clock::now() - start < BENCH_MIN_TIME)
+    {
+        std::chrono::steady_clock::time_point   callStart = std::chrono::steady_clock::now();
+        ULONGLONG                               charged = Run(iterations);
+
+        elapsed += charged != 0 ? std::chrono::nanoseconds(charged) : std::chrono::steady_clock::now() - callStart;
+        iterations++;
+    }
+
+    printf("%-16s %-20s %12.1f %12.2f\n",
+           CaseName,
+           OperationName,
+           (double)elapsed.count() / iterations,
+           (double)(allocationCount - allocations) / iterations);
+}
+
+static void FillReportPool(
+    PHID_DEVICE         HidDevice,
+    std::vector<CHAR>&  Pool
+)
+/*++
+RoutineDescription:
+   Fill the pool with pseudo random reports carrying the report IDs the
+   device actually uses, so every report is decoded rather than skipped.
+--*/
+{
+    ULONG   length = HidDevice->Caps.InputReportByteLength;
+    ULONG   seed = 0x2545F491;
+
+    Pool.assign((size_t)BENCH_REPORT_POOL * length, 0);
+
+    for (ULONG i = 0; i < BENCH_REPORT_POOL; i++)
+    {
+        PCHAR report = Pool.data() + (size_t)i * length;
+
+        for (ULONG b = 1; b < length; b++)
+        {
+            seed = seed * 1103515245 + 12345;
+            report[b] = (CHAR)(seed >> 16);
+        }
+
+        if (HidDevice->InputDataLength > 0)
+        {
+            report[0] = (CHAR)HidDevice->InputData[i % HidDevice->InputDataLength].ReportID;
+        }
+    }
+}
+
+static std::vector<USAGE> UsageSet(
+    const HID_DATA&     Data
+)
+{
+    std::vector<USAGE> usages;
+
+    for (ULONG u = 0; u < Data.ButtonData.MaxUsageLength && Data.ButtonData.Usages[u] != 0; u++)
+    {
+        usages.push_back(Data.ButtonData.Usages[u]);
+    }
+    std::sort(usages.begin(), usages.end());
+    return usages;
+}
+
+static bool CheckDecoder(
+    const char*     CaseName,
+    PHID_DEVICE     HidDevice
+)
+/*++
+RoutineDescription:
+   Unpack every report of the pool both through UnpackReport, into a
+   scratch copy of InputData, and through UnpackInputReport, and print
+   every entry where the two disagree on the status, the usages down or
+   the value. Usage lists are compared as sets since HidP does not
+   promise an order. Only a decoder that agrees is worth timing.
+--*/
+{
+    std::vector<CHAR>                   pool;
+    std::vector<HID_DATA>               reference(HidDevice->InputData, HidDevice->InputData + HidDevice->InputDataLength);
+    std::vector<std::vector<USAGE>>     usages(reference.size());
+    ULONG                               length = HidDevice->Caps.InputReportByteLength;
+    ULONG                               mismatches = 0;
+
+    if (length == 0 || HidDevice->InputData == nullptr)
+    {
+        return true;
+    }
+
+    FillReportPool(HidDevice, pool);
+
+    for (size_t i = 0; i < reference.size(); i++)
+    {
+        if (reference[i].IsButtonData)
+        {
+            usages[i].assign(reference[i].ButtonData.MaxUsageLength + 1, 0);
+            reference[i].ButtonData.Usages = usages[i].data();
+        }
+    }
+
+    for (ULONG r = 0; r < BENCH_REPORT_POOL; r++)
+    {
+        PCHAR   report = pool.data() + (size_t)r * length;
+        bool    unpacked = UnpackReport(report, (USHORT)length, HidP_Input, reference.data(), (ULONG)reference.size(), HidDevice->Ppd);
+        bool    decoded;
+
+        std::memcpy(HidDevice->InputReportBuffer, report, length);
+        decoded = UnpackInputReport(HidDevice);
+
+        if (unpacked != decoded)
+        {
+            fprintf(stderr, "%s: report %lu: UnpackReport %s, UnpackInputReport %s\n", CaseName, (unsigned long)r,
+                    unpacked ? "succeeded" : "failed", decoded ? "succeeded" : "failed");
+            mismatches++;
+            continue;
+        }
+
+        for (size_t i = 0; unpacked && i < reference.size(); i++)
+        {
+            const HID_DATA& expected = reference[i];
+            const HID_DATA& actual = HidDevice->InputData[i];
+
+            if (expected.ReportID != (UCHAR)report[0])
+            {
+                continue;
+            }
+
+            if (actual.Status != expected.Status)
+            {
+                fprintf(stderr, "%s: report %lu entry %lu: status %08lx, UnpackReport %08lx\n", CaseName, (unsigned long)r,
+                        (unsigned long)i, (unsigned long)actual.Status, (unsigned long)expected.Status);
+                mismatches++;
+            }
+            else if (expected.IsButtonData && UsageSet(actual) != UsageSet(expected))
+            {
+                fprintf(stderr, "%s: report %lu entry %lu: usages differ from UnpackReport's\n", CaseName, (unsigned long)r,
+                        (unsigned long)i);
+                mismatches++;
+            }
+            else if (!expected.IsButtonData &&
+                     (actual.ValueData.Value != expected.ValueData.Value ||
+                      (expected.Status == HIDP_STATUS_SUCCESS && actual.ValueData.ScaledValue != expected.ValueData.ScaledValue)))
+            {
+                fprintf(stderr, "%s: report %lu entry %lu: value %lu scaled %ld, UnpackReport %lu scaled %ld\n", CaseName, (unsigned long)r,
+                        (unsigned long)i, (unsigned long)actual.ValueData.Value, (long)actual.ValueData.ScaledValue,
+                        (unsigned long)expected.ValueData.Value, (long)expected.ValueData.ScaledValue);
+                mismatches++;
+            }
+        }
+    }
+
+    if (mismatches != 0)
+    {
+        fprintf(stderr, "%s: UnpackInputReport disagrees with UnpackReport %lu time(s)\n", CaseName, (unsigned long)mismatches);
+    }
+    return mismatches == 0;
+}
+
+static void BenchDevice(
+    const char*     CaseName,
+    PHID_DEVICE     HidDevice
+)
+{
+    std::vector<CHAR>   pool;
+    ULONG               length = HidDevice->Caps.InputReportByteLength;
+
+    if (length == 0 || HidDevice->InputData == nullptr)
+    {
+        return;
+    }
+
+    FillReportPool(HidDevice, pool);
+
+    Measure(CaseName, "FillDeviceInfo", [&](ULONGLONG) -> ULONGLONG
+    {
+        HID_DEVICE  device = {};
+
+        device.HidDevice = INVALID_HANDLE_VALUE;
+        device.Ppd = HidDevice->Ppd;
+        device.Caps = HidDevice->Caps;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        FillDeviceInfo(&device);
+        ULONGLONG charged = (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        // The preparsed data belongs to HidDevice
+        device.Ppd = nullptr;
+        CloseHidDevice(&device);
+        return charged;
+    });
+
+    Measure(CaseName, "UnpackReport", [&](ULONGLONG Iteration) -> ULONGLONG
+    {
+        UnpackReport(pool.data() + (Iteration % BENCH_REPORT_POOL) * length,
+                     (USHORT)length,
+                     HidP_Input,
+                     HidDevice->InputData,
+                     HidDevice->InputDataLength,
+                     HidDevice->Ppd);
+        return 0;
+    });
+
+    Measure(CaseName, "UnpackInputReport", [&](ULONGLONG Iteration) -> ULONGLONG
+    {
+        std::memcpy(HidDevice->InputReportBuffer, pool.data() + (Iteration % BENCH_REPORT_POOL) * length, length);
+        UnpackInputReport(HidDevice);
+        return 0;
+    });
+
+    // The last decoded report gives PackReport realistic data to write back
+    Measure(CaseName, "PackReport", [&](ULONGLONG) -> ULONGLONG
+    {
+        PackReport(HidDevice->InputReportBuffer,
+                   (USHORT)length,
+                   HidP_Input,
+                   HidDevice->InputData,
+                   HidDevice->InputDataLength,
+                   HidDevice->Ppd);
+        return 0;
+    });
+
+    //
+    // FillDeviceInfo leaves output and feature state for whoever needs it;
+    // the second figure is what laying it out anyway costs.
+    //
+    printf("%-16s %-20s %12llu bytes\n", CaseName, "footprint", (unsigned long long)GetHidDeviceFootprint(HidDevice));
+
+    if (PrepareHidReports(HidDevice, HidP_Output) && PrepareHidReports(HidDevice, HidP_Feature))
+    {
+        printf("%-16s %-20s %12llu bytes\n", CaseName, "footprint (all)", (unsigned long long)GetHidDeviceFootprint(HidDevice));
+    }
+}
+
+#ifndef _WIN32
+static const char* const reportTypeNames[] = { "input", "output", "feature" };
+
+static bool SameCaps(
+    const BENCH_CAPS&   Left,
+    const BENCH_CAPS&   Right
+)
+{
+    return Left.ReportID == Right.ReportID &&
+           Left.UsagePage == Right.UsagePage &&
+           Left.UsageMin == Right.UsageMin &&
+           Left.UsageMax == Right.UsageMax &&
+           Left.LinkCollection == Right.LinkCollection &&
+           Left.ReportCount == Right.ReportCount &&
+           Left.BitSize == Right.BitSize &&
+           Left.LogicalMin == Right.LogicalMin &&
+           Left.LogicalMax == Right.LogicalMax &&
+           Left.PhysicalMin == Right.PhysicalMin &&
+           Left.PhysicalMax == Right.PhysicalMax;
+}
+
+static void PrintCaps(
+    const char*         Prefix,
+    const BENCH_CAPS&   Caps
+)
+{
+    fprintf(stderr, "  %-8s id %u usage %04x:%04x-%04x link %u count %u",
+            Prefix, Caps.ReportID, Caps.UsagePage, Caps.UsageMin, Caps.UsageMax, Caps.LinkCollection, Caps.ReportCount);
+    if (!Caps.IsButton)
+    {
+        fprintf(stderr, " bits %u logical %ld..%ld physical %ld..%ld",
+                Caps.BitSize, (long)Caps.LogicalMin, (long)Caps.LogicalMax, (long)Caps.PhysicalMin, (long)Caps.PhysicalMax);
+    }
+    fprintf(stderr, "\n");
+}
+
+static bool CheckCapsList(
+    const char*                     Name,
+    const BENCH_EXPECTED*           Expected,
+    HIDP_REPORT_TYPE                ReportType,
+    bool                            IsButton,
+    const std::vector<BENCH_CAPS>&  Actual
+)
+/*++
+RoutineDescription:
+   Compare the button or value caps of one report type, in order, with the
+   expected entries of that kind.
+--*/
+{
+    std::vector<BENCH_CAPS> expected;
+    bool                    matches;
+
+    for (ULONG i = 0; i < Expected->NumberCaps; i++)
+    {
+        if (Expected->Caps[i].ReportType == ReportType && Expected->Caps[i].IsButton == IsButton)
+        {
+            expected.push_back(Expected->Caps[i]);
+        }
+    }
+
+    matches = expected.size() == Actual.size();
+    for (size_t i = 0; matches && i < expected.size(); i++)
+    {
+        matches = SameCaps(expected[i], Actual[i]);
+    }
+
+    if (!matches)
+    {
+        fprintf(stderr, "%s: %s %s caps differ\n", Name, reportTypeNames[ReportType], IsButton ? "button" : "value");
+        for (const BENCH_CAPS& caps : expected)
+        {
+            PrintCaps("expected", caps);
+        }
+        for (const BENCH_CAPS& caps : Actual)
+        {
+            PrintCaps("parsed", caps);
+        }
+    }
+    return matches;
+}
+
+static bool CheckDescriptor(
+    const BENCH_DESCRIPTOR& Bench
+)
+/*++
+RoutineDescription:
+   Parse the descriptor and compare the HIDP_CAPS, button and value caps the
+   HidP routines report with the ones it is known to describe, printing
+   every difference. A malformed descriptor passes when it is refused.
+--*/
+{
+    const BENCH_EXPECTED*   expected = Bench.Expected;
+    PHIDP_PREPARSED_DATA    ppd;
+    ULONG                   numberCollections;
+    HIDP_CAPS               caps;
+    bool                    matches = true;
+
+    if (!HidP_ParseReportDescriptor(Bench.Descriptor, Bench.DescriptorLength, 0, &ppd, &numberCollections))
+    {
+        if (expected != nullptr)
+        {
+            fprintf(stderr, "%s: descriptor rejected\n", Bench.Name);
+            return false;
+        }
+        return true;
+    }
+
+    if (expected == nullptr)
+    {
+        fprintf(stderr, "%s: malformed descriptor accepted\n", Bench.Name);
+        HidD_FreePreparsedData(ppd);
+        return false;
+    }
+
+    HidP_GetCaps(ppd, &caps);
+
+    const USHORT lengths[3] = { caps.InputReportByteLength, caps.OutputReportByteLength, caps.FeatureReportByteLength };
+    const USHORT indices[3] = { caps.NumberInputDataIndices, caps.NumberOutputDataIndices, caps.NumberFeatureDataIndices };
+    const USHORT buttons[3] = { caps.NumberInputButtonCaps, caps.NumberOutputButtonCaps, caps.NumberFeatureButtonCaps };
+    const USHORT values[3] = { caps.NumberInputValueCaps, caps.NumberOutputValueCaps, caps.NumberFeatureValueCaps };
+
+    if (caps.UsagePage != expected->UsagePage || caps.Usage != expected->Usage)
+    {
+        fprintf(stderr, "%s: top level usage %04x:%04x, expected %04x:%04x\n",
+                Bench.Name, caps.UsagePage, caps.Usage, expected->UsagePage, expected->Usage);
+        matches = false;
+    }
+
+    if (caps.NumberLinkCollectionNodes != expected->NumberLinkCollectionNodes)
+    {
+        fprintf(stderr, "%s: %u link collection(s), expected %u\n",
+                Bench.Name, caps.NumberLinkCollectionNodes, expected->NumberLinkCollectionNodes);
+        matches = false;
+    }
+
+    for (int type = HidP_Input; type <= HidP_Feature; type++)
+    {
+        HIDP_REPORT_TYPE                reportType = (HIDP_REPORT_TYPE)type;
+        std::vector<HIDP_BUTTON_CAPS>   buttonCaps(buttons[type]);
+        std::vector<HIDP_VALUE_CAPS>    valueCaps(values[type]);
+        std::vector<BENCH_CAPS>         actual;
+        USHORT                          length;
+
+        if (lengths[type] != expected->ReportByteLength[type])
+        {
+            fprintf(stderr, "%s: %s reports of %u byte(s), expected %u\n",
+                    Bench.Name, reportTypeNames[type], lengths[type], expected->ReportByteLength[type]);
+            matches = false;
+        }
+
+        if (indices[type] != expected->NumberDataIndices[type])
+        {
+            fprintf(stderr, "%s: %u %s data indices, expected %u\n",
+                    Bench.Name, indices[type], reportTypeNames[type], expected->NumberDataIndices[type]);
+            matches = false;
+        }
+
+        length = buttons[type];
+        if (length > 0)
+        {
+            HidP_GetButtonCaps(reportType, buttonCaps.data(), &length, ppd);
+        }
+        for (USHORT i = 0; i < length; i++)
+        {
+            const HIDP_BUTTON_CAPS& button = buttonCaps[i];
+
+            actual.push_back({ reportType, true, button.ReportID, button.UsagePage,
+                               button.IsRange ? button.Range.UsageMin : button.NotRange.Usage,
+                               button.IsRange ? button.Range.UsageMax : button.NotRange.Usage,
+                               button.LinkCollection, button.ReportCount, 0, 0, 0, 0, 0 });
+        }
+        matches = CheckCapsList(Bench.Name, expected, reportType, true, actual) && matches;
+
+        actual.clear();
+        length = values[type];
+        if (length > 0)
+        {
+            HidP_GetValueCaps(reportType, valueCaps.data(), &length, ppd);
+        }
+        for (USHORT i = 0; i < length; i++)
+        {
+            const HIDP_VALUE_CAPS& value = valueCaps[i];
+
+            actual.push_back({ reportType, false, value.ReportID, value.UsagePage,
+                               value.IsRange ? value.Range.UsageMin : value.NotRange.Usage,
+                               value.IsRange ? value.Range.UsageMax : value.NotRange.Usage,
+                               value.LinkCollection, value.ReportCount, value.BitSize,
+                               value.LogicalMin, value.LogicalMax, value.PhysicalMin, value.PhysicalMax });
+        }
+        matches = CheckCapsList(Bench.Name, expected, reportType, false, actual) && matches;
+    }
+
+    HidD_FreePreparsedData(ppd);
+    return matches;
+}
+#endif
+
+int main(int argc, char* argv[])
+{
+    HidDeviceRegistry   registry;
+
+    (void)argc;
+    (void)argv;
+
+#ifndef _WIN32
+    //
+    // Timing a parser that gets the descriptors wrong, or accepts broken
+    // ones, is pointless; check the corpus first.
+    //
+    bool corpusMatches = true;
+
+    for (const BENCH_DESCRIPTOR& bench : benchDescriptors)
+    {
+        corpusMatches = CheckDescriptor(bench) && corpusMatches;
+    }
+    for (const BENCH_DESCRIPTOR& bench : malformedDescriptors)
+    {
+        corpusMatches = CheckDescriptor(bench) && corpusMatches;
+    }
+    if (!corpusMatches)
+    {
+        return 1;
+    }
+#endif
+
+    printf("%-16s %-20s %12s %12s\n", "case", "operation", "ns/op", "allocs/op");
+
+#ifndef _WIN32
+    for (const BENCH_DESCRIPTOR& bench : benchDescriptors)
+    {
+        HID_DEVICE          hidDevice;
+        HIDD_ATTRIBUTES     attributes = { sizeof(HIDD_ATTRIBUTES), 0, 0, 0 };
+
+        //
+        // Every interface found at startup is parsed once per collection,
+        // so this has to stay well below the cost of opening it.
+        //
+        Measure(bench.Name, "ParseDescriptor", [&](ULONGLONG) -> ULONGLONG
+        {
+            PHIDP_PREPARSED_DATA    ppd;
+            ULONG                   numberCollections;
+
+            if (HidP_ParseReportDescriptor(bench.Descriptor, bench.DescriptorLength, 0, &ppd, &numberCollections))
+            {
+                HidD_FreePreparsedData(ppd);
+            }
+            return 0;
+        });
+
+        if (!OpenHidDeviceFromDescriptor(bench.Name, INVALID_HANDLE_VALUE, bench.Descriptor, bench.DescriptorLength, 0, &attributes, &hidDevice))
+        {
+            fprintf(stderr, "%s: descriptor rejected\n", bench.Name);
+            return 1;
+        }
+
+        if (!CheckDecoder(bench.Name, &hidDevice))
+        {
+            CloseHidDevice(&hidDevice);
+            return 1;
+        }
+
+        BenchDevice(bench.Name, &hidDevice);
+        CloseHidDevice(&hidDevice);
+    }
+#endif
+
+    Measure("system", "FindKnownHidDevices", [&](ULONGLONG) -> ULONGLONG
+    {
+        registry.Enumerate(nullptr);
+        registry.Clear();
+        return 0;
+    });
+
+    if (registry.Enumerate(nullptr))
+    {
+        HID_ENUMERATION_TIMING timing;
+
+        printf("system: %lu HID device(s)\n", (unsigned long)registry.Size());
+
+        if (GetHidEnumerationTiming(&timing, nullptr, 0))
+        {
+            printf("system: probed %lu interface(s) in %llu us on %lu thread(s), %llu us one after the other\n",
+                   (unsigned long)timing.NumberProbes, (unsigned long long)(timing.Elapsed / 1000),
+                   (unsigned long)timing.Workers, (unsigned long long)(timing.ProbeTotal / 1000));
+        }
+
+        for (UniqueHidDevice& device : registry)
+        {
+            char name[32];
+
+            snprintf(name, sizeof(name), "%04x:%04x/%04x:%04x",
+                     device->Attributes.VendorID, device->Attributes.ProductID,
+                     device->Caps.UsagePage, device->Caps.Usage);
+            BenchDevice(name, device.Get());
+        }
+    }
+
+    return 0;
+}
@@ -23,21 +23,37 @@
 
 #pragma once
 
+#include "actions.h"
+#include "eventserver.h"
 #include "hid.h"
+#include "inject.h"
+#include "keyboards.h"
+#ifdef _WIN32
 #include <minwindef.h>
+#endif
 
-// Following are correct for Alienware m17 R4. Other machines may need other VID/PIDs. Problem for another day.
-#define AW_KB_VID       "0x0d62"
-#define AW_KB_PID       "0x1a1c"
-#define AW_USAGEPAGE    0x0c
-#define AW_USAGE        0x01
-
+// The macro keys as HandleMacroKey takes them, whatever usages a keyboard sends them as (see keyboards.h)
 #define MACROA          0x4c
 #define MACROB          0x4d
 #define MACROC          0x4e
 #define MACROD          0x4f
 
-#define READ_THREAD_TIMEOUT     1000
+// Per-device state for every interface the monitor has open.
+typedef struct _MONITORED_DEVICE
+{
+    HID_DEVICE              HidDevice;
+    const KNOWN_KEYBOARD*   Keyboard;
+    const MACRO_ACTION_MAP* Actions;        // What each of the keyboard's macro keys does
+    PHID_DATA               MacroData;      // Button data carrying the keyboard's macro usages
+    USHORT                  Device;         // Its slot, the number event clients know it by
+    USAGE                   HeldKey;        // Macro key down as of the last report, 0 for none
+    bool                    Attached;       // Still attached to the event loop
+    USHORT                  CaptureId;      // Device id in the capture file, when capturing
+} MONITORED_DEVICE, * PMONITORED_DEVICE;
 
-DWORD StartMonitor(WORD targetVID, WORD targetPID);
-void HandleMacroKey(USAGE macroKey);
\ No newline at end of file
+// A zero VID/PID monitors every known keyboard. Macro key actions go to keySink, or are only printed without one;
+// presses and releases also go to the clients of eventServer when there is one
+DWORD StartMonitor(WORD targetVID, WORD targetPID, ULONG queueDepth, LPCSTR captureFile, bool hotplug, PKEY_SINK keySink, PEVENT_SERVER eventServer);
+DWORD ReplayMonitor(LPCSTR replayFile, bool realTime, PKEY_SINK keySink, PEVENT_SERVER eventServer);
+void StopMonitor(void);
+void HandleMacroKey(USAGE macroKey, const MACRO_ACTION* action);
\ No newline at end of file
@@ -0,0 +1,120 @@
+/*++
+
+Module Name:
+
+    actions.h
+
+Abstract:
+
+    What each macro key does, see actions.cpp.
+
+    By default macro key n of a keyboard (counted from its MacroUsageMin,
+    see keyboards.h) sends F13 + n. LoadMacroActions changes that from a
+    text file, one key per line:
+
+        # VID   PID    Usage Action
+        0x0d62 0x1a1c 0x4c  key F13
+        0x0d62 0x1a1c 0x4d  combo Ctrl+Shift+Esc
+        0x0d62 0x1a1c 0x4e  sequence H E L L O Enter
+        0x0d62 0x1a1c 0x4f  macro Ctrl+A wait 20 text "Hello 2" down Shift wait 0.5 up Shift
+
+    Usage is the button usage the keyboard sends the key as, which has to
+    lie within its macro range, and "none" makes the key do nothing. A
+    combo presses its keys in order and releases them in reverse; a
+    sequence presses and releases each in turn. A macro is a series of
+    steps played on the macro player's thread (see player.h), each a key
+    or combo pressed as above, "down K" or "up K", "wait" a number of
+    milliseconds (fractions allowed, up to a minute) or "text" followed by
+    a quoted string of letters, digits and spaces to type. Keys are A-Z,
+    0-9, F1-F24, Enter, Esc, Backspace, Tab, Space, Ctrl, Shift, Alt and
+    Win (with an L or R prefix for one side) or a keyboard page usage in
+    hex.
+
+    Each keyboard's actions are compiled into a dense table indexed by
+    macro key number while the file is loaded, so finding the action for
+    a key press is one bounds check and one load.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef ACTIONS_H
+#define ACTIONS_H
+
+#include "hid.h"
+#include "keyboards.h"
+
+#define MACRO_ACTION_MAX_KEYS   8
+
+typedef enum _MACRO_ACTION_TYPE
+{
+    MacroActionNone,
+    MacroActionKey,
+    MacroActionCombo,
+    MacroActionSequence,
+    MacroActionScript
+} MACRO_ACTION_TYPE;
+
+//
+// A macro is compiled down to key transitions and waits when it is
+// loaded; presses, combos and text all become KeyDown/KeyUp steps.
+//
+typedef enum _MACRO_STEP_TYPE
+{
+    MacroStepKeyDown,
+    MacroStepKeyUp,
+    MacroStepWait
+} MACRO_STEP_TYPE;
+
+typedef struct _MACRO_STEP
+{
+    MACRO_STEP_TYPE     Type;
+    USAGE               Key;
+    ULONG               Delay;      // Microseconds, for MacroStepWait
+} MACRO_STEP, * PMACRO_STEP;
+
+typedef struct _MACRO_ACTION
+{
+    MACRO_ACTION_TYPE   Type;
+    ULONG               NumberKeys;
+    USAGE               Keys[MACRO_ACTION_MAX_KEYS];    // Keyboard page usages, see inject.h
+    ULONG               NumberSteps;                    // MacroActionScript only
+    const MACRO_STEP*   Steps;
+} MACRO_ACTION, * PMACRO_ACTION;
+
+typedef struct _MACRO_ACTION_MAP
+{
+    ULONG               NumberActions;
+    MACRO_ACTION        Actions[KNOWN_KEYBOARD_MAX_MACROS];
+} MACRO_ACTION_MAP, * PMACRO_ACTION_MAP;
+
+//
+// The actions of a keyboard's macro keys, the defaults when the file
+// named none of them. Stays valid for the rest of the run.
+//
+const MACRO_ACTION_MAP* GetMacroActions(
+    IN  const KNOWN_KEYBOARD*   Keyboard
+);
+
+inline const MACRO_ACTION* LookupMacroAction(
+    IN  const MACRO_ACTION_MAP* Actions,
+    IN  ULONG                   MacroKey    // Usage less the keyboard's MacroUsageMin
+)
+{
+    return MacroKey < Actions->NumberActions ? &Actions->Actions[MacroKey] : nullptr;
+}
+
+//
+// False when the file cannot be read or a line does not parse or names a
+// keyboard or usage that is not known, in which case LineNumber is the
+// offending line (0 for the file itself). Keyboard models have to be
+// loaded first.
+//
+bool LoadMacroActions(
+    IN  LPCSTR                  FileName,
+    OUT PULONG                  LineNumber
+);
+
+#endif
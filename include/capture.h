@@ -0,0 +1,126 @@
+/*++
+
+Module Name:
+
+    capture.h
+
+Abstract:
+
+    Binary capture and replay of raw input reports, see capture.cpp.
+
+    A capture file is a HID_CAPTURE_HEADER followed by records, each a
+    HID_CAPTURE_RECORD and Length bytes of payload. A HidCaptureDevice
+    record describes one device before any of its reports: a
+    HID_CAPTURE_DEVICE, the report descriptor and the device path. A
+    HidCaptureReport record carries one raw input report exactly as it was
+    placed in InputReportBuffer, report ID first. All fields are little
+    endian and records are not padded.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <cstdint>
+#include "hid.h"
+
+#define HID_CAPTURE_MAGIC       "AMCAPT01"
+#define HID_CAPTURE_VERSION     1
+
+typedef struct _HID_CAPTURE_HEADER
+{
+    CHAR        Magic[8];
+    ULONG       Version;
+    ULONG       Reserved;
+} HID_CAPTURE_HEADER, * PHID_CAPTURE_HEADER;
+
+typedef enum _HID_CAPTURE_RECORD_TYPE
+{
+    HidCaptureDevice = 1,
+    HidCaptureReport = 2
+} HID_CAPTURE_RECORD_TYPE;
+
+typedef struct _HID_CAPTURE_RECORD
+{
+    USHORT      Type;           // HID_CAPTURE_RECORD_TYPE
+    USHORT      DeviceId;       // Numbered in the order the devices were captured
+    ULONG       Length;         // Payload bytes following the record
+    uint64_t    Timestamp;      // Nanoseconds since the capture was opened
+} HID_CAPTURE_RECORD, * PHID_CAPTURE_RECORD;
+
+typedef struct _HID_CAPTURE_DEVICE
+{
+    USHORT      VendorID;
+    USHORT      ProductID;
+    USHORT      VersionNumber;
+    USAGE       UsagePage;
+    USAGE       Usage;
+    USHORT      InputReportByteLength;
+    ULONG       CollectionIndex;    // Top level collection the device is within Descriptor
+    ULONG       DescriptorLength;   // Zero when no descriptor could be obtained
+    ULONG       PathLength;         // Without a terminator
+} HID_CAPTURE_DEVICE, * PHID_CAPTURE_DEVICE;
+
+static_assert(sizeof(HID_CAPTURE_HEADER) == 16, "capture header is part of the file format");
+static_assert(sizeof(HID_CAPTURE_RECORD) == 16, "capture record is part of the file format");
+static_assert(sizeof(HID_CAPTURE_DEVICE) == 24, "capture device is part of the file format");
+
+typedef struct _HID_CAPTURE HID_CAPTURE, * PHID_CAPTURE;
+typedef struct _HID_REPLAY  HID_REPLAY, * PHID_REPLAY;
+
+//
+// Capture. Devices are described once with CaptureHidDevice, which hands
+// back the id their reports are recorded under.
+//
+PHID_CAPTURE OpenHidCapture(
+    IN  LPCSTR          FileName
+);
+
+bool CaptureHidDevice(
+    IN  PHID_CAPTURE    Capture,
+    IN  PHID_DEVICE     HidDevice,
+    OUT PUSHORT         DeviceId
+);
+
+bool CaptureHidReport(
+    IN  PHID_CAPTURE    Capture,
+    IN  USHORT          DeviceId,
+    _In_reads_bytes_(ReportLength) const CHAR* Report,
+    IN  ULONG           ReportLength
+);
+
+bool CloseHidCapture(
+    IN  PHID_CAPTURE    Capture
+);
+
+//
+// Replay. The file is memory mapped and every captured device is rebuilt
+// from its descriptor. ReadHidReplay copies the next report into the
+// device's InputReportBuffer, optionally waiting until it is due relative
+// to the first one, and returns HidWaitStopped at the end of the file or
+// after StopHidReplay.
+//
+PHID_REPLAY OpenHidReplay(
+    IN  LPCSTR          FileName,
+    IN  bool            RealTime
+);
+
+HID_WAIT_STATUS ReadHidReplay(
+    IN  PHID_REPLAY     Replay,
+    OUT PHID_DEVICE*    HidDevice,
+    OUT PULONG          BytesRead
+);
+
+void StopHidReplay(
+    IN  PHID_REPLAY     Replay
+);
+
+void CloseHidReplay(
+    IN  PHID_REPLAY     Replay
+);
+
+#endif
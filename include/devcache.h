@@ -0,0 +1,107 @@
+/*++
+
+Module Name:
+
+    devcache.h
+
+Abstract:
+
+    Persistent cache of device layouts, see devcache.cpp.
+
+    A cache file is a HID_CACHE_HEADER followed by one record per device
+    path: a HID_CACHE_RECORD, the device path, the input button caps and
+    value caps (as many as the cached Caps list), the InputData array
+    (DataLength entries, usage buffers left out) and DecoderLength bytes of
+    SaveReportDecoder image. Output and feature state is only laid out when
+    something asks for it, see PrepareHidReports, and is not cached. The
+    file is written and read by the same build on the same machine, so
+    structures are stored as they are in memory and a header recording their
+    sizes keeps a file from another build from being used.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef DEVCACHE_H
+#define DEVCACHE_H
+
+#include <string>
+#include "hid.h"
+
+#define HID_CACHE_MAGIC         "AMCACHE1"
+#define HID_CACHE_VERSION       2
+
+typedef struct _HID_CACHE_HEADER
+{
+    CHAR        Magic[8];
+    ULONG       Version;
+    ULONG       NumberRecords;
+    USHORT      CapsSize;           // sizeof(HIDP_CAPS)
+    USHORT      ButtonCapsSize;     // sizeof(HIDP_BUTTON_CAPS)
+    USHORT      ValueCapsSize;      // sizeof(HIDP_VALUE_CAPS)
+    USHORT      DataSize;           // sizeof(HID_DATA)
+} HID_CACHE_HEADER, * PHID_CACHE_HEADER;
+
+typedef struct _HID_CACHE_RECORD
+{
+    ULONG           PathLength;     // Without a terminator
+    ULONG           DecoderLength;  // Zero for a device without a decoder
+    ULONGLONG       DescriptorHash;
+    HIDD_ATTRIBUTES Attributes;
+    HIDP_CAPS       Caps;
+    ULONG           DataLength;     // InputData entries
+} HID_CACHE_RECORD, * PHID_CACHE_RECORD;
+
+//
+// Reads FileName, when it exists, and enables the cache: from then on
+// FillDeviceInfo restores devices it has seen before instead of deriving
+// their layout again, and remembers the ones it had to derive. A missing
+// or unusable file leaves the cache enabled and empty.
+//
+bool OpenHidDeviceCache(
+    IN  LPCSTR          FileName
+);
+
+//
+// Writes the cache back to the file it was opened from when anything
+// changed since the last flush. Harmless when no cache is open.
+//
+bool FlushHidDeviceCache(
+    void
+);
+
+void CloseHidDeviceCache(
+    void
+);
+
+//
+// Per user cache location: %LOCALAPPDATA% on Windows, $XDG_CACHE_HOME or
+// ~/.cache elsewhere. False when neither is set.
+//
+bool GetDefaultHidDeviceCachePath(
+    OUT std::string&    FileName
+);
+
+ULONGLONG HashHidDescriptor(
+    _In_reads_bytes_(DescriptorLength) const UCHAR* Descriptor,
+    IN  ULONG           DescriptorLength
+);
+
+//
+// Used by FillDeviceInfo. Restored is set when the cache held the device's
+// layout and it was put in place; false is only returned when it held it
+// but ran out of memory doing so, and the caller then fails the way it
+// does on its own allocation failures.
+//
+bool RestoreHidDeviceLayout(
+    IN OUT PHID_DEVICE  HidDevice,
+    OUT    bool*        Restored
+);
+
+void StoreHidDeviceLayout(
+    IN  PHID_DEVICE     HidDevice
+);
+
+#endif
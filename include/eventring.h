@@ -0,0 +1,106 @@
+/*++
+
+Module Name:
+
+    eventring.h
+
+Abstract:
+
+    The queue between the monitor's reader and the threads acting on its
+    macro keys, see eventring.cpp.
+
+    The reader decodes reports and pushes one MACRO_EVENT per macro key
+    edge. The injector pops the presses, prints them and injects their
+    action; the event server (see eventserver.h) has a ring of its own and
+    sends presses and releases on to its clients. There is exactly one
+    thread on either end of a ring. Pushing never blocks or
+    takes a lock, so a stalled injector cannot hold up the next read; an
+    event that finds the ring full is refused and the reader decides
+    whether to drop it. The injector sleeps in WaitMacroEvent while the
+    ring is empty and is only woken by a push that finds it asleep.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef EVENTRING_H
+#define EVENTRING_H
+
+#include "actions.h"
+
+//
+// A power of two; far more key presses than anyone can make while the
+// injector is busy with one.
+//
+#define MACRO_EVENT_RING_SIZE   256
+
+typedef struct _MACRO_EVENT
+{
+    USAGE                   MacroKey;       // As HandleMacroKey takes it
+    USHORT                  Device;         // The monitor's number for the interface it came from
+    USHORT                  VendorID;
+    USHORT                  ProductID;
+    bool                    Down;           // Pressed rather than let go
+    const MACRO_ACTION*     Action;
+    ULONGLONG               ReportTime;     // GetReportTime() when the report was read
+    ULONGLONG               PushTime;       // GetReportTime() when it was pushed, set by PushMacroEvent
+} MACRO_EVENT, * PMACRO_EVENT;
+
+typedef struct _MACRO_EVENT_RING_STATS
+{
+    ULONGLONG   Pushed;
+    ULONG       Depth;              // Events waiting now
+    ULONG       MaxDepth;           // Most events waiting at once
+} MACRO_EVENT_RING_STATS, * PMACRO_EVENT_RING_STATS;
+
+typedef struct _MACRO_EVENT_RING MACRO_EVENT_RING, * PMACRO_EVENT_RING;
+
+PMACRO_EVENT_RING CreateMacroEventRing(
+    void
+);
+
+void DestroyMacroEventRing(
+    IN  PMACRO_EVENT_RING       Ring
+);
+
+//
+// Producer side. False when the ring is full.
+//
+bool PushMacroEvent(
+    IN  PMACRO_EVENT_RING       Ring,
+    IN  const MACRO_EVENT*      Event
+);
+
+//
+// Tells the consumer no more events are coming; WaitMacroEvent returns
+// false once it has popped the rest.
+//
+void CloseMacroEventRing(
+    IN  PMACRO_EVENT_RING       Ring
+);
+
+//
+// Consumer side. PopMacroEvent returns false when the ring is empty;
+// WaitMacroEvent blocks until it is not, and returns false when it is
+// empty and closed.
+//
+bool PopMacroEvent(
+    IN  PMACRO_EVENT_RING       Ring,
+    OUT PMACRO_EVENT            Event
+);
+
+bool WaitMacroEvent(
+    IN  PMACRO_EVENT_RING       Ring
+);
+
+//
+// Any thread; a close snapshot while events are moving.
+//
+void GetMacroEventRingStats(
+    IN  PMACRO_EVENT_RING       Ring,
+    OUT PMACRO_EVENT_RING_STATS Stats
+);
+
+#endif
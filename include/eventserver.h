@@ -0,0 +1,94 @@
+/*++
+
+Module Name:
+
+    eventserver.h
+
+Abstract:
+
+    Macro key events for local programs, see eventserver.cpp.
+
+    A program that only needs to know which macro key went down or up can
+    connect to the event server instead of hooking the keyboard for the
+    keys the monitor injects. The server listens on a Unix domain stream
+    socket on Linux and on a named pipe on Windows (\\.\pipe\ followed by
+    the endpoint name, unless that is already a full pipe path); any
+    number of clients may connect, and each reads a stream of
+    MACRO_EVENT_RECORDs from the moment it connected. Clients only read.
+
+    The reader hands each edge to the server's own thread as soon as the
+    report is decoded, without waiting on any client. A client that does
+    not keep up misses records rather than holding up the others; the
+    Sequence field shows where.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef EVENTSERVER_H
+#define EVENTSERVER_H
+
+#include <cstdint>
+#include "eventring.h"
+
+#define MACRO_EDGE_UP           0
+#define MACRO_EDGE_DOWN         1
+
+//
+// The wire format, in the host's byte order.
+//
+typedef struct _MACRO_EVENT_RECORD
+{
+    uint64_t    Timestamp;          // Nanoseconds on the steady clock when the report was read: CLOCK_MONOTONIC
+                                    // on Linux, QueryPerformanceCounter on Windows
+    ULONG       Sequence;           // Counts every record the server sends out, from 0
+    USHORT      VendorID;
+    USHORT      ProductID;
+    USHORT      Device;             // The monitor's number for the interface, reused once it is gone
+    USAGE       Usage;              // The macro key, 0x4c onwards as in AWKeyboardMonitor.h
+    UCHAR       Edge;               // MACRO_EDGE_*
+    UCHAR       Reserved[3];
+} MACRO_EVENT_RECORD, * PMACRO_EVENT_RECORD;
+
+static_assert(sizeof(MACRO_EVENT_RECORD) == 24, "event record is part of the wire format");
+
+typedef struct _EVENT_SERVER EVENT_SERVER, * PEVENT_SERVER;
+
+typedef struct _EVENT_SERVER_STATS
+{
+    ULONGLONG   Clients;            // Connections accepted
+    ULONGLONG   Records;            // Records sent out, each to every client connected at the time
+    ULONGLONG   Dropped;            // Edges refused because the server's ring was full
+    ULONGLONG   Missed;             // Records a client was still too far behind to take
+} EVENT_SERVER_STATS, * PEVENT_SERVER_STATS;
+
+//
+// Null when the endpoint cannot be created, or is in use by a server that
+// is still running.
+//
+PEVENT_SERVER StartEventServer(
+    IN  LPCSTR                  Endpoint
+);
+
+//
+// Meant for the monitor's reader thread alone. False when the edge was
+// dropped, which never happens when told to Wait for room in the ring.
+//
+bool PublishMacroEvent(
+    IN  PEVENT_SERVER           Server,
+    IN  const MACRO_EVENT*      Event,
+    IN  bool                    Wait
+);
+
+//
+// Sends what was published before it, disconnects every client and
+// removes the endpoint.
+//
+void StopEventServer(
+    IN  PEVENT_SERVER           Server,
+    OUT PEVENT_SERVER_STATS     Stats       // Optional
+);
+
+#endif
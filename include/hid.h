@@ -20,8 +20,7 @@ Environment:
 #ifndef HID_H
 #define HID_H
 
-#include "hidsdi.h"
-#include "setupapi.h"
+#include "hidport.h"
 
 #define ASSERT(x)
 
@@ -65,6 +64,41 @@ typedef struct _HID_DATA
     };
 } HID_DATA, * PHID_DATA;
 
+typedef struct _HID_REPORT_DECODER HID_REPORT_DECODER, * PHID_REPORT_DECODER;
+
+//
+// InputData grouped by report ID: the entries of report ID n are
+// InputData[Spans[n].First] .. InputData[Spans[n].First + Spans[n].Count - 1].
+// Reports whose bit in Subscribed is clear are not decoded at all.
+//
+typedef struct _HID_REPORT_SPAN
+{
+    ULONG       First;
+    ULONG       Count;
+} HID_REPORT_SPAN, * PHID_REPORT_SPAN;
+
+typedef struct _HID_REPORT_INDEX
+{
+    HID_REPORT_SPAN Spans[256];
+    ULONG           Subscribed[256 / 32];
+} HID_REPORT_INDEX, * PHID_REPORT_INDEX;
+
+//
+// Everything FillDeviceInfo and PrepareHidReports lay out for one report
+// type lives in a single block, in the order the read path touches it:
+// the report buffer, the HID_DATA array, the usage lists of its button
+// entries, the report index (input only) and, coldest, the caps. Opening
+// a device is one allocation per report type it uses and closing it one
+// free, and decoding a report stays within a few neighbouring lines.
+//
+typedef struct _HID_ARENA
+{
+    PUCHAR      Base;
+    ULONG       Length;
+    ULONG       UsageOffset;        // Where the usage lists start
+    ULONG       UsageLength;        // Usages they have room for in all
+} HID_ARENA, * PHID_ARENA;
+
 typedef struct _HID_DEVICE
 {
     PCHAR                DevicePath;
@@ -77,13 +111,18 @@ typedef struct _HID_DEVICE
     PHIDP_PREPARSED_DATA Ppd; // The opaque parser info describing this device
     HIDP_CAPS            Caps; // The Capabilities of this hid device.
     HIDD_ATTRIBUTES      Attributes;
+    ULONGLONG            DescriptorHash; // Of the report descriptor, 0 where it cannot be read
 
     PCHAR                InputReportBuffer;
+    ULONGLONG            InputReportTime;   // GetReportTime() when the report was read
     _Field_size_(InputDataLength)
     PHID_DATA            InputData; // array of hid data structures
     ULONG                InputDataLength; // Num elements in this array.
     PHIDP_BUTTON_CAPS    InputButtonCaps;
     PHIDP_VALUE_CAPS     InputValueCaps;
+    PHID_REPORT_DECODER  InputDecoder; // Compiled layout of InputData, may be null
+    PHID_REPORT_INDEX    InputReportIndex; // InputData spans per report ID, may be null
+    HID_ARENA            InputArena;
 
     PCHAR                OutputReportBuffer;
     _Field_size_(OutputDataLength)
@@ -91,6 +130,7 @@ typedef struct _HID_DEVICE
     ULONG                OutputDataLength;
     PHIDP_BUTTON_CAPS    OutputButtonCaps;
     PHIDP_VALUE_CAPS     OutputValueCaps;
+    HID_ARENA            OutputArena;
 
     PCHAR                FeatureReportBuffer;
     _Field_size_(FeatureDataLength) 
@@ -98,11 +138,12 @@ typedef struct _HID_DEVICE
     ULONG                FeatureDataLength;
     PHIDP_BUTTON_CAPS    FeatureButtonCaps;
     PHIDP_VALUE_CAPS     FeatureValueCaps;
+    HID_ARENA            FeatureArena;
 } HID_DEVICE, * PHID_DEVICE;
 
 
 bool OpenHidDevice(
-    _In_     LPSTR          DevicePath,
+    _In_     LPCSTR         DevicePath,
     _In_     bool           HasReadAccess,
     _In_     bool           HasWriteAccess,
     _In_     bool           IsOverlapped,
@@ -115,10 +156,148 @@ bool FindKnownHidDevices(
    OUT PULONG        NumberDevices // the length of this array.
 );
 
+//
+// Enumeration that only opens what it is looking for. Interfaces are
+// rejected on the vendor and product ID first, which come from the device
+// path on Windows and from sysfs on Linux without opening anything. The
+// survivors are opened just far enough to read their top level usage, and
+// only full matches get the FillDeviceInfo treatment. A zero field in the
+// filter matches anything.
+//
+// With a Lookup routine an interface also has to have IDs it knows, and
+// the top level usage it gives for them; it is called from the probe
+// threads, so it must not change what it answers during an enumeration.
+//
+typedef bool (*PHID_LOOKUP_ROUTINE)(
+    IN  USHORT      VendorID,
+    IN  USHORT      ProductID,
+    OUT PUSAGE      UsagePage,
+    OUT PUSAGE      Usage
+);
+
+typedef struct _HID_DEVICE_FILTER
+{
+    USHORT              VendorID;
+    USHORT              ProductID;
+    USAGE               UsagePage;
+    USAGE               Usage;
+    PHID_LOOKUP_ROUTINE Lookup;     // Optional
+} HID_DEVICE_FILTER, * PHID_DEVICE_FILTER;
+
+bool FindHidDevices(
+   IN  const HID_DEVICE_FILTER* Filter,
+   OUT PHID_DEVICE*             HidDevices,     // Free with CloseHidDevices and delete[]
+   OUT PULONG                   NumberDevices
+);
+
+bool MatchHidDeviceIds(
+   IN  const HID_DEVICE_FILTER* Filter,
+   IN  USHORT                   VendorID,
+   IN  USHORT                   ProductID
+);
+
+bool MatchHidDeviceUsage(
+   IN  const HID_DEVICE_FILTER* Filter,
+   IN  USHORT                   VendorID,
+   IN  USHORT                   ProductID,
+   IN  USAGE                    UsagePage,
+   IN  USAGE                    Usage
+);
+
+//
+// Both backends list interfaces first and then probe (open and fill in)
+// them on up to HID_MAX_PROBE_WORKERS threads, since opening one can block
+// for tens of milliseconds. Probe writes the results for DevicePaths[Index]
+// to a slot of its own and the caller merges the slots in index order, so
+// the result does not depend on which worker got to which interface first.
+// GetHidEnumerationTiming reports how long the last probe phase in the
+// process took as a whole and per interface; Probes may be null to ask for
+// just the totals.
+//
+#define HID_MAX_PROBE_WORKERS   8
+
+typedef void (*PHID_PROBE_ROUTINE)(
+    IN  ULONG       Index,
+    IN  PVOID       Context
+);
+
+typedef struct _HID_PROBE_TIMING
+{
+    CHAR        DevicePath[MAX_PATH];
+    ULONGLONG   Elapsed;            // Nanoseconds spent probing the interface
+} HID_PROBE_TIMING, * PHID_PROBE_TIMING;
+
+typedef struct _HID_ENUMERATION_TIMING
+{
+    ULONGLONG   Elapsed;            // Nanoseconds from the first probe starting to the last one ending
+    ULONGLONG   ProbeTotal;         // Sum of every probe, what probing one after the other would take
+    ULONG       Workers;            // Threads the probes ran on, the caller's included
+    ULONG       NumberProbes;
+} HID_ENUMERATION_TIMING, * PHID_ENUMERATION_TIMING;
+
+bool RunHidProbes(
+   IN  const LPCSTR*            DevicePaths,
+   IN  ULONG                    NumberPaths,
+   IN  PHID_PROBE_ROUTINE       Probe,
+   IN  PVOID                    Context
+);
+
+bool GetHidEnumerationTiming(
+   OUT PHID_ENUMERATION_TIMING  Timing,
+   _Out_writes_opt_(MaxProbes) PHID_PROBE_TIMING Probes,  // Slowest first
+   IN  ULONG                    MaxProbes
+);
+
+//
+// FillDeviceInfo lays out the input side of a device only. Its output and
+// feature buffers, caps and HID_DATA arrays stay null until
+// PrepareHidReports asks for them; Write, SetFeature and GetFeature do so
+// themselves, but a caller filling in OutputData or FeatureData before
+// them has to call it first. A device opened to be read never pays for
+// either.
+//
 bool FillDeviceInfo(
     IN  PHID_DEVICE HidDevice
 );
 
+bool PrepareHidReports(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+);
+
+//
+// The arena primitives FillDeviceInfo is built on, for code that restores a
+// layout from elsewhere. AllocateHidReportState sizes the block of one
+// report type from the device's caps, DataLength and UsageLength (the
+// MaxUsageLength of every button entry added up), points the device's
+// fields into it and zeroes it. Once the caller has filled in the caps and
+// the entries, AssignHidUsageBuffers hands each button entry its part of
+// the usage lists; it fails when they need more than UsageLength.
+//
+bool AllocateHidReportState(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType,
+    IN  ULONG               DataLength,
+    IN  ULONG               UsageLength
+);
+
+bool AssignHidUsageBuffers(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+);
+
+void FreeHidReportState(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+);
+
+//
+// Bytes of device state held for HidDevice, preparsed data aside.
+//
+SIZE_T GetHidDeviceFootprint(
+    IN  PHID_DEVICE HidDevice
+);
+
 void CloseHidDevices(
    IN PHID_DEVICE   HidDevices, // A array of struct _HID_DEVICE
    IN ULONG         NumberDevices // the length of this array.
@@ -129,15 +308,58 @@ void CloseHidDevice(
 );
 
 
+#ifndef _WIN32
+bool OpenHidDeviceFromDescriptor(
+    _In_     LPCSTR         DevicePath,
+    _In_     HANDLE         Handle,
+    _In_reads_bytes_(DescriptorLength) const UCHAR* Descriptor,
+    _In_     ULONG          DescriptorLength,
+    _In_     ULONG          CollectionIndex,
+    _In_     const HIDD_ATTRIBUTES* Attributes,
+    _Out_    PHID_DEVICE    HidDevice
+);
+
+bool GetHidReportDescriptor(
+    _In_     PHID_DEVICE    HidDevice,
+    _Out_writes_bytes_(*DescriptorLength) PUCHAR Descriptor,
+    _Inout_  PULONG         DescriptorLength,
+    _Out_    PULONG         CollectionIndex
+);
+#endif
+
+//
+// Monotonic time in nanoseconds. The backends stamp InputReportTime with it
+// as each report comes off the device.
+//
+ULONGLONG GetReportTime(
+   void
+);
+
+//
+// Backend primitives behind Read and Write: move one raw report between the
+// device and InputReportBuffer/OutputReportBuffer. The report ID is always
+// the first byte of the buffer, as the HidP routines expect.
+//
+bool ReadInputReport(
+   PHID_DEVICE    HidDevice,
+   PULONG         BytesRead
+);
+
+bool WriteOutputReport(
+   PHID_DEVICE    HidDevice
+);
+
 bool Read(
    PHID_DEVICE    HidDevice
 );
 
+#ifdef _WIN32
 bool ReadOverlapped(
     PHID_DEVICE     HidDevice,
     HANDLE          CompletionEvent,
     LPOVERLAPPED    Overlap
 );
+#endif
 
 bool Write(
    PHID_DEVICE    HidDevice
@@ -152,6 +374,68 @@ bool UnpackReport(
    IN       PHIDP_PREPARSED_DATA Ppd
 );
 
+//
+// Precompiled input report decoding, see decode.cpp. FillDeviceInfo indexes
+// InputData by report ID and compiles the decoder; UnpackInputReport uses
+// both when present and falls back to UnpackReport otherwise.
+// BuildInputReportDescriptor writes the compiled input layout back out as a
+// report descriptor, for captures taken where the original is unavailable.
+//
+bool BuildInputReportIndex(
+   IN OUT   PHID_DEVICE          HidDevice
+);
+
+void SetInputReportSubscription(
+   IN OUT   PHID_DEVICE          HidDevice,
+   IN       UCHAR                ReportID,
+   IN       bool                 Subscribed
+);
+
+bool CompileInputDecoder(
+   IN OUT   PHID_DEVICE          HidDevice
+);
+
+bool DecodeReport(
+   IN       PHID_REPORT_DECODER  Decoder,
+   _In_reads_bytes_(ReportBufferLength)PCHAR ReportBuffer,
+   IN       USHORT               ReportBufferLength,
+   IN OUT   PHID_DATA            Data,
+   IN       ULONG                DataIndex,     // Position of Data in the compiled array
+   IN       ULONG                DataLength
+);
+
+void FreeReportDecoder(
+   IN       PHID_REPORT_DECODER  Decoder
+);
+
+//
+// Decoders saved by SaveReportDecoder are rebuilt by LoadReportDecoder
+// without probing the preparsed data, see devcache.cpp.
+//
+bool SaveReportDecoder(
+   IN       PHID_REPORT_DECODER  Decoder,
+   _Out_writes_bytes_(*ImageLength)PUCHAR Image,
+   IN OUT   PULONG               ImageLength
+);
+
+PHID_REPORT_DECODER LoadReportDecoder(
+   _In_reads_bytes_(ImageLength)const UCHAR* Image,
+   IN       ULONG                ImageLength,
+   IN       USHORT               ReportByteLength,
+   IN       const HID_DATA*      Data,
+   IN       ULONG                DataLength
+);
+
+bool UnpackInputReport(
+   IN OUT   PHID_DEVICE          HidDevice
+);
+
+bool BuildInputReportDescriptor(
+   IN       PHID_DEVICE          HidDevice,
+   _Out_writes_bytes_(*DescriptorLength)PUCHAR Descriptor,
+   IN OUT   PULONG               DescriptorLength
+);
+
 bool PackReport(
    _Out_writes_bytes_(ReportBufferLength)PCHAR ReportBuffer,
    IN       USHORT               ReportBufferLength,
@@ -169,5 +453,102 @@ bool GetFeature(
    PHID_DEVICE    HidDevice
 );
 
+//
+// Transport abstraction. The monitor never touches platform handles; it
+// attaches opened devices to an event loop and waits for completed input
+// reports. Any number of devices can share one loop and one thread. Each
+// device gets a ring of QueueDepth report buffers so a burst that arrives
+// while the caller is busy is queued rather than dropped. The Windows backend
+// keeps that many overlapped ReadFile calls outstanding and collects them from
+// an I/O completion port, the Linux backend drains the hidraw node into the
+// ring through epoll. Reports are handed out oldest first, copied into the
+// device's InputReportBuffer ready for UnpackReport. With an INFINITE timeout
+// an idle loop never wakes up; StopHidEventLoop ends the wait instead.
+//
+typedef struct _HID_EVENT_LOOP HID_EVENT_LOOP, * PHID_EVENT_LOOP;
+
+#define HID_DEFAULT_READ_QUEUE_DEPTH    8
+
+typedef struct _HID_READ_STATS
+{
+    ULONG       QueueDepth;     // Report buffers in the device's ring
+    ULONG       Reports;        // Reports handed out
+    ULONG       Overflows;      // Times the ring filled up with reports still arriving
+} HID_READ_STATS, * PHID_READ_STATS;
+
+typedef enum _HID_WAIT_STATUS
+{
+    HidWaitReport,              // A report is available in InputReportBuffer
+    HidWaitTimeout,             // Nothing arrived within the timeout
+    HidWaitError,               // The read failed, typically device removal
+    HidWaitStopped,             // StopHidEventLoop was called
+    HidWaitArrival              // HID devices appeared, see GetHidArrivals
+} HID_WAIT_STATUS;
+
+PHID_EVENT_LOOP CreateHidEventLoop(
+    void
+);
+
+bool AttachHidDevice(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice,  // Must be opened for overlapped read
+    IN  ULONG               QueueDepth  // Reads kept outstanding, at least 1
+);
+
+void DetachHidDevice(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice   // Detach before CloseHidDevice
+);
+
+bool GetHidReadStats(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice,
+    OUT PHID_READ_STATS     Stats
+);
+
+HID_WAIT_STATUS WaitForHidReport(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  ULONG               Timeout,    // Milliseconds or INFINITE
+    OUT PHID_DEVICE*        HidDevice,  // The device the report arrived on
+    OUT PULONG              BytesRead
+);
+
+void StopHidEventLoop(
+    IN  PHID_EVENT_LOOP     EventLoop   // Any thread or signal handler
+);
+
+//
+// Device arrival. After WatchHidArrivals, WaitForHidReport also returns
+// HidWaitArrival when HID devices appear, and keeps waiting rather than
+// failing while no device is attached. GetHidArrivals opens just the new
+// devices with query access, as FindKnownHidDevices does for all of them,
+// so they can be matched and opened for reading without enumerating the
+// whole system again. Windows uses device interface notifications, Linux
+// the kernel and udev uevent netlink groups; SendHidUevent feeds a
+// uevent to every watching loop in the process, so tests and simulated
+// devices can stand in for the kernel. Removal is still reported by the
+// device's own reads failing with HidWaitError.
+//
+bool WatchHidArrivals(
+    IN  PHID_EVENT_LOOP     EventLoop
+);
+
+bool GetHidArrivals(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    OUT PHID_DEVICE*        HidDevices,     // Free with CloseHidDevices and delete[]
+    OUT PULONG              NumberDevices
+);
+
+#ifndef _WIN32
+bool SendHidUevent(
+    _In_reads_bytes_(Length) const CHAR* Uevent,    // "action@devpath\0KEY=value\0..."
+    IN  ULONG               Length
+);
+#endif
+
+void DestroyHidEventLoop(
+    IN  PHID_EVENT_LOOP     EventLoop
+);
+
 #endif
 
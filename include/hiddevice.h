@@ -0,0 +1,127 @@
+/*++
+
+Module Name:
+
+    hiddevice.h
+
+Abstract:
+
+    Owning wrappers around HID_DEVICE, see hiddevice.cpp.
+
+    A HID_DEVICE owns a handle, preparsed data and a dozen buffers, and the
+    C style enumeration routines hand out arrays of them that the caller has
+    to remember to close one by one before deleting the array. A
+    UniqueHidDevice owns exactly one device and closes it when it goes away;
+    it can be moved but not copied, so a device cannot end up closed twice
+    or not at all. A HidDeviceRegistry holds the devices one enumeration
+    found, sized once for all of them, and closes whatever the caller did not
+    Take out of it when it is cleared, refilled or destroyed.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef HIDDEVICE_H
+#define HIDDEVICE_H
+
+#include <vector>
+#include "hid.h"
+
+class UniqueHidDevice
+{
+public:
+    UniqueHidDevice() noexcept;
+
+    //
+    // Takes ownership of an opened device, which the caller must no longer
+    // close itself.
+    //
+    explicit UniqueHidDevice(const HID_DEVICE& HidDevice) noexcept;
+
+    UniqueHidDevice(UniqueHidDevice&& Other) noexcept;
+    UniqueHidDevice& operator=(UniqueHidDevice&& Other) noexcept;
+
+    UniqueHidDevice(const UniqueHidDevice&) = delete;
+    UniqueHidDevice& operator=(const UniqueHidDevice&) = delete;
+
+    ~UniqueHidDevice();
+
+    PHID_DEVICE Get() noexcept
+    {
+        return &Device;
+    }
+
+    PHID_DEVICE operator->() noexcept
+    {
+        return &Device;
+    }
+
+    //
+    // Hands the device back to the caller, who then has to close it.
+    //
+    HID_DEVICE Release() noexcept;
+
+    void Reset() noexcept;
+
+private:
+    HID_DEVICE  Device;
+};
+
+class HidDeviceRegistry
+{
+public:
+    //
+    // Refill the registry with every HID device (Filter null, unopened ones
+    // listed by path) or just those passing Filter, closing what it held.
+    //
+    bool Enumerate(
+        IN  const HID_DEVICE_FILTER* Filter
+    );
+
+    //
+    // Refill the registry with the devices GetHidArrivals reports.
+    //
+    bool Arrivals(
+        IN  PHID_EVENT_LOOP     EventLoop
+    );
+
+    size_t Size() const noexcept
+    {
+        return Devices.size();
+    }
+
+    PHID_DEVICE operator[](size_t Index) noexcept
+    {
+        return Devices[Index].Get();
+    }
+
+    //
+    // Moves a device out of the registry, leaving its slot empty, so it
+    // outlives the enumeration it came from.
+    //
+    UniqueHidDevice Take(size_t Index) noexcept;
+
+    void Clear() noexcept;
+
+    std::vector<UniqueHidDevice>::iterator begin() noexcept
+    {
+        return Devices.begin();
+    }
+
+    std::vector<UniqueHidDevice>::iterator end() noexcept
+    {
+        return Devices.end();
+    }
+
+private:
+    bool Adopt(
+        IN  PHID_DEVICE         HidDevices,
+        IN  ULONG               NumberDevices
+    );
+
+    std::vector<UniqueHidDevice> Devices;
+};
+
+#endif
@@ -0,0 +1,55 @@
+/*++
+
+Module Name:
+
+    hidlist.h
+
+Abstract:
+
+    Listing of every HID interface in the system as JSON, see hidlist.cpp.
+
+    The output is one object:
+
+        {
+          "enumeration": { "elapsedUs": ..., "probeTotalUs": ..., "workers": ..., "probes": ... },
+          "devices": [
+            {
+              "path": "...", "opened": true, "probeUs": 812.4,
+              "vendorId": "0x0d62", "productId": "0x1a1c", "version": "0x0100",
+              "usagePage": "0x000c", "usage": "0x0001", "keyboard": "Alienware m17 R4",
+              "input": {
+                "reportLength": 3, "reportIds": [ 2 ],
+                "buttons": [ { "reportId": 2, "usagePage": "0x000c", "usageMin": "0x0000", "usageMax": "0x023c" } ],
+                "values": [ { "reportId": 2, "usagePage": "0x0001", "usageMin": "0x0030", "usageMax": "0x0030",
+                              "bitSize": 12, "reportCount": 1, "logicalMin": -2047, "logicalMax": 2047 } ]
+              },
+              "output": { ... },
+              "feature": { ... }
+            }
+          ]
+        }
+
+    IDs and usages are hex strings, written the way --vid and --keyboards
+    take them. "keyboard" is the known keyboard the IDs belong to, null
+    for any other device. An interface that could not be opened has just
+    its path, "opened": false and its probe time. probeUs is how long the
+    interface took to open and set up, all of a multi collection node's
+    collections together on Linux.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef HIDLIST_H
+#define HIDLIST_H
+
+#include <cstdio>
+#include "hid.h"
+
+bool PrintHidDeviceList(
+    IN  FILE*   Stream
+);
+
+#endif
@@ -0,0 +1,365 @@
+/*++
+
+Module Name:
+
+    hidport.h
+
+Abstract:
+
+    Platform glue for the HID transport. On Windows this simply pulls in the
+    DDK headers the hclient derived code was written against. Everywhere else
+    it provides the subset of the Windows types, HIDP_XXX structures and
+    HidP_XXX/HidD_XXX routines that hid.h, pnp.cpp and report.cpp rely on so
+    the same report pipeline can run on top of a hidraw backend. The HidP_XXX
+    routines are implemented in hidparse.cpp from the raw report descriptor.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef HIDPORT_H
+#define HIDPORT_H
+
+#ifdef _WIN32
+
+#include <wtypes.h>
+#include "hidsdi.h"
+#include "setupapi.h"
+
+#else
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+//
+// SAL annotations and the classic IN/OUT markers compile away.
+//
+#define IN
+#define OUT
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_reads_bytes_(size)
+#define _Out_writes_bytes_(size)
+#define _Out_writes_opt_(size)
+#define _Field_size_(size)
+
+#ifndef MAX_PATH
+#define MAX_PATH                260
+#endif
+
+#define INFINITE                0xFFFFFFFF
+
+typedef uint8_t                 UCHAR, * PUCHAR;
+typedef uint8_t                 BOOLEAN;
+typedef uint16_t                USHORT, * PUSHORT;
+typedef uint16_t                WORD;
+typedef uint32_t                ULONG, * PULONG;
+typedef uint32_t                DWORD;
+typedef uint64_t                ULONGLONG;
+typedef int32_t                 LONG, * PLONG;
+typedef uint32_t                NTSTATUS;       // LONG on Windows; unsigned so it compares cleanly with HID_DATA::Status
+typedef char                    CHAR, * PCHAR, * LPSTR;
+typedef const char*             LPCSTR;
+typedef unsigned int            UINT;
+typedef void*                   PVOID;
+typedef size_t                  SIZE_T;
+typedef long                    HRESULT;
+
+//
+// Device handles are plain file descriptors.
+//
+typedef int                     HANDLE;
+#define INVALID_HANDLE_VALUE    (-1)
+
+inline bool CloseHandle(HANDLE Handle)
+{
+    return close(Handle) == 0;
+}
+
+//
+// intsafe.h
+//
+#define S_OK                    ((HRESULT)0L)
+#define INTSAFE_E_ARITHMETIC_OVERFLOW ((HRESULT)0x80070216L)
+#define FAILED(hr)              (((HRESULT)(hr)) < 0)
+
+inline HRESULT ULongAdd(ULONG Augend, ULONG Addend, ULONG* Result)
+{
+    if (Augend + Addend < Augend)
+    {
+        *Result = 0;
+        return INTSAFE_E_ARITHMETIC_OVERFLOW;
+    }
+    *Result = Augend + Addend;
+    return S_OK;
+}
+
+//
+// hidusage.h / hidpi.h
+//
+typedef USHORT                  USAGE, * PUSAGE;
+
+typedef enum _HIDP_REPORT_TYPE
+{
+    HidP_Input,
+    HidP_Output,
+    HidP_Feature
+} HIDP_REPORT_TYPE;
+
+#define HIDP_ERROR_CODES(SEV, CODE) ((NTSTATUS) (((ULONG)(SEV) << 28) | (0x11 << 16) | (CODE)))
+
+#define HIDP_STATUS_SUCCESS                 (HIDP_ERROR_CODES(0x0, 0))
+#define HIDP_STATUS_NULL                    (HIDP_ERROR_CODES(0x8, 1))
+#define HIDP_STATUS_INVALID_PREPARSED_DATA  (HIDP_ERROR_CODES(0xC, 1))
+#define HIDP_STATUS_INVALID_REPORT_TYPE     (HIDP_ERROR_CODES(0xC, 2))
+#define HIDP_STATUS_INVALID_REPORT_LENGTH   (HIDP_ERROR_CODES(0xC, 3))
+#define HIDP_STATUS_USAGE_NOT_FOUND         (HIDP_ERROR_CODES(0xC, 4))
+#define HIDP_STATUS_VALUE_OUT_OF_RANGE      (HIDP_ERROR_CODES(0xC, 5))
+#define HIDP_STATUS_BAD_LOG_PHY_VALUES      (HIDP_ERROR_CODES(0xC, 6))
+#define HIDP_STATUS_BUFFER_TOO_SMALL        (HIDP_ERROR_CODES(0xC, 7))
+#define HIDP_STATUS_INTERNAL_ERROR          (HIDP_ERROR_CODES(0xC, 8))
+#define HIDP_STATUS_INCOMPATIBLE_REPORT_ID  (HIDP_ERROR_CODES(0xC, 0xA))
+
+typedef struct _HIDP_PREPARSED_DATA* PHIDP_PREPARSED_DATA;
+
+typedef struct _HIDP_CAPS
+{
+    USAGE   Usage;
+    USAGE   UsagePage;
+    USHORT  InputReportByteLength;
+    USHORT  OutputReportByteLength;
+    USHORT  FeatureReportByteLength;
+    USHORT  Reserved[17];
+
+    USHORT  NumberLinkCollectionNodes;
+
+    USHORT  NumberInputButtonCaps;
+    USHORT  NumberInputValueCaps;
+    USHORT  NumberInputDataIndices;
+
+    USHORT  NumberOutputButtonCaps;
+    USHORT  NumberOutputValueCaps;
+    USHORT  NumberOutputDataIndices;
+
+    USHORT  NumberFeatureButtonCaps;
+    USHORT  NumberFeatureValueCaps;
+    USHORT  NumberFeatureDataIndices;
+} HIDP_CAPS, * PHIDP_CAPS;
+
+typedef struct _HIDP_BUTTON_CAPS
+{
+    USAGE    UsagePage;
+    UCHAR    ReportID;
+    BOOLEAN  IsAlias;
+
+    USHORT   BitField;
+    USHORT   LinkCollection;
+
+    USAGE    LinkUsage;
+    USAGE    LinkUsagePage;
+
+    BOOLEAN  IsRange;
+    BOOLEAN  IsStringRange;
+    BOOLEAN  IsDesignatorRange;
+    BOOLEAN  IsAbsolute;
+
+    USHORT   ReportCount;
+    USHORT   Reserved2;
+    ULONG    Reserved[9];
+
+    union
+    {
+        struct
+        {
+            USAGE    UsageMin, UsageMax;
+            USHORT   StringMin, StringMax;
+            USHORT   DesignatorMin, DesignatorMax;
+            USHORT   DataIndexMin, DataIndexMax;
+        } Range;
+        struct
+        {
+            USAGE    Usage, Reserved1;
+            USHORT   StringIndex, Reserved2;
+            USHORT   DesignatorIndex, Reserved3;
+            USHORT   DataIndex, Reserved4;
+        } NotRange;
+    };
+} HIDP_BUTTON_CAPS, * PHIDP_BUTTON_CAPS;
+
+typedef struct _HIDP_VALUE_CAPS
+{
+    USAGE    UsagePage;
+    UCHAR    ReportID;
+    BOOLEAN  IsAlias;
+
+    USHORT   BitField;
+    USHORT   LinkCollection;
+
+    USAGE    LinkUsage;
+    USAGE    LinkUsagePage;
+
+    BOOLEAN  IsRange;
+    BOOLEAN  IsStringRange;
+    BOOLEAN  IsDesignatorRange;
+    BOOLEAN  IsAbsolute;
+
+    BOOLEAN  HasNull;
+    UCHAR    Reserved;
+    USHORT   BitSize;
+
+    USHORT   ReportCount;
+    USHORT   Reserved2[5];
+
+    ULONG    UnitsExp;
+    ULONG    Units;
+
+    LONG     LogicalMin, LogicalMax;
+    LONG     PhysicalMin, PhysicalMax;
+
+    union
+    {
+        struct
+        {
+            USAGE    UsageMin, UsageMax;
+            USHORT   StringMin, StringMax;
+            USHORT   DesignatorMin, DesignatorMax;
+            USHORT   DataIndexMin, DataIndexMax;
+        } Range;
+        struct
+        {
+            USAGE    Usage, Reserved1;
+            USHORT   StringIndex, Reserved2;
+            USHORT   DesignatorIndex, Reserved3;
+            USHORT   DataIndex, Reserved4;
+        } NotRange;
+    };
+} HIDP_VALUE_CAPS, * PHIDP_VALUE_CAPS;
+
+NTSTATUS HidP_GetCaps(
+    IN  PHIDP_PREPARSED_DATA PreparsedData,
+    OUT PHIDP_CAPS           Capabilities
+);
+
+NTSTATUS HidP_GetButtonCaps(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    OUT    PHIDP_BUTTON_CAPS    ButtonCaps,
+    IN OUT PUSHORT              ButtonCapsLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData
+);
+
+NTSTATUS HidP_GetValueCaps(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    OUT    PHIDP_VALUE_CAPS     ValueCaps,
+    IN OUT PUSHORT              ValueCapsLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData
+);
+
+ULONG HidP_MaxUsageListLength(
+    IN HIDP_REPORT_TYPE     ReportType,
+    IN USAGE                UsagePage,
+    IN PHIDP_PREPARSED_DATA PreparsedData
+);
+
+NTSTATUS HidP_GetUsages(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    IN     USAGE                UsagePage,
+    IN     USHORT               LinkCollection,
+    OUT    PUSAGE               UsageList,
+    IN OUT PULONG               UsageLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData,
+    IN     PCHAR                Report,
+    IN     ULONG                ReportLength
+);
+
+NTSTATUS HidP_SetUsages(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    IN     USAGE                UsagePage,
+    IN     USHORT               LinkCollection,
+    IN     PUSAGE               UsageList,
+    IN OUT PULONG               UsageLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData,
+    IN OUT PCHAR                Report,
+    IN     ULONG                ReportLength
+);
+
+NTSTATUS HidP_GetUsageValue(
+    IN  HIDP_REPORT_TYPE     ReportType,
+    IN  USAGE                UsagePage,
+    IN  USHORT               LinkCollection,
+    IN  USAGE                Usage,
+    OUT PULONG               UsageValue,
+    IN  PHIDP_PREPARSED_DATA PreparsedData,
+    IN  PCHAR                Report,
+    IN  ULONG                ReportLength
+);
+
+NTSTATUS HidP_GetScaledUsageValue(
+    IN  HIDP_REPORT_TYPE     ReportType,
+    IN  USAGE                UsagePage,
+    IN  USHORT               LinkCollection,
+    IN  USAGE                Usage,
+    OUT PLONG                UsageValue,
+    IN  PHIDP_PREPARSED_DATA PreparsedData,
+    IN  PCHAR                Report,
+    IN  ULONG                ReportLength
+);
+
+NTSTATUS HidP_SetUsageValue(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    IN     USAGE                UsagePage,
+    IN     USHORT               LinkCollection,
+    IN     USAGE                Usage,
+    IN     ULONG                UsageValue,
+    IN     PHIDP_PREPARSED_DATA PreparsedData,
+    IN OUT PCHAR                Report,
+    IN     ULONG                ReportLength
+);
+
+//
+// hidsdi.h
+//
+typedef struct _HIDD_ATTRIBUTES
+{
+    ULONG   Size;
+    USHORT  VendorID;
+    USHORT  ProductID;
+    USHORT  VersionNumber;
+} HIDD_ATTRIBUTES, * PHIDD_ATTRIBUTES;
+
+bool HidD_FreePreparsedData(
+    IN PHIDP_PREPARSED_DATA PreparsedData
+);
+
+bool HidD_GetFeature(
+    IN  HANDLE  HidDeviceObject,
+    OUT void*   ReportBuffer,
+    IN  ULONG   ReportBufferLength
+);
+
+bool HidD_SetFeature(
+    IN  HANDLE  HidDeviceObject,
+    IN  void*   ReportBuffer,
+    IN  ULONG   ReportBufferLength
+);
+
+//
+// Not part of the Windows API: builds the preparsed data for one top level
+// collection of a raw report descriptor (as returned by HIDIOCGRDESC) and
+// reports how many top level collections the descriptor contains.
+//
+bool HidP_ParseReportDescriptor(
+    _In_reads_bytes_(DescriptorLength) const UCHAR* Descriptor,
+    IN  ULONG                   DescriptorLength,
+    IN  ULONG                   CollectionIndex,
+    OUT PHIDP_PREPARSED_DATA*   PreparsedData,
+    OUT PULONG                  NumberCollections
+);
+
+#endif // _WIN32
+
+#endif
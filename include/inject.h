@@ -0,0 +1,104 @@
+/*++
+
+Module Name:
+
+    inject.h
+
+Abstract:
+
+    Key injection, see inject.cpp.
+
+    A key sink collects key events and hands them to the system in one
+    call when flushed: a single SendInput on Windows, a single write of an
+    input_event array to a uinput device on Linux. Keys are named by their
+    HID keyboard page usage whatever the platform; letters, digits, Enter,
+    Escape, Backspace, Tab, Space, F1-F24 and the modifiers can be sent.
+
+    On Linux a sink can also write to a plain file instead of uinput,
+    producing exactly the bytes a uinput device would have been sent, each
+    key event followed by a SYN_REPORT. That needs no permissions, so the
+    injection path can be checked against simulated keyboards.
+
+    The monitor and the macro player may share a sink; each call is done
+    under the sink's lock, so events queued by one may go out with a flush
+    by the other, but always in the order they were queued.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef INJECT_H
+#define INJECT_H
+
+#include "hid.h"
+
+//
+// Key events a sink holds before it flushes by itself.
+//
+#define KEY_SINK_MAX_EVENTS     64
+
+#define KEY_USAGE_F13           0x68
+
+typedef struct _KEY_SINK KEY_SINK, * PKEY_SINK;
+
+//
+// The system's injection path. Null when it is unavailable, which on
+// Linux usually means no write access to /dev/uinput.
+//
+PKEY_SINK OpenKeySink(
+    void
+);
+
+#ifndef _WIN32
+PKEY_SINK OpenKeySinkFile(
+    IN  LPCSTR      FileName
+);
+#endif
+
+//
+// Whether sinks can send a HID keyboard page usage at all.
+//
+bool CanInjectKey(
+    IN  USAGE       Key
+);
+
+//
+// False for a key the sink cannot send, or when the sink was full and
+// flushing it failed.
+//
+bool QueueKeyEvent(
+    IN  PKEY_SINK   Sink,
+    IN  USAGE       Key,
+    IN  bool        Down
+);
+
+//
+// A press followed by a release, both queued or neither.
+//
+bool QueueKeyPress(
+    IN  PKEY_SINK   Sink,
+    IN  USAGE       Key
+);
+
+ULONG GetQueuedKeyEvents(
+    IN  PKEY_SINK   Sink
+);
+
+//
+// Sends everything queued. The queue is emptied even when this fails, so
+// one lost batch does not hold up the next.
+//
+bool FlushKeySink(
+    IN  PKEY_SINK   Sink
+);
+
+//
+// Flushes what is still queued.
+//
+void CloseKeySink(
+    IN  PKEY_SINK   Sink
+);
+
+#endif
@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+    keyboards.h
+
+Abstract:
+
+    Keyboards the monitor knows how to read macro keys from, see
+    keyboards.cpp.
+
+    Each model is identified by its vendor and product ID and says which
+    top level collection the macro keys arrive on and which button usages
+    they are. The built-in models are compiled into a perfect hash, so
+    deciding whether an interface is a known keyboard costs one probe
+    whatever the table holds; LoadKnownKeyboards adds models from a text
+    file at startup, one per line:
+
+        # VID   PID    Page  Usage MacroPage First  Last ReportID Name
+        0x0d62 0x1a1c 0x0c  0x01  0x0c      0x4c   0x4f 0        Alienware m17 R4
+
+    A ReportID of 0 finds the macro report by its usages. A file entry for
+    a model that is built in replaces it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef KEYBOARDS_H
+#define KEYBOARDS_H
+
+#include "hid.h"
+
+//
+// The macro keys are injected as F13 onwards, of which there are twelve.
+//
+#define KNOWN_KEYBOARD_MAX_MACROS   12
+
+typedef struct _KNOWN_KEYBOARD
+{
+    CHAR        Name[48];
+    USHORT      VendorID;
+    USHORT      ProductID;
+    USAGE       UsagePage;          // Top level collection the macro keys arrive on
+    USAGE       Usage;
+    USAGE       MacroUsagePage;     // Button usages of the macro keys, first to last
+    USAGE       MacroUsageMin;
+    USAGE       MacroUsageMax;
+    UCHAR       MacroReportID;      // 0 to find the report by its usages
+} KNOWN_KEYBOARD, * PKNOWN_KEYBOARD;
+
+const KNOWN_KEYBOARD* FindKnownKeyboard(
+    IN  USHORT                  VendorID,
+    IN  USHORT                  ProductID
+);
+
+//
+// A PHID_LOOKUP_ROUTINE for HID_DEVICE_FILTER: any known keyboard passes,
+// on the collection its entry names.
+//
+bool LookupKnownKeyboard(
+    IN  USHORT                  VendorID,
+    IN  USHORT                  ProductID,
+    OUT PUSAGE                  UsagePage,
+    OUT PUSAGE                  Usage
+);
+
+//
+// The first built-in model, used where no keyboard has been named or found
+// yet.
+//
+const KNOWN_KEYBOARD* GetDefaultKeyboard(
+    void
+);
+
+//
+// Added models are looked up from the enumeration threads without a lock,
+// so they have to be in place before the first enumeration.
+//
+bool AddKnownKeyboard(
+    IN  const KNOWN_KEYBOARD*   Keyboard
+);
+
+//
+// False when the file cannot be read or a line does not parse, in which
+// case LineNumber is the offending line (0 for the file itself) and the
+// lines before it have been added.
+//
+bool LoadKnownKeyboards(
+    IN  LPCSTR                  FileName,
+    OUT PULONG                  LineNumber
+);
+
+#endif
@@ -0,0 +1,49 @@
+/*++
+
+Module Name:
+
+    latency.h
+
+Abstract:
+
+    Per stage latency histograms for the path from a report leaving the
+    device to the injected key, see latency.cpp.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include "hid.h"
+
+typedef enum _LATENCY_STAGE
+{
+    LatencyStageQueue,      // Report read until the monitor picks it up
+    LatencyStageDecode,     // UnpackInputReport
+    LatencyStageHandoff,    // A macro key waiting in the ring for the injector thread
+    LatencyStageConsole,    // The console line for a macro key
+    LatencyStageInject,     // Flushing the key sink, once per batch of macro keys
+    LatencyStageTotal,      // Report read until the key has been injected
+    LatencyStageCount
+} LATENCY_STAGE;
+
+//
+// Record one sample. Each stage is meant to be recorded by a single thread,
+// the monitor's reader or its injector; any thread may print the histograms
+// while they record.
+//
+void RecordLatency(
+    IN  LATENCY_STAGE   Stage,
+    IN  ULONGLONG       Start,      // GetReportTime() values
+    IN  ULONGLONG       End
+);
+
+void PrintLatencyReport(
+    void
+);
+
+#endif
@@ -0,0 +1,70 @@
+/*++
+
+Module Name:
+
+    player.h
+
+Abstract:
+
+    The macro player, see player.cpp.
+
+    Macro actions (see actions.h) are played on a thread of the player's
+    own so their waits never hold up the monitor. Key steps go to the key
+    sink and are flushed together at each wait and at the end; waits are
+    timed against deadlines taken from the start of the macro, so late
+    wakeups do not add up over a long macro. Macros handed to the player
+    while one is playing are played after it, in order.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include "actions.h"
+#include "inject.h"
+
+//
+// Macros waiting to be played beyond this are dropped.
+//
+#define MACRO_PLAYER_MAX_QUEUED 16
+
+typedef struct _MACRO_PLAYER MACRO_PLAYER, * PMACRO_PLAYER;
+
+typedef struct _MACRO_PLAYER_STATS
+{
+    ULONGLONG   Macros;             // Macros played to the end
+    ULONGLONG   Dropped;            // Macros refused because the queue was full
+    ULONGLONG   Waits;
+    ULONGLONG   TotalLateness;      // Nanoseconds the waits overran their deadlines, summed
+    ULONGLONG   MaxLateness;
+} MACRO_PLAYER_STATS, * PMACRO_PLAYER_STATS;
+
+PMACRO_PLAYER StartMacroPlayer(
+    IN  PKEY_SINK               Sink
+);
+
+//
+// Queue a MacroActionScript action, which has to outlive the player.
+// False when the queue is full.
+//
+bool PlayMacro(
+    IN  PMACRO_PLAYER           Player,
+    IN  const MACRO_ACTION*     Action
+);
+
+//
+// Ends the player thread, after the queued macros have been played when
+// Finish is set, at once otherwise. Keys a macro left held are released
+// either way.
+//
+void StopMacroPlayer(
+    IN  PMACRO_PLAYER           Player,
+    IN  bool                    Finish,
+    OUT PMACRO_PLAYER_STATS     Stats       // Optional
+);
+
+#endif
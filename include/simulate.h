@@ -0,0 +1,98 @@
+/*++
+
+Module Name:
+
+    simulate.h
+
+Abstract:
+
+    Simulated HID devices for load and latency testing without the
+    keyboard, see simulate.cpp.
+
+    Once a simulation is started, FindKnownHidDevices lists every instance
+    next to the real hidraw nodes as "sim:hidrawN" (with the usual "&colNN"
+    suffix for descriptors holding several collections), and OpenHidDevice
+    opens it like any other node. Opening one for read starts a thread that
+    writes input reports to it at the configured rate, so the monitor, the
+    event loop and the decoder all run exactly as they do against hardware.
+    A device that went away after ReportCount reports can be made to come
+    back through SendHidUevent, the way the kernel announces a hidraw node,
+    to exercise arrival handling.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef SIMULATE_H
+#define SIMULATE_H
+
+#include <string>
+#include <vector>
+#include "hid.h"
+
+#define HID_SIMULATED_NODE      "sim:hidraw"
+
+typedef struct _HID_SIMULATION
+{
+    LPCSTR      DescriptorFile;     // Raw report descriptor, null for the Alienware consumer collection
+    USHORT      VendorID;
+    USHORT      ProductID;
+    ULONG       Instances;          // Simulated nodes to list
+    ULONG       ReportsPerSecond;   // Per opened collection, 0 for as fast as possible
+    ULONG       BurstLength;        // Reports written back to back before pausing, at least 1
+    ULONGLONG   ReportCount;        // Reports per opened collection before it goes away, 0 for no limit
+    ULONG       ReplugDelay;        // Milliseconds until a device that went away arrives again, 0 for never
+    USAGE       UsagePage;          // Keys pressed in turn, each press followed by a release
+    USAGE       UsageMin;
+    USAGE       UsageMax;
+} HID_SIMULATION, * PHID_SIMULATION;
+
+typedef struct _HID_SIMULATION_STATS
+{
+    ULONGLONG   Reports;            // Reports written to an open device
+    ULONGLONG   Dropped;            // Reports discarded because the device's queue was full
+    ULONGLONG   Elapsed;            // Nanoseconds from the first report written to the last
+} HID_SIMULATION_STATS, * PHID_SIMULATION_STATS;
+
+bool StartHidSimulation(
+    IN  const HID_SIMULATION*   Simulation
+);
+
+//
+// Ends every report thread. Devices still open see end of file, as if
+// unplugged.
+//
+void StopHidSimulation(
+    void
+);
+
+void GetHidSimulationStats(
+    OUT PHID_SIMULATION_STATS   Stats
+);
+
+//
+// Used by the hidraw backend to list and open the simulated nodes.
+//
+bool IsSimulatedHidNode(
+    IN  LPCSTR                  Node
+);
+
+bool ListSimulatedHidNodes(
+    IN OUT std::vector<std::string>& Nodes
+);
+
+bool GetSimulatedHidDescriptor(
+    IN  LPCSTR                  Node,
+    OUT std::vector<UCHAR>&     Descriptor,
+    OUT PHIDD_ATTRIBUTES        Attributes
+);
+
+HANDLE ConnectSimulatedHidNode(
+    IN  LPCSTR                  DevicePath,
+    IN  ULONG                   CollectionIndex,
+    IN  bool                    IsOverlapped
+);
+
+#endif
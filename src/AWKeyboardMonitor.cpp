@@ -21,143 +21,838 @@
  *
  */
 
+#include <atomic>
+#include <cstring>
+#include <deque>
 #include <iostream>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
 #include <wtypes.h>
-#include <strsafe.h>
+#endif
 #include "hid.h"
+#include "capture.h"
+#include "devcache.h"
+#include "eventring.h"
+#include "hiddevice.h"
+#include "latency.h"
+#include "player.h"
 #include <AWKeyboardMonitor.h>
 
+#ifdef _MSC_VER
 #pragma comment(lib, "hid.lib")
 #pragma comment(lib, "setupapi.lib")
+#pragma comment(lib, "cfgmgr32.lib")
+#endif
+
+// Enumeration slower than this (in nanoseconds) names the interface that held it up
+#define SLOW_ENUMERATION_TIME   250000000ull
+
+// Published for StopMonitor, which may run on another thread or in a signal handler
+static std::atomic<PHID_EVENT_LOOP> activeEventLoop;
+static std::atomic<PHID_REPLAY>     activeReplay;
+static std::atomic<bool>            stopRequested;
+static std::atomic<ULONG>           activeStoppers;         // StopMonitor calls that may still hold the loop or replay
+
+// The reader thread only decodes reports and hands the macro keys to the injector thread over this ring
+static PMACRO_EVENT_RING            activeRing;
+static std::thread                  injectorThread;
+static bool                         losslessHandoff;        // A replay waits for room in the rings rather than dropping keys
+static ULONGLONG                    droppedKeys;            // The reader's count of keys that found the ring full
+
+// Edges go to event clients straight from the reader, before the injector has seen them
+static PEVENT_SERVER                activeEventServer;
 
-DWORD StartMonitor(WORD targetVID, WORD targetPID)
+// The injector queues keys in the sink while the ring keeps filling and flushes them together; these are the reports still waiting on it
+static PKEY_SINK                    activeKeySink;
+static ULONGLONG                    pendingReportTimes[KEY_SINK_MAX_EVENTS / 2];
+static ULONG                        pendingReports;
+
+// Macros play on a thread of their own, started the first time one is pressed
+static PMACRO_PLAYER                activePlayer;
+
+static PHID_DATA FindMacroData(PHID_DEVICE hidDevice, const KNOWN_KEYBOARD* keyboard)
 {
-    static HID_DEVICE               targetDevice;
-    HANDLE                          completionEvent;
-    bool                            readResult;
-    DWORD                           waitStatus;
-    OVERLAPPED                      overlap;
-    DWORD                           bytesTransferred;
-    PCHAR                           targetDevicePath = nullptr;
-    PHID_DEVICE                     pDevice = nullptr;
-    ULONG                           numberDevices;
+    for (ULONG i = 0; i < hidDevice->InputDataLength; i++)
+    {
+        PHID_DATA data = &hidDevice->InputData[i];
 
-    if (!FindKnownHidDevices(&pDevice, &numberDevices))
+        if (data->IsButtonData &&
+            data->UsagePage == keyboard->MacroUsagePage &&
+            data->ButtonData.UsageMin <= keyboard->MacroUsageMax &&
+            data->ButtonData.UsageMax >= keyboard->MacroUsageMin &&
+            (keyboard->MacroReportID == 0 || data->ReportID == keyboard->MacroReportID))
+        {
+            return data;
+        }
+    }
+
+    // Fall back to the first data item, which is what a single collection keyboard reports on
+    return hidDevice->InputDataLength > 0 && hidDevice->InputData->IsButtonData ? hidDevice->InputData : nullptr;
+}
+
+// Only the report carrying the macro keys is worth decoding
+static PHID_DATA SubscribeMacroReport(PHID_DEVICE hidDevice, const KNOWN_KEYBOARD* keyboard)
+{
+    PHID_DATA macroData = FindMacroData(hidDevice, keyboard);
+
+    if (macroData != nullptr)
     {
-        std::cerr << "No HID devices found." << std::endl;
-        return -1;
+        for (ULONG reportID = 0; reportID < 256; reportID++)
+        {
+            SetInputReportSubscription(hidDevice, (UCHAR)reportID, reportID == macroData->ReportID);
+        }
+    }
+    return macroData;
+}
+
+static void PublishMacroEdge(PHID_DEVICE hidDevice, USHORT device, USAGE macroKey, bool down, ULONGLONG reportTime)
+{
+    MACRO_EVENT event = {};
+
+    if (activeEventServer == nullptr || macroKey == 0)
+    {
+        return;
+    }
+
+    event.MacroKey = macroKey;
+    event.Device = device;
+    event.VendorID = hidDevice->Attributes.VendorID;
+    event.ProductID = hidDevice->Attributes.ProductID;
+    event.Down = down;
+    event.ReportTime = reportTime;
+
+    PublishMacroEvent(activeEventServer, &event, losslessHandoff);
+}
+
+static void ProcessMacroReport(PHID_DEVICE reportDevice, const KNOWN_KEYBOARD* keyboard, const MACRO_ACTION_MAP* actions, PHID_DATA macroData,
+                               USHORT device, PUSAGE heldKey)
+{
+    ULONGLONG decodeStart = GetReportTime();
+
+    RecordLatency(LatencyStageQueue, reportDevice->InputReportTime, decodeStart);
+
+    // Reports for other collections on the same interface leave MacroData untouched
+    if (macroData == nullptr || (UCHAR)reportDevice->InputReportBuffer[0] != macroData->ReportID)
+    {
+        return;
+    }
+
+    UnpackInputReport(reportDevice);
+    RecordLatency(LatencyStageDecode, decodeStart, GetReportTime());
+
+    USAGE       usage = *macroData->ButtonData.Usages;
+    bool        pressed = usage >= keyboard->MacroUsageMin && usage <= keyboard->MacroUsageMax;
+    MACRO_EVENT event = {};
+
+    event.MacroKey = pressed ? MACROA + (usage - keyboard->MacroUsageMin) : 0;
+    event.Device = device;
+    event.VendorID = reportDevice->Attributes.VendorID;
+    event.ProductID = reportDevice->Attributes.ProductID;
+    event.ReportTime = reportDevice->InputReportTime;
+
+    // Clients hear of a key going from one down to another as the one let go before the other pressed
+    if (event.MacroKey != *heldKey)
+    {
+        PublishMacroEdge(reportDevice, device, *heldKey, false, event.ReportTime);
+        PublishMacroEdge(reportDevice, device, event.MacroKey, true, event.ReportTime);
+        *heldKey = event.MacroKey;
     }
 
-    for (ULONG iIndex = 0; iIndex < numberDevices; iIndex++, pDevice++)
+    if (pressed)
     {
-        // If currently pointed to device is our target device, copy the DevicePath into a buffer to use later
-        if (pDevice->Attributes.VendorID == targetVID &&
-            pDevice->Attributes.ProductID == targetPID &&
-            pDevice->Caps.UsagePage == AW_USAGEPAGE &&
-            pDevice->Caps.Usage == AW_USAGE)
+        event.Down = true;
+        event.Action = LookupMacroAction(actions, usage - keyboard->MacroUsageMin);
+
+        while (!PushMacroEvent(activeRing, &event))
         {
-            int iDevicePathSize = static_cast<int>(strnlen(pDevice->DevicePath, MAX_PATH) + 1);
-            // Try to allocate memory for storing the Device Path
-            try
+            if (!losslessHandoff)
             {
-                targetDevicePath = new char[iDevicePathSize];
-                std::memset(targetDevicePath, 0, iDevicePathSize);
+                droppedKeys++;
+                break;
             }
-            catch (const std::bad_alloc&)
+            std::this_thread::yield();
+        }
+    }
+}
+
+// Inject every queued key in one call
+static void FlushMacroKeys(void)
+{
+    if (activeKeySink == nullptr || GetQueuedKeyEvents(activeKeySink) == 0)
+    {
+        return;
+    }
+
+    ULONGLONG injectStart = GetReportTime();
+
+    if (!FlushKeySink(activeKeySink))
+    {
+        std::cerr << "Unable to inject the macro keys" << std::endl;
+    }
+
+    ULONGLONG injectEnd = GetReportTime();
+
+    RecordLatency(LatencyStageInject, injectStart, injectEnd);
+
+    for (ULONG i = 0; i < pendingReports; i++)
+    {
+        RecordLatency(LatencyStageTotal, pendingReportTimes[i], injectEnd);
+    }
+    pendingReports = 0;
+}
+
+static void InjectorThread(PMACRO_EVENT_RING ring)
+{
+    MACRO_EVENT event;
+
+    while (WaitMacroEvent(ring))
+    {
+        while (PopMacroEvent(ring, &event))
+        {
+            RecordLatency(LatencyStageHandoff, event.PushTime, GetReportTime());
+            HandleMacroKey(event.MacroKey, event.Action);
+
+            // A key waiting in the sink is not injected until FlushMacroKeys
+            if (activeKeySink != nullptr && GetQueuedKeyEvents(activeKeySink) > 0 && pendingReports < KEY_SINK_MAX_EVENTS / 2)
+            {
+                pendingReportTimes[pendingReports++] = event.ReportTime;
+            }
+            else
             {
-                std::cerr << "Unable to allocate memory for device path." << std::endl;
-                return -1;
+                RecordLatency(LatencyStageTotal, event.ReportTime, GetReportTime());
             }
-            StringCbCopyA(targetDevicePath, iDevicePathSize, pDevice->DevicePath);
-            pDevice -= iIndex;          // Move pDevice pointer back to the beginning of the list again in preparation for the free statement
+        }
+
+        // The ring has run dry, so whatever this burst queued goes out in one call
+        FlushMacroKeys();
+    }
+}
+
+static bool StartInjector(PKEY_SINK keySink)
+{
+    activeKeySink = keySink;
+    activeRing = CreateMacroEventRing();
+
+    if (activeRing == nullptr)
+    {
+        std::cerr << "Unable to allocate memory for the macro key ring." << std::endl;
+        return false;
+    }
+
+    try
+    {
+        injectorThread = std::thread(InjectorThread, activeRing);
+    }
+    catch (const std::system_error&)
+    {
+        std::cerr << "Unable to start the injector thread" << std::endl;
+        DestroyMacroEventRing(activeRing);
+        activeRing = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+// Lets the injector handle every key still in the ring before it goes
+static void StopInjector(void)
+{
+    MACRO_EVENT_RING_STATS stats;
+
+    if (activeRing == nullptr)
+    {
+        return;
+    }
+
+    CloseMacroEventRing(activeRing);
+    injectorThread.join();
+    GetMacroEventRingStats(activeRing, &stats);
+    DestroyMacroEventRing(activeRing);
+    activeRing = nullptr;
+    activeKeySink = nullptr;
+
+    if (stats.Pushed > 0 || droppedKeys > 0)
+    {
+        std::cout << "Handed " << stats.Pushed << " macro key(s) to the injector, at most " << stats.MaxDepth
+                  << " of " << MACRO_EVENT_RING_SIZE << " waiting";
+        if (droppedKeys > 0)
+        {
+            std::cout << ", " << droppedKeys << " dropped with the ring full";
+        }
+        std::cout << std::endl;
+    }
+    droppedKeys = 0;
+}
+
+static void ReportReadStats(PHID_EVENT_LOOP eventLoop, PHID_DEVICE hidDevice)
+{
+    HID_READ_STATS stats;
+
+    // Only worth mentioning when a burst outran the read queue
+    if (GetHidReadStats(eventLoop, hidDevice, &stats) && stats.Overflows > 0)
+    {
+        std::cerr << hidDevice->DevicePath << ": read queue of " << stats.QueueDepth
+                  << " overflowed " << stats.Overflows << " time(s) in " << stats.Reports << " reports" << std::endl;
+    }
+}
+
+static void ReportEnumerationTiming(void)
+{
+    HID_ENUMERATION_TIMING  timing;
+    HID_PROBE_TIMING        slowest;
+
+    if (GetHidEnumerationTiming(&timing, &slowest, 1) && timing.NumberProbes > 0 && timing.Elapsed >= SLOW_ENUMERATION_TIME)
+    {
+        std::cerr << "Probing " << timing.NumberProbes << " HID interface(s) took " << timing.Elapsed / 1000000
+                  << " ms on " << timing.Workers << " thread(s), slowest: " << slowest.DevicePath
+                  << " (" << slowest.Elapsed / 1000000 << " ms)" << std::endl;
+    }
+}
+
+// The known keyboard an interface belongs to, when it is the collection that keyboard sends its macro keys on
+static const KNOWN_KEYBOARD* FindTargetKeyboard(PHID_DEVICE hidDevice, WORD targetVID, WORD targetPID)
+{
+    const KNOWN_KEYBOARD* keyboard = FindKnownKeyboard(hidDevice->Attributes.VendorID, hidDevice->Attributes.ProductID);
+
+    if (keyboard == nullptr ||
+        (targetVID != 0 && hidDevice->Attributes.VendorID != targetVID) ||
+        (targetPID != 0 && hidDevice->Attributes.ProductID != targetPID) ||
+        hidDevice->Caps.UsagePage != keyboard->UsagePage ||
+        hidDevice->Caps.Usage != keyboard->Usage)
+    {
+        return nullptr;
+    }
+    return keyboard;
+}
+
+// Lock-free so StopMonitor can count itself from a signal handler; a stopper only holds on for one stop call
+static void WaitForStoppers(void)
+{
+    while (activeStoppers != 0)
+    {
+        std::this_thread::yield();
+    }
+}
+
+static bool IsAttached(const std::deque<MONITORED_DEVICE>& targetDevices, LPCSTR devicePath)
+{
+    for (const MONITORED_DEVICE& target : targetDevices)
+    {
+        if (target.Attached && strcmp(target.HidDevice.DevicePath, devicePath) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void StopPlayer(bool finish)
+{
+    MACRO_PLAYER_STATS stats;
+
+    if (activePlayer == nullptr)
+    {
+        return;
+    }
+
+    StopMacroPlayer(activePlayer, finish, &stats);
+    activePlayer = nullptr;
+
+    std::cout << "Played " << stats.Macros << " macro(s)";
+    if (stats.Waits > 0)
+    {
+        std::cout << ", waits late by " << stats.TotalLateness / stats.Waits / 1000.0 << " us on average and "
+                  << stats.MaxLateness / 1000.0 << " us at most";
+    }
+    if (stats.Dropped > 0)
+    {
+        std::cout << ", " << stats.Dropped << " dropped";
+    }
+    std::cout << std::endl;
+}
+
+// Open a matching interface for reading and start serving it, reusing the slot of a device that went away
+static bool AttachTarget(PHID_EVENT_LOOP eventLoop, std::deque<MONITORED_DEVICE>& targetDevices, LPCSTR devicePath,
+                         const KNOWN_KEYBOARD* keyboard, ULONG queueDepth, PHID_CAPTURE& capture, LPCSTR captureFile)
+{
+    PMONITORED_DEVICE target = nullptr;
+    USHORT            device = 0;
+
+    for (MONITORED_DEVICE& candidate : targetDevices)
+    {
+        if (!candidate.Attached)
+        {
+            target = &candidate;
             break;
         }
+        device++;
     }
-    delete[] pDevice;
-    pDevice = nullptr;
 
-    if (targetDevicePath == nullptr)
+    try
     {
-        std::cerr << "Target device could not be located!" << std::endl;
-        return -1;
+        // A deque keeps the HID_DEVICE addresses handed to the event loop stable as it grows
+        target = (target != nullptr) ? target : &targetDevices.emplace_back();
+    }
+    catch (const std::bad_alloc&)
+    {
+        std::cerr << "Unable to allocate memory for device state." << std::endl;
+        return false;
     }
 
 #ifdef _DEBUG
-    std::cout << "Target Device located: " << targetDevicePath << std::endl;
+    std::cout << "Target Device located: " << devicePath << std::endl;
 #endif
 
     // Open target device for asynchronous reading
-    bool openForAsync = OpenHidDevice(targetDevicePath, true, false, true, false, &targetDevice);
+    if (!OpenHidDevice(devicePath, true, false, true, false, &target->HidDevice))
+    {
+        std::cerr << "Unable to open target HID device for async read: " << devicePath << std::endl;
+        return false;
+    }
+
+    target->Keyboard = keyboard;
+    target->Actions = GetMacroActions(keyboard);
+    target->Device = device;
+    target->HeldKey = 0;
+    target->MacroData = SubscribeMacroReport(&target->HidDevice, keyboard);
+    target->Attached = AttachHidDevice(eventLoop, &target->HidDevice, queueDepth);
+
+    if (!target->Attached)
+    {
+        CloseHidDevice(&target->HidDevice);
+        return false;
+    }
+
+    if (capture != nullptr && !CaptureHidDevice(capture, &target->HidDevice, &target->CaptureId))
+    {
+        std::cerr << "Unable to write capture file: " << captureFile << std::endl;
+        CloseHidCapture(capture);
+        capture = nullptr;
+    }
+
+    // Opened for reading only, so the output and feature state is never laid out
+    std::cout << "Attached " << keyboard->Name << ": " << devicePath << " ("
+              << GetHidDeviceFootprint(&target->HidDevice) << " bytes of device state)" << std::endl;
+
+    return true;
+}
+
+DWORD StartMonitor(WORD targetVID, WORD targetPID, ULONG queueDepth, LPCSTR captureFile, bool hotplug, PKEY_SINK keySink, PEVENT_SERVER eventServer)
+{
+    std::deque<MONITORED_DEVICE>    targetDevices;
+    size_t                          attachedDevices = 0;
+    PHID_EVENT_LOOP                 eventLoop;
+    HID_WAIT_STATUS                 waitStatus;
+    PHID_DEVICE                     reportDevice;
+    ULONG                           bytesRead;
+    HidDeviceRegistry               candidates;
+    HID_DEVICE_FILTER               filter = { targetVID, targetPID, 0, 0, LookupKnownKeyboard };
+    const KNOWN_KEYBOARD*           keyboard;
+    bool                            found;
+    PHID_CAPTURE                    capture = nullptr;
+    bool                            watching = false;
 
-    delete[] targetDevicePath;
+    eventLoop = CreateHidEventLoop();
 
-    if (!openForAsync)
+    if (eventLoop == nullptr)
     {
-        std::cerr << "Unable to open target HID device for async read" << std::endl;
+        std::cerr << "Unable to create the event loop" << std::endl;
         return -1;
     }
 
-    std::cout << "Starting monitor" << std::endl;
+    // Watching starts before the enumeration so a keyboard plugged in meanwhile is not missed
+    if (hotplug)
+    {
+        watching = WatchHidArrivals(eventLoop);
 
-    completionEvent = CreateEvent(nullptr, false, false, nullptr);
+        if (!watching)
+        {
+            std::cerr << "Device arrival notifications are unavailable, a removed keyboard will not be picked up again." << std::endl;
+        }
+    }
 
-    if (completionEvent == nullptr)
+    if (captureFile != nullptr)
     {
+        capture = OpenHidCapture(captureFile);
+
+        if (capture == nullptr)
+        {
+            std::cerr << "Unable to create capture file: " << captureFile << std::endl;
+        }
+    }
+
+    // Only the macro collection of a known keyboard gets opened and filled in
+    found = candidates.Enumerate(&filter);
+
+    ReportEnumerationTiming();
+
+    if (!found)
+    {
+        if (!watching)
+        {
+            std::cerr << "No HID devices found." << std::endl;
+            DestroyHidEventLoop(eventLoop);
+            CloseHidCapture(capture);
+            return -1;
+        }
+    }
+
+    // Attach every interface that matches, not just the first one
+    for (UniqueHidDevice& candidate : candidates)
+    {
+        if ((keyboard = FindTargetKeyboard(candidate.Get(), targetVID, targetPID)) != nullptr &&
+            AttachTarget(eventLoop, targetDevices, candidate->DevicePath, keyboard, queueDepth, capture, captureFile))
+        {
+            attachedDevices++;
+        }
+    }
+
+    // The query handles are done with once the targets have their own
+    candidates.Clear();
+
+    // Whatever had to be derived from scratch is cached for the next start
+    FlushHidDeviceCache();
+
+    if (attachedDevices == 0 && !watching)
+    {
+        std::cerr << "Target device could not be located!" << std::endl;
+        DestroyHidEventLoop(eventLoop);
+        CloseHidCapture(capture);
+        return -1;
+    }
+
+    if (!StartInjector(keySink))
+    {
+        DestroyHidEventLoop(eventLoop);
+        CloseHidCapture(capture);
+        for (MONITORED_DEVICE& target : targetDevices)
+        {
+            if (target.Attached)
+            {
+                CloseHidDevice(&target.HidDevice);
+            }
+        }
         return -1;
     }
 
-    readResult = true;
+    activeEventLoop = eventLoop;
+    activeEventServer = eventServer;
+
+    // A stop that arrived before the loop was published would otherwise be lost
+    if (stopRequested)
+    {
+        StopHidEventLoop(eventLoop);
+    }
+
+    if (attachedDevices > 0)
+    {
+        std::cout << "Starting monitor on " << attachedDevices << " device(s)" << std::endl;
+    }
+    else
+    {
+        std::cout << "Waiting for the target device" << std::endl;
+    }
 
-    // Begin monitoring loop. This likely could be made more efficient. Is is mostly a copy of Microsoft's hclient sample
-    do
+    // One wait multiplexes every attached device; a device that fails is dropped and the rest carry on
+    while (attachedDevices > 0 || watching)
     {
-        readResult = ReadOverlapped(&targetDevice, completionEvent, &overlap);
+        // Blocks until a report or a device arrives or StopMonitor is called, an idle keyboard costs no wakeups
+        waitStatus = WaitForHidReport(eventLoop, INFINITE, &reportDevice, &bytesRead);
 
-        if (!readResult)
+        if (waitStatus == HidWaitStopped)
         {
+            std::cout << "Stopping monitor" << std::endl;
             break;
         }
-        while (true)
+
+        if (waitStatus == HidWaitTimeout)
+        {
+            continue;
+        }
+
+        // Only the new devices are opened and checked, not every HID device on the system
+        if (waitStatus == HidWaitArrival)
         {
-            waitStatus = WaitForSingleObject(completionEvent, READ_THREAD_TIMEOUT);
+            if (!candidates.Arrivals(eventLoop))
+            {
+                continue;
+            }
 
-            if (waitStatus == WAIT_OBJECT_0)
+            for (UniqueHidDevice& candidate : candidates)
             {
-                readResult = GetOverlappedResult(targetDevice.HidDevice, &overlap, &bytesTransferred, true);
+                if ((keyboard = FindTargetKeyboard(candidate.Get(), targetVID, targetPID)) != nullptr &&
+                    !IsAttached(targetDevices, candidate->DevicePath) &&
+                    AttachTarget(eventLoop, targetDevices, candidate->DevicePath, keyboard, queueDepth, capture, captureFile))
+                {
+                    attachedDevices++;
+                }
+            }
+
+            candidates.Clear();
+            FlushHidDeviceCache();
+            continue;
+        }
+
+        PMONITORED_DEVICE target = nullptr;
+
+        for (MONITORED_DEVICE& candidate : targetDevices)
+        {
+            if (candidate.Attached && &candidate.HidDevice == reportDevice)
+            {
+                target = &candidate;
                 break;
             }
         }
-        UnpackReport(targetDevice.InputReportBuffer,
-                     targetDevice.Caps.InputReportByteLength,
-                     HidP_Input,
-                     targetDevice.InputData,
-                     targetDevice.InputDataLength,
-                     targetDevice.Ppd);
 
-        USAGE usage = *targetDevice.InputData->ButtonData.Usages;
+        if (waitStatus == HidWaitError)
+        {
+            if (target == nullptr)
+            {
+                break;
+            }
+
+            std::cerr << "Lost device: " << target->HidDevice.DevicePath << std::endl;
+            PublishMacroEdge(&target->HidDevice, target->Device, target->HeldKey, false, GetReportTime());
+            ReportReadStats(eventLoop, &target->HidDevice);
+            DetachHidDevice(eventLoop, &target->HidDevice);
+            CloseHidDevice(&target->HidDevice);
+            target->Attached = false;
+            attachedDevices--;
+            continue;
+        }
 
-        if (usage >= MACROA && usage <= MACROD)
+        if (target == nullptr)
         {
-            HandleMacroKey(usage);
+            continue;
         }
-    } while (readResult);
+
+        // Every report goes into the capture, not just the ones carrying macro keys
+        if (capture != nullptr &&
+            !CaptureHidReport(capture, target->CaptureId, reportDevice->InputReportBuffer, bytesRead))
+        {
+            std::cerr << "Unable to write capture file: " << captureFile << std::endl;
+            CloseHidCapture(capture);
+            capture = nullptr;
+        }
+
+        ProcessMacroReport(reportDevice, target->Keyboard, target->Actions, target->MacroData, target->Device, &target->HeldKey);
+    }
+
+    if (capture != nullptr && !CloseHidCapture(capture))
+    {
+        std::cerr << "Unable to write capture file: " << captureFile << std::endl;
+    }
+
+    for (MONITORED_DEVICE& target : targetDevices)
+    {
+        if (target.Attached)
+        {
+            ReportReadStats(eventLoop, &target.HidDevice);
+        }
+    }
+
+    // A monitor that was not stopped lets the macros already pressed play out
+    StopInjector();
+    StopPlayer(!stopRequested);
+    activeEventServer = nullptr;
+
+    // Cancels the reads still in flight before the devices are closed
+    activeEventLoop = nullptr;
+    WaitForStoppers();
+    DestroyHidEventLoop(eventLoop);
+
+    for (MONITORED_DEVICE& target : targetDevices)
+    {
+        if (target.Attached)
+        {
+            CloseHidDevice(&target.HidDevice);
+        }
+    }
 
     return 0;
 }
 
-void HandleMacroKey(USAGE macroKey)
+// What ReplayMonitor has worked out about each device in the capture
+typedef struct _REPLAYED_DEVICE
 {
-    std::cout << "Read key: 0x" << std::hex << macroKey << " Macro " << (char)(macroKey - 0xb) << std::endl;
+    PHID_DEVICE             HidDevice;
+    const KNOWN_KEYBOARD*   Keyboard;
+    const MACRO_ACTION_MAP* Actions;
+    PHID_DATA               MacroData;
+    USAGE                   HeldKey;
+} REPLAYED_DEVICE, * PREPLAYED_DEVICE;
 
-    INPUT inputs[2] = {};
-    ZeroMemory(inputs, sizeof(inputs));
+DWORD ReplayMonitor(LPCSTR replayFile, bool realTime, PKEY_SINK keySink, PEVENT_SERVER eventServer)
+{
+    std::vector<REPLAYED_DEVICE>    replayDevices;
+    PHID_REPLAY                     replay;
+    HID_WAIT_STATUS                 waitStatus;
+    PHID_DEVICE                     reportDevice;
+    ULONG                           bytesRead;
+    ULONG                           reports = 0;
+    DWORD                           result = 0;
 
-    inputs[0].type = INPUT_KEYBOARD;
-    inputs[0].ki.wVk = macroKey + 0x30;                            // Maps the macro keys to F13-F16
+    replay = OpenHidReplay(replayFile, realTime);
 
-    inputs[1].type = INPUT_KEYBOARD;
-    inputs[1].ki.wVk = macroKey + 0x30;
-    inputs[1].ki.dwFlags = KEYEVENTF_KEYUP;
+    if (replay == nullptr)
+    {
+        std::cerr << "Unable to open capture file: " << replayFile << std::endl;
+        return -1;
+    }
+
+    // Played as fast as possible a capture would outrun the injector, which must not cost it keys
+    losslessHandoff = true;
+
+    if (!StartInjector(keySink))
+    {
+        CloseHidReplay(replay);
+        return -1;
+    }
+
+    activeReplay = replay;
+    activeEventServer = eventServer;
+
+    if (stopRequested)
+    {
+        StopHidReplay(replay);
+    }
+
+    std::cout << "Replaying " << replayFile << std::endl;
+
+    while ((waitStatus = ReadHidReplay(replay, &reportDevice, &bytesRead)) == HidWaitReport)
+    {
+        PREPLAYED_DEVICE device = nullptr;
+
+        for (REPLAYED_DEVICE& candidate : replayDevices)
+        {
+            if (candidate.HidDevice == reportDevice)
+            {
+                device = &candidate;
+                break;
+            }
+        }
+
+        if (device == nullptr)
+        {
+            REPLAYED_DEVICE added = {};
+
+            // A capture of a keyboard that is not in the table was taken with its VID/PID named, most likely the default's layout
+            added.HidDevice = reportDevice;
+            added.Keyboard = FindKnownKeyboard(reportDevice->Attributes.VendorID, reportDevice->Attributes.ProductID);
+            added.Keyboard = (added.Keyboard != nullptr) ? added.Keyboard : GetDefaultKeyboard();
+            added.Actions = GetMacroActions(added.Keyboard);
+            added.MacroData = SubscribeMacroReport(reportDevice, added.Keyboard);
+
+            try
+            {
+                device = &replayDevices.emplace_back(added);
+            }
+            catch (const std::bad_alloc&)
+            {
+                std::cerr << "Unable to allocate memory for device state." << std::endl;
+                result = (DWORD)-1;
+                break;
+            }
+        }
+
+        reports++;
+        ProcessMacroReport(reportDevice, device->Keyboard, device->Actions, device->MacroData,
+                           (USHORT)(device - replayDevices.data()), &device->HeldKey);
+    }
+
+    StopInjector();
+    StopPlayer(!stopRequested);
+    losslessHandoff = false;
+    activeEventServer = nullptr;
+
+    if (waitStatus == HidWaitError)
+    {
+        std::cerr << "Capture file is damaged or holds a device that cannot be rebuilt: " << replayFile << std::endl;
+        result = (DWORD)-1;
+    }
+
+    std::cout << "Replayed " << reports << " report(s)" << std::endl;
+
+    activeReplay = nullptr;
+    WaitForStoppers();
+    CloseHidReplay(replay);
+    return result;
+}
 
-    SendInput(ARRAYSIZE(inputs), inputs, sizeof(INPUT));
-}
\ No newline at end of file
+void StopMonitor(void)
+{
+    stopRequested = true;
+
+    // Counted before the loads, so a monitor that unpublishes the loop or replay after them waits for this call
+    activeStoppers++;
+
+    PHID_EVENT_LOOP eventLoop = activeEventLoop;
+    PHID_REPLAY     replay = activeReplay;
+
+    if (eventLoop != nullptr)
+    {
+        StopHidEventLoop(eventLoop);
+    }
+
+    if (replay != nullptr)
+    {
+        StopHidReplay(replay);
+    }
+
+    activeStoppers--;
+}
+
+void HandleMacroKey(USAGE macroKey, const MACRO_ACTION* action)
+{
+    ULONGLONG consoleStart = GetReportTime();
+
+    std::cout << "Read key: 0x" << std::hex << macroKey << " Macro " << (char)(macroKey - 0xb) << std::dec << std::endl;
+
+    RecordLatency(LatencyStageConsole, consoleStart, GetReportTime());
+
+    if (activeKeySink == nullptr || action == nullptr || action->Type == MacroActionNone)
+    {
+        return;
+    }
+
+    if (action->Type == MacroActionScript)
+    {
+        activePlayer = (activePlayer != nullptr) ? activePlayer : StartMacroPlayer(activeKeySink);
+
+        if (activePlayer == nullptr)
+        {
+            std::cerr << "Unable to start the macro player" << std::endl;
+        }
+        else if (!PlayMacro(activePlayer, action))
+        {
+            std::cerr << "Macro dropped, too many are still waiting to be played" << std::endl;
+        }
+        return;
+    }
+
+    // A full sink is flushed here rather than by itself so the reports waiting on it are accounted for
+    if (GetQueuedKeyEvents(activeKeySink) + 2 * action->NumberKeys > KEY_SINK_MAX_EVENTS)
+    {
+        FlushMacroKeys();
+    }
+
+    if (action->Type == MacroActionCombo)
+    {
+        // Held down in order and let go in reverse, so modifiers wrap the key they modify
+        for (ULONG i = 0; i < action->NumberKeys; i++)
+        {
+            QueueKeyEvent(activeKeySink, action->Keys[i], true);
+        }
+        for (ULONG i = action->NumberKeys; i > 0; i--)
+        {
+            QueueKeyEvent(activeKeySink, action->Keys[i - 1], false);
+        }
+        return;
+    }
+
+    for (ULONG i = 0; i < action->NumberKeys; i++)
+    {
+        QueueKeyPress(activeKeySink, action->Keys[i]);
+    }
+}
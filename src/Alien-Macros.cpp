@@ -21,31 +21,312 @@
  *
  */
 
+#include <cstdio>
 #include <regex>
+#ifdef _WIN32
 #include <wtypes.h>
+#endif
 #include "version.h"
 #include "argparse.h"
 #include "AWKeyboardMonitor.h"
+#include "latency.h"
+#include "devcache.h"
+#include "hidlist.h"
+#ifndef _WIN32
+#include <csignal>
+#include <thread>
+#include "simulate.h"
+#endif
+
+#ifdef _WIN32
+// Console control handlers run on their own thread, so printing here is fine
+static BOOL WINAPI ConsoleCtrlHandler(DWORD ctrlType)
+{
+    if (ctrlType == CTRL_C_EVENT)
+    {
+        StopMonitor();
+        return TRUE;
+    }
+    if (ctrlType == CTRL_BREAK_EVENT)
+    {
+        PrintLatencyReport();
+        return TRUE;
+    }
+    return FALSE;
+}
+#else
+static void StopSignalHandler(int)
+{
+    StopMonitor();
+}
+
+// Printing is not async-signal-safe, so SIGUSR1 is taken synchronously by a thread of its own
+static void LatencyReportThread(sigset_t signals)
+{
+    int signal;
+
+    while (sigwait(&signals, &signal) == 0)
+    {
+        PrintLatencyReport();
+    }
+}
+#endif
 
 int main(int argc, char* argv[])
 {
     argparse::Parser parser;
 
-    auto& vid = parser.AddArg<std::string>("vid", 'v', "Target VID").Default(AW_KB_VID);
-    auto& pid = parser.AddArg<std::string>("pid", 'p', "Target PID").Default(AW_KB_PID);
+    auto vid = parser.AddArg<std::string>("vid", 'v', "Target VID, any known keyboard by default");
+    auto pid = parser.AddArg<std::string>("pid", 'p', "Target PID, any known keyboard by default");
+    auto keyboardsFile = parser.AddArg<std::string>("keyboards", 'k', "Add the keyboard models listed in this file to the built-in ones");
+    auto actionsFile = parser.AddArg<std::string>("actions", 'a', "What each macro key does, F13 onwards by default");
+    auto queueDepth = parser.AddArg<int>("queue-depth", 'q', "Input reads kept outstanding per device").Default(HID_DEFAULT_READ_QUEUE_DEPTH);
+    auto captureFile = parser.AddArg<std::string>("capture", 'c', "Record every input report to this file");
+    auto replayFile = parser.AddArg<std::string>("replay", 'r', "Replay a capture file instead of reading the keyboard");
+    auto replayFast = parser.AddFlag("fast", 'f', "Replay as fast as possible rather than at the recorded pace");
+    auto cacheFile = parser.AddArg<std::string>("cache", "Device layout cache file, kept in the user's cache directory by default");
+    auto noCache = parser.AddFlag("no-cache", "Derive every device's layout afresh and keep no cache");
+    auto list = parser.AddFlag("list", 'l', "Print every HID interface with its reports and probe time as JSON and exit");
+    auto eventsEndpoint = parser.AddArg<std::string>("events", 'e', "Send macro key presses and releases to local clients of this socket (pipe name on Windows)");
+    auto noInject = parser.AddFlag("no-inject", "Inject no keys, only print the macro keys and send them to event clients");
+#ifndef _WIN32
+    auto simulate = parser.AddArg<int>("simulate", 's', "Add this many simulated keyboards sending macro keys").Default(0);
+    auto simulateRate = parser.AddArg<int>("sim-rate", "Reports per second from each simulated keyboard, 0 for no limit").Default(1000);
+    auto simulateBurst = parser.AddArg<int>("sim-burst", "Reports each simulated keyboard sends back to back").Default(1);
+    auto simulateCount = parser.AddArg<int>("sim-count", "Reports before a simulated keyboard goes away, 0 for no limit").Default(0);
+    auto simulateReplug = parser.AddArg<int>("sim-replug", "Milliseconds until a simulated keyboard that went away comes back, 0 for never").Default(0);
+    auto simulateDescriptor = parser.AddArg<std::string>("sim-descriptor", "Report descriptor file for the simulated keyboards");
+    auto injectFile = parser.AddArg<std::string>("inject-file", "Write the injected keys to this file as uinput input_events instead of /dev/uinput");
+#endif
     parser.ParseArgs(argc, argv);
 
     std::regex re("(?:0x)[0-9a-fA-F]{4}");
-    if (!std::regex_match(*pid, re) || !std::regex_match(*vid, re))
+    if ((bool)vid != (bool)pid || (vid && (!std::regex_match(*pid, re) || !std::regex_match(*vid, re))))
     {
         std::cerr << "VID/PID is invalid. Please make sure it is in the format 0xXXXX where XXXX is the hexadecimal VID/PID." << std::endl;
         return -1;
     }
 
-    WORD targetVID = (WORD)std::stoi(*vid, nullptr, 16);
-    WORD targetPID = (WORD)std::stoi(*pid, nullptr, 16);
+    if (*queueDepth < 1 || *queueDepth > 512)
+    {
+        std::cerr << "Queue depth must be between 1 and 512." << std::endl;
+        return -1;
+    }
+
+    ULONG keyboardsLine;
+    if (keyboardsFile && !LoadKnownKeyboards(keyboardsFile->c_str(), &keyboardsLine))
+    {
+        std::cerr << "Unable to load keyboard models from " << *keyboardsFile;
+        if (keyboardsLine > 0)
+        {
+            std::cerr << ", line " << keyboardsLine << " is not VID PID UsagePage Usage MacroUsagePage First Last ReportID Name";
+        }
+        std::cerr << "." << std::endl;
+        return -1;
+    }
+
+    // Zero monitors every known keyboard
+    WORD targetVID = vid ? (WORD)std::stoi(*vid, nullptr, 16) : 0;
+    WORD targetPID = pid ? (WORD)std::stoi(*pid, nullptr, 16) : 0;
+
+    // A keyboard named by VID/PID that is not in the table is taken to be laid out like the default one
+    if (vid && FindKnownKeyboard(targetVID, targetPID) == nullptr)
+    {
+        KNOWN_KEYBOARD keyboard = *GetDefaultKeyboard();
+
+        snprintf(keyboard.Name, sizeof(keyboard.Name), "Keyboard %04x:%04x", targetVID, targetPID);
+        keyboard.VendorID = targetVID;
+        keyboard.ProductID = targetPID;
+        AddKnownKeyboard(&keyboard);
+    }
+
+    ULONG actionsLine;
+    if (actionsFile && !LoadMacroActions(actionsFile->c_str(), &actionsLine))
+    {
+        std::cerr << "Unable to load macro key actions from " << *actionsFile;
+        if (actionsLine > 0)
+        {
+            std::cerr << ", line " << actionsLine << " is not VID PID Usage Action for a known keyboard's macro key";
+        }
+        std::cerr << "." << std::endl;
+        return -1;
+    }
+
+    // Nothing but the JSON goes to stdout, so the listing can be piped straight into a tool
+    if (*list)
+    {
+        if (!PrintHidDeviceList(stdout))
+        {
+            std::cerr << "Unable to enumerate the HID devices." << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+#ifndef _WIN32
+    if (*simulate < 0 || *simulateRate < 0 || *simulateBurst < 1 || *simulateCount < 0 || *simulateReplug < 0)
+    {
+        std::cerr << "Simulation counts must not be negative and the burst must be at least 1." << std::endl;
+        return -1;
+    }
+
+    // Simulated keyboards carry the target keyboard's VID/PID so the monitor picks them up like the real one
+    if (*simulate > 0)
+    {
+        HID_SIMULATION          simulation = {};
+        const KNOWN_KEYBOARD*   keyboard = vid ? FindKnownKeyboard(targetVID, targetPID) : GetDefaultKeyboard();
+
+        simulation.DescriptorFile = simulateDescriptor ? simulateDescriptor->c_str() : nullptr;
+        simulation.VendorID = keyboard->VendorID;
+        simulation.ProductID = keyboard->ProductID;
+        simulation.Instances = (ULONG)*simulate;
+        simulation.ReportsPerSecond = (ULONG)*simulateRate;
+        simulation.BurstLength = (ULONG)*simulateBurst;
+        simulation.ReportCount = (ULONGLONG)*simulateCount;
+        simulation.ReplugDelay = (ULONG)*simulateReplug;
+        simulation.UsagePage = keyboard->MacroUsagePage;
+        simulation.UsageMin = keyboard->MacroUsageMin;
+        simulation.UsageMax = keyboard->MacroUsageMax;
+
+        if (!StartHidSimulation(&simulation))
+        {
+            std::cerr << "Unable to start the simulation, check the report descriptor." << std::endl;
+            return -1;
+        }
+    }
+#endif
 
     std::cout << "Alien Macros - Version " << GetAppVersion() << std::endl;
 
-    return StartMonitor(targetVID, targetPID);
+    // Ctrl+C or a supervisor's stop request shuts the monitor down cleanly, Ctrl+Break/SIGUSR1 print latencies
+#ifdef _WIN32
+    SetConsoleCtrlHandler(ConsoleCtrlHandler, TRUE);
+#else
+    struct sigaction action = {};
+    action.sa_handler = StopSignalHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // Blocked before any other thread exists so every thread inherits the mask
+    sigset_t reportSignals;
+    sigemptyset(&reportSignals);
+    sigaddset(&reportSignals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &reportSignals, nullptr);
+#endif
+
+    PKEY_SINK keySink;
+
+    // Programs listening for events have no use for the keys as well
+    if (*noInject)
+    {
+        keySink = nullptr;
+    }
+#ifndef _WIN32
+    else if (injectFile)
+    {
+        keySink = OpenKeySinkFile(injectFile->c_str());
+
+        if (keySink == nullptr)
+        {
+            std::cerr << "Unable to create " << *injectFile << "." << std::endl;
+            return -1;
+        }
+    }
+    else
+#endif
+    {
+        keySink = OpenKeySink();
+
+        // The keys still show on the console, they just do not reach other programs
+        if (keySink == nullptr)
+        {
+            std::cerr << "Unable to set up key injection, macro keys will only be printed." << std::endl;
+        }
+    }
+
+    PEVENT_SERVER eventServer = nullptr;
+
+    if (eventsEndpoint)
+    {
+        eventServer = StartEventServer(eventsEndpoint->c_str());
+
+        if (eventServer == nullptr)
+        {
+            std::cerr << "Unable to listen for event clients on " << *eventsEndpoint << ", it may be in use." << std::endl;
+            CloseKeySink(keySink);
+            return -1;
+        }
+    }
+
+#ifndef _WIN32
+    // Not before the event server has bound its socket, under a umask no other thread may see
+    std::thread(LatencyReportThread, reportSignals).detach();
+#endif
+
+    DWORD result;
+    bool  hotplug = true;
+
+#ifndef _WIN32
+    // A simulation that sends a fixed number of reports ends the run once its keyboards are gone for good
+    hotplug = *simulate == 0 || *simulateCount == 0 || *simulateReplug > 0;
+#endif
+
+    if (replayFile)
+    {
+        result = ReplayMonitor(replayFile->c_str(), *replayFast == 0, keySink, eventServer);
+    }
+    else
+    {
+        std::string cachePath;
+
+        // Without a usable cache the keyboard is simply set up from scratch, as it always was
+        if (*noCache == 0 && (cacheFile ? (cachePath = *cacheFile, true) : GetDefaultHidDeviceCachePath(cachePath)))
+        {
+            OpenHidDeviceCache(cachePath.c_str());
+        }
+
+        result = StartMonitor(targetVID, targetPID, (ULONG)*queueDepth, captureFile ? captureFile->c_str() : nullptr, hotplug, keySink, eventServer);
+        CloseHidDeviceCache();
+    }
+
+    CloseKeySink(keySink);
+
+    if (eventServer != nullptr)
+    {
+        EVENT_SERVER_STATS stats;
+
+        StopEventServer(eventServer, &stats);
+
+        std::cout << "Sent " << stats.Records << " macro key event(s) to " << stats.Clients << " client(s)";
+        if (stats.Missed > 0)
+        {
+            std::cout << ", " << stats.Missed << " missed by clients falling behind";
+        }
+        if (stats.Dropped > 0)
+        {
+            std::cout << ", " << stats.Dropped << " dropped with the ring full";
+        }
+        std::cout << std::endl;
+    }
+
+#ifndef _WIN32
+    if (*simulate > 0)
+    {
+        HID_SIMULATION_STATS stats;
+
+        StopHidSimulation();
+        GetHidSimulationStats(&stats);
+
+        std::cout << "Simulated " << stats.Reports << " report(s) in " << stats.Elapsed / 1000000 << " ms";
+        if (stats.Elapsed > 0)
+        {
+            std::cout << " (" << (ULONGLONG)(stats.Reports * 1e9 / stats.Elapsed) << " reports/s)";
+        }
+        std::cout << ", " << stats.Dropped << " dropped" << std::endl;
+    }
+#endif
+
+    PrintLatencyReport();
+    return result;
 }
\ No newline at end of file
@@ -0,0 +1,540 @@
+/*++
+
+Module Name:
+
+    actions.cpp
+
+Abstract:
+
+    Macro key actions. Keyboards the actions file names get a table of
+    their own, filled with the defaults and then overwritten line by line;
+    every other keyboard shares the default table. Tables live in a node
+    based map, so the pointers handed out stay put as more are added; the
+    steps of macros are kept in a deque of their own for the same reason.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <new>
+#include <unordered_map>
+#include <vector>
+#include "actions.h"
+#include "inject.h"
+
+namespace
+{
+    constexpr MACRO_ACTION_MAP BuildDefaultActions()
+    {
+        MACRO_ACTION_MAP actions = {};
+
+        actions.NumberActions = KNOWN_KEYBOARD_MAX_MACROS;
+
+        for (ULONG i = 0; i < KNOWN_KEYBOARD_MAX_MACROS; i++)
+        {
+            actions.Actions[i].Type = MacroActionKey;
+            actions.Actions[i].NumberKeys = 1;
+            actions.Actions[i].Keys[0] = (USAGE)(KEY_USAGE_F13 + i);
+        }
+
+        return actions;
+    }
+
+    constexpr MACRO_ACTION_MAP defaultActions = BuildDefaultActions();
+
+    typedef struct _KEY_NAME
+    {
+        const char* Name;
+        USAGE       Key;
+    } KEY_NAME;
+
+    //
+    // Letters, digits and function keys are worked out in ParseKey, which
+    // matches these in lower case.
+    //
+    constexpr KEY_NAME keyNames[] =
+    {
+        { "enter", 0x28 }, { "esc", 0x29 }, { "backspace", 0x2A }, { "tab", 0x2B }, { "space", 0x2C },
+        { "ctrl", 0xE0 }, { "shift", 0xE1 }, { "alt", 0xE2 }, { "win", 0xE3 },
+        { "lctrl", 0xE0 }, { "lshift", 0xE1 }, { "lalt", 0xE2 }, { "lwin", 0xE3 },
+        { "rctrl", 0xE4 }, { "rshift", 0xE5 }, { "ralt", 0xE6 }, { "rwin", 0xE7 },
+    };
+
+    std::unordered_map<ULONG, MACRO_ACTION_MAP> keyboardActions;
+    std::deque<std::vector<MACRO_STEP>>         macroSteps;
+
+    //
+    // Longest wait a macro may ask for, in milliseconds.
+    //
+    constexpr double maxMacroWait = 60000;
+
+    constexpr USAGE shiftKey = 0xE1;
+
+    ULONG KeyboardKey(
+        USHORT  VendorID,
+        USHORT  ProductID
+    )
+    {
+        return ((ULONG)VendorID << 16) | ProductID;
+    }
+}
+
+static bool ParseKey(
+    const char*     Name,
+    size_t          Length,
+    PUSAGE          Key
+)
+/*++
+RoutineDescription:
+   Parse one key name, see actions.h. Only keys the key sink can send are
+   accepted.
+--*/
+{
+    char    name[16];
+    char*   end;
+    ULONG   number;
+
+    if (Length == 0 || Length >= sizeof(name))
+    {
+        return false;
+    }
+
+    std::memcpy(name, Name, Length);
+    name[Length] = '\0';
+
+    if (Length == 1 && std::isalpha((unsigned char)name[0]))
+    {
+        *Key = (USAGE)(0x04 + (std::toupper((unsigned char)name[0]) - 'A'));
+        return true;
+    }
+
+    if (Length == 1 && std::isdigit((unsigned char)name[0]))
+    {
+        *Key = (name[0] == '0') ? 0x27 : (USAGE)(0x1E + (name[0] - '1'));
+        return true;
+    }
+
+    if ((name[0] == 'F' || name[0] == 'f') && std::isdigit((unsigned char)name[1]))
+    {
+        number = std::strtoul(name + 1, &end, 10);
+
+        if (*end == '\0' && number >= 1 && number <= 24)
+        {
+            *Key = (USAGE)(number <= 12 ? 0x3A + (number - 1) : KEY_USAGE_F13 + (number - 13));
+            return true;
+        }
+        return false;
+    }
+
+    if (name[0] == '0' && (name[1] == 'x' || name[1] == 'X'))
+    {
+        number = std::strtoul(name + 2, &end, 16);
+
+        if (*end == '\0' && end != name + 2 && number <= 0xFF && CanInjectKey((USAGE)number))
+        {
+            *Key = (USAGE)number;
+            return true;
+        }
+        return false;
+    }
+
+    for (size_t i = 0; i < Length; i++)
+    {
+        name[i] = (char)std::tolower((unsigned char)name[i]);
+    }
+
+    for (const KEY_NAME& keyName : keyNames)
+    {
+        if (std::strcmp(name, keyName.Name) == 0)
+        {
+            *Key = keyName.Key;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static const char* NextToken(
+    const char*     Text,
+    size_t*         Length
+)
+/*++
+RoutineDescription:
+   Skip to the next token of a macro, a quoted string or a run of
+   anything but whitespace. Null at the end of the line or a comment; an
+   unterminated string comes back with a Length of 0.
+--*/
+{
+    const char* end;
+
+    Text += std::strspn(Text, " \t\r\n");
+
+    if (*Text == '\0' || *Text == '#')
+    {
+        return nullptr;
+    }
+
+    if (*Text == '"')
+    {
+        end = std::strchr(Text + 1, '"');
+        *Length = (end != nullptr) ? (size_t)(end - Text) + 1 : 0;
+        return Text;
+    }
+
+    *Length = std::strcspn(Text, " \t\r\n");
+    return Text;
+}
+
+static void AddKeySteps(
+    std::vector<MACRO_STEP>&    Steps,
+    const USAGE*                Keys,
+    ULONG                       NumberKeys
+)
+/*++
+RoutineDescription:
+   Press Keys together, releasing them in reverse.
+--*/
+{
+    for (ULONG i = 0; i < NumberKeys; i++)
+    {
+        Steps.push_back({ MacroStepKeyDown, Keys[i], 0 });
+    }
+    for (ULONG i = NumberKeys; i > 0; i--)
+    {
+        Steps.push_back({ MacroStepKeyUp, Keys[i - 1], 0 });
+    }
+}
+
+static bool AddTextSteps(
+    std::vector<MACRO_STEP>&    Steps,
+    const char*                 Text,
+    size_t                      Length
+)
+{
+    for (size_t i = 0; i < Length; i++)
+    {
+        unsigned char   c = (unsigned char)Text[i];
+        USAGE           keys[2];
+        ULONG           numberKeys = 0;
+
+        if (std::isupper(c))
+        {
+            keys[numberKeys++] = shiftKey;
+        }
+
+        if (c == ' ')
+        {
+            keys[numberKeys++] = 0x2C;
+        }
+        else if (std::isalnum(c))
+        {
+            ParseKey(Text + i, 1, &keys[numberKeys++]);
+        }
+        else
+        {
+            return false;
+        }
+
+        AddKeySteps(Steps, keys, numberKeys);
+    }
+
+    return true;
+}
+
+static bool ParseMacro(
+    const char*                 Text,
+    std::vector<MACRO_STEP>&    Steps
+)
+/*++
+RoutineDescription:
+   Compile the steps of a macro, see actions.h, into key transitions and
+   waits.
+--*/
+{
+    const char* token;
+    size_t      length;
+
+    while ((token = NextToken(Text, &length)) != nullptr)
+    {
+        if (length == 0)
+        {
+            return false;
+        }
+
+        Text = token + length;
+
+        if ((length == 4 && std::strncmp(token, "wait", 4) == 0) ||
+            (length == 4 && std::strncmp(token, "text", 4) == 0) ||
+            (length == 4 && std::strncmp(token, "down", 4) == 0) ||
+            (length == 2 && std::strncmp(token, "up", 2) == 0))
+        {
+            const char* step = token;
+            USAGE       key;
+
+            if ((token = NextToken(Text, &length)) == nullptr || length == 0)
+            {
+                return false;
+            }
+
+            Text = token + length;
+
+            if (step[0] == 'w')
+            {
+                char    number[16];
+                char*   end;
+                double  delay;
+
+                if (length >= sizeof(number))
+                {
+                    return false;
+                }
+
+                std::memcpy(number, token, length);
+                number[length] = '\0';
+                delay = std::strtod(number, &end);
+
+                if (*end != '\0' || !(delay >= 0 && delay <= maxMacroWait))
+                {
+                    return false;
+                }
+
+                Steps.push_back({ MacroStepWait, 0, (ULONG)(delay * 1000 + 0.5) });
+            }
+            else if (step[0] == 't')
+            {
+                if (token[0] != '"' || !AddTextSteps(Steps, token + 1, length - 2))
+                {
+                    return false;
+                }
+            }
+            else if (ParseKey(token, length, &key))
+            {
+                Steps.push_back({ step[0] == 'd' ? MacroStepKeyDown : MacroStepKeyUp, key, 0 });
+            }
+            else
+            {
+                return false;
+            }
+            continue;
+        }
+
+        //
+        // Anything else is a key or a combo to press.
+        //
+        USAGE   keys[MACRO_ACTION_MAX_KEYS];
+        ULONG   numberKeys = 0;
+
+        for (size_t offset = 0; offset < length; )
+        {
+            size_t keyLength = std::min(std::strcspn(token + offset, "+"), length - offset);
+
+            if (numberKeys == MACRO_ACTION_MAX_KEYS ||
+                !ParseKey(token + offset, keyLength, &keys[numberKeys]))
+            {
+                return false;
+            }
+
+            numberKeys++;
+            offset += keyLength + 1;
+        }
+
+        AddKeySteps(Steps, keys, numberKeys);
+    }
+
+    return !Steps.empty();
+}
+
+static bool ParseAction(
+    const char*     Text,
+    PMACRO_ACTION   Action
+)
+/*++
+RoutineDescription:
+   Parse "none", "key K", "combo K+K+...", "sequence K K ..." or
+   "macro step step ...". Throws std::bad_alloc.
+--*/
+{
+    const char* separators;
+    size_t      length = std::strcspn(Text, " \t\r\n");
+
+    *Action = {};
+
+    if (length == 4 && std::strncmp(Text, "none", 4) == 0)
+    {
+        Action->Type = MacroActionNone;
+        separators = " \t\r\n";
+    }
+    else if (length == 3 && std::strncmp(Text, "key", 3) == 0)
+    {
+        Action->Type = MacroActionKey;
+        separators = " \t\r\n";
+    }
+    else if (length == 5 && std::strncmp(Text, "combo", 5) == 0)
+    {
+        Action->Type = MacroActionCombo;
+        separators = "+ \t\r\n";
+    }
+    else if (length == 8 && std::strncmp(Text, "sequence", 8) == 0)
+    {
+        Action->Type = MacroActionSequence;
+        separators = " \t\r\n";
+    }
+    else if (length == 5 && std::strncmp(Text, "macro", 5) == 0)
+    {
+        std::vector<MACRO_STEP> steps;
+
+        Action->Type = MacroActionScript;
+
+        if (!ParseMacro(Text + length, steps))
+        {
+            return false;
+        }
+
+        macroSteps.push_back(std::move(steps));
+        Action->NumberSteps = (ULONG)macroSteps.back().size();
+        Action->Steps = macroSteps.back().data();
+        return true;
+    }
+    else
+    {
+        return false;
+    }
+
+    Text += length;
+
+    for (;;)
+    {
+        Text += std::strspn(Text, separators);
+
+        if (*Text == '\0' || *Text == '#')
+        {
+            break;
+        }
+
+        length = std::strcspn(Text, separators);
+
+        if (Action->NumberKeys == MACRO_ACTION_MAX_KEYS ||
+            !ParseKey(Text, length, &Action->Keys[Action->NumberKeys]))
+        {
+            return false;
+        }
+
+        Action->NumberKeys++;
+        Text += length;
+    }
+
+    switch (Action->Type)
+    {
+    case MacroActionNone:
+        return Action->NumberKeys == 0;
+    case MacroActionKey:
+        return Action->NumberKeys == 1;
+    default:
+        return Action->NumberKeys > 0;
+    }
+}
+
+const MACRO_ACTION_MAP* GetMacroActions(
+    IN  const KNOWN_KEYBOARD*   Keyboard
+)
+{
+    if (!keyboardActions.empty())
+    {
+        auto actions = keyboardActions.find(KeyboardKey(Keyboard->VendorID, Keyboard->ProductID));
+
+        if (actions != keyboardActions.end())
+        {
+            return &actions->second;
+        }
+    }
+
+    return &defaultActions;
+}
+
+bool LoadMacroActions(
+    IN  LPCSTR                  FileName,
+    OUT PULONG                  LineNumber
+)
+{
+    FILE*   stream;
+    CHAR    line[1024];     // Room for a macro of some length
+    bool    loaded = true;
+
+    *LineNumber = 0;
+
+    stream = fopen(FileName, "r");
+    if (stream == nullptr)
+    {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), stream) != nullptr)
+    {
+        const KNOWN_KEYBOARD*   keyboard;
+        USHORT                  vendorID;
+        USHORT                  productID;
+        USAGE                   usage;
+        MACRO_ACTION            action;
+        int                     actionOffset = -1;
+        char                    first = '\0';
+
+        (*LineNumber)++;
+
+        sscanf(line, " %c", &first);
+        if (first == '\0' || first == '#')
+        {
+            continue;
+        }
+
+        if (sscanf(line, "%hx %hx %hx %n", &vendorID, &productID, &usage, &actionOffset) != 3 ||
+            actionOffset < 0 ||
+            (keyboard = FindKnownKeyboard(vendorID, productID)) == nullptr ||
+            usage < keyboard->MacroUsageMin ||
+            usage > keyboard->MacroUsageMax)
+        {
+            loaded = false;
+            break;
+        }
+
+        try
+        {
+            if (!ParseAction(line + actionOffset, &action))
+            {
+                loaded = false;
+                break;
+            }
+
+            auto inserted = keyboardActions.try_emplace(KeyboardKey(vendorID, productID), defaultActions);
+
+            if (inserted.second)
+            {
+                inserted.first->second.NumberActions = keyboard->MacroUsageMax - keyboard->MacroUsageMin + 1;
+            }
+
+            inserted.first->second.Actions[usage - keyboard->MacroUsageMin] = action;
+        }
+        catch (const std::bad_alloc&)
+        {
+            loaded = false;
+            break;
+        }
+    }
+
+    if (loaded && ferror(stream))
+    {
+        *LineNumber = 0;
+        loaded = false;
+    }
+
+    fclose(stream);
+    return loaded;
+}
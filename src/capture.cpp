@@ -0,0 +1,567 @@
+/*++
+
+Module Name:
+
+    capture.cpp
+
+Abstract:
+
+    Capture and replay of raw input reports. The monitor can append every
+    report it reads to a capture file together with a description of the
+    device it came from, and later feed the same reports back through
+    UnpackInputReport and the macro handling without the keyboard attached,
+    either at the recorded pace or as fast as they can be decoded.
+
+    Each captured device carries its report descriptor so the replay can
+    rebuild the device with the same preparsed data. The hidraw backend
+    records the descriptor of the node; where that is not available, which
+    includes every device on Windows, the input layout is written back out
+    from the compiled decoder by BuildInputReportDescriptor.
+
+    Replay rebuilds devices through OpenHidDeviceFromDescriptor and so needs
+    the descriptor parser of the hidraw backend.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <wtypes.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "capture.h"
+
+//
+// Sleeps while waiting for a replayed report are cut into slices of this
+// length so StopHidReplay is noticed during long idle stretches.
+//
+#define REPLAY_SLEEP_SLICE      std::chrono::milliseconds(50)
+
+//
+// Room for the largest descriptor hidraw hands out.
+//
+#define CAPTURE_DESCRIPTOR_SIZE 4096
+
+struct _HID_CAPTURE
+{
+    FILE*                                   File;
+    std::chrono::steady_clock::time_point   Start;
+    USHORT                                  NextDeviceId;
+};
+
+struct _HID_REPLAY
+{
+    const UCHAR*                            View;
+    size_t                                  Size;
+    size_t                                  Offset;
+#ifdef _WIN32
+    HANDLE                                  File;
+    HANDLE                                  Mapping;
+#endif
+    std::vector<PHID_DEVICE>                Devices;        // Indexed by DeviceId
+    bool                                    RealTime;
+    bool                                    Started;
+    uint64_t                                FirstTimestamp;
+    std::chrono::steady_clock::time_point   Start;
+    std::atomic<bool>                       Stopped;
+};
+
+static bool WriteRecord(
+    PHID_CAPTURE    Capture,
+    USHORT          Type,
+    USHORT          DeviceId,
+    ULONG           Length
+)
+{
+    HID_CAPTURE_RECORD record = {};
+
+    record.Type = Type;
+    record.DeviceId = DeviceId;
+    record.Length = Length;
+    record.Timestamp = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - Capture->Start).count();
+
+    return fwrite(&record, sizeof(record), 1, Capture->File) == 1;
+}
+
+PHID_CAPTURE OpenHidCapture(
+    IN  LPCSTR          FileName
+)
+/*++
+RoutineDescription:
+   Create (or truncate) FileName and write the capture header. Writes are
+   buffered; the file is complete once CloseHidCapture returns.
+--*/
+{
+    PHID_CAPTURE        capture;
+    HID_CAPTURE_HEADER  header = {};
+
+    capture = new (std::nothrow) HID_CAPTURE{};
+    if (capture == nullptr)
+    {
+        return nullptr;
+    }
+
+    capture->File = fopen(FileName, "wb");
+    if (capture->File == nullptr)
+    {
+        delete capture;
+        return nullptr;
+    }
+
+    std::memcpy(header.Magic, HID_CAPTURE_MAGIC, sizeof(header.Magic));
+    header.Version = HID_CAPTURE_VERSION;
+
+    if (fwrite(&header, sizeof(header), 1, capture->File) != 1)
+    {
+        fclose(capture->File);
+        delete capture;
+        return nullptr;
+    }
+
+    capture->Start = std::chrono::steady_clock::now();
+    return capture;
+}
+
+bool CaptureHidDevice(
+    IN  PHID_CAPTURE    Capture,
+    IN  PHID_DEVICE     HidDevice,
+    OUT PUSHORT         DeviceId
+)
+/*++
+RoutineDescription:
+   Describe HidDevice in the capture and assign the id its reports are to
+   be recorded under. A device whose descriptor cannot be obtained is
+   still recorded, without one, so its reports are kept for inspection,
+   but it cannot be replayed.
+--*/
+{
+    HID_CAPTURE_DEVICE  device = {};
+    std::vector<UCHAR>  descriptor;
+    ULONG               descriptorLength = CAPTURE_DESCRIPTOR_SIZE;
+    ULONG               collectionIndex = 0;
+
+    try
+    {
+        descriptor.resize(descriptorLength);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+#ifndef _WIN32
+    if (!GetHidReportDescriptor(HidDevice, descriptor.data(), &descriptorLength, &collectionIndex))
+#endif
+    {
+        descriptorLength = CAPTURE_DESCRIPTOR_SIZE;
+        collectionIndex = 0;
+
+        if (!BuildInputReportDescriptor(HidDevice, descriptor.data(), &descriptorLength))
+        {
+            descriptorLength = 0;
+        }
+    }
+
+    device.VendorID = HidDevice->Attributes.VendorID;
+    device.ProductID = HidDevice->Attributes.ProductID;
+    device.VersionNumber = HidDevice->Attributes.VersionNumber;
+    device.UsagePage = HidDevice->Caps.UsagePage;
+    device.Usage = HidDevice->Caps.Usage;
+    device.InputReportByteLength = HidDevice->Caps.InputReportByteLength;
+    device.CollectionIndex = collectionIndex;
+    device.DescriptorLength = descriptorLength;
+    device.PathLength = (ULONG)strnlen(HidDevice->DevicePath, MAX_PATH);
+
+    *DeviceId = Capture->NextDeviceId;
+
+    if (!WriteRecord(Capture, HidCaptureDevice, *DeviceId,
+                     (ULONG)sizeof(device) + device.DescriptorLength + device.PathLength) ||
+        fwrite(&device, sizeof(device), 1, Capture->File) != 1 ||
+        fwrite(descriptor.data(), 1, device.DescriptorLength, Capture->File) != device.DescriptorLength ||
+        fwrite(HidDevice->DevicePath, 1, device.PathLength, Capture->File) != device.PathLength)
+    {
+        return false;
+    }
+
+    Capture->NextDeviceId++;
+    return true;
+}
+
+bool CaptureHidReport(
+    IN  PHID_CAPTURE    Capture,
+    IN  USHORT          DeviceId,
+    _In_reads_bytes_(ReportLength) const CHAR* Report,
+    IN  ULONG           ReportLength
+)
+{
+    return WriteRecord(Capture, HidCaptureReport, DeviceId, ReportLength) &&
+           fwrite(Report, 1, ReportLength, Capture->File) == ReportLength;
+}
+
+bool CloseHidCapture(
+    IN  PHID_CAPTURE    Capture
+)
+/*++
+RoutineDescription:
+   Flush and close the capture. Returns false when any buffered data could
+   not be written.
+--*/
+{
+    bool written;
+
+    if (Capture == nullptr)
+    {
+        return true;
+    }
+
+    written = fflush(Capture->File) == 0;
+    written = (fclose(Capture->File) == 0) && written;
+    delete Capture;
+    return written;
+}
+
+static bool MapReplayFile(
+    PHID_REPLAY     Replay,
+    LPCSTR          FileName
+)
+{
+#ifdef _WIN32
+    LARGE_INTEGER   size;
+
+    Replay->File = CreateFileA(FileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (Replay->File == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+
+    if (!GetFileSizeEx(Replay->File, &size) || size.QuadPart == 0)
+    {
+        return false;
+    }
+
+    Replay->Mapping = CreateFileMappingA(Replay->File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (Replay->Mapping == nullptr)
+    {
+        return false;
+    }
+
+    Replay->View = (const UCHAR*)MapViewOfFile(Replay->Mapping, FILE_MAP_READ, 0, 0, 0);
+    Replay->Size = (size_t)size.QuadPart;
+    return Replay->View != nullptr;
+#else
+    struct stat     status;
+    int             file;
+    void*           view;
+
+    file = open(FileName, O_RDONLY | O_CLOEXEC);
+    if (file < 0)
+    {
+        return false;
+    }
+
+    if (fstat(file, &status) < 0 || status.st_size == 0)
+    {
+        close(file);
+        return false;
+    }
+
+    // The mapping stays valid once the descriptor is closed
+    view = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+
+    if (view == MAP_FAILED)
+    {
+        return false;
+    }
+
+    Replay->View = (const UCHAR*)view;
+    Replay->Size = (size_t)status.st_size;
+    return true;
+#endif
+}
+
+static void UnmapReplayFile(
+    PHID_REPLAY     Replay
+)
+{
+#ifdef _WIN32
+    if (Replay->View != nullptr)
+    {
+        UnmapViewOfFile(Replay->View);
+    }
+    if (Replay->Mapping != nullptr)
+    {
+        CloseHandle(Replay->Mapping);
+    }
+    if (Replay->File != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(Replay->File);
+    }
+#else
+    if (Replay->View != nullptr)
+    {
+        munmap((void*)Replay->View, Replay->Size);
+    }
+#endif
+    Replay->View = nullptr;
+}
+
+PHID_REPLAY OpenHidReplay(
+    IN  LPCSTR          FileName,
+    IN  bool            RealTime
+)
+/*++
+RoutineDescription:
+   Map a capture file for replay and check its header. Devices are rebuilt
+   as their records are reached. With RealTime set reports are handed out
+   at the pace they were captured at, otherwise as fast as they are asked
+   for.
+--*/
+{
+    PHID_REPLAY         replay;
+    HID_CAPTURE_HEADER  header;
+
+    replay = new (std::nothrow) HID_REPLAY{};
+    if (replay == nullptr)
+    {
+        return nullptr;
+    }
+
+#ifdef _WIN32
+    replay->File = INVALID_HANDLE_VALUE;
+#endif
+
+    if (!MapReplayFile(replay, FileName) || replay->Size < sizeof(header))
+    {
+        CloseHidReplay(replay);
+        return nullptr;
+    }
+
+    std::memcpy(&header, replay->View, sizeof(header));
+
+    if (std::memcmp(header.Magic, HID_CAPTURE_MAGIC, sizeof(header.Magic)) != 0 ||
+        header.Version != HID_CAPTURE_VERSION)
+    {
+        CloseHidReplay(replay);
+        return nullptr;
+    }
+
+    replay->Offset = sizeof(header);
+    replay->RealTime = RealTime;
+    return replay;
+}
+
+static bool ReplayDevice(
+    PHID_REPLAY         Replay,
+    USHORT              DeviceId,
+    const UCHAR*        Payload,
+    ULONG               Length
+)
+/*++
+RoutineDescription:
+   Rebuild a captured device from its record. Device ids are handed out in
+   order, so anything else means the file is damaged.
+--*/
+{
+    HID_CAPTURE_DEVICE  device;
+    HIDD_ATTRIBUTES     attributes = {};
+    std::vector<char>   path;
+    PHID_DEVICE         hidDevice;
+
+    if (DeviceId != Replay->Devices.size() || Length < sizeof(device))
+    {
+        return false;
+    }
+
+    std::memcpy(&device, Payload, sizeof(device));
+
+    if (device.DescriptorLength == 0 ||
+        (uint64_t)sizeof(device) + device.DescriptorLength + device.PathLength != Length)
+    {
+        return false;
+    }
+
+    attributes.Size = sizeof(attributes);
+    attributes.VendorID = device.VendorID;
+    attributes.ProductID = device.ProductID;
+    attributes.VersionNumber = device.VersionNumber;
+
+    try
+    {
+        path.assign(Payload + sizeof(device) + device.DescriptorLength,
+                    Payload + sizeof(device) + device.DescriptorLength + device.PathLength);
+        path.push_back('\0');
+        Replay->Devices.reserve(Replay->Devices.size() + 1);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    hidDevice = new (std::nothrow) HID_DEVICE{};
+    if (hidDevice == nullptr)
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    // hid.dll only builds preparsed data for devices it enumerated itself
+    delete hidDevice;
+    return false;
+#else
+    if (!OpenHidDeviceFromDescriptor(path.data(),
+                                     INVALID_HANDLE_VALUE,
+                                     Payload + sizeof(device),
+                                     device.DescriptorLength,
+                                     device.CollectionIndex,
+                                     &attributes,
+                                     hidDevice))
+    {
+        delete hidDevice;
+        return false;
+    }
+
+    Replay->Devices.push_back(hidDevice);
+    return true;
+#endif
+}
+
+HID_WAIT_STATUS ReadHidReplay(
+    IN  PHID_REPLAY     Replay,
+    OUT PHID_DEVICE*    HidDevice,
+    OUT PULONG          BytesRead
+)
+/*++
+RoutineDescription:
+   Hand out the next captured report in the InputReportBuffer of the device
+   it was captured from. A report shorter than the device's reports is
+   zero filled, as a short read would be. Returns HidWaitError with
+   HidDevice null when the file is damaged or a device cannot be rebuilt.
+--*/
+{
+    *HidDevice = nullptr;
+    *BytesRead = 0;
+
+    while (!Replay->Stopped)
+    {
+        HID_CAPTURE_RECORD  record;
+        const UCHAR*        payload;
+        PHID_DEVICE         device;
+
+        if (Replay->Size - Replay->Offset < sizeof(record))
+        {
+            // A record cut short by a crash ends the replay like the end of the file
+            return HidWaitStopped;
+        }
+
+        std::memcpy(&record, Replay->View + Replay->Offset, sizeof(record));
+
+        if (Replay->Size - Replay->Offset - sizeof(record) < record.Length)
+        {
+            return HidWaitStopped;
+        }
+
+        payload = Replay->View + Replay->Offset + sizeof(record);
+        Replay->Offset += sizeof(record) + record.Length;
+
+        if (record.Type == HidCaptureDevice)
+        {
+            if (!ReplayDevice(Replay, record.DeviceId, payload, record.Length))
+            {
+                return HidWaitError;
+            }
+            continue;
+        }
+
+        if (record.Type != HidCaptureReport)
+        {
+            continue;
+        }
+
+        if (record.DeviceId >= Replay->Devices.size() || record.Length == 0)
+        {
+            return HidWaitError;
+        }
+
+        if (Replay->RealTime)
+        {
+            std::chrono::steady_clock::time_point due;
+
+            if (!Replay->Started)
+            {
+                Replay->Started = true;
+                Replay->FirstTimestamp = record.Timestamp;
+                Replay->Start = std::chrono::steady_clock::now();
+            }
+
+            due = Replay->Start + std::chrono::nanoseconds(record.Timestamp - Replay->FirstTimestamp);
+
+            while (!Replay->Stopped && std::chrono::steady_clock::now() < due)
+            {
+                std::this_thread::sleep_until(std::min(due, std::chrono::steady_clock::now() + REPLAY_SLEEP_SLICE));
+            }
+
+            if (Replay->Stopped)
+            {
+                break;
+            }
+        }
+
+        device = Replay->Devices[record.DeviceId];
+        *BytesRead = std::min<ULONG>(record.Length, device->Caps.InputReportByteLength);
+
+        std::memcpy(device->InputReportBuffer, payload, *BytesRead);
+        std::memset(device->InputReportBuffer + *BytesRead, 0, device->Caps.InputReportByteLength - *BytesRead);
+        device->InputReportTime = GetReportTime();
+
+        *HidDevice = device;
+        return HidWaitReport;
+    }
+
+    return HidWaitStopped;
+}
+
+void StopHidReplay(
+    IN  PHID_REPLAY     Replay
+)
+/*++
+RoutineDescription:
+   Make ReadHidReplay return HidWaitStopped, waking it from a real time
+   wait within REPLAY_SLEEP_SLICE. Safe from any thread or signal handler.
+--*/
+{
+    Replay->Stopped = true;
+}
+
+void CloseHidReplay(
+    IN  PHID_REPLAY     Replay
+)
+{
+    if (Replay == nullptr)
+    {
+        return;
+    }
+
+    for (PHID_DEVICE device : Replay->Devices)
+    {
+        CloseHidDevice(device);
+        delete device;
+    }
+
+    UnmapReplayFile(Replay);
+    delete Replay;
+}
@@ -0,0 +1,1349 @@
+/*++
+
+Module Name:
+
+    decode.cpp
+
+Abstract:
+
+    Precompiled input report decoder. UnpackReport goes through the preparsed
+    data for every HID_DATA entry on every report: HidP_GetUsages walks every
+    button capability of the usage page, and the result is then filtered down
+    to the entry's usage range. The layout of a device's reports never
+    changes, so this module works it out once, when the device is opened,
+    and reduces it to a flat table of bit offsets, sizes and usage ranges.
+    Reports are then decoded straight from the byte buffer. InputData is
+    also grouped by report ID with an index to each group, so a report only
+    visits the entries of its own report ID, and consumers can unsubscribe
+    from report IDs they do not care about.
+
+    The table is built by probing the HidP_SetUsages/HidP_SetUsageValue
+    routines with blank reports and watching which bits they touch, so it
+    relies on nothing beyond the documented HidP API and behaves the same
+    on top of hid.dll and of the hidraw shim. A layout that cannot be
+    probed leaves the device without a decoder and UnpackInputReport falls
+    back to UnpackReport.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <bit>
+#include <new>
+#include <vector>
+#ifdef _WIN32
+#include <wtypes.h>
+#include "hidsdi.h"
+#endif
+#include "hid.h"
+
+//
+// One run of button bits or one array field. Bitmap runs map bit n to
+// UsageMin + n and never exceed 32 bits so they are read with one load.
+// Array fields hold Count slots of BitSize bits each; a slot value in
+// [LogicalMin, LogicalMax] maps to UsageMin + (value - LogicalMin).
+//
+typedef struct _HID_DECODER_FIELD
+{
+    ULONG       BitOffset;
+    USHORT      BitSize;
+    USHORT      Count;
+    USAGE       UsageMin;
+    bool        IsArray;
+    LONG        LogicalMin;
+    LONG        LogicalMax;
+} HID_DECODER_FIELD, * PHID_DECODER_FIELD;
+
+//
+// One entry per HID_DATA element, in the same order. Button entries own a
+// span of Fields: every field of every capability sharing the entry's usage
+// page and report ID, which is what HidP_GetUsages returns, with bitmap
+// runs already clipped to the entry's usage range.
+//
+typedef struct _HID_DECODER_ENTRY
+{
+    ULONG       FirstField;
+    ULONG       NumberFields;
+
+    ULONG       BitOffset;      // Value entries
+    USHORT      BitSize;
+    bool        IsSigned;
+    NTSTATUS    ScaleStatus;    // HIDP_STATUS_BAD_LOG_PHY_VALUES when unscalable
+    LONG        LogicalMin;
+    LONG        LogicalMax;
+    LONG        PhysicalMin;
+    LONG        PhysicalMax;
+} HID_DECODER_ENTRY, * PHID_DECODER_ENTRY;
+
+struct _HID_REPORT_DECODER
+{
+    USHORT                          ReportByteLength;
+    std::vector<HID_DECODER_FIELD>  Fields;
+    std::vector<HID_DECODER_ENTRY>  Entries;
+};
+
+static inline ULONG ExtractBits(
+    const UCHAR*    Report,
+    ULONG           BitOffset,
+    ULONG           BitSize
+)
+/*++
+RoutineDescription:
+   Read up to 32 little endian bits starting at BitOffset. Only the bytes the
+   field covers are touched, the compiler validated they are in the report.
+--*/
+{
+    const UCHAR*    source = Report + (BitOffset >> 3);
+    ULONG           shift = BitOffset & 7;
+    ULONG           bytes = (shift + BitSize + 7) >> 3;
+    uint64_t        word = 0;
+
+    for (ULONG i = 0; i < bytes; i++)
+    {
+        word |= (uint64_t)source[i] << (8 * i);
+    }
+
+    word >>= shift;
+    return (BitSize >= 32) ? (ULONG)word : (ULONG)(word & ((1ull << BitSize) - 1));
+}
+
+static void ResetProbe(
+    std::vector<CHAR>&  Probe,
+    UCHAR               ReportID
+)
+{
+    std::fill(Probe.begin(), Probe.end(), (CHAR)0);
+    Probe[0] = (CHAR)ReportID;
+}
+
+static bool FindSetBits(
+    const std::vector<CHAR>&    Probe,
+    PULONG                      FirstBit,
+    PULONG                      LastBit,
+    PULONG                      NumberBits
+)
+/*++
+RoutineDescription:
+   Locate the bits a probe write set, ignoring the report ID byte.
+--*/
+{
+    *NumberBits = 0;
+
+    for (ULONG bit = 8; bit < Probe.size() * 8; bit++)
+    {
+        if (Probe[bit >> 3] & (1 << (bit & 7)))
+        {
+            if ((*NumberBits)++ == 0)
+            {
+                *FirstBit = bit;
+            }
+            *LastBit = bit;
+        }
+    }
+    return *NumberBits > 0;
+}
+
+static bool ProbeBitmapCaps(
+    PHID_DEVICE                     HidDevice,
+    PHIDP_BUTTON_CAPS               ButtonCaps,
+    std::vector<CHAR>&              Probe,
+    std::vector<HID_DECODER_FIELD>& Fields
+)
+/*++
+RoutineDescription:
+   Find the bit of every usage of a variable (bitmap) button capability and
+   coalesce consecutive usages on consecutive bits into runs.
+
+   Usage zero cannot be probed, HidP_SetUsages takes it as the end of the
+   list, but HidP_GetUsages still reports its bit. Full keyboard bitmaps
+   commonly start there, so for a range its bit is taken to be the one
+   before usage one's, where the usages of a range are laid out.
+--*/
+{
+    USAGE   usageMin = ButtonCaps->IsRange ? ButtonCaps->Range.UsageMin : ButtonCaps->NotRange.Usage;
+    USAGE   usageMax = ButtonCaps->IsRange ? ButtonCaps->Range.UsageMax : ButtonCaps->NotRange.Usage;
+    size_t  firstField = Fields.size();
+
+    for (ULONG usage = usageMin; usage <= usageMax; usage++)
+    {
+        USAGE   usageList[1] = { (USAGE)usage };
+        ULONG   usageLength = 1;
+        ULONG   firstBit;
+        ULONG   lastBit;
+        ULONG   numberBits;
+
+        if (usage == 0)
+        {
+            continue;
+        }
+
+        ResetProbe(Probe, ButtonCaps->ReportID);
+
+        if (HIDP_STATUS_SUCCESS != HidP_SetUsages(HidP_Input,
+                                                  ButtonCaps->UsagePage,
+                                                  ButtonCaps->LinkCollection,
+                                                  usageList,
+                                                  &usageLength,
+                                                  HidDevice->Ppd,
+                                                  Probe.data(),
+                                                  (ULONG)Probe.size()) ||
+            !FindSetBits(Probe, &firstBit, &lastBit, &numberBits) ||
+            numberBits != 1)
+        {
+            return false;
+        }
+
+        if (!Fields.empty())
+        {
+            HID_DECODER_FIELD& run = Fields.back();
+
+            if (!run.IsArray &&
+                run.Count < 32 &&
+                run.BitOffset + run.Count == firstBit &&
+                run.UsageMin + run.Count == usage)
+            {
+                run.Count++;
+                continue;
+            }
+        }
+
+        Fields.push_back({ firstBit, 1, 1, (USAGE)usage, false, 0, 0 });
+    }
+
+    if (usageMin == 0)
+    {
+        if (!ButtonCaps->IsRange || Fields.size() == firstField ||
+            Fields[firstField].UsageMin != 1 || Fields[firstField].BitOffset <= 8)
+        {
+            return false;
+        }
+
+        Fields.insert(Fields.begin() + firstField, { Fields[firstField].BitOffset - 1, 1, 1, 0, false, 0, 0 });
+    }
+    return true;
+}
+
+static bool IsUsageShared(
+    PHID_DEVICE         HidDevice,
+    PHIDP_BUTTON_CAPS   ButtonCaps,
+    ULONG               Usage
+)
+/*++
+RoutineDescription:
+   A usage that another button capability on the same page also lists (the
+   modifier bitmap next to a keyboard's key array, say) may be written
+   there by HidP_SetUsages, so probing it says nothing about this one.
+--*/
+{
+    for (USHORT i = 0; i < HidDevice->Caps.NumberInputButtonCaps; i++)
+    {
+        PHIDP_BUTTON_CAPS   other = &HidDevice->InputButtonCaps[i];
+        USAGE               usageMin = other->IsRange ? other->Range.UsageMin : other->NotRange.Usage;
+        USAGE               usageMax = other->IsRange ? other->Range.UsageMax : other->NotRange.Usage;
+
+        if (other != ButtonCaps &&
+            other->UsagePage == ButtonCaps->UsagePage &&
+            usageMin <= Usage && Usage <= usageMax)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ProbeArrayCaps(
+    PHID_DEVICE                     HidDevice,
+    PHIDP_BUTTON_CAPS               ButtonCaps,
+    std::vector<CHAR>&              Probe,
+    std::vector<HID_DECODER_FIELD>& Fields
+)
+/*++
+RoutineDescription:
+   Find the first slot of an array button capability. Writing every usage of
+   the capability lights up the bits that index values use; any higher bits
+   of the slot are found by adding them to the highest written index and
+   checking that HidP_GetUsages no longer decodes it. The slot count is the
+   capability's ReportCount.
+--*/
+{
+    USAGE               usageMin = ButtonCaps->IsRange ? ButtonCaps->Range.UsageMin : ButtonCaps->NotRange.Usage;
+    USAGE               usageMax = ButtonCaps->IsRange ? ButtonCaps->Range.UsageMax : ButtonCaps->NotRange.Usage;
+    std::vector<CHAR>   usedBits(Probe.size(), 0);
+    std::vector<CHAR>   lastProbe;
+    std::vector<USAGE>  usageList;
+    ULONG               firstBit;
+    ULONG               lastBit;
+    ULONG               numberBits;
+    ULONG               bitSize;
+    ULONG               slots = ButtonCaps->ReportCount ? ButtonCaps->ReportCount : 1;
+    ULONG               referenceUsage = 0;
+    ULONG               indexMin;
+    ULONG               indexMax;
+
+    for (ULONG usage = usageMin; usage <= usageMax; usage++)
+    {
+        USAGE   probeUsage[1] = { (USAGE)usage };
+        ULONG   usageLength = 1;
+
+        if (IsUsageShared(HidDevice, ButtonCaps, usage))
+        {
+            continue;
+        }
+
+        ResetProbe(Probe, ButtonCaps->ReportID);
+
+        if (HIDP_STATUS_SUCCESS != HidP_SetUsages(HidP_Input,
+                                                  ButtonCaps->UsagePage,
+                                                  ButtonCaps->LinkCollection,
+                                                  probeUsage,
+                                                  &usageLength,
+                                                  HidDevice->Ppd,
+                                                  Probe.data(),
+                                                  (ULONG)Probe.size()))
+        {
+            return false;
+        }
+
+        for (size_t i = 1; i < Probe.size(); i++)
+        {
+            usedBits[i] |= Probe[i];
+        }
+
+        referenceUsage = usage;
+        lastProbe = Probe;
+    }
+
+    //
+    // lastProbe holds the index of referenceUsage, the highest usage probed.
+    //
+    if (lastProbe.empty() || !FindSetBits(usedBits, &firstBit, &lastBit, &numberBits))
+    {
+        return false;
+    }
+
+    bitSize = lastBit - firstBit + 1;
+    usageList.resize(std::max<ULONG>(HidP_MaxUsageListLength(HidP_Input, ButtonCaps->UsagePage, HidDevice->Ppd), 1));
+
+    while (bitSize < 32 && firstBit + bitSize < Probe.size() * 8)
+    {
+        ULONG   bit = firstBit + bitSize;
+        ULONG   usageLength = (ULONG)usageList.size();
+
+        Probe = lastProbe;
+        Probe[bit >> 3] |= (CHAR)(1 << (bit & 7));
+
+        if (HIDP_STATUS_SUCCESS == HidP_GetUsages(HidP_Input,
+                                                  ButtonCaps->UsagePage,
+                                                  ButtonCaps->LinkCollection,
+                                                  usageList.data(),
+                                                  &usageLength,
+                                                  HidDevice->Ppd,
+                                                  Probe.data(),
+                                                  (ULONG)Probe.size()) &&
+            std::find(usageList.begin(), usageList.begin() + usageLength, (USAGE)referenceUsage) != usageList.begin() + usageLength)
+        {
+            break;
+        }
+        bitSize++;
+    }
+
+    if (bitSize > 32 || firstBit + slots * bitSize > Probe.size() * 8)
+    {
+        return false;
+    }
+
+    indexMax = ExtractBits(reinterpret_cast<const UCHAR*>(lastProbe.data()), firstBit, bitSize);
+    if (indexMax < referenceUsage - usageMin)
+    {
+        return false;
+    }
+    indexMin = indexMax - (referenceUsage - usageMin);
+    indexMax = indexMin + (usageMax - usageMin);
+
+    Fields.push_back({ firstBit, (USHORT)bitSize, (USHORT)slots, usageMin, true, (LONG)indexMin, (LONG)indexMax });
+    return true;
+}
+
+static bool ProbeValue(
+    PHID_DEVICE         HidDevice,
+    PHID_DATA           Data,
+    std::vector<CHAR>&  Probe,
+    PHID_DECODER_ENTRY  Entry
+)
+/*++
+RoutineDescription:
+   Locate the value HidP_GetUsageValue would read for a value entry by
+   writing an all ones value, and record the scaling parameters that
+   HidP_GetScaledUsageValue applies.
+--*/
+{
+    PHIDP_VALUE_CAPS    valueCaps = nullptr;
+    ULONG               firstBit;
+    ULONG               lastBit;
+    ULONG               numberBits;
+    LONG                scaledValue;
+
+    for (USHORT i = 0; i < HidDevice->Caps.NumberInputValueCaps; i++)
+    {
+        PHIDP_VALUE_CAPS    caps = &HidDevice->InputValueCaps[i];
+        USAGE               usageMin = caps->IsRange ? caps->Range.UsageMin : caps->NotRange.Usage;
+        USAGE               usageMax = caps->IsRange ? caps->Range.UsageMax : caps->NotRange.Usage;
+
+        if (caps->UsagePage == Data->UsagePage &&
+            caps->ReportID == Data->ReportID &&
+            usageMin <= Data->ValueData.Usage && Data->ValueData.Usage <= usageMax)
+        {
+            valueCaps = caps;
+            break;
+        }
+    }
+
+    if (valueCaps == nullptr || valueCaps->BitSize == 0 || valueCaps->BitSize > 32)
+    {
+        return false;
+    }
+
+    ResetProbe(Probe, (UCHAR)Data->ReportID);
+
+    if (HIDP_STATUS_SUCCESS != HidP_SetUsageValue(HidP_Input,
+                                                  Data->UsagePage,
+                                                  0,
+                                                  Data->ValueData.Usage,
+                                                  (valueCaps->BitSize >= 32) ? 0xFFFFFFFF : ((1u << valueCaps->BitSize) - 1),
+                                                  HidDevice->Ppd,
+                                                  Probe.data(),
+                                                  (ULONG)Probe.size()) ||
+        !FindSetBits(Probe, &firstBit, &lastBit, &numberBits) ||
+        numberBits != valueCaps->BitSize ||
+        lastBit - firstBit + 1 != numberBits)
+    {
+        return false;
+    }
+
+    Entry->BitOffset = firstBit;
+    Entry->BitSize = valueCaps->BitSize;
+    Entry->IsSigned = valueCaps->LogicalMin < 0;
+    Entry->LogicalMin = valueCaps->LogicalMin;
+    Entry->LogicalMax = valueCaps->LogicalMax;
+    Entry->PhysicalMin = valueCaps->PhysicalMin;
+    Entry->PhysicalMax = valueCaps->PhysicalMax;
+
+    //
+    // With no physical range the physical values equal the logical values.
+    //
+    if (Entry->PhysicalMin == 0 && Entry->PhysicalMax == 0)
+    {
+        Entry->PhysicalMin = Entry->LogicalMin;
+        Entry->PhysicalMax = Entry->LogicalMax;
+    }
+
+    //
+    // Whether the usage can be scaled at all depends only on its caps, so ask
+    // once rather than deciding on every report.
+    //
+    Entry->ScaleStatus = HIDP_STATUS_SUCCESS;
+
+    if (HIDP_STATUS_BAD_LOG_PHY_VALUES == HidP_GetScaledUsageValue(HidP_Input,
+                                                                   Data->UsagePage,
+                                                                   0,
+                                                                   Data->ValueData.Usage,
+                                                                   &scaledValue,
+                                                                   HidDevice->Ppd,
+                                                                   Probe.data(),
+                                                                   (ULONG)Probe.size()) ||
+        Entry->LogicalMin >= Entry->LogicalMax ||
+        Entry->PhysicalMin >= Entry->PhysicalMax)
+    {
+        Entry->ScaleStatus = HIDP_STATUS_BAD_LOG_PHY_VALUES;
+    }
+
+    return true;
+}
+
+bool CompileInputDecoder(
+    IN OUT PHID_DEVICE  HidDevice
+)
+/*++
+RoutineDescription:
+   Build HidDevice->InputDecoder from the input caps and the InputData array
+   FillDeviceInfo laid out. Returns false, leaving InputDecoder null, when
+   out of memory or when the layout cannot be probed; the device still works
+   through UnpackReport.
+--*/
+{
+    PHID_REPORT_DECODER                         decoder = nullptr;
+    USHORT                                      reportLength = HidDevice->Caps.InputReportByteLength;
+    std::vector<std::vector<HID_DECODER_FIELD>> capsFields;
+    std::vector<CHAR>                           probe;
+
+    HidDevice->InputDecoder = nullptr;
+
+    if (reportLength < 2 || HidDevice->InputData == nullptr)
+    {
+        return false;
+    }
+
+    try
+    {
+        decoder = new HID_REPORT_DECODER{};
+        decoder->ReportByteLength = reportLength;
+        probe.resize(reportLength);
+        capsFields.resize(HidDevice->Caps.NumberInputButtonCaps);
+
+        for (USHORT i = 0; i < HidDevice->Caps.NumberInputButtonCaps; i++)
+        {
+            PHIDP_BUTTON_CAPS   buttonCaps = &HidDevice->InputButtonCaps[i];
+            bool                probed;
+
+            if (buttonCaps->BitField & 0x02)        // Variable, one bit per usage
+            {
+                probed = ProbeBitmapCaps(HidDevice, buttonCaps, probe, capsFields[i]);
+            }
+            else
+            {
+                probed = ProbeArrayCaps(HidDevice, buttonCaps, probe, capsFields[i]);
+            }
+
+            if (!probed)
+            {
+                delete decoder;
+                return false;
+            }
+        }
+
+        decoder->Entries.resize(HidDevice->InputDataLength);
+
+        for (ULONG i = 0; i < HidDevice->InputDataLength; i++)
+        {
+            PHID_DATA           data = &HidDevice->InputData[i];
+            PHID_DECODER_ENTRY  entry = &decoder->Entries[i];
+
+            if (!data->IsButtonData)
+            {
+                if (!ProbeValue(HidDevice, data, probe, entry))
+                {
+                    delete decoder;
+                    return false;
+                }
+                continue;
+            }
+
+            entry->FirstField = (ULONG)decoder->Fields.size();
+
+            for (USHORT caps = 0; caps < HidDevice->Caps.NumberInputButtonCaps; caps++)
+            {
+                if (HidDevice->InputButtonCaps[caps].UsagePage != data->UsagePage ||
+                    HidDevice->InputButtonCaps[caps].ReportID != data->ReportID)
+                {
+                    continue;
+                }
+
+                for (HID_DECODER_FIELD field : capsFields[caps])
+                {
+                    //
+                    // Arrays are filtered per slot at decode time, bitmap
+                    // runs can be clipped to the entry's range right away.
+                    //
+                    if (!field.IsArray)
+                    {
+                        ULONG first = std::max<ULONG>(field.UsageMin, data->ButtonData.UsageMin);
+                        ULONG last = std::min<ULONG>(field.UsageMin + field.Count - 1, data->ButtonData.UsageMax);
+
+                        if (first > last)
+                        {
+                            continue;
+                        }
+
+                        field.BitOffset += first - field.UsageMin;
+                        field.Count = (USHORT)(last - first + 1);
+                        field.UsageMin = (USAGE)first;
+                    }
+
+                    decoder->Fields.push_back(field);
+                }
+            }
+
+            entry->NumberFields = (ULONG)decoder->Fields.size() - entry->FirstField;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        delete decoder;
+        return false;
+    }
+
+    HidDevice->InputDecoder = decoder;
+    return true;
+}
+
+void FreeReportDecoder(
+    IN  PHID_REPORT_DECODER Decoder
+)
+{
+    delete Decoder;
+}
+
+//
+// Flat image of a decoder, for the device layout cache: this header, then
+// NumberFields HID_DECODER_FIELDs and NumberEntries HID_DECODER_ENTRYs.
+//
+typedef struct _HID_DECODER_IMAGE
+{
+    USHORT      ReportByteLength;
+    USHORT      Reserved;
+    ULONG       NumberFields;
+    ULONG       NumberEntries;
+} HID_DECODER_IMAGE, * PHID_DECODER_IMAGE;
+
+bool SaveReportDecoder(
+    IN       PHID_REPORT_DECODER  Decoder,
+    _Out_writes_bytes_(*ImageLength) PUCHAR Image,
+    IN OUT   PULONG               ImageLength
+)
+/*++
+RoutineDescription:
+   Write Decoder out so LoadReportDecoder can rebuild it without probing.
+   Fails when Image is too small, in which case ImageLength is the size
+   required.
+--*/
+{
+    HID_DECODER_IMAGE   header = {};
+    size_t              fieldsLength = Decoder->Fields.size() * sizeof(HID_DECODER_FIELD);
+    size_t              entriesLength = Decoder->Entries.size() * sizeof(HID_DECODER_ENTRY);
+    size_t              length = sizeof(header) + fieldsLength + entriesLength;
+
+    if (*ImageLength < length)
+    {
+        *ImageLength = (ULONG)length;
+        return false;
+    }
+
+    header.ReportByteLength = Decoder->ReportByteLength;
+    header.NumberFields = (ULONG)Decoder->Fields.size();
+    header.NumberEntries = (ULONG)Decoder->Entries.size();
+
+    std::memcpy(Image, &header, sizeof(header));
+    std::memcpy(Image + sizeof(header), Decoder->Fields.data(), fieldsLength);
+    std::memcpy(Image + sizeof(header) + fieldsLength, Decoder->Entries.data(), entriesLength);
+
+    *ImageLength = (ULONG)length;
+    return true;
+}
+
+PHID_REPORT_DECODER LoadReportDecoder(
+    _In_reads_bytes_(ImageLength) const UCHAR* Image,
+    IN       ULONG                ImageLength,
+    IN       USHORT               ReportByteLength,
+    IN       const HID_DATA*      Data,
+    IN       ULONG                DataLength
+)
+/*++
+RoutineDescription:
+   Rebuild a decoder saved by SaveReportDecoder for a device whose input
+   reports are ReportByteLength bytes and whose InputData is Data. Decode
+   Report trusts the table to stay within the report, and a value entry
+   to have the bit size and, when marked scalable, the ranges ProbeValue
+   gives every value CompileInputDecoder accepts. An image that breaks
+   either, whatever its origin, is refused rather than loaded.
+--*/
+{
+    HID_DECODER_IMAGE   header;
+    PHID_REPORT_DECODER decoder;
+    ULONG               reportBits = (ULONG)ReportByteLength * 8;
+
+    if (ImageLength < sizeof(header))
+    {
+        return nullptr;
+    }
+
+    std::memcpy(&header, Image, sizeof(header));
+
+    if (header.ReportByteLength != ReportByteLength ||
+        header.NumberEntries != DataLength ||
+        header.NumberFields > ImageLength / sizeof(HID_DECODER_FIELD) ||
+        sizeof(header) + (size_t)header.NumberFields * sizeof(HID_DECODER_FIELD) +
+            (size_t)header.NumberEntries * sizeof(HID_DECODER_ENTRY) != ImageLength)
+    {
+        return nullptr;
+    }
+
+    decoder = new (std::nothrow) HID_REPORT_DECODER{};
+    if (decoder == nullptr)
+    {
+        return nullptr;
+    }
+
+    try
+    {
+        decoder->ReportByteLength = header.ReportByteLength;
+        decoder->Fields.resize(header.NumberFields);
+        decoder->Entries.resize(header.NumberEntries);
+    }
+    catch (const std::bad_alloc&)
+    {
+        delete decoder;
+        return nullptr;
+    }
+
+    std::memcpy(decoder->Fields.data(), Image + sizeof(header), header.NumberFields * sizeof(HID_DECODER_FIELD));
+    std::memcpy(decoder->Entries.data(),
+                Image + sizeof(header) + header.NumberFields * sizeof(HID_DECODER_FIELD),
+                header.NumberEntries * sizeof(HID_DECODER_ENTRY));
+
+    for (const HID_DECODER_FIELD& field : decoder->Fields)
+    {
+        ULONG bits = field.IsArray ? (ULONG)field.BitSize * field.Count : field.Count;
+
+        if ((field.IsArray ? field.BitSize : field.Count) > 32 ||
+            field.BitOffset < 8 || field.BitOffset > reportBits || bits > reportBits - field.BitOffset)
+        {
+            delete decoder;
+            return nullptr;
+        }
+    }
+
+    for (ULONG i = 0; i < header.NumberEntries; i++)
+    {
+        const HID_DECODER_ENTRY& entry = decoder->Entries[i];
+
+        if (entry.FirstField > header.NumberFields ||
+            entry.NumberFields > header.NumberFields - entry.FirstField ||
+            entry.BitSize > 32 ||
+            entry.BitOffset > reportBits || entry.BitSize > reportBits - entry.BitOffset ||
+            (!Data[i].IsButtonData &&
+             (entry.BitSize == 0 ||
+              (entry.ScaleStatus == HIDP_STATUS_SUCCESS &&
+               (entry.LogicalMin >= entry.LogicalMax || entry.PhysicalMin >= entry.PhysicalMax)))))
+        {
+            delete decoder;
+            return nullptr;
+        }
+    }
+
+    return decoder;
+}
+
+bool DecodeReport(
+    IN       PHID_REPORT_DECODER  Decoder,
+    _In_reads_bytes_(ReportBufferLength) PCHAR ReportBuffer,
+    IN       USHORT               ReportBufferLength,
+    IN OUT   PHID_DATA            Data,
+    IN       ULONG                DataIndex,
+    IN       ULONG                DataLength
+)
+/*++
+Routine Description:
+   UnpackReport without the preparsed data: fill in every HID_DATA entry
+   whose ReportID matches the report, with the same results, statuses and
+   early exit on error, from the compiled table. Data may be a span of the
+   array the decoder was compiled for, starting at element DataIndex.
+--*/
+{
+    const UCHAR*    report = reinterpret_cast<const UCHAR*>(ReportBuffer);
+    UCHAR           reportID = report[0];
+
+    if (DataIndex + DataLength > Decoder->Entries.size())
+    {
+        return false;
+    }
+
+    for (ULONG i = 0; i < DataLength; i++, Data++)
+    {
+        const HID_DECODER_ENTRY* entry = &Decoder->Entries[DataIndex + i];
+
+        if (reportID != Data->ReportID)
+        {
+            continue;
+        }
+
+        if (ReportBufferLength != Decoder->ReportByteLength)
+        {
+            Data->Status = HIDP_STATUS_INVALID_REPORT_LENGTH;
+            return false;
+        }
+
+        if (Data->IsButtonData)
+        {
+            const HID_DECODER_FIELD*    field = Decoder->Fields.data() + entry->FirstField;
+            PUSAGE                      usages = Data->ButtonData.Usages;
+            ULONG                       maxUsages = Data->ButtonData.MaxUsageLength;
+            ULONG                       nextUsage = 0;
+
+            for (ULONG f = 0; f < entry->NumberFields; f++, field++)
+            {
+                if (!field->IsArray)
+                {
+                    ULONG bits = ExtractBits(report, field->BitOffset, field->Count);
+
+                    while (bits != 0)
+                    {
+                        if (nextUsage < maxUsages)
+                        {
+                            usages[nextUsage] = (USAGE)(field->UsageMin + std::countr_zero(bits));
+                        }
+                        nextUsage++;
+                        bits &= bits - 1;
+                    }
+                    continue;
+                }
+
+                for (ULONG slot = 0; slot < field->Count; slot++)
+                {
+                    LONG    index = (LONG)ExtractBits(report, field->BitOffset + slot * field->BitSize, field->BitSize);
+                    ULONG   usage;
+
+                    if (index < field->LogicalMin || index > field->LogicalMax)
+                    {
+                        continue;
+                    }
+
+                    usage = (USAGE)(field->UsageMin + (index - field->LogicalMin));
+
+                    if (Data->ButtonData.UsageMin <= usage && usage <= Data->ButtonData.UsageMax)
+                    {
+                        if (nextUsage < maxUsages)
+                        {
+                            usages[nextUsage] = (USAGE)usage;
+                        }
+                        nextUsage++;
+                    }
+                }
+            }
+
+            //
+            // HidP_GetUsages fills the buffer and fails the same way when
+            // more usages are down than it holds.
+            //
+            if (nextUsage > maxUsages)
+            {
+                Data->Status = HIDP_STATUS_BUFFER_TOO_SMALL;
+                return false;
+            }
+
+            if (nextUsage < maxUsages)
+            {
+                usages[nextUsage] = 0;
+            }
+            Data->Status = HIDP_STATUS_SUCCESS;
+        }
+        else
+        {
+            ULONG   value = ExtractBits(report, entry->BitOffset, entry->BitSize);
+            LONG    logical = (LONG)value;
+
+            Data->ValueData.Value = value;
+
+            if (entry->ScaleStatus != HIDP_STATUS_SUCCESS)
+            {
+                Data->Status = entry->ScaleStatus;
+                return false;
+            }
+
+            if (entry->IsSigned && entry->BitSize < 32 && (value & (1u << (entry->BitSize - 1))))
+            {
+                logical = (LONG)(value | ~((1u << entry->BitSize) - 1));
+            }
+
+            if (logical < entry->LogicalMin || logical > entry->LogicalMax)
+            {
+                Data->ValueData.ScaledValue = 0;
+                Data->Status = HIDP_STATUS_NULL;
+            }
+            else
+            {
+                Data->ValueData.ScaledValue = (LONG)(entry->PhysicalMin +
+                                                     ((int64_t)(logical - entry->LogicalMin) * (entry->PhysicalMax - entry->PhysicalMin)) /
+                                                     (entry->LogicalMax - entry->LogicalMin));
+                Data->Status = HIDP_STATUS_SUCCESS;
+            }
+        }
+        Data->IsDataSet = true;
+    }
+    return true;
+}
+
+#ifdef _DEBUG
+static void VerifyDecodedReport(
+    PHID_DEVICE     HidDevice,
+    bool            Decoded
+)
+/*++
+RoutineDescription:
+   Decode the same report again through UnpackReport into a scratch copy of
+   InputData and check that the compiled decoder produced the same thing.
+   Usage lists are compared as sets since HidP does not promise an order.
+--*/
+{
+    std::vector<HID_DATA>               reference(HidDevice->InputData, HidDevice->InputData + HidDevice->InputDataLength);
+    std::vector<std::vector<USAGE>>     usages(reference.size());
+
+    for (size_t i = 0; i < reference.size(); i++)
+    {
+        if (reference[i].IsButtonData)
+        {
+            usages[i].assign(reference[i].ButtonData.MaxUsageLength + 1, 0);
+            reference[i].ButtonData.Usages = usages[i].data();
+        }
+    }
+
+    bool unpacked = UnpackReport(HidDevice->InputReportBuffer,
+                                 HidDevice->Caps.InputReportByteLength,
+                                 HidP_Input,
+                                 reference.data(),
+                                 (ULONG)reference.size(),
+                                 HidDevice->Ppd);
+
+    assert(unpacked == Decoded);
+
+    for (size_t i = 0; i < reference.size(); i++)
+    {
+        PHID_DATA   decoded = &HidDevice->InputData[i];
+        PHID_DATA   expected = &reference[i];
+
+        if (expected->ReportID != (UCHAR)HidDevice->InputReportBuffer[0] || !unpacked)
+        {
+            continue;
+        }
+
+        assert(decoded->Status == expected->Status);
+
+        if (expected->IsButtonData)
+        {
+            std::vector<USAGE> left;
+            std::vector<USAGE> right;
+
+            for (ULONG u = 0; u < expected->ButtonData.MaxUsageLength && expected->ButtonData.Usages[u] != 0; u++)
+            {
+                right.push_back(expected->ButtonData.Usages[u]);
+            }
+            for (ULONG u = 0; u < decoded->ButtonData.MaxUsageLength && decoded->ButtonData.Usages[u] != 0; u++)
+            {
+                left.push_back(decoded->ButtonData.Usages[u]);
+            }
+
+            std::sort(left.begin(), left.end());
+            std::sort(right.begin(), right.end());
+            assert(left == right);
+        }
+        else
+        {
+            assert(decoded->ValueData.Value == expected->ValueData.Value);
+            assert(expected->Status != HIDP_STATUS_SUCCESS ||
+                   decoded->ValueData.ScaledValue == expected->ValueData.ScaledValue);
+        }
+    }
+}
+#endif
+
+bool BuildInputReportIndex(
+    IN OUT PHID_DEVICE  HidDevice
+)
+/*++
+RoutineDescription:
+   Group InputData by report ID and record where each report ID's entries
+   start, so a report only visits its own entries. The sort is stable, so
+   entries keep their relative order within a report ID. Every report ID
+   starts out subscribed. Must run before CompileInputDecoder, whose table
+   follows the InputData order. The index itself has its place in the
+   input arena.
+--*/
+{
+    PHID_REPORT_INDEX   index = HidDevice->InputReportIndex;
+
+    if (index == nullptr)
+    {
+        return false;
+    }
+
+    *index = {};
+
+    std::stable_sort(HidDevice->InputData,
+                     HidDevice->InputData + HidDevice->InputDataLength,
+                     [](const HID_DATA& Left, const HID_DATA& Right)
+                     {
+                         return Left.ReportID < Right.ReportID;
+                     });
+
+    for (ULONG i = 0; i < HidDevice->InputDataLength; i++)
+    {
+        PHID_REPORT_SPAN span = &index->Spans[(UCHAR)HidDevice->InputData[i].ReportID];
+
+        if (span->Count++ == 0)
+        {
+            span->First = i;
+        }
+    }
+
+    std::memset(index->Subscribed, 0xFF, sizeof(index->Subscribed));
+
+    HidDevice->InputReportIndex = index;
+    return true;
+}
+
+void SetInputReportSubscription(
+    IN OUT PHID_DEVICE  HidDevice,
+    IN     UCHAR        ReportID,
+    IN     bool         Subscribed
+)
+{
+    PHID_REPORT_INDEX   index = HidDevice->InputReportIndex;
+
+    if (index == nullptr)
+    {
+        return;
+    }
+
+    if (Subscribed)
+    {
+        index->Subscribed[ReportID >> 5] |= (1u << (ReportID & 31));
+    }
+    else
+    {
+        index->Subscribed[ReportID >> 5] &= ~(1u << (ReportID & 31));
+    }
+}
+
+bool UnpackInputReport(
+    IN OUT PHID_DEVICE  HidDevice
+)
+/*++
+Routine Description:
+   Unpack InputReportBuffer into the InputData entries of its report ID,
+   through the compiled decoder when the device has one and through
+   UnpackReport otherwise. Reports whose ID has been unsubscribed are
+   skipped without being looked at.
+--*/
+{
+    PHID_REPORT_INDEX   index = HidDevice->InputReportIndex;
+    UCHAR               reportID = (UCHAR)HidDevice->InputReportBuffer[0];
+    ULONG               first = 0;
+    ULONG               count = HidDevice->InputDataLength;
+    bool                decoded;
+
+    if (index != nullptr)
+    {
+        if (!(index->Subscribed[reportID >> 5] & (1u << (reportID & 31))))
+        {
+            return true;
+        }
+
+        first = index->Spans[reportID].First;
+        count = index->Spans[reportID].Count;
+
+        if (count == 0)
+        {
+            return true;
+        }
+    }
+
+    if (HidDevice->InputDecoder == nullptr)
+    {
+        return UnpackReport(HidDevice->InputReportBuffer,
+                            HidDevice->Caps.InputReportByteLength,
+                            HidP_Input,
+                            HidDevice->InputData + first,
+                            count,
+                            HidDevice->Ppd);
+    }
+
+    decoded = DecodeReport(HidDevice->InputDecoder,
+                           HidDevice->InputReportBuffer,
+                           HidDevice->Caps.InputReportByteLength,
+                           HidDevice->InputData + first,
+                           first,
+                           count);
+
+#ifdef _DEBUG
+    VerifyDecodedReport(HidDevice, decoded);
+#endif
+
+    return decoded;
+}
+
+//
+// Short item prefixes, size bits clear (HID 1.11, 6.2.2).
+//
+#define HID_ITEM_INPUT              0x80
+#define HID_ITEM_COLLECTION         0xA0
+#define HID_ITEM_END_COLLECTION     0xC0
+#define HID_ITEM_USAGE_PAGE         0x04
+#define HID_ITEM_LOGICAL_MINIMUM    0x14
+#define HID_ITEM_LOGICAL_MAXIMUM    0x24
+#define HID_ITEM_PHYSICAL_MINIMUM   0x34
+#define HID_ITEM_PHYSICAL_MAXIMUM   0x44
+#define HID_ITEM_REPORT_SIZE        0x74
+#define HID_ITEM_REPORT_ID          0x84
+#define HID_ITEM_REPORT_COUNT       0x94
+#define HID_ITEM_USAGE              0x08
+#define HID_ITEM_USAGE_MINIMUM      0x18
+#define HID_ITEM_USAGE_MAXIMUM      0x28
+
+#define HID_MAIN_CONSTANT           0x01
+#define HID_MAIN_VARIABLE           0x02
+#define HID_COLLECTION_APPLICATION  0x01
+
+//
+// One main item of the rebuilt descriptor. Bitmap runs and arrays come from
+// the button fields, values from the value entries.
+//
+typedef struct _HID_DESCRIPTOR_ITEM
+{
+    ULONG       BitOffset;
+    USHORT      BitSize;
+    USHORT      Count;
+    USAGE       UsagePage;
+    USAGE       UsageMin;
+    USAGE       UsageMax;
+    UCHAR       Flags;
+    LONG        LogicalMin;
+    LONG        LogicalMax;
+    LONG        PhysicalMin;
+    LONG        PhysicalMax;
+} HID_DESCRIPTOR_ITEM, * PHID_DESCRIPTOR_ITEM;
+
+static void AppendItem(
+    std::vector<UCHAR>& Descriptor,
+    UCHAR               Prefix,
+    LONG                Value,
+    bool                IsSigned
+)
+/*++
+RoutineDescription:
+   Append a short item with the smallest data size that holds Value. Usages
+   are unsigned data, logical and physical extents signed.
+--*/
+{
+    ULONG   size;
+
+    if (IsSigned)
+    {
+        size = (Value >= -128 && Value <= 127) ? 1 : (Value >= -32768 && Value <= 32767) ? 2 : 4;
+    }
+    else
+    {
+        size = ((ULONG)Value <= 0xFF) ? 1 : ((ULONG)Value <= 0xFFFF) ? 2 : 4;
+    }
+
+    Descriptor.push_back((UCHAR)(Prefix | (size == 4 ? 3 : size)));
+
+    for (ULONG i = 0; i < size; i++)
+    {
+        Descriptor.push_back((UCHAR)((ULONG)Value >> (8 * i)));
+    }
+}
+
+static void AppendPadding(
+    std::vector<UCHAR>& Descriptor,
+    ULONG               Bits
+)
+{
+    while (Bits > 0)
+    {
+        ULONG chunk = std::min<ULONG>(Bits, 0xFF);
+
+        AppendItem(Descriptor, HID_ITEM_REPORT_SIZE, (LONG)chunk, false);
+        AppendItem(Descriptor, HID_ITEM_REPORT_COUNT, 1, false);
+        AppendItem(Descriptor, HID_ITEM_INPUT, HID_MAIN_CONSTANT, false);
+        Bits -= chunk;
+    }
+}
+
+bool BuildInputReportDescriptor(
+    IN     PHID_DEVICE  HidDevice,
+    _Out_writes_bytes_(*DescriptorLength) PUCHAR Descriptor,
+    IN OUT PULONG       DescriptorLength
+)
+/*++
+RoutineDescription:
+   Write out a report descriptor with the same input layout as HidDevice,
+   built from the compiled decoder: one application collection with the
+   device's top level usage, and per report ID the bitmap runs, arrays and
+   values at the bit offsets the probe found, with constant padding in
+   between. Parsing it yields a device whose input reports decode exactly
+   as HidDevice's do, which is all a replay needs; output and feature
+   reports, link collections and units are not carried over.
+
+   On return DescriptorLength holds the length of the descriptor. Returns
+   false when the device has no decoder or when Descriptor is too small,
+   in which case DescriptorLength is the size required.
+--*/
+{
+    PHID_REPORT_DECODER                 decoder = HidDevice->InputDecoder;
+    std::vector<UCHAR>                  descriptor;
+    std::vector<HID_DESCRIPTOR_ITEM>    items;
+    ULONG                               reportBits;
+
+    if (decoder == nullptr)
+    {
+        *DescriptorLength = 0;
+        return false;
+    }
+
+    reportBits = (ULONG)decoder->ReportByteLength * 8;
+
+    try
+    {
+        AppendItem(descriptor, HID_ITEM_USAGE_PAGE, HidDevice->Caps.UsagePage, false);
+        AppendItem(descriptor, HID_ITEM_USAGE, HidDevice->Caps.Usage, false);
+        AppendItem(descriptor, HID_ITEM_COLLECTION, HID_COLLECTION_APPLICATION, false);
+
+        for (ULONG reportID = 0; reportID < 256; reportID++)
+        {
+            std::vector<USAGE>  bitmapPages(reportBits, 0);
+            std::vector<USAGE>  bitmapUsages(reportBits, 0);
+            std::vector<bool>   bitmapSet(reportBits, false);
+            ULONG               cursor = 8;         // Past the report ID byte
+
+            items.clear();
+
+            for (ULONG i = 0; i < HidDevice->InputDataLength; i++)
+            {
+                PHID_DATA                   data = &HidDevice->InputData[i];
+                const HID_DECODER_ENTRY*    entry = &decoder->Entries[i];
+
+                if (data->ReportID != reportID)
+                {
+                    continue;
+                }
+
+                if (!data->IsButtonData)
+                {
+                    items.push_back({ entry->BitOffset, entry->BitSize, 1, data->UsagePage,
+                                      data->ValueData.Usage, data->ValueData.Usage, HID_MAIN_VARIABLE,
+                                      entry->LogicalMin, entry->LogicalMax, entry->PhysicalMin, entry->PhysicalMax });
+                    continue;
+                }
+
+                //
+                // Entries sharing a usage page see the same fields, so
+                // bitmaps are flattened to bits and arrays deduplicated by
+                // offset before anything is written.
+                //
+                for (ULONG f = 0; f < entry->NumberFields; f++)
+                {
+                    const HID_DECODER_FIELD* field = &decoder->Fields[entry->FirstField + f];
+
+                    if (!field->IsArray)
+                    {
+                        for (ULONG bit = 0; bit < field->Count; bit++)
+                        {
+                            bitmapPages[field->BitOffset + bit] = data->UsagePage;
+                            bitmapUsages[field->BitOffset + bit] = (USAGE)(field->UsageMin + bit);
+                            bitmapSet[field->BitOffset + bit] = true;
+                        }
+                        continue;
+                    }
+
+                    if (std::none_of(items.begin(), items.end(),
+                                     [field](const HID_DESCRIPTOR_ITEM& Item) { return Item.BitOffset == field->BitOffset; }))
+                    {
+                        items.push_back({ field->BitOffset, field->BitSize, field->Count, data->UsagePage,
+                                          field->UsageMin, (USAGE)(field->UsageMin + (field->LogicalMax - field->LogicalMin)), 0,
+                                          field->LogicalMin, field->LogicalMax, 0, 0 });
+                    }
+                }
+            }
+
+            //
+            // Regroup the bits into runs of consecutive usages on one page.
+            //
+            for (ULONG bit = 0; bit < reportBits; bit++)
+            {
+                if (!bitmapSet[bit])
+                {
+                    continue;
+                }
+
+                ULONG run = 1;
+
+                while (bit + run < reportBits &&
+                       bitmapSet[bit + run] &&
+                       bitmapPages[bit + run] == bitmapPages[bit] &&
+                       bitmapUsages[bit + run] == bitmapUsages[bit] + run)
+                {
+                    run++;
+                }
+
+                items.push_back({ bit, 1, (USHORT)run, bitmapPages[bit], bitmapUsages[bit],
+                                  (USAGE)(bitmapUsages[bit] + run - 1), HID_MAIN_VARIABLE, 0, 1, 0, 0 });
+                bit += run - 1;
+            }
+
+            if (items.empty())
+            {
+                continue;
+            }
+
+            std::sort(items.begin(), items.end(),
+                      [](const HID_DESCRIPTOR_ITEM& Left, const HID_DESCRIPTOR_ITEM& Right)
+                      {
+                          return Left.BitOffset < Right.BitOffset;
+                      });
+
+            if (reportID != 0)
+            {
+                AppendItem(descriptor, HID_ITEM_REPORT_ID, (LONG)reportID, false);
+            }
+
+            for (const HID_DESCRIPTOR_ITEM& item : items)
+            {
+                if (item.BitOffset < cursor)
+                {
+                    *DescriptorLength = 0;          // Overlapping fields cannot be expressed
+                    return false;
+                }
+
+                AppendPadding(descriptor, item.BitOffset - cursor);
+
+                AppendItem(descriptor, HID_ITEM_USAGE_PAGE, item.UsagePage, false);
+                if (item.UsageMin == item.UsageMax)
+                {
+                    AppendItem(descriptor, HID_ITEM_USAGE, item.UsageMin, false);
+                }
+                else
+                {
+                    AppendItem(descriptor, HID_ITEM_USAGE_MINIMUM, item.UsageMin, false);
+                    AppendItem(descriptor, HID_ITEM_USAGE_MAXIMUM, item.UsageMax, false);
+                }
+                AppendItem(descriptor, HID_ITEM_LOGICAL_MINIMUM, item.LogicalMin, true);
+                AppendItem(descriptor, HID_ITEM_LOGICAL_MAXIMUM, item.LogicalMax, true);
+                AppendItem(descriptor, HID_ITEM_PHYSICAL_MINIMUM, item.PhysicalMin, true);
+                AppendItem(descriptor, HID_ITEM_PHYSICAL_MAXIMUM, item.PhysicalMax, true);
+                AppendItem(descriptor, HID_ITEM_REPORT_SIZE, item.BitSize, false);
+                AppendItem(descriptor, HID_ITEM_REPORT_COUNT, item.Count, false);
+                AppendItem(descriptor, HID_ITEM_INPUT, item.Flags, false);
+
+                cursor = item.BitOffset + (ULONG)item.BitSize * item.Count;
+            }
+
+            //
+            // Pad every report to the full length so the rebuilt device
+            // reports the same InputReportByteLength.
+            //
+            AppendPadding(descriptor, reportBits - std::min(cursor, reportBits));
+        }
+
+        descriptor.push_back(HID_ITEM_END_COLLECTION);
+    }
+    catch (const std::bad_alloc&)
+    {
+        *DescriptorLength = 0;
+        return false;
+    }
+
+    if (*DescriptorLength < descriptor.size())
+    {
+        *DescriptorLength = (ULONG)descriptor.size();
+        return false;
+    }
+
+    std::memcpy(Descriptor, descriptor.data(), descriptor.size());
+    *DescriptorLength = (ULONG)descriptor.size();
+    return true;
+}
@@ -0,0 +1,600 @@
+/*++
+
+Module Name:
+
+    devcache.cpp
+
+Abstract:
+
+    Persistent cache of device layouts. FillDeviceInfo derives everything
+    about the input side of a device from its preparsed data: the button
+    and value caps, the HID_DATA array laid out from them and, most
+    expensive of all, the compiled input decoder, which probes every field.
+    None of that changes while the device keeps its report descriptor, so
+    the monitor keeps it in a file between runs and, on start or when the
+    keyboard comes back, only has to open the device and read its caps.
+
+    A device is looked up by path and validated against its descriptor
+    hash, attributes, HIDP_CAPS and input button and value caps before
+    anything cached is used. The hidraw backend hashes the report
+    descriptor itself; Windows offers no raw descriptor, so there the caps
+    and the attributes, version number included, are the whole check.
+    Either way a firmware update that changes the layout changes what is
+    compared and the device is derived afresh.
+
+    Storing a device drops the entries it makes stale: the one cached for
+    its path, and ones for the same device under a path no device has used
+    this run, such as a hidraw node the kernel has since renumbered.
+    Simulated devices are never cached.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef _WIN32
+#include <wtypes.h>
+#endif
+#include "devcache.h"
+#include "simulate.h"
+
+//
+// Usage buffers are sized from the cache; anything beyond the usages a
+// 16 bit usage range can hold means the file is damaged.
+//
+#define CACHE_MAX_USAGE_LENGTH  0x10000
+
+typedef struct _HID_CACHE_ENTRY
+{
+    std::string                     Path;
+    HID_CACHE_RECORD                Record;
+    std::vector<HIDP_BUTTON_CAPS>   ButtonCaps;
+    std::vector<HIDP_VALUE_CAPS>    ValueCaps;
+    std::vector<HID_DATA>           Data;
+    std::vector<UCHAR>              Decoder;
+    bool                            Used;           // Restored or stored this run, not saved
+} HID_CACHE_ENTRY, * PHID_CACHE_ENTRY;
+
+static std::mutex                       cacheLock;
+static bool                             cacheOpen = false;
+static bool                             cacheDirty = false;
+static std::string                      cacheFile;
+static std::vector<HID_CACHE_ENTRY>     cacheEntries;
+
+static bool IsSimulatedDevice(
+    PHID_DEVICE             HidDevice
+)
+{
+    return HidDevice->DevicePath == nullptr ||
+           std::strncmp(HidDevice->DevicePath, HID_SIMULATED_NODE, sizeof(HID_SIMULATED_NODE) - 1) == 0;
+}
+
+static bool SameDevice(
+    const HID_CACHE_ENTRY&  Entry,
+    PHID_DEVICE             HidDevice
+)
+{
+    return Entry.Record.DescriptorHash == HidDevice->DescriptorHash &&
+           Entry.Record.Attributes.VendorID == HidDevice->Attributes.VendorID &&
+           Entry.Record.Attributes.ProductID == HidDevice->Attributes.ProductID &&
+           Entry.Record.Attributes.VersionNumber == HidDevice->Attributes.VersionNumber &&
+           std::memcmp(&Entry.Record.Caps, &HidDevice->Caps, sizeof(HIDP_CAPS)) == 0;
+}
+
+static bool MatchEntry(
+    const HID_CACHE_ENTRY&  Entry,
+    PHID_DEVICE             HidDevice
+)
+{
+    return Entry.Path == HidDevice->DevicePath && SameDevice(Entry, HidDevice);
+}
+
+static bool MatchInputCaps(
+    const HID_CACHE_ENTRY&  Entry,
+    PHID_DEVICE             HidDevice
+)
+/*++
+RoutineDescription:
+   Compare the cached input button and value caps with the ones the
+   preparsed data gives now. HIDP_CAPS only has their numbers, which
+   already matched; on Windows these are all there is to tell a changed
+   layout by. Throws std::bad_alloc.
+--*/
+{
+    std::vector<HIDP_BUTTON_CAPS>   buttonCaps(Entry.ButtonCaps.size());
+    std::vector<HIDP_VALUE_CAPS>    valueCaps(Entry.ValueCaps.size());
+    USHORT                          length;
+
+    length = (USHORT)buttonCaps.size();
+    if (length > 0 &&
+        (HidP_GetButtonCaps(HidP_Input, buttonCaps.data(), &length, HidDevice->Ppd) != HIDP_STATUS_SUCCESS ||
+         length != buttonCaps.size() ||
+         std::memcmp(buttonCaps.data(), Entry.ButtonCaps.data(), length * sizeof(HIDP_BUTTON_CAPS)) != 0))
+    {
+        return false;
+    }
+
+    length = (USHORT)valueCaps.size();
+    if (length > 0 &&
+        (HidP_GetValueCaps(HidP_Input, valueCaps.data(), &length, HidDevice->Ppd) != HIDP_STATUS_SUCCESS ||
+         length != valueCaps.size() ||
+         std::memcmp(valueCaps.data(), Entry.ValueCaps.data(), length * sizeof(HIDP_VALUE_CAPS)) != 0))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+template <typename T>
+static bool ReadArray(
+    const std::vector<UCHAR>&   File,
+    size_t&                     Offset,
+    size_t                      Count,
+    std::vector<T>&             Array
+)
+{
+    if (Count > (File.size() - Offset) / sizeof(T))
+    {
+        return false;
+    }
+
+    Array.resize(Count);
+    if (Count > 0)
+    {
+        std::memcpy(Array.data(), File.data() + Offset, Count * sizeof(T));
+    }
+    Offset += Count * sizeof(T);
+    return true;
+}
+
+template <typename T>
+static bool WriteArray(
+    FILE*                       Stream,
+    const std::vector<T>&       Array
+)
+{
+    return Array.empty() || fwrite(Array.data(), sizeof(T), Array.size(), Stream) == Array.size();
+}
+
+static bool ParseCacheFile(
+    const std::vector<UCHAR>&       File,
+    std::vector<HID_CACHE_ENTRY>&   Entries
+)
+/*++
+RoutineDescription:
+   Split a cache file into entries. Everything is checked against the file
+   size and a damaged file yields no entries at all rather than some.
+--*/
+{
+    HID_CACHE_HEADER    header;
+    size_t              offset = sizeof(header);
+
+    if (File.size() < sizeof(header))
+    {
+        return false;
+    }
+
+    std::memcpy(&header, File.data(), sizeof(header));
+
+    if (std::memcmp(header.Magic, HID_CACHE_MAGIC, sizeof(header.Magic)) != 0 ||
+        header.Version != HID_CACHE_VERSION ||
+        header.CapsSize != sizeof(HIDP_CAPS) ||
+        header.ButtonCapsSize != sizeof(HIDP_BUTTON_CAPS) ||
+        header.ValueCapsSize != sizeof(HIDP_VALUE_CAPS) ||
+        header.DataSize != sizeof(HID_DATA))
+    {
+        return false;
+    }
+
+    for (ULONG i = 0; i < header.NumberRecords; i++)
+    {
+        HID_CACHE_ENTRY entry = {};
+
+        if (File.size() - offset < sizeof(HID_CACHE_RECORD))
+        {
+            return false;
+        }
+
+        std::memcpy(&entry.Record, File.data() + offset, sizeof(HID_CACHE_RECORD));
+        offset += sizeof(HID_CACHE_RECORD);
+
+        if (entry.Record.PathLength == 0 || entry.Record.PathLength >= MAX_PATH ||
+            File.size() - offset < entry.Record.PathLength)
+        {
+            return false;
+        }
+
+        entry.Path.assign(reinterpret_cast<const char*>(File.data() + offset), entry.Record.PathLength);
+        offset += entry.Record.PathLength;
+
+        if (!ReadArray(File, offset, entry.Record.Caps.NumberInputButtonCaps, entry.ButtonCaps) ||
+            !ReadArray(File, offset, entry.Record.Caps.NumberInputValueCaps, entry.ValueCaps) ||
+            !ReadArray(File, offset, entry.Record.DataLength, entry.Data))
+        {
+            return false;
+        }
+
+        for (HID_DATA& data : entry.Data)
+        {
+            if (data.IsButtonData)
+            {
+                if (data.ButtonData.MaxUsageLength > CACHE_MAX_USAGE_LENGTH)
+                {
+                    return false;
+                }
+                data.ButtonData.Usages = nullptr;
+            }
+        }
+
+        if (!ReadArray(File, offset, entry.Record.DecoderLength, entry.Decoder))
+        {
+            return false;
+        }
+
+        Entries.push_back(std::move(entry));
+    }
+
+    return offset == File.size();
+}
+
+bool OpenHidDeviceCache(
+    IN  LPCSTR          FileName
+)
+{
+    std::vector<UCHAR>              file;
+    std::vector<HID_CACHE_ENTRY>    entries;
+    FILE*                           stream;
+
+    try
+    {
+        stream = fopen(FileName, "rb");
+        if (stream != nullptr)
+        {
+            UCHAR   chunk[4096];
+            size_t  length;
+
+            while ((length = fread(chunk, 1, sizeof(chunk), stream)) > 0)
+            {
+                file.insert(file.end(), chunk, chunk + length);
+            }
+            fclose(stream);
+
+            if (!ParseCacheFile(file, entries))
+            {
+                entries.clear();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(cacheLock);
+
+        cacheFile = FileName;
+        cacheEntries.swap(entries);
+        cacheOpen = true;
+        cacheDirty = false;
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool FlushHidDeviceCache(
+    void
+)
+/*++
+RoutineDescription:
+   Write the cache to a temporary file next to the real one and move it
+   into place, so a run killed halfway leaves the previous cache intact.
+--*/
+{
+    std::lock_guard<std::mutex> lock(cacheLock);
+    HID_CACHE_HEADER            header = {};
+    std::string                 temporary;
+    FILE*                       stream;
+    bool                        written;
+
+    if (!cacheOpen || !cacheDirty)
+    {
+        return true;
+    }
+
+    try
+    {
+        temporary = cacheFile + ".tmp";
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    stream = fopen(temporary.c_str(), "wb");
+    if (stream == nullptr)
+    {
+        return false;
+    }
+
+    std::memcpy(header.Magic, HID_CACHE_MAGIC, sizeof(header.Magic));
+    header.Version = HID_CACHE_VERSION;
+    header.NumberRecords = (ULONG)cacheEntries.size();
+    header.CapsSize = sizeof(HIDP_CAPS);
+    header.ButtonCapsSize = sizeof(HIDP_BUTTON_CAPS);
+    header.ValueCapsSize = sizeof(HIDP_VALUE_CAPS);
+    header.DataSize = sizeof(HID_DATA);
+
+    written = fwrite(&header, sizeof(header), 1, stream) == 1;
+
+    for (const HID_CACHE_ENTRY& entry : cacheEntries)
+    {
+        written = written &&
+                  fwrite(&entry.Record, sizeof(entry.Record), 1, stream) == 1 &&
+                  fwrite(entry.Path.data(), 1, entry.Path.size(), stream) == entry.Path.size() &&
+                  WriteArray(stream, entry.ButtonCaps) &&
+                  WriteArray(stream, entry.ValueCaps) &&
+                  WriteArray(stream, entry.Data) &&
+                  WriteArray(stream, entry.Decoder);
+    }
+
+    written = fclose(stream) == 0 && written;
+
+#ifdef _WIN32
+    written = written && MoveFileExA(temporary.c_str(), cacheFile.c_str(), MOVEFILE_REPLACE_EXISTING);
+#else
+    written = written && std::rename(temporary.c_str(), cacheFile.c_str()) == 0;
+#endif
+
+    if (!written)
+    {
+        std::remove(temporary.c_str());
+        return false;
+    }
+
+    cacheDirty = false;
+    return true;
+}
+
+void CloseHidDeviceCache(
+    void
+)
+{
+    std::lock_guard<std::mutex> lock(cacheLock);
+
+    cacheOpen = false;
+    cacheDirty = false;
+    cacheEntries.clear();
+    cacheFile.clear();
+}
+
+bool GetDefaultHidDeviceCachePath(
+    OUT std::string&    FileName
+)
+{
+    try
+    {
+#ifdef _WIN32
+        CHAR    directory[MAX_PATH];
+        DWORD   length = GetEnvironmentVariableA("LOCALAPPDATA", directory, sizeof(directory));
+
+        if (length == 0 || length >= sizeof(directory))
+        {
+            return false;
+        }
+
+        FileName = std::string(directory) + "\\Alien-Macros.cache";
+#else
+        const char* directory = std::getenv("XDG_CACHE_HOME");
+
+        if (directory != nullptr && directory[0] == '/')
+        {
+            FileName = std::string(directory) + "/alien-macros.cache";
+        }
+        else if ((directory = std::getenv("HOME")) != nullptr && directory[0] != '\0')
+        {
+            FileName = std::string(directory) + "/.cache/alien-macros.cache";
+        }
+        else
+        {
+            return false;
+        }
+#endif
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+ULONGLONG HashHidDescriptor(
+    _In_reads_bytes_(DescriptorLength) const UCHAR* Descriptor,
+    IN  ULONG           DescriptorLength
+)
+/*++
+RoutineDescription:
+   64 bit FNV-1a. Only ever compared against a hash this function produced
+   for the same device, so it needs to be stable, not strong.
+--*/
+{
+    ULONGLONG hash = 0xcbf29ce484222325ull;
+
+    for (ULONG i = 0; i < DescriptorLength; i++)
+    {
+        hash ^= Descriptor[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
+bool RestoreHidDeviceLayout(
+    IN OUT PHID_DEVICE  HidDevice,
+    OUT    bool*        Restored
+)
+{
+    std::lock_guard<std::mutex> lock(cacheLock);
+    PHID_CACHE_ENTRY            entry = nullptr;
+    ULONGLONG                   usageLength = 0;
+
+    *Restored = false;
+
+    if (!cacheOpen || IsSimulatedDevice(HidDevice))
+    {
+        return true;
+    }
+
+    for (HID_CACHE_ENTRY& candidate : cacheEntries)
+    {
+        if (MatchEntry(candidate, HidDevice))
+        {
+            entry = &candidate;
+            break;
+        }
+    }
+
+    if (entry == nullptr)
+    {
+        return true;
+    }
+
+    try
+    {
+        if (!MatchInputCaps(*entry, HidDevice))
+        {
+            return true;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        *Restored = true;
+        return false;
+    }
+
+    for (const HID_DATA& data : entry->Data)
+    {
+        if (data.IsButtonData)
+        {
+            usageLength += data.ButtonData.MaxUsageLength;
+        }
+    }
+
+    //
+    // The whole input arena in one go, as FillDeviceInfo would lay it out.
+    // Usage buffers were stripped when the entry was stored and are carved
+    // out of the arena afresh.
+    //
+    if (usageLength > 0xFFFFFFFF ||
+        !AllocateHidReportState(HidDevice, HidP_Input, (ULONG)entry->Data.size(), (ULONG)usageLength))
+    {
+        *Restored = true;
+        return false;
+    }
+
+    std::copy(entry->ButtonCaps.begin(), entry->ButtonCaps.end(), HidDevice->InputButtonCaps);
+    std::copy(entry->ValueCaps.begin(), entry->ValueCaps.end(), HidDevice->InputValueCaps);
+    std::copy(entry->Data.begin(), entry->Data.end(), HidDevice->InputData);
+    AssignHidUsageBuffers(HidDevice, HidP_Input);
+
+    //
+    // InputData was stored already grouped by report ID, so indexing it
+    // again leaves it as it is. A decoder image that does not fit the
+    // device is compiled again instead.
+    //
+    BuildInputReportIndex(HidDevice);
+
+    if (!entry->Decoder.empty())
+    {
+        HidDevice->InputDecoder = LoadReportDecoder(entry->Decoder.data(),
+                                                    (ULONG)entry->Decoder.size(),
+                                                    HidDevice->Caps.InputReportByteLength,
+                                                    HidDevice->InputData,
+                                                    HidDevice->InputDataLength);
+        if (HidDevice->InputDecoder == nullptr)
+        {
+            CompileInputDecoder(HidDevice);
+        }
+    }
+
+    entry->Used = true;
+    *Restored = true;
+    return true;
+}
+
+void StoreHidDeviceLayout(
+    IN  PHID_DEVICE     HidDevice
+)
+/*++
+RoutineDescription:
+   Remember the layout FillDeviceInfo just derived, replacing whatever was
+   cached for the same path and dropping the same device cached under a
+   path nothing has used this run. Nothing is stored when out of memory;
+   the device is derived again next time.
+--*/
+{
+    std::lock_guard<std::mutex> lock(cacheLock);
+    HID_CACHE_ENTRY             entry = {};
+
+    if (!cacheOpen || IsSimulatedDevice(HidDevice))
+    {
+        return;
+    }
+
+    try
+    {
+        entry.Path = HidDevice->DevicePath;
+        entry.Record.PathLength = (ULONG)entry.Path.size();
+        entry.Record.DescriptorHash = HidDevice->DescriptorHash;
+        entry.Record.Attributes = HidDevice->Attributes;
+        entry.Record.Caps = HidDevice->Caps;
+
+        entry.ButtonCaps.assign(HidDevice->InputButtonCaps, HidDevice->InputButtonCaps + HidDevice->Caps.NumberInputButtonCaps);
+        entry.ValueCaps.assign(HidDevice->InputValueCaps, HidDevice->InputValueCaps + HidDevice->Caps.NumberInputValueCaps);
+        entry.Data.assign(HidDevice->InputData, HidDevice->InputData + HidDevice->InputDataLength);
+        entry.Record.DataLength = HidDevice->InputDataLength;
+
+        for (HID_DATA& data : entry.Data)
+        {
+            if (data.IsButtonData)
+            {
+                data.ButtonData.Usages = nullptr;
+            }
+        }
+
+        if (HidDevice->InputDecoder != nullptr)
+        {
+            ULONG imageLength = 0;
+
+            SaveReportDecoder(HidDevice->InputDecoder, nullptr, &imageLength);
+            entry.Decoder.resize(imageLength);
+            SaveReportDecoder(HidDevice->InputDecoder, entry.Decoder.data(), &imageLength);
+            entry.Record.DecoderLength = imageLength;
+        }
+
+        entry.Used = true;
+
+        cacheEntries.erase(std::remove_if(cacheEntries.begin(), cacheEntries.end(),
+                                          [&](const HID_CACHE_ENTRY& cached)
+                                          {
+                                              return cached.Path == entry.Path ||
+                                                     (!cached.Used && SameDevice(cached, HidDevice));
+                                          }),
+                           cacheEntries.end());
+        cacheEntries.push_back(std::move(entry));
+        cacheDirty = true;
+    }
+    catch (const std::bad_alloc&)
+    {
+        return;
+    }
+}
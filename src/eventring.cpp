@@ -0,0 +1,167 @@
+/*++
+
+Module Name:
+
+    eventring.cpp
+
+Abstract:
+
+    A single producer, single consumer ring of macro events. Head and Tail
+    count every event ever popped and pushed and are each written by one
+    side only, on cache lines of their own so the two threads do not keep
+    stealing one line from each other; the slot an index names is the
+    index modulo the power of two ring size, and the depth is simply
+    Tail - Head, which unsigned wrap-around keeps right.
+
+    The consumer announces it is about to sleep by setting Sleeping and
+    then looks at Tail once more; the producer publishes Tail and then
+    looks at Sleeping. Both are sequentially consistent, so at least one
+    of them sees the other's store: either the consumer finds the event,
+    or the producer rings the doorbell. A producer that finds the consumer
+    busy pays nothing beyond that load.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <atomic>
+#include <new>
+#include "eventring.h"
+
+#define MACRO_EVENT_RING_MASK   (MACRO_EVENT_RING_SIZE - 1)
+
+static_assert((MACRO_EVENT_RING_SIZE & MACRO_EVENT_RING_MASK) == 0, "MACRO_EVENT_RING_SIZE must be a power of two");
+
+struct _MACRO_EVENT_RING
+{
+    alignas(64) std::atomic<ULONG>      Head;           // Consumer's
+    alignas(64) std::atomic<ULONG>      Tail;           // Producer's, as are the stats
+    std::atomic<ULONGLONG>              Pushed;
+    std::atomic<ULONG>                  MaxDepth;
+    alignas(64) std::atomic<bool>       Sleeping;       // Consumer is in, or about to be in, Doorbell.wait
+    std::atomic<bool>                   Closed;
+    std::atomic<ULONG>                  Doorbell;       // Bumped to wake the consumer
+    MACRO_EVENT                         Events[MACRO_EVENT_RING_SIZE];
+};
+
+PMACRO_EVENT_RING CreateMacroEventRing(
+    void
+)
+{
+    return new (std::nothrow) MACRO_EVENT_RING();
+}
+
+void DestroyMacroEventRing(
+    IN  PMACRO_EVENT_RING       Ring
+)
+{
+    delete Ring;
+}
+
+static void RingDoorbell(
+    PMACRO_EVENT_RING   Ring
+)
+{
+    Ring->Doorbell.fetch_add(1, std::memory_order_release);
+    Ring->Doorbell.notify_one();
+}
+
+bool PushMacroEvent(
+    IN  PMACRO_EVENT_RING       Ring,
+    IN  const MACRO_EVENT*      Event
+)
+{
+    ULONG   tail = Ring->Tail.load(std::memory_order_relaxed);
+    ULONG   depth = tail - Ring->Head.load(std::memory_order_acquire);
+
+    if (depth >= MACRO_EVENT_RING_SIZE)
+    {
+        return false;
+    }
+
+    Ring->Events[tail & MACRO_EVENT_RING_MASK] = *Event;
+    Ring->Events[tail & MACRO_EVENT_RING_MASK].PushTime = GetReportTime();
+    Ring->Tail.store(tail + 1, std::memory_order_seq_cst);
+
+    Ring->Pushed.store(Ring->Pushed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (depth + 1 > Ring->MaxDepth.load(std::memory_order_relaxed))
+    {
+        Ring->MaxDepth.store(depth + 1, std::memory_order_relaxed);
+    }
+
+    if (Ring->Sleeping.load(std::memory_order_seq_cst))
+    {
+        RingDoorbell(Ring);
+    }
+    return true;
+}
+
+void CloseMacroEventRing(
+    IN  PMACRO_EVENT_RING       Ring
+)
+{
+    Ring->Closed.store(true, std::memory_order_seq_cst);
+    RingDoorbell(Ring);
+}
+
+bool PopMacroEvent(
+    IN  PMACRO_EVENT_RING       Ring,
+    OUT PMACRO_EVENT            Event
+)
+{
+    ULONG   head = Ring->Head.load(std::memory_order_relaxed);
+
+    if (head == Ring->Tail.load(std::memory_order_acquire))
+    {
+        return false;
+    }
+
+    *Event = Ring->Events[head & MACRO_EVENT_RING_MASK];
+    Ring->Head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+bool WaitMacroEvent(
+    IN  PMACRO_EVENT_RING       Ring
+)
+/*++
+RoutineDescription:
+   Closed is read before Tail, so a ring seen closed has its last push in
+   view as well.
+--*/
+{
+    ULONG   head = Ring->Head.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        ULONG   bell = Ring->Doorbell.load(std::memory_order_acquire);
+        bool    closed;
+
+        Ring->Sleeping.store(true, std::memory_order_seq_cst);
+        closed = Ring->Closed.load(std::memory_order_seq_cst);
+
+        if (Ring->Tail.load(std::memory_order_seq_cst) != head || closed)
+        {
+            Ring->Sleeping.store(false, std::memory_order_relaxed);
+            return Ring->Tail.load(std::memory_order_acquire) != head;
+        }
+
+        Ring->Doorbell.wait(bell, std::memory_order_acquire);
+        Ring->Sleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+void GetMacroEventRingStats(
+    IN  PMACRO_EVENT_RING       Ring,
+    OUT PMACRO_EVENT_RING_STATS Stats
+)
+{
+    ULONG   head = Ring->Head.load(std::memory_order_relaxed);
+
+    Stats->Pushed = Ring->Pushed.load(std::memory_order_relaxed);
+    Stats->Depth = Ring->Tail.load(std::memory_order_relaxed) - head;
+    Stats->MaxDepth = Ring->MaxDepth.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,675 @@
+/*++
+
+Module Name:
+
+    eventserver.cpp
+
+Abstract:
+
+    The event server. PublishMacroEvent only pushes onto the server's ring
+    (see eventring.h), so the reader pays the same few stores whether no
+    client or a hundred are connected. Two threads of the server's own do
+    the rest: the listener accepts clients and the publisher pops edges,
+    numbers them and writes each record to every client.
+
+    Writes never block. On Linux the sockets are non-blocking; a record
+    that does not fit in a client's socket buffer is skipped for that
+    client, and the tail of one that only partly fitted is finished before
+    the client gets another, so the stream stays whole records. On Windows
+    each client's pipe has one overlapped write at a time; while it is
+    still pending the client is skipped. A client that has gone away is
+    found out by its next write and dropped.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <wtypes.h>
+#else
+#include <cerrno>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "eventserver.h"
+
+#ifdef _WIN32
+#define EVENT_PIPE_PREFIX       "\\\\.\\pipe\\"
+#define EVENT_PIPE_BUFFER       (64 * sizeof(MACRO_EVENT_RECORD))
+#endif
+
+typedef struct _EVENT_CLIENT
+{
+#ifdef _WIN32
+    HANDLE              Pipe;
+    OVERLAPPED          Overlapped;
+    bool                Writing;            // Overlapped is in use
+    MACRO_EVENT_RECORD  Record;             // What it is writing
+#else
+    int                 Socket;
+    ULONG               Sent;               // Bytes of Record that are out, all of them unless the socket was full
+    MACRO_EVENT_RECORD  Record;
+#endif
+} EVENT_CLIENT, * PEVENT_CLIENT;
+
+struct _EVENT_SERVER
+{
+    PMACRO_EVENT_RING           Ring;
+    std::thread                 Publisher;
+    std::thread                 Listener;
+    std::mutex                  Lock;
+    std::vector<PEVENT_CLIENT>  Clients;        // Guarded by Lock
+    EVENT_SERVER_STATS          Stats;          // Clients is guarded by Lock, Dropped is the reader's, the rest the publisher's
+#ifdef _WIN32
+    std::string                 PipeName;
+    HANDLE                      Pipe;           // The instance waiting for the next client
+    HANDLE                      StopEvent;
+#else
+    std::string                 Path;
+    int                         Socket;
+    int                         StopHandle;     // eventfd, readable once stopping
+#endif
+};
+
+typedef enum _EVENT_SEND_STATUS
+{
+    EventSent,
+    EventMissed,
+    EventClientGone
+} EVENT_SEND_STATUS;
+
+#ifdef _WIN32
+
+static HANDLE CreatePipeInstance(
+    PEVENT_SERVER   Server,
+    bool            First
+)
+/*++
+RoutineDescription:
+   The first instance claims the name, so a second server started on it
+   fails rather than sharing its clients.
+--*/
+{
+    return CreateNamedPipeA(Server->PipeName.c_str(),
+                            PIPE_ACCESS_OUTBOUND | FILE_FLAG_OVERLAPPED | (First ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                            PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                            PIPE_UNLIMITED_INSTANCES,
+                            EVENT_PIPE_BUFFER,
+                            0,
+                            0,
+                            nullptr);
+}
+
+static EVENT_SEND_STATUS SendRecord(
+    PEVENT_CLIENT               Client,
+    const MACRO_EVENT_RECORD*   Record
+)
+{
+    DWORD   written;
+
+    if (Client->Writing)
+    {
+        if (!HasOverlappedIoCompleted(&Client->Overlapped))
+        {
+            return EventMissed;
+        }
+
+        Client->Writing = false;
+
+        if (!GetOverlappedResult(Client->Pipe, &Client->Overlapped, &written, FALSE))
+        {
+            return EventClientGone;
+        }
+    }
+
+    Client->Record = *Record;
+
+    if (WriteFile(Client->Pipe, &Client->Record, sizeof(Client->Record), nullptr, &Client->Overlapped))
+    {
+        return EventSent;
+    }
+
+    if (GetLastError() != ERROR_IO_PENDING)
+    {
+        return EventClientGone;
+    }
+
+    Client->Writing = true;
+    return EventSent;
+}
+
+static void CloseClient(
+    PEVENT_CLIENT   Client
+)
+{
+    DWORD   written;
+
+    if (Client->Writing)
+    {
+        CancelIoEx(Client->Pipe, &Client->Overlapped);
+        GetOverlappedResult(Client->Pipe, &Client->Overlapped, &written, TRUE);
+    }
+
+    CloseHandle(Client->Overlapped.hEvent);
+    CloseHandle(Client->Pipe);
+    delete Client;
+}
+
+static bool AddClient(
+    PEVENT_SERVER   Server,
+    HANDLE          Pipe
+)
+{
+    PEVENT_CLIENT client = new (std::nothrow) EVENT_CLIENT();
+
+    if (client == nullptr)
+    {
+        return false;
+    }
+
+    client->Pipe = Pipe;
+    client->Overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+    if (client->Overlapped.hEvent == nullptr)
+    {
+        delete client;
+        return false;
+    }
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(Server->Lock);
+
+        Server->Clients.push_back(client);
+        Server->Stats.Clients++;
+    }
+    catch (const std::bad_alloc&)
+    {
+        CloseHandle(client->Overlapped.hEvent);
+        delete client;
+        return false;
+    }
+
+    return true;
+}
+
+static void ListenerThread(
+    PEVENT_SERVER   Server
+)
+{
+    OVERLAPPED  overlapped = {};
+    HANDLE      events[2];
+    DWORD       transferred;
+
+    overlapped.hEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+    if (overlapped.hEvent == nullptr)
+    {
+        return;
+    }
+
+    events[0] = overlapped.hEvent;
+    events[1] = Server->StopEvent;
+
+    while (Server->Pipe != INVALID_HANDLE_VALUE)
+    {
+        bool connected = ConnectNamedPipe(Server->Pipe, &overlapped) != FALSE;
+
+        if (!connected)
+        {
+            switch (GetLastError())
+            {
+            case ERROR_PIPE_CONNECTED:
+                connected = true;
+                break;
+
+            case ERROR_NO_DATA:
+                break;
+
+            case ERROR_IO_PENDING:
+                if (WaitForMultipleObjects(2, events, FALSE, INFINITE) != WAIT_OBJECT_0)
+                {
+                    CancelIoEx(Server->Pipe, &overlapped);
+                    GetOverlappedResult(Server->Pipe, &overlapped, &transferred, TRUE);
+                    CloseHandle(overlapped.hEvent);
+                    return;
+                }
+                connected = GetOverlappedResult(Server->Pipe, &overlapped, &transferred, FALSE) != FALSE;
+                break;
+
+            default:
+                CloseHandle(overlapped.hEvent);
+                return;
+            }
+        }
+
+        // A client that has gone again, or could not be taken on, leaves the instance for the next one
+        if (connected && AddClient(Server, Server->Pipe))
+        {
+            Server->Pipe = CreatePipeInstance(Server, false);
+        }
+        else
+        {
+            DisconnectNamedPipe(Server->Pipe);
+        }
+    }
+
+    CloseHandle(overlapped.hEvent);
+}
+
+#else
+
+static EVENT_SEND_STATUS SendRecord(
+    PEVENT_CLIENT               Client,
+    const MACRO_EVENT_RECORD*   Record
+)
+{
+    ssize_t sent;
+
+    // The rest of a record that only partly fitted goes before anything else
+    if (Client->Sent < sizeof(Client->Record))
+    {
+        sent = send(Client->Socket, (const char*)&Client->Record + Client->Sent,
+                    sizeof(Client->Record) - Client->Sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (sent < 0)
+        {
+            return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? EventMissed : EventClientGone;
+        }
+
+        Client->Sent += (ULONG)sent;
+
+        if (Client->Sent < sizeof(Client->Record))
+        {
+            return EventMissed;
+        }
+    }
+
+    Client->Record = *Record;
+    sent = send(Client->Socket, &Client->Record, sizeof(Client->Record), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    if (sent < 0)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? EventMissed : EventClientGone;
+    }
+
+    Client->Sent = (ULONG)sent;
+    return EventSent;
+}
+
+static void CloseClient(
+    PEVENT_CLIENT   Client
+)
+{
+    close(Client->Socket);
+    delete Client;
+}
+
+static bool AddClient(
+    PEVENT_SERVER   Server,
+    int             Socket
+)
+{
+    PEVENT_CLIENT client = new (std::nothrow) EVENT_CLIENT();
+
+    if (client == nullptr)
+    {
+        return false;
+    }
+
+    client->Socket = Socket;
+    client->Sent = sizeof(client->Record);
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(Server->Lock);
+
+        Server->Clients.push_back(client);
+        Server->Stats.Clients++;
+    }
+    catch (const std::bad_alloc&)
+    {
+        delete client;
+        return false;
+    }
+
+    return true;
+}
+
+static void ListenerThread(
+    PEVENT_SERVER   Server
+)
+{
+    struct pollfd   fds[2] = {};
+
+    fds[0].fd = Server->Socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = Server->StopHandle;
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+
+        if (fds[1].revents != 0)
+        {
+            return;
+        }
+
+        int client = accept4(Server->Socket, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+        if (client >= 0)
+        {
+            // Clients only read, anything they send is of no interest
+            shutdown(client, SHUT_RD);
+
+            if (!AddClient(Server, client))
+            {
+                close(client);
+            }
+        }
+    }
+}
+
+static bool BindPrivate(
+    int                         Socket,
+    const struct sockaddr_un*   Address
+)
+/*++
+RoutineDescription:
+   The socket file is created without group or other permissions, so
+   nobody else can connect even before listen. The umask is the process's,
+   so main starts the server before any thread that could create a file
+   meanwhile, the latency report thread included.
+--*/
+{
+    mode_t  mask = umask(S_IRWXG | S_IRWXO);
+    bool    bound = bind(Socket, (const struct sockaddr*)Address, sizeof(*Address)) == 0;
+    int     error = errno;
+
+    umask(mask);
+    errno = error;
+    return bound;
+}
+
+static bool Listen(
+    PEVENT_SERVER   Server,
+    LPCSTR          Path
+)
+/*++
+RoutineDescription:
+   A socket file left behind by a server that did not get to remove it is
+   replaced; one a running server still answers on is not, and neither is
+   anything at the path that is not a socket. Only the user running the
+   monitor may connect.
+--*/
+{
+    struct sockaddr_un  address = {};
+
+    if (strlen(Path) >= sizeof(address.sun_path))
+    {
+        return false;
+    }
+
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, Path);
+
+    Server->Socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    if (Server->Socket < 0)
+    {
+        return false;
+    }
+
+    if (!BindPrivate(Server->Socket, &address))
+    {
+        struct stat status;
+        int probe;
+        bool stale;
+
+        if (errno != EADDRINUSE || lstat(Path, &status) != 0 || !S_ISSOCK(status.st_mode) ||
+            (probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        {
+            return false;
+        }
+
+        stale = connect(probe, (struct sockaddr*)&address, sizeof(address)) != 0 && errno == ECONNREFUSED;
+        close(probe);
+
+        if (!stale || unlink(Path) != 0 || !BindPrivate(Server->Socket, &address))
+        {
+            return false;
+        }
+    }
+
+    Server->Path = Path;
+
+    return listen(Server->Socket, SOMAXCONN) == 0;
+}
+
+#endif
+
+static void PublisherThread(
+    PEVENT_SERVER   Server
+)
+{
+    MACRO_EVENT         event;
+    MACRO_EVENT_RECORD  record = {};
+
+    while (WaitMacroEvent(Server->Ring))
+    {
+        while (PopMacroEvent(Server->Ring, &event))
+        {
+            record.Timestamp = event.ReportTime;
+            record.Sequence = (ULONG)Server->Stats.Records;
+            record.VendorID = event.VendorID;
+            record.ProductID = event.ProductID;
+            record.Device = event.Device;
+            record.Usage = event.MacroKey;
+            record.Edge = event.Down ? MACRO_EDGE_DOWN : MACRO_EDGE_UP;
+
+            std::lock_guard<std::mutex> lock(Server->Lock);
+
+            for (size_t i = 0; i < Server->Clients.size(); )
+            {
+                switch (SendRecord(Server->Clients[i], &record))
+                {
+                case EventMissed:
+                    Server->Stats.Missed++;
+                    [[fallthrough]];
+
+                case EventSent:
+                    i++;
+                    break;
+
+                case EventClientGone:
+                    CloseClient(Server->Clients[i]);
+                    Server->Clients.erase(Server->Clients.begin() + i);
+                    break;
+                }
+            }
+
+            Server->Stats.Records++;
+        }
+    }
+}
+
+static void DestroyServer(
+    PEVENT_SERVER   Server
+)
+{
+    for (PEVENT_CLIENT client : Server->Clients)
+    {
+        CloseClient(client);
+    }
+
+#ifdef _WIN32
+    if (Server->Pipe != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(Server->Pipe);
+    }
+    if (Server->StopEvent != nullptr)
+    {
+        CloseHandle(Server->StopEvent);
+    }
+#else
+    if (Server->Socket >= 0)
+    {
+        close(Server->Socket);
+
+        if (!Server->Path.empty())
+        {
+            unlink(Server->Path.c_str());
+        }
+    }
+    if (Server->StopHandle >= 0)
+    {
+        close(Server->StopHandle);
+    }
+#endif
+
+    if (Server->Ring != nullptr)
+    {
+        DestroyMacroEventRing(Server->Ring);
+    }
+
+    delete Server;
+}
+
+PEVENT_SERVER StartEventServer(
+    IN  LPCSTR                  Endpoint
+)
+{
+    PEVENT_SERVER server = new (std::nothrow) EVENT_SERVER();
+
+    if (server == nullptr)
+    {
+        return nullptr;
+    }
+
+#ifdef _WIN32
+    server->Pipe = INVALID_HANDLE_VALUE;
+#else
+    server->Socket = -1;
+    server->StopHandle = -1;
+#endif
+
+    try
+    {
+#ifdef _WIN32
+        server->PipeName = (strncmp(Endpoint, EVENT_PIPE_PREFIX, strlen(EVENT_PIPE_PREFIX)) == 0) ? "" : EVENT_PIPE_PREFIX;
+        server->PipeName += Endpoint;
+        server->StopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        server->Pipe = CreatePipeInstance(server, true);
+
+        if (server->StopEvent == nullptr || server->Pipe == INVALID_HANDLE_VALUE)
+        {
+            DestroyServer(server);
+            return nullptr;
+        }
+#else
+        server->StopHandle = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+        if (server->StopHandle < 0 || !Listen(server, Endpoint))
+        {
+            DestroyServer(server);
+            return nullptr;
+        }
+#endif
+
+        server->Ring = CreateMacroEventRing();
+
+        if (server->Ring == nullptr)
+        {
+            DestroyServer(server);
+            return nullptr;
+        }
+
+        server->Publisher = std::thread(PublisherThread, server);
+    }
+    catch (const std::exception&)
+    {
+        DestroyServer(server);
+        return nullptr;
+    }
+
+    try
+    {
+        server->Listener = std::thread(ListenerThread, server);
+    }
+    catch (const std::system_error&)
+    {
+        CloseMacroEventRing(server->Ring);
+        server->Publisher.join();
+        DestroyServer(server);
+        return nullptr;
+    }
+
+    return server;
+}
+
+bool PublishMacroEvent(
+    IN  PEVENT_SERVER           Server,
+    IN  const MACRO_EVENT*      Event,
+    IN  bool                    Wait
+)
+{
+    while (!PushMacroEvent(Server->Ring, Event))
+    {
+        if (!Wait)
+        {
+            Server->Stats.Dropped++;
+            return false;
+        }
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+void StopEventServer(
+    IN  PEVENT_SERVER           Server,
+    OUT PEVENT_SERVER_STATS     Stats
+)
+{
+    if (Server == nullptr)
+    {
+        return;
+    }
+
+    // Everything published has gone out to the clients before they are let go
+    CloseMacroEventRing(Server->Ring);
+    Server->Publisher.join();
+
+#ifdef _WIN32
+    SetEvent(Server->StopEvent);
+#else
+    eventfd_write(Server->StopHandle, 1);
+#endif
+    Server->Listener.join();
+
+    if (Stats != nullptr)
+    {
+        *Stats = Server->Stats;
+    }
+
+    DestroyServer(Server);
+}
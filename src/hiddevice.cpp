@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+    hiddevice.cpp
+
+Abstract:
+
+    UniqueHidDevice and HidDeviceRegistry. The enumeration routines still
+    build plain HID_DEVICE arrays; the registry takes each device over into
+    a UniqueHidDevice, sized once for the lot, and frees the array itself,
+    so nothing it found can leak whichever devices the caller keeps.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <cstring>
+#include <new>
+#include <utility>
+#include "hiddevice.h"
+
+UniqueHidDevice::UniqueHidDevice() noexcept
+{
+    std::memset(&Device, 0, sizeof(Device));
+    Device.HidDevice = INVALID_HANDLE_VALUE;
+}
+
+UniqueHidDevice::UniqueHidDevice(const HID_DEVICE& HidDevice) noexcept
+    : Device(HidDevice)
+{
+}
+
+UniqueHidDevice::UniqueHidDevice(UniqueHidDevice&& Other) noexcept
+    : Device(Other.Release())
+{
+}
+
+UniqueHidDevice& UniqueHidDevice::operator=(UniqueHidDevice&& Other) noexcept
+{
+    if (this != &Other)
+    {
+        CloseHidDevice(&Device);
+        Device = Other.Release();
+    }
+
+    return *this;
+}
+
+UniqueHidDevice::~UniqueHidDevice()
+{
+    CloseHidDevice(&Device);
+}
+
+HID_DEVICE UniqueHidDevice::Release() noexcept
+{
+    HID_DEVICE device = Device;
+
+    std::memset(&Device, 0, sizeof(Device));
+    Device.HidDevice = INVALID_HANDLE_VALUE;
+    return device;
+}
+
+void UniqueHidDevice::Reset() noexcept
+{
+    CloseHidDevice(&Device);
+}
+
+bool HidDeviceRegistry::Enumerate(
+    IN  const HID_DEVICE_FILTER* Filter
+)
+{
+    PHID_DEVICE hidDevices = nullptr;
+    ULONG       numberDevices = 0;
+    bool        found;
+
+    Clear();
+
+    found = (Filter == nullptr) ?
+                FindKnownHidDevices(&hidDevices, &numberDevices) :
+                FindHidDevices(Filter, &hidDevices, &numberDevices);
+
+    return found && Adopt(hidDevices, numberDevices);
+}
+
+bool HidDeviceRegistry::Arrivals(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+{
+    PHID_DEVICE hidDevices = nullptr;
+    ULONG       numberDevices = 0;
+
+    Clear();
+
+    return GetHidArrivals(EventLoop, &hidDevices, &numberDevices) &&
+           Adopt(hidDevices, numberDevices);
+}
+
+UniqueHidDevice HidDeviceRegistry::Take(
+    size_t  Index
+) noexcept
+{
+    return std::move(Devices[Index]);
+}
+
+void HidDeviceRegistry::Clear() noexcept
+{
+    Devices.clear();
+}
+
+bool HidDeviceRegistry::Adopt(
+    IN  PHID_DEVICE         HidDevices,
+    IN  ULONG               NumberDevices
+)
+/*++
+RoutineDescription:
+   Take over every device of an array from the enumeration routines and
+   free the array. Everything is closed if there is no room for them.
+--*/
+{
+    try
+    {
+        Devices.reserve(NumberDevices);
+    }
+    catch (const std::bad_alloc&)
+    {
+        CloseHidDevices(HidDevices, NumberDevices);
+        delete[] HidDevices;
+        return false;
+    }
+
+    for (ULONG i = 0; i < NumberDevices; i++)
+    {
+        Devices.emplace_back(HidDevices[i]);
+    }
+
+    delete[] HidDevices;
+    return true;
+}
@@ -0,0 +1,272 @@
+/*++
+
+Module Name:
+
+    hidlist.cpp
+
+Abstract:
+
+    The --list mode. Every HID interface FindKnownHidDevices turns up is
+    written out with its IDs, top level usage, report lengths and the
+    report IDs and usage ranges of its button and value caps, so the
+    collection a new keyboard sends its macro keys on can be picked out
+    without a USB trace. Output and feature state is laid out for the
+    listing only; the probe time of each interface comes from
+    GetHidEnumerationTiming and does not include it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <cstring>
+#include <new>
+#include <vector>
+#ifdef _WIN32
+#include <wtypes.h>
+#endif
+#include "hidlist.h"
+#include "hiddevice.h"
+#include "keyboards.h"
+
+static void PrintJsonString(
+    FILE*       Stream,
+    LPCSTR      String
+)
+/*++
+RoutineDescription:
+   Write String quoted, escaping what JSON requires. Windows device paths
+   are full of backslashes.
+--*/
+{
+    fputc('"', Stream);
+
+    for (; *String != '\0'; String++)
+    {
+        UCHAR c = (UCHAR)*String;
+
+        if (c == '"' || c == '\\')
+        {
+            fprintf(Stream, "\\%c", c);
+        }
+        else if (c < 0x20)
+        {
+            fprintf(Stream, "\\u%04x", c);
+        }
+        else
+        {
+            fputc(c, Stream);
+        }
+    }
+
+    fputc('"', Stream);
+}
+
+static ULONGLONG FindProbeTime(
+    const std::vector<HID_PROBE_TIMING>&    Probes,
+    LPCSTR                                  DevicePath
+)
+/*++
+RoutineDescription:
+   The time spent probing the interface DevicePath belongs to. The hidraw
+   backend probes a node once and appends a suffix to the path of each of
+   its collections, so the longest probed path DevicePath starts with is
+   the one.
+--*/
+{
+    ULONGLONG   elapsed = 0;
+    size_t      matched = 0;
+
+    for (const HID_PROBE_TIMING& probe : Probes)
+    {
+        size_t length = strnlen(probe.DevicePath, sizeof(probe.DevicePath));
+
+        if (length > matched && std::strncmp(DevicePath, probe.DevicePath, length) == 0)
+        {
+            elapsed = probe.Elapsed;
+            matched = length;
+        }
+    }
+
+    return elapsed;
+}
+
+static void PrintReportType(
+    FILE*               Stream,
+    LPCSTR              Name,
+    USHORT              ReportLength,
+    PHIDP_BUTTON_CAPS   ButtonCaps,
+    USHORT              NumberButtonCaps,
+    PHIDP_VALUE_CAPS    ValueCaps,
+    USHORT              NumberValueCaps
+)
+{
+    bool    reportIds[256] = {};
+    LPCSTR  separator = "";
+
+    for (USHORT i = 0; i < NumberButtonCaps; i++)
+    {
+        reportIds[ButtonCaps[i].ReportID] = true;
+    }
+
+    for (USHORT i = 0; i < NumberValueCaps; i++)
+    {
+        reportIds[ValueCaps[i].ReportID] = true;
+    }
+
+    fprintf(Stream, ",\n      \"%s\": {\n        \"reportLength\": %u,\n        \"reportIds\": [", Name, ReportLength);
+
+    for (ULONG id = 0; id < 256; id++)
+    {
+        if (reportIds[id])
+        {
+            fprintf(Stream, "%s %lu", separator, (unsigned long)id);
+            separator = ",";
+        }
+    }
+
+    fprintf(Stream, " ],\n        \"buttons\": [");
+
+    for (USHORT i = 0; i < NumberButtonCaps; i++)
+    {
+        PHIDP_BUTTON_CAPS caps = &ButtonCaps[i];
+
+        fprintf(Stream, "%s\n          { \"reportId\": %u, \"usagePage\": \"0x%04x\", \"usageMin\": \"0x%04x\", \"usageMax\": \"0x%04x\" }",
+                i > 0 ? "," : "",
+                caps->ReportID,
+                caps->UsagePage,
+                caps->IsRange ? caps->Range.UsageMin : caps->NotRange.Usage,
+                caps->IsRange ? caps->Range.UsageMax : caps->NotRange.Usage);
+    }
+
+    fprintf(Stream, "%s],\n        \"values\": [", NumberButtonCaps > 0 ? "\n        " : " ");
+
+    for (USHORT i = 0; i < NumberValueCaps; i++)
+    {
+        PHIDP_VALUE_CAPS caps = &ValueCaps[i];
+
+        fprintf(Stream, "%s\n          { \"reportId\": %u, \"usagePage\": \"0x%04x\", \"usageMin\": \"0x%04x\", \"usageMax\": \"0x%04x\", "
+                        "\"bitSize\": %u, \"reportCount\": %u, \"logicalMin\": %ld, \"logicalMax\": %ld }",
+                i > 0 ? "," : "",
+                caps->ReportID,
+                caps->UsagePage,
+                caps->IsRange ? caps->Range.UsageMin : caps->NotRange.Usage,
+                caps->IsRange ? caps->Range.UsageMax : caps->NotRange.Usage,
+                caps->BitSize,
+                caps->ReportCount,
+                (long)caps->LogicalMin,
+                (long)caps->LogicalMax);
+    }
+
+    fprintf(Stream, "%s]\n      }", NumberValueCaps > 0 ? "\n        " : " ");
+}
+
+static void PrintDevice(
+    FILE*                                   Stream,
+    PHID_DEVICE                             HidDevice,
+    const std::vector<HID_PROBE_TIMING>&    Probes
+)
+{
+    LPCSTR                  path = HidDevice->DevicePath != nullptr ? HidDevice->DevicePath : "";
+    bool                    opened = HidDevice->Ppd != nullptr;
+    const KNOWN_KEYBOARD*   keyboard;
+
+    fprintf(Stream, "    {\n      \"path\": ");
+    PrintJsonString(Stream, path);
+    fprintf(Stream, ",\n      \"opened\": %s,\n      \"probeUs\": %.1f",
+            opened ? "true" : "false",
+            FindProbeTime(Probes, path) / 1000.0);
+
+    if (!opened)
+    {
+        fprintf(Stream, "\n    }");
+        return;
+    }
+
+    fprintf(Stream, ",\n      \"vendorId\": \"0x%04x\",\n      \"productId\": \"0x%04x\",\n      \"version\": \"0x%04x\","
+                    "\n      \"usagePage\": \"0x%04x\",\n      \"usage\": \"0x%04x\",\n      \"keyboard\": ",
+            HidDevice->Attributes.VendorID,
+            HidDevice->Attributes.ProductID,
+            HidDevice->Attributes.VersionNumber,
+            HidDevice->Caps.UsagePage,
+            HidDevice->Caps.Usage);
+
+    keyboard = FindKnownKeyboard(HidDevice->Attributes.VendorID, HidDevice->Attributes.ProductID);
+    if (keyboard != nullptr)
+    {
+        PrintJsonString(Stream, keyboard->Name);
+    }
+    else
+    {
+        fprintf(Stream, "null");
+    }
+
+    PrintReportType(Stream, "input", HidDevice->Caps.InputReportByteLength,
+                    HidDevice->InputButtonCaps, HidDevice->InputButtonCaps != nullptr ? HidDevice->Caps.NumberInputButtonCaps : 0,
+                    HidDevice->InputValueCaps, HidDevice->InputValueCaps != nullptr ? HidDevice->Caps.NumberInputValueCaps : 0);
+
+    //
+    // A device that cannot spare the memory is listed without them rather
+    // than not at all.
+    //
+    PrepareHidReports(HidDevice, HidP_Output);
+    PrepareHidReports(HidDevice, HidP_Feature);
+
+    PrintReportType(Stream, "output", HidDevice->Caps.OutputReportByteLength,
+                    HidDevice->OutputButtonCaps, HidDevice->OutputButtonCaps != nullptr ? HidDevice->Caps.NumberOutputButtonCaps : 0,
+                    HidDevice->OutputValueCaps, HidDevice->OutputValueCaps != nullptr ? HidDevice->Caps.NumberOutputValueCaps : 0);
+    PrintReportType(Stream, "feature", HidDevice->Caps.FeatureReportByteLength,
+                    HidDevice->FeatureButtonCaps, HidDevice->FeatureButtonCaps != nullptr ? HidDevice->Caps.NumberFeatureButtonCaps : 0,
+                    HidDevice->FeatureValueCaps, HidDevice->FeatureValueCaps != nullptr ? HidDevice->Caps.NumberFeatureValueCaps : 0);
+
+    fprintf(Stream, "\n    }");
+}
+
+bool PrintHidDeviceList(
+    IN  FILE*   Stream
+)
+/*++
+RoutineDescription:
+   Enumerate every HID interface and write the listing described in
+   hidlist.h to Stream. Fails when the enumeration does.
+--*/
+{
+    HidDeviceRegistry               registry;
+    HID_ENUMERATION_TIMING          timing = {};
+    std::vector<HID_PROBE_TIMING>   probes;
+
+    if (!registry.Enumerate(nullptr))
+    {
+        return false;
+    }
+
+    if (GetHidEnumerationTiming(&timing, nullptr, 0))
+    {
+        try
+        {
+            probes.resize(timing.NumberProbes);
+            GetHidEnumerationTiming(&timing, probes.data(), (ULONG)probes.size());
+        }
+        catch (const std::bad_alloc&)
+        {
+            probes.clear();
+        }
+    }
+
+    fprintf(Stream, "{\n  \"enumeration\": { \"elapsedUs\": %.1f, \"probeTotalUs\": %.1f, \"workers\": %lu, \"probes\": %lu },\n  \"devices\": [",
+            timing.Elapsed / 1000.0,
+            timing.ProbeTotal / 1000.0,
+            (unsigned long)timing.Workers,
+            (unsigned long)timing.NumberProbes);
+
+    for (size_t i = 0; i < registry.Size(); i++)
+    {
+        fprintf(Stream, "%s\n", i > 0 ? "," : "");
+        PrintDevice(Stream, registry[i], probes);
+    }
+
+    fprintf(Stream, "%s]\n}\n", registry.Size() > 0 ? "\n  " : " ");
+    fflush(Stream);
+    return true;
+}
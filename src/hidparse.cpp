@@ -0,0 +1,1282 @@
+/*++
+
+Module Name:
+
+    hidparse.cpp
+
+Abstract:
+
+    This module contains a report descriptor parser and the subset of the
+    HidP_XXX routines used by pnp.cpp and report.cpp for platforms that do not
+    have hid.dll. The raw report descriptor read from the device is turned
+    into the same button/value capability model Windows exposes, plus the bit
+    position of every field so reports can be unpacked directly.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifndef _WIN32
+
+#include <algorithm>
+#include <new>
+#include <vector>
+#include "hid.h"
+
+//
+// hidraw hands out reports of at most HID_MAX_BUFFER_SIZE (4096) bytes,
+// report ID included, and HIDP_CAPS keeps report lengths in a USHORT; a
+// descriptor describing longer reports is refused rather than truncated.
+//
+#define HIDP_MAX_REPORT_BYTES   4096
+
+//
+// Location of a capability's data inside a report buffer. As on Windows the
+// first byte of every report buffer holds the report ID (zero when the
+// device does not use report IDs), so offsets start at bit 8.
+//
+typedef struct _HIDP_FIELD
+{
+    ULONG       BitOffset;
+    USHORT      BitSize;
+    USHORT      ReportCount;
+    LONG        LogicalMin;     // For arrays: the index that maps to UsageMin
+    LONG        LogicalMax;
+    bool        IsArray;
+} HIDP_FIELD;
+
+struct _HIDP_PREPARSED_DATA
+{
+    HIDP_CAPS                       Caps;
+    std::vector<HIDP_BUTTON_CAPS>   ButtonCaps[3];
+    std::vector<HIDP_FIELD>         ButtonFields[3];
+    std::vector<HIDP_VALUE_CAPS>    ValueCaps[3];
+    std::vector<HIDP_FIELD>         ValueFields[3];
+};
+
+namespace
+{
+    typedef struct _USAGE_RANGE
+    {
+        USAGE       UsagePage;
+        USAGE       UsageMin;
+        USAGE       UsageMax;
+        bool        IsRange;
+    } USAGE_RANGE;
+
+    typedef struct _PARSER_GLOBALS
+    {
+        USAGE       UsagePage;
+        LONG        LogicalMin;
+        LONG        LogicalMax;
+        LONG        PhysicalMin;
+        LONG        PhysicalMax;
+        ULONG       UnitsExp;
+        ULONG       Units;
+        ULONG       ReportSize;
+        ULONG       ReportCount;
+        UCHAR       ReportID;
+    } PARSER_GLOBALS;
+
+    typedef struct _LINK_NODE
+    {
+        USAGE       LinkUsage;
+        USAGE       LinkUsagePage;
+    } LINK_NODE;
+
+    ULONG ReadBits(const UCHAR* Report, ULONG BitOffset, ULONG BitSize)
+    {
+        ULONG   value = 0;
+
+        for (ULONG bit = 0; bit < BitSize; bit++)
+        {
+            ULONG position = BitOffset + bit;
+            if (Report[position >> 3] & (1u << (position & 7)))
+            {
+                value |= (1u << bit);
+            }
+        }
+        return value;
+    }
+
+    void WriteBits(UCHAR* Report, ULONG BitOffset, ULONG BitSize, ULONG Value)
+    {
+        for (ULONG bit = 0; bit < BitSize; bit++)
+        {
+            ULONG position = BitOffset + bit;
+            if (Value & (1u << bit))
+            {
+                Report[position >> 3] |= (UCHAR)(1u << (position & 7));
+            }
+            else
+            {
+                Report[position >> 3] &= (UCHAR)~(1u << (position & 7));
+            }
+        }
+    }
+
+    //
+    // Whether BitSize bits from BitOffset lie within a report of
+    // ReportLength bytes.
+    //
+    bool BitsFit(ULONGLONG BitOffset, ULONGLONG BitSize, ULONG ReportLength)
+    {
+        return BitOffset + BitSize <= (ULONGLONG)ReportLength * 8;
+    }
+
+    LONG SignExtend(ULONG Value, ULONG BitSize)
+    {
+        if (BitSize > 0 && BitSize < 32 && (Value & (1u << (BitSize - 1))))
+        {
+            Value |= ~((1u << BitSize) - 1);
+        }
+        return (LONG)Value;
+    }
+
+    USHORT ReportByteLength(
+        IN HIDP_REPORT_TYPE     ReportType,
+        IN PHIDP_PREPARSED_DATA Ppd
+    )
+    {
+        switch (ReportType)
+        {
+            case HidP_Input:
+                return Ppd->Caps.InputReportByteLength;
+            case HidP_Output:
+                return Ppd->Caps.OutputReportByteLength;
+            default:
+                return Ppd->Caps.FeatureReportByteLength;
+        }
+    }
+
+    //
+    // Common checks for every routine that takes a report buffer.
+    //
+    NTSTATUS ValidateReport(
+        IN HIDP_REPORT_TYPE     ReportType,
+        IN PHIDP_PREPARSED_DATA Ppd,
+        IN ULONG                ReportLength
+    )
+    {
+        if (Ppd == nullptr)
+        {
+            return HIDP_STATUS_INVALID_PREPARSED_DATA;
+        }
+
+        if (ReportType != HidP_Input && ReportType != HidP_Output && ReportType != HidP_Feature)
+        {
+            return HIDP_STATUS_INVALID_REPORT_TYPE;
+        }
+
+        if (ReportLength != ReportByteLength(ReportType, Ppd) || ReportLength == 0)
+        {
+            return HIDP_STATUS_INVALID_REPORT_LENGTH;
+        }
+
+        return HIDP_STATUS_SUCCESS;
+    }
+
+    //
+    // Walks the report descriptor once. Fields belonging to the requested
+    // top level collection become capabilities; fields of every collection
+    // advance the per report ID bit counters so offsets stay correct when
+    // several collections share a report.
+    //
+    class DescriptorParser
+    {
+    public:
+        DescriptorParser(PHIDP_PREPARSED_DATA Ppd, ULONG CollectionIndex) :
+            m_Ppd(Ppd),
+            m_CollectionIndex(CollectionIndex)
+        {
+        }
+
+        bool Parse(const UCHAR* Descriptor, ULONG DescriptorLength)
+        {
+            ULONG   position = 0;
+
+            while (position < DescriptorLength)
+            {
+                UCHAR   prefix = Descriptor[position++];
+                ULONG   size = prefix & 0x03;
+                UCHAR   type = (prefix >> 2) & 0x03;
+                UCHAR   tag = (prefix >> 4) & 0x0f;
+                ULONG   data = 0;
+
+                if (prefix == 0xfe)
+                {
+                    //
+                    // Long items carry no standard meaning, skip them.
+                    //
+                    if (position + 2 > DescriptorLength)
+                    {
+                        return false;
+                    }
+                    position += 2 + Descriptor[position];
+                    continue;
+                }
+
+                if (size == 3)
+                {
+                    size = 4;
+                }
+
+                if (position + size > DescriptorLength)
+                {
+                    return false;
+                }
+
+                for (ULONG i = 0; i < size; i++)
+                {
+                    data |= (ULONG)Descriptor[position + i] << (8 * i);
+                }
+                position += size;
+
+                bool handled = true;
+                switch (type)
+                {
+                    case 0:
+                        handled = MainItem(tag, data);
+                        break;
+                    case 1:
+                        handled = GlobalItem(tag, data, size);
+                        break;
+                    case 2:
+                        LocalItem(tag, data, size);
+                        break;
+                    default:
+                        break;
+                }
+
+                if (!handled)
+                {
+                    return false;
+                }
+            }
+
+            if (m_Depth != 0 || m_CollectionIndex >= m_NumberCollections)
+            {
+                return false;
+            }
+
+            return FinishCaps();
+        }
+
+        ULONG NumberCollections() const
+        {
+            return m_NumberCollections;
+        }
+
+    private:
+        bool MainItem(UCHAR Tag, ULONG Data)
+        {
+            switch (Tag)
+            {
+                case 0x8:       // Input
+                    if (!AddField(HidP_Input, Data))
+                    {
+                        return false;
+                    }
+                    break;
+                case 0x9:       // Output
+                    if (!AddField(HidP_Output, Data))
+                    {
+                        return false;
+                    }
+                    break;
+                case 0xb:       // Feature
+                    if (!AddField(HidP_Feature, Data))
+                    {
+                        return false;
+                    }
+                    break;
+                case 0xa:       // Collection
+                    if (m_Depth == 0)
+                    {
+                        m_CurrentCollection = m_NumberCollections++;
+                        if (m_CurrentCollection == m_CollectionIndex)
+                        {
+                            USAGE_RANGE first = m_Usages.empty() ? USAGE_RANGE{} : m_Usages.front();
+                            m_Ppd->Caps.UsagePage = first.UsagePage;
+                            m_Ppd->Caps.Usage = first.UsageMin;
+                        }
+                    }
+                    if (m_CurrentCollection == m_CollectionIndex)
+                    {
+                        USAGE_RANGE first = m_Usages.empty() ? USAGE_RANGE{} : m_Usages.front();
+                        m_LinkStack.push_back((USHORT)m_LinkNodes.size());
+                        m_LinkNodes.push_back({ first.UsageMin, first.UsagePage });
+                    }
+                    m_Depth++;
+                    break;
+                case 0xc:       // End Collection
+                    if (m_Depth == 0)
+                    {
+                        return false;
+                    }
+                    if (InTarget())
+                    {
+                        m_LinkStack.pop_back();
+                    }
+                    m_Depth--;
+                    break;
+                default:
+                    break;
+            }
+
+            m_Usages.clear();
+            m_HasUsageMin = false;
+            return true;
+        }
+
+        bool GlobalItem(UCHAR Tag, ULONG Data, ULONG Size)
+        {
+            switch (Tag)
+            {
+                case 0x0:
+                    m_Globals.UsagePage = (USAGE)Data;
+                    break;
+                case 0x1:
+                    m_Globals.LogicalMin = SignExtend(Data, Size * 8);
+                    break;
+                case 0x2:
+                    m_Globals.LogicalMax = SignExtend(Data, Size * 8);
+                    //
+                    // Descriptors commonly encode an unsigned maximum in too
+                    // few bytes (0x25 0xff for 255); treat it as unsigned
+                    // when the minimum is not negative.
+                    //
+                    if (m_Globals.LogicalMax < 0 && m_Globals.LogicalMin >= 0 && Size < 4)
+                    {
+                        m_Globals.LogicalMax = (LONG)Data;
+                    }
+                    break;
+                case 0x3:
+                    m_Globals.PhysicalMin = SignExtend(Data, Size * 8);
+                    break;
+                case 0x4:
+                    m_Globals.PhysicalMax = SignExtend(Data, Size * 8);
+                    if (m_Globals.PhysicalMax < 0 && m_Globals.PhysicalMin >= 0 && Size < 4)
+                    {
+                        m_Globals.PhysicalMax = (LONG)Data;
+                    }
+                    break;
+                case 0x5:
+                    m_Globals.UnitsExp = Data;
+                    break;
+                case 0x6:
+                    m_Globals.Units = Data;
+                    break;
+                case 0x7:
+                    if (Data == 0 || Data > 32)
+                    {
+                        return false;
+                    }
+                    m_Globals.ReportSize = Data;
+                    break;
+                case 0x8:
+                    if (Data == 0 || Data > 0xff)
+                    {
+                        return false;
+                    }
+                    m_Globals.ReportID = (UCHAR)Data;
+                    m_UsesReportIds = true;
+                    break;
+                case 0x9:
+                    m_Globals.ReportCount = Data;
+                    break;
+                case 0xa:       // Push
+                    m_GlobalStack.push_back(m_Globals);
+                    break;
+                case 0xb:       // Pop
+                    if (m_GlobalStack.empty())
+                    {
+                        return false;
+                    }
+                    m_Globals = m_GlobalStack.back();
+                    m_GlobalStack.pop_back();
+                    break;
+                default:
+                    break;
+            }
+            return true;
+        }
+
+        void LocalItem(UCHAR Tag, ULONG Data, ULONG Size)
+        {
+            USAGE   page = (Size == 4) ? (USAGE)(Data >> 16) : m_Globals.UsagePage;
+            USAGE   usage = (USAGE)(Data & 0xffff);
+
+            switch (Tag)
+            {
+                case 0x0:       // Usage
+                    m_Usages.push_back({ page, usage, usage, false });
+                    break;
+                case 0x1:       // Usage Minimum
+                    m_UsageMin = { page, usage, usage, true };
+                    m_HasUsageMin = true;
+                    break;
+                case 0x2:       // Usage Maximum
+                    if (m_HasUsageMin && usage >= m_UsageMin.UsageMin)
+                    {
+                        m_UsageMin.UsageMax = usage;
+                        m_Usages.push_back(m_UsageMin);
+                    }
+                    m_HasUsageMin = false;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        bool InTarget() const
+        {
+            return m_Depth > 0 && m_CurrentCollection == m_CollectionIndex;
+        }
+
+        bool AddField(HIDP_REPORT_TYPE ReportType, ULONG Flags)
+        {
+            ULONG&      bitCounter = m_BitCounters[ReportType][m_Globals.ReportID];
+            ULONG       base = (bitCounter == 0) ? 8 : bitCounter;
+            ULONGLONG   totalBits = (ULONGLONG)m_Globals.ReportSize * m_Globals.ReportCount;
+
+            if (base + totalBits > HIDP_MAX_REPORT_BYTES * 8)
+            {
+                return false;
+            }
+
+            bitCounter = base + (ULONG)totalBits;
+
+            if (!InTarget())
+            {
+                return true;
+            }
+
+            m_ReportBits[ReportType] = std::max(m_ReportBits[ReportType], bitCounter);
+
+            //
+            // Constant fields are padding; they only take up space.
+            //
+            if ((Flags & 0x01) || m_Usages.empty() || m_Globals.ReportCount == 0)
+            {
+                return true;
+            }
+
+            bool isArray = !(Flags & 0x02);
+
+            if (isArray)
+            {
+                AddArrayField(ReportType, Flags, base);
+            }
+            else if (m_Globals.ReportSize == 1)
+            {
+                AddVariableButtons(ReportType, Flags, base);
+            }
+            else
+            {
+                AddValues(ReportType, Flags, base);
+            }
+            return true;
+        }
+
+        void InitCaps(HIDP_BUTTON_CAPS& Caps, ULONG Flags, const USAGE_RANGE& Range)
+        {
+            Caps.UsagePage = Range.UsagePage;
+            Caps.ReportID = m_Globals.ReportID;
+            Caps.BitField = (USHORT)Flags;
+            Caps.LinkCollection = m_LinkStack.empty() ? 0 : m_LinkStack.back();
+            Caps.LinkUsage = m_LinkNodes[Caps.LinkCollection].LinkUsage;
+            Caps.LinkUsagePage = m_LinkNodes[Caps.LinkCollection].LinkUsagePage;
+            Caps.IsAbsolute = !(Flags & 0x04);
+            Caps.IsRange = Range.IsRange;
+            if (Range.IsRange)
+            {
+                Caps.Range.UsageMin = Range.UsageMin;
+                Caps.Range.UsageMax = Range.UsageMax;
+            }
+            else
+            {
+                Caps.NotRange.Usage = Range.UsageMin;
+            }
+        }
+
+        void AddArrayField(HIDP_REPORT_TYPE ReportType, ULONG Flags, ULONG Base)
+        {
+            LONG    index = m_Globals.LogicalMin;
+
+            for (const USAGE_RANGE& range : m_Usages)
+            {
+                HIDP_BUTTON_CAPS    caps{};
+                HIDP_FIELD          field{};
+
+                InitCaps(caps, Flags, range);
+                caps.ReportCount = (USHORT)m_Globals.ReportCount;
+
+                field.BitOffset = Base;
+                field.BitSize = (USHORT)m_Globals.ReportSize;
+                field.ReportCount = (USHORT)m_Globals.ReportCount;
+                field.LogicalMin = index;
+                field.LogicalMax = index + (range.UsageMax - range.UsageMin);
+                field.IsArray = true;
+
+                index = field.LogicalMax + 1;
+
+                m_Ppd->ButtonCaps[ReportType].push_back(caps);
+                m_Ppd->ButtonFields[ReportType].push_back(field);
+            }
+        }
+
+        //
+        // Assigns one usage to each of the ReportCount slots of a variable
+        // main item. Surplus slots reuse the last usage as the spec requires.
+        //
+        std::vector<USAGE_RANGE> ExpandUsages() const
+        {
+            std::vector<USAGE_RANGE> slots;
+
+            for (const USAGE_RANGE& range : m_Usages)
+            {
+                for (ULONG usage = range.UsageMin;
+                     usage <= range.UsageMax && slots.size() < m_Globals.ReportCount;
+                     usage++)
+                {
+                    slots.push_back({ range.UsagePage, (USAGE)usage, (USAGE)usage, range.IsRange });
+                }
+            }
+            return slots;
+        }
+
+        void AddVariableButtons(HIDP_REPORT_TYPE ReportType, ULONG Flags, ULONG Base)
+        {
+            std::vector<USAGE_RANGE>    slots = ExpandUsages();
+            size_t                      first = 0;
+
+            //
+            // Coalesce runs of consecutive usages into one range capability.
+            //
+            while (first < slots.size())
+            {
+                size_t last = first;
+                while (last + 1 < slots.size() &&
+                       slots[last + 1].UsagePage == slots[first].UsagePage &&
+                       slots[last + 1].UsageMin == slots[last].UsageMin + 1)
+                {
+                    last++;
+                }
+
+                USAGE_RANGE         range = { slots[first].UsagePage, slots[first].UsageMin, slots[last].UsageMin, last != first };
+                HIDP_BUTTON_CAPS    caps{};
+                HIDP_FIELD          field{};
+
+                InitCaps(caps, Flags, range);
+                caps.ReportCount = (USHORT)(last - first + 1);
+
+                field.BitOffset = Base + (ULONG)first;
+                field.BitSize = 1;
+                field.ReportCount = caps.ReportCount;
+                field.LogicalMin = 0;
+                field.LogicalMax = 1;
+                field.IsArray = false;
+
+                m_Ppd->ButtonCaps[ReportType].push_back(caps);
+                m_Ppd->ButtonFields[ReportType].push_back(field);
+
+                first = last + 1;
+            }
+        }
+
+        void AddValues(HIDP_REPORT_TYPE ReportType, ULONG Flags, ULONG Base)
+        {
+            std::vector<USAGE_RANGE>    slots = ExpandUsages();
+            size_t                      first = 0;
+
+            while (first < slots.size())
+            {
+                size_t last = first;
+                while (last + 1 < slots.size() &&
+                       slots[last + 1].UsagePage == slots[first].UsagePage &&
+                       slots[last + 1].UsageMin == slots[last].UsageMin + 1)
+                {
+                    last++;
+                }
+
+                HIDP_VALUE_CAPS     caps{};
+                HIDP_FIELD          field{};
+                USHORT              count = (USHORT)(last - first + 1);
+
+                //
+                // A single usage followed by unused slots describes a value
+                // array covering the rest of the main item.
+                //
+                if (last + 1 == slots.size() && slots.size() < m_Globals.ReportCount)
+                {
+                    count = (USHORT)(m_Globals.ReportCount - first);
+                }
+
+                caps.UsagePage = slots[first].UsagePage;
+                caps.ReportID = m_Globals.ReportID;
+                caps.BitField = (USHORT)Flags;
+                caps.LinkCollection = m_LinkStack.empty() ? 0 : m_LinkStack.back();
+                caps.LinkUsage = m_LinkNodes[caps.LinkCollection].LinkUsage;
+                caps.LinkUsagePage = m_LinkNodes[caps.LinkCollection].LinkUsagePage;
+                caps.IsAbsolute = !(Flags & 0x04);
+                caps.HasNull = (Flags & 0x40) != 0;
+                caps.BitSize = (USHORT)m_Globals.ReportSize;
+                caps.ReportCount = count;
+                caps.UnitsExp = m_Globals.UnitsExp;
+                caps.Units = m_Globals.Units;
+                caps.LogicalMin = m_Globals.LogicalMin;
+                caps.LogicalMax = m_Globals.LogicalMax;
+                caps.PhysicalMin = m_Globals.PhysicalMin;
+                caps.PhysicalMax = m_Globals.PhysicalMax;
+                caps.IsRange = last != first;
+                if (caps.IsRange)
+                {
+                    caps.Range.UsageMin = slots[first].UsageMin;
+                    caps.Range.UsageMax = slots[last].UsageMin;
+                }
+                else
+                {
+                    caps.NotRange.Usage = slots[first].UsageMin;
+                }
+
+                field.BitOffset = Base + (ULONG)first * m_Globals.ReportSize;
+                field.BitSize = (USHORT)m_Globals.ReportSize;
+                field.ReportCount = count;
+                field.LogicalMin = m_Globals.LogicalMin;
+                field.LogicalMax = m_Globals.LogicalMax;
+                field.IsArray = false;
+
+                m_Ppd->ValueCaps[ReportType].push_back(caps);
+                m_Ppd->ValueFields[ReportType].push_back(field);
+
+                first = last + 1;
+            }
+        }
+
+        bool FinishCaps()
+        {
+            HIDP_CAPS&  caps = m_Ppd->Caps;
+            ULONG       dataIndex;
+
+            //
+            // Report lengths include the report ID byte, whether or not the
+            // device uses report IDs, exactly like HidP_GetCaps. AddField has
+            // kept them within HIDP_MAX_REPORT_BYTES.
+            //
+            caps.InputReportByteLength = (USHORT)((m_ReportBits[HidP_Input] + 7) / 8);
+            caps.OutputReportByteLength = (USHORT)((m_ReportBits[HidP_Output] + 7) / 8);
+            caps.FeatureReportByteLength = (USHORT)((m_ReportBits[HidP_Feature] + 7) / 8);
+            caps.NumberLinkCollectionNodes = (USHORT)m_LinkNodes.size();
+
+            caps.NumberInputButtonCaps = (USHORT)m_Ppd->ButtonCaps[HidP_Input].size();
+            caps.NumberInputValueCaps = (USHORT)m_Ppd->ValueCaps[HidP_Input].size();
+            caps.NumberOutputButtonCaps = (USHORT)m_Ppd->ButtonCaps[HidP_Output].size();
+            caps.NumberOutputValueCaps = (USHORT)m_Ppd->ValueCaps[HidP_Output].size();
+            caps.NumberFeatureButtonCaps = (USHORT)m_Ppd->ButtonCaps[HidP_Feature].size();
+            caps.NumberFeatureValueCaps = (USHORT)m_Ppd->ValueCaps[HidP_Feature].size();
+
+            //
+            // Data indices are USHORTs too, so a report type may use no more
+            // than 0xffff of them.
+            //
+            for (int type = HidP_Input; type <= HidP_Feature; type++)
+            {
+                dataIndex = 0;
+                for (HIDP_BUTTON_CAPS& button : m_Ppd->ButtonCaps[type])
+                {
+                    ULONG count = button.IsRange ? (ULONG)(button.Range.UsageMax - button.Range.UsageMin + 1) : 1;
+                    if (dataIndex + count > 0xffff)
+                    {
+                        return false;
+                    }
+                    button.Range.DataIndexMin = (USHORT)dataIndex;
+                    button.Range.DataIndexMax = (USHORT)(dataIndex + count - 1);
+                    dataIndex += count;
+                }
+                for (HIDP_VALUE_CAPS& value : m_Ppd->ValueCaps[type])
+                {
+                    ULONG count = value.IsRange ? (ULONG)(value.Range.UsageMax - value.Range.UsageMin + 1) : 1;
+                    if (dataIndex + count > 0xffff)
+                    {
+                        return false;
+                    }
+                    value.Range.DataIndexMin = (USHORT)dataIndex;
+                    value.Range.DataIndexMax = (USHORT)(dataIndex + count - 1);
+                    dataIndex += count;
+                }
+
+                switch (type)
+                {
+                    case HidP_Input:
+                        caps.NumberInputDataIndices = (USHORT)dataIndex;
+                        break;
+                    case HidP_Output:
+                        caps.NumberOutputDataIndices = (USHORT)dataIndex;
+                        break;
+                    default:
+                        caps.NumberFeatureDataIndices = (USHORT)dataIndex;
+                        break;
+                }
+            }
+            return true;
+        }
+
+        PHIDP_PREPARSED_DATA        m_Ppd;
+        ULONG                       m_CollectionIndex;
+        ULONG                       m_NumberCollections = 0;
+        ULONG                       m_CurrentCollection = 0;
+        ULONG                       m_Depth = 0;
+        bool                        m_UsesReportIds = false;
+        PARSER_GLOBALS              m_Globals{};
+        std::vector<PARSER_GLOBALS> m_GlobalStack;
+        std::vector<USAGE_RANGE>    m_Usages;
+        USAGE_RANGE                 m_UsageMin{};
+        bool                        m_HasUsageMin = false;
+        std::vector<LINK_NODE>      m_LinkNodes;
+        std::vector<USHORT>         m_LinkStack;
+        ULONG                       m_BitCounters[3][256] = {};
+        ULONG                       m_ReportBits[3] = {};
+    };
+}
+
+bool HidP_ParseReportDescriptor(
+    _In_reads_bytes_(DescriptorLength) const UCHAR* Descriptor,
+    IN  ULONG                   DescriptorLength,
+    IN  ULONG                   CollectionIndex,
+    OUT PHIDP_PREPARSED_DATA*   PreparsedData,
+    OUT PULONG                  NumberCollections
+)
+/*++
+Routine Description:
+   Parse a raw report descriptor into preparsed data describing the top
+   level collection CollectionIndex. The result is released with
+   HidD_FreePreparsedData. Fails for malformed descriptors, including ones
+   with unbalanced collections or Push/Pop items, and ones describing a
+   report longer than HIDP_MAX_REPORT_BYTES.
+--*/
+{
+    PHIDP_PREPARSED_DATA    ppd;
+
+    *PreparsedData = nullptr;
+    *NumberCollections = 0;
+
+    try
+    {
+        ppd = new _HIDP_PREPARSED_DATA();
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    DescriptorParser parser(ppd, CollectionIndex);
+
+    bool parsed = parser.Parse(Descriptor, DescriptorLength);
+
+    *NumberCollections = parser.NumberCollections();
+
+    if (!parsed)
+    {
+        delete ppd;
+        return false;
+    }
+
+    *PreparsedData = ppd;
+    return true;
+}
+
+bool HidD_FreePreparsedData(
+    IN PHIDP_PREPARSED_DATA PreparsedData
+)
+{
+    delete PreparsedData;
+    return true;
+}
+
+NTSTATUS HidP_GetCaps(
+    IN  PHIDP_PREPARSED_DATA PreparsedData,
+    OUT PHIDP_CAPS           Capabilities
+)
+{
+    if (PreparsedData == nullptr)
+    {
+        return HIDP_STATUS_INVALID_PREPARSED_DATA;
+    }
+
+    *Capabilities = PreparsedData->Caps;
+    return HIDP_STATUS_SUCCESS;
+}
+
+NTSTATUS HidP_GetButtonCaps(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    OUT    PHIDP_BUTTON_CAPS    ButtonCaps,
+    IN OUT PUSHORT              ButtonCapsLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData
+)
+{
+    if (PreparsedData == nullptr)
+    {
+        return HIDP_STATUS_INVALID_PREPARSED_DATA;
+    }
+
+    if (ReportType != HidP_Input && ReportType != HidP_Output && ReportType != HidP_Feature)
+    {
+        return HIDP_STATUS_INVALID_REPORT_TYPE;
+    }
+
+    const std::vector<HIDP_BUTTON_CAPS>& caps = PreparsedData->ButtonCaps[ReportType];
+    USHORT count = std::min<USHORT>(*ButtonCapsLength, (USHORT)caps.size());
+
+    std::copy(caps.begin(), caps.begin() + count, ButtonCaps);
+    *ButtonCapsLength = count;
+
+    return caps.empty() ? HIDP_STATUS_USAGE_NOT_FOUND : HIDP_STATUS_SUCCESS;
+}
+
+NTSTATUS HidP_GetValueCaps(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    OUT    PHIDP_VALUE_CAPS     ValueCaps,
+    IN OUT PUSHORT              ValueCapsLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData
+)
+{
+    if (PreparsedData == nullptr)
+    {
+        return HIDP_STATUS_INVALID_PREPARSED_DATA;
+    }
+
+    if (ReportType != HidP_Input && ReportType != HidP_Output && ReportType != HidP_Feature)
+    {
+        return HIDP_STATUS_INVALID_REPORT_TYPE;
+    }
+
+    const std::vector<HIDP_VALUE_CAPS>& caps = PreparsedData->ValueCaps[ReportType];
+    USHORT count = std::min<USHORT>(*ValueCapsLength, (USHORT)caps.size());
+
+    std::copy(caps.begin(), caps.begin() + count, ValueCaps);
+    *ValueCapsLength = count;
+
+    return caps.empty() ? HIDP_STATUS_USAGE_NOT_FOUND : HIDP_STATUS_SUCCESS;
+}
+
+ULONG HidP_MaxUsageListLength(
+    IN HIDP_REPORT_TYPE     ReportType,
+    IN USAGE                UsagePage,
+    IN PHIDP_PREPARSED_DATA PreparsedData
+)
+{
+    ULONG   length = 0;
+
+    if (PreparsedData == nullptr ||
+        (ReportType != HidP_Input && ReportType != HidP_Output && ReportType != HidP_Feature))
+    {
+        return 0;
+    }
+
+    for (const HIDP_BUTTON_CAPS& caps : PreparsedData->ButtonCaps[ReportType])
+    {
+        if (UsagePage == 0 || caps.UsagePage == UsagePage)
+        {
+            length += caps.ReportCount;
+        }
+    }
+    return length;
+}
+
+NTSTATUS HidP_GetUsages(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    IN     USAGE                UsagePage,
+    IN     USHORT               LinkCollection,
+    OUT    PUSAGE               UsageList,
+    IN OUT PULONG               UsageLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData,
+    IN     PCHAR                Report,
+    IN     ULONG                ReportLength
+)
+{
+    NTSTATUS        status = ValidateReport(ReportType, PreparsedData, ReportLength);
+    const UCHAR*    report = reinterpret_cast<const UCHAR*>(Report);
+    ULONG           found = 0;
+    bool            pageFound = false;
+    bool            reportFound = false;
+
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    const std::vector<HIDP_BUTTON_CAPS>&    caps = PreparsedData->ButtonCaps[ReportType];
+    const std::vector<HIDP_FIELD>&          fields = PreparsedData->ButtonFields[ReportType];
+
+    for (size_t i = 0; i < caps.size(); i++)
+    {
+        if (caps[i].UsagePage != UsagePage ||
+            (LinkCollection != 0 && caps[i].LinkCollection != LinkCollection))
+        {
+            continue;
+        }
+
+        pageFound = true;
+
+        if (caps[i].ReportID != report[0])
+        {
+            continue;
+        }
+
+        reportFound = true;
+
+        if (!BitsFit(fields[i].BitOffset, (ULONGLONG)fields[i].ReportCount * fields[i].BitSize, ReportLength))
+        {
+            return HIDP_STATUS_INVALID_REPORT_LENGTH;
+        }
+
+        USAGE usageMin = caps[i].IsRange ? caps[i].Range.UsageMin : caps[i].NotRange.Usage;
+
+        for (ULONG slot = 0; slot < fields[i].ReportCount; slot++)
+        {
+            ULONG value = ReadBits(report, fields[i].BitOffset + slot * fields[i].BitSize, fields[i].BitSize);
+            USAGE usage;
+
+            if (fields[i].IsArray)
+            {
+                if ((LONG)value < fields[i].LogicalMin || (LONG)value > fields[i].LogicalMax)
+                {
+                    continue;
+                }
+                usage = (USAGE)(usageMin + (value - fields[i].LogicalMin));
+            }
+            else
+            {
+                if (!value)
+                {
+                    continue;
+                }
+                usage = (USAGE)(usageMin + slot);
+            }
+
+            if (found < *UsageLength)
+            {
+                UsageList[found] = usage;
+            }
+            found++;
+        }
+    }
+
+    if (!pageFound)
+    {
+        return HIDP_STATUS_USAGE_NOT_FOUND;
+    }
+
+    if (!reportFound)
+    {
+        return HIDP_STATUS_INCOMPATIBLE_REPORT_ID;
+    }
+
+    if (found > *UsageLength)
+    {
+        *UsageLength = found;
+        return HIDP_STATUS_BUFFER_TOO_SMALL;
+    }
+
+    *UsageLength = found;
+    return HIDP_STATUS_SUCCESS;
+}
+
+NTSTATUS HidP_SetUsages(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    IN     USAGE                UsagePage,
+    IN     USHORT               LinkCollection,
+    IN     PUSAGE               UsageList,
+    IN OUT PULONG               UsageLength,
+    IN     PHIDP_PREPARSED_DATA PreparsedData,
+    IN OUT PCHAR                Report,
+    IN     ULONG                ReportLength
+)
+{
+    NTSTATUS    status = ValidateReport(ReportType, PreparsedData, ReportLength);
+    UCHAR*      report = reinterpret_cast<UCHAR*>(Report);
+
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    const std::vector<HIDP_BUTTON_CAPS>&    caps = PreparsedData->ButtonCaps[ReportType];
+    const std::vector<HIDP_FIELD>&          fields = PreparsedData->ButtonFields[ReportType];
+
+    for (ULONG index = 0; index < *UsageLength; index++)
+    {
+        USAGE   usage = UsageList[index];
+        bool    set = false;
+
+        //
+        // A zero usage terminates the list, the convention UnpackReport
+        // uses for HID_DATA usage buffers.
+        //
+        if (usage == 0)
+        {
+            break;
+        }
+
+        for (size_t i = 0; i < caps.size() && !set; i++)
+        {
+            USAGE usageMin = caps[i].IsRange ? caps[i].Range.UsageMin : caps[i].NotRange.Usage;
+            USAGE usageMax = caps[i].IsRange ? caps[i].Range.UsageMax : caps[i].NotRange.Usage;
+
+            if (caps[i].UsagePage != UsagePage || usage < usageMin || usage > usageMax ||
+                (LinkCollection != 0 && caps[i].LinkCollection != LinkCollection))
+            {
+                continue;
+            }
+
+            if (report[0] != 0 && report[0] != caps[i].ReportID)
+            {
+                *UsageLength = index;
+                return HIDP_STATUS_INCOMPATIBLE_REPORT_ID;
+            }
+
+            if (!BitsFit(fields[i].BitOffset, (ULONGLONG)fields[i].ReportCount * fields[i].BitSize, ReportLength))
+            {
+                *UsageLength = index;
+                return HIDP_STATUS_INVALID_REPORT_LENGTH;
+            }
+            report[0] = caps[i].ReportID;
+
+            if (!fields[i].IsArray)
+            {
+                WriteBits(report, fields[i].BitOffset + (usage - usageMin), 1, 1);
+                set = true;
+                continue;
+            }
+
+            //
+            // Array fields take the usage index in the first free slot.
+            //
+            for (ULONG slot = 0; slot < fields[i].ReportCount; slot++)
+            {
+                ULONG offset = fields[i].BitOffset + slot * fields[i].BitSize;
+                if (ReadBits(report, offset, fields[i].BitSize) == 0)
+                {
+                    WriteBits(report, offset, fields[i].BitSize, fields[i].LogicalMin + (usage - usageMin));
+                    set = true;
+                    break;
+                }
+            }
+
+            if (!set)
+            {
+                *UsageLength = index;
+                return HIDP_STATUS_BUFFER_TOO_SMALL;
+            }
+        }
+
+        if (!set)
+        {
+            *UsageLength = index;
+            return HIDP_STATUS_USAGE_NOT_FOUND;
+        }
+    }
+
+    return HIDP_STATUS_SUCCESS;
+}
+
+namespace
+{
+    NTSTATUS FindValue(
+        IN  HIDP_REPORT_TYPE        ReportType,
+        IN  USAGE                   UsagePage,
+        IN  USHORT                  LinkCollection,
+        IN  USAGE                   Usage,
+        IN  PHIDP_PREPARSED_DATA    PreparsedData,
+        IN  UCHAR                   ReportID,
+        OUT const HIDP_VALUE_CAPS** Caps,
+        OUT ULONG*                  BitOffset
+    )
+    {
+        const std::vector<HIDP_VALUE_CAPS>& caps = PreparsedData->ValueCaps[ReportType];
+        const std::vector<HIDP_FIELD>&      fields = PreparsedData->ValueFields[ReportType];
+        bool                                found = false;
+
+        for (size_t i = 0; i < caps.size(); i++)
+        {
+            USAGE usageMin = caps[i].IsRange ? caps[i].Range.UsageMin : caps[i].NotRange.Usage;
+            USAGE usageMax = caps[i].IsRange ? caps[i].Range.UsageMax : caps[i].NotRange.Usage;
+
+            if (caps[i].UsagePage != UsagePage || Usage < usageMin || Usage > usageMax ||
+                (LinkCollection != 0 && caps[i].LinkCollection != LinkCollection))
+            {
+                continue;
+            }
+
+            found = true;
+
+            if (ReportID != 0 && caps[i].ReportID != ReportID)
+            {
+                continue;
+            }
+
+            *Caps = &caps[i];
+            *BitOffset = fields[i].BitOffset + (Usage - usageMin) * fields[i].BitSize;
+            return HIDP_STATUS_SUCCESS;
+        }
+
+        return found ? HIDP_STATUS_INCOMPATIBLE_REPORT_ID : HIDP_STATUS_USAGE_NOT_FOUND;
+    }
+}
+
+NTSTATUS HidP_GetUsageValue(
+    IN  HIDP_REPORT_TYPE     ReportType,
+    IN  USAGE                UsagePage,
+    IN  USHORT               LinkCollection,
+    IN  USAGE                Usage,
+    OUT PULONG               UsageValue,
+    IN  PHIDP_PREPARSED_DATA PreparsedData,
+    IN  PCHAR                Report,
+    IN  ULONG                ReportLength
+)
+{
+    NTSTATUS                status = ValidateReport(ReportType, PreparsedData, ReportLength);
+    const UCHAR*            report = reinterpret_cast<const UCHAR*>(Report);
+    const HIDP_VALUE_CAPS*  caps;
+    ULONG                   bitOffset;
+
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    status = FindValue(ReportType, UsagePage, LinkCollection, Usage, PreparsedData, report[0], &caps, &bitOffset);
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    if (caps->ReportID != report[0])
+    {
+        return HIDP_STATUS_INCOMPATIBLE_REPORT_ID;
+    }
+
+    if (!BitsFit(bitOffset, caps->BitSize, ReportLength))
+    {
+        return HIDP_STATUS_INVALID_REPORT_LENGTH;
+    }
+
+    *UsageValue = ReadBits(report, bitOffset, caps->BitSize);
+    return HIDP_STATUS_SUCCESS;
+}
+
+NTSTATUS HidP_GetScaledUsageValue(
+    IN  HIDP_REPORT_TYPE     ReportType,
+    IN  USAGE                UsagePage,
+    IN  USHORT               LinkCollection,
+    IN  USAGE                Usage,
+    OUT PLONG                UsageValue,
+    IN  PHIDP_PREPARSED_DATA PreparsedData,
+    IN  PCHAR                Report,
+    IN  ULONG                ReportLength
+)
+{
+    NTSTATUS                status = ValidateReport(ReportType, PreparsedData, ReportLength);
+    const UCHAR*            report = reinterpret_cast<const UCHAR*>(Report);
+    const HIDP_VALUE_CAPS*  caps;
+    ULONG                   bitOffset;
+    LONG                    logical;
+    LONG                    physicalMin;
+    LONG                    physicalMax;
+
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    status = FindValue(ReportType, UsagePage, LinkCollection, Usage, PreparsedData, report[0], &caps, &bitOffset);
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    if (caps->ReportID != report[0])
+    {
+        return HIDP_STATUS_INCOMPATIBLE_REPORT_ID;
+    }
+
+    if (!BitsFit(bitOffset, caps->BitSize, ReportLength))
+    {
+        return HIDP_STATUS_INVALID_REPORT_LENGTH;
+    }
+
+    //
+    // With no physical range the physical values equal the logical values.
+    //
+    physicalMin = caps->PhysicalMin;
+    physicalMax = caps->PhysicalMax;
+    if (physicalMin == 0 && physicalMax == 0)
+    {
+        physicalMin = caps->LogicalMin;
+        physicalMax = caps->LogicalMax;
+    }
+
+    if (caps->LogicalMin >= caps->LogicalMax || physicalMin >= physicalMax)
+    {
+        return HIDP_STATUS_BAD_LOG_PHY_VALUES;
+    }
+
+    logical = ReadBits(report, bitOffset, caps->BitSize);
+    if (caps->LogicalMin < 0)
+    {
+        logical = SignExtend((ULONG)logical, caps->BitSize);
+    }
+
+    if (logical < caps->LogicalMin || logical > caps->LogicalMax)
+    {
+        *UsageValue = 0;
+        return HIDP_STATUS_NULL;
+    }
+
+    *UsageValue = (LONG)(physicalMin +
+                         ((int64_t)(logical - caps->LogicalMin) * (physicalMax - physicalMin)) /
+                         (caps->LogicalMax - caps->LogicalMin));
+    return HIDP_STATUS_SUCCESS;
+}
+
+NTSTATUS HidP_SetUsageValue(
+    IN     HIDP_REPORT_TYPE     ReportType,
+    IN     USAGE                UsagePage,
+    IN     USHORT               LinkCollection,
+    IN     USAGE                Usage,
+    IN     ULONG                UsageValue,
+    IN     PHIDP_PREPARSED_DATA PreparsedData,
+    IN OUT PCHAR                Report,
+    IN     ULONG                ReportLength
+)
+{
+    NTSTATUS                status = ValidateReport(ReportType, PreparsedData, ReportLength);
+    UCHAR*                  report = reinterpret_cast<UCHAR*>(Report);
+    const HIDP_VALUE_CAPS*  caps;
+    ULONG                   bitOffset;
+
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    status = FindValue(ReportType, UsagePage, LinkCollection, Usage, PreparsedData, report[0], &caps, &bitOffset);
+    if (status != HIDP_STATUS_SUCCESS)
+    {
+        return status;
+    }
+
+    if (!BitsFit(bitOffset, caps->BitSize, ReportLength))
+    {
+        return HIDP_STATUS_INVALID_REPORT_LENGTH;
+    }
+
+    report[0] = caps->ReportID;
+    WriteBits(report, bitOffset, caps->BitSize, UsageValue);
+    return HIDP_STATUS_SUCCESS;
+}
+
+#endif // !_WIN32
@@ -0,0 +1,1425 @@
+/*++
+
+Module Name:
+
+    hidraw.cpp
+
+Abstract:
+
+    This module contains the Linux hidraw transport: finding and opening
+    hidraw nodes, moving raw reports in and out of them and the epoll driven
+    event loop used by the monitor. Preparsed data comes from the report
+    descriptor (see hidparse.cpp) so everything above this layer is shared
+    with the Windows backend.
+
+    A node whose descriptor holds several top level collections is exposed
+    as one HID_DEVICE per collection, with a Windows style "&colNN" suffix on
+    the device path, because Windows enumerates each collection as its own
+    interface and the monitor matches on the collection's usage.
+
+    Simulated nodes (see simulate.cpp) are listed and opened here as well,
+    so they reach the monitor through the same path as real ones.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/hidraw.h>
+#include <linux/netlink.h>
+#include "hid.h"
+#include "simulate.h"
+#include "devcache.h"
+
+#define HIDRAW_CLASS_PATH       "/sys/class/hidraw"
+#define HIDRAW_DEVICE_PATH      "/dev/"
+#define COLLECTION_SUFFIX       "&col"
+
+//
+// Multicast groups of NETLINK_KOBJECT_UEVENT: the kernel's own events and
+// the ones udev sends once its rules (node permissions among them) ran.
+//
+#define UEVENT_GROUP_KERNEL     1
+#define UEVENT_GROUP_UDEV       2
+#define UEVENT_BUFFER_SIZE      8192
+
+namespace
+{
+    //
+    // Per the HID spec either every report of a device carries a report ID
+    // or none does. hidraw strips nothing but also adds nothing, so devices
+    // without report IDs need the zero ID byte inserted to match the buffer
+    // layout the HidP routines use.
+    //
+    bool UsesReportIds(
+        IN PHID_DEVICE HidDevice
+    )
+    {
+        if (HidDevice->Caps.NumberInputButtonCaps > 0)
+        {
+            return HidDevice->InputButtonCaps[0].ReportID != 0;
+        }
+
+        if (HidDevice->Caps.NumberInputValueCaps > 0)
+        {
+            return HidDevice->InputValueCaps[0].ReportID != 0;
+        }
+
+        //
+        // Only a device without input reports gets this far, and only from
+        // WriteOutputReport, after Write had PrepareHidReports lay out the
+        // output caps.
+        //
+        if (HidDevice->Caps.NumberOutputButtonCaps > 0)
+        {
+            return HidDevice->OutputButtonCaps[0].ReportID != 0;
+        }
+
+        return HidDevice->Caps.NumberOutputValueCaps > 0 && HidDevice->OutputValueCaps[0].ReportID != 0;
+    }
+
+    //
+    // Split "/dev/hidrawN&colNN" into the node path and a zero based
+    // collection index.
+    //
+    std::string SplitDevicePath(
+        IN  LPCSTR  DevicePath,
+        OUT PULONG  CollectionIndex
+    )
+    {
+        std::string path(DevicePath);
+        size_t      suffix = path.rfind(COLLECTION_SUFFIX);
+
+        *CollectionIndex = 0;
+
+        if (suffix == std::string::npos)
+        {
+            return path;
+        }
+
+        ULONG collection = std::strtoul(path.c_str() + suffix + sizeof(COLLECTION_SUFFIX) - 1, nullptr, 10);
+        *CollectionIndex = collection > 0 ? collection - 1 : 0;
+        return path.substr(0, suffix);
+    }
+
+    bool GetReportDescriptor(
+        IN  HANDLE              Handle,
+        OUT std::vector<UCHAR>& Descriptor
+    )
+    {
+        int                             descriptorSize = 0;
+        struct hidraw_report_descriptor report = {};
+
+        if (ioctl(Handle, HIDIOCGRDESCSIZE, &descriptorSize) < 0 ||
+            descriptorSize <= 0 || descriptorSize > HID_MAX_DESCRIPTOR_SIZE)
+        {
+            return false;
+        }
+
+        report.size = (__u32)descriptorSize;
+        if (ioctl(Handle, HIDIOCGRDESC, &report) < 0)
+        {
+            return false;
+        }
+
+        Descriptor.assign(report.value, report.value + report.size);
+        return true;
+    }
+
+    bool GetAttributes(
+        IN  HANDLE              Handle,
+        OUT PHIDD_ATTRIBUTES    Attributes
+    )
+    {
+        struct hidraw_devinfo info = {};
+
+        if (ioctl(Handle, HIDIOCGRAWINFO, &info) < 0)
+        {
+            return false;
+        }
+
+        std::memset(Attributes, 0, sizeof(HIDD_ATTRIBUTES));
+        Attributes->Size = sizeof(HIDD_ATTRIBUTES);
+        Attributes->VendorID = (USHORT)info.vendor;
+        Attributes->ProductID = (USHORT)info.product;
+        return true;
+    }
+
+    //
+    // Read the IDs of "/dev/hidrawN" from the HID_ID line of its parent's
+    // uevent file ("HID_ID=0003:00000D62:00001A1C"), which needs no access
+    // to the node itself.
+    //
+    bool GetSysfsIds(
+        IN  const std::string&  Node,
+        OUT PUSHORT             VendorID,
+        OUT PUSHORT             ProductID
+    )
+    {
+        std::string     uevent = std::string(HIDRAW_CLASS_PATH "/") + Node.substr(Node.rfind('/') + 1) + "/device/uevent";
+        FILE*           file = std::fopen(uevent.c_str(), "re");
+        char            line[256];
+        unsigned int    bus;
+        unsigned int    vendor;
+        unsigned int    product;
+        bool            found = false;
+
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        while (!found && std::fgets(line, sizeof(line), file) != nullptr)
+        {
+            if (std::sscanf(line, "HID_ID=%x:%x:%x", &bus, &vendor, &product) == 3)
+            {
+                *VendorID = (USHORT)vendor;
+                *ProductID = (USHORT)product;
+                found = true;
+            }
+        }
+
+        std::fclose(file);
+        return found;
+    }
+}
+
+typedef struct _NODE_PROBE
+{
+    std::vector<LPCSTR>                     Nodes;
+    const HID_DEVICE_FILTER*                Filter;
+    bool                                    ListUnopened;
+    std::vector<std::vector<HID_DEVICE>>    Devices;    // The collections of each node
+    std::atomic<bool>                       OutOfMemory;
+} NODE_PROBE, * PNODE_PROBE;
+
+static void ProbeNode(
+    IN  ULONG       Index,
+    IN  PVOID       Context
+)
+/*++
+RoutineDescription:
+   Open each top level collection of one node with query access into the
+   node's slot. Collections that cannot be opened (usually permissions) are
+   listed by path alone when ListUnopened is set and left out otherwise.
+
+   A node whose IDs do not pass Filter is dropped on what sysfs says, before
+   being opened, and collections whose usage does not pass it on their own
+   parse of the descriptor, before FillDeviceInfo runs for them.
+--*/
+{
+    PNODE_PROBE                 probe = static_cast<PNODE_PROBE>(Context);
+    const HID_DEVICE_FILTER*    filter = probe->Filter;
+    std::vector<HID_DEVICE>&    devices = probe->Devices[Index];
+
+    try
+    {
+        std::string             node = probe->Nodes[Index];
+        std::vector<UCHAR>      descriptor;
+        HIDD_ATTRIBUTES         attributes = {};
+        PHIDP_PREPARSED_DATA    ppd = nullptr;
+        ULONG                   numberCollections = 1;
+        HANDLE                  handle = INVALID_HANDLE_VALUE;
+        bool                    identified = false;
+
+        if (IsSimulatedHidNode(node.c_str()))
+        {
+            identified = GetSimulatedHidDescriptor(node.c_str(), descriptor, &attributes);
+        }
+        else
+        {
+            identified = GetSysfsIds(node, &attributes.VendorID, &attributes.ProductID);
+
+            if ((!identified || MatchHidDeviceIds(filter, attributes.VendorID, attributes.ProductID)) &&
+                (handle = open(node.c_str(), O_RDONLY | O_CLOEXEC)) != INVALID_HANDLE_VALUE)
+            {
+                identified = GetAttributes(handle, &attributes);
+                GetReportDescriptor(handle, descriptor);
+                CloseHandle(handle);
+            }
+        }
+
+        if (identified && !MatchHidDeviceIds(filter, attributes.VendorID, attributes.ProductID))
+        {
+            return;
+        }
+
+        if (!descriptor.empty() &&
+            HidP_ParseReportDescriptor(descriptor.data(), (ULONG)descriptor.size(), 0, &ppd, &numberCollections))
+        {
+            HidD_FreePreparsedData(ppd);
+        }
+
+        devices.reserve(numberCollections);
+
+        for (ULONG collection = 0; collection < numberCollections; collection++)
+        {
+            HID_DEVICE  device;
+            std::string path = node;
+            HIDP_CAPS   caps;
+            ULONG       count;
+
+            if (numberCollections > 1)
+            {
+                char suffix[16];
+                std::snprintf(suffix, sizeof(suffix), COLLECTION_SUFFIX "%02u", collection + 1);
+                path += suffix;
+            }
+
+            if (filter != nullptr && (filter->UsagePage != 0 || filter->Usage != 0 || filter->Lookup != nullptr) && !descriptor.empty())
+            {
+                if (!HidP_ParseReportDescriptor(descriptor.data(), (ULONG)descriptor.size(), collection, &ppd, &count))
+                {
+                    continue;
+                }
+
+                bool match = HidP_GetCaps(ppd, &caps) == HIDP_STATUS_SUCCESS &&
+                             MatchHidDeviceUsage(filter, attributes.VendorID, attributes.ProductID, caps.UsagePage, caps.Usage);
+
+                HidD_FreePreparsedData(ppd);
+                if (!match)
+                {
+                    continue;
+                }
+            }
+
+            if (!OpenHidDevice(path.c_str(), false, false, false, false, &device))
+            {
+                if (!probe->ListUnopened)
+                {
+                    continue;
+                }
+
+                //
+                // Save the device path so it can be still listed.
+                //
+                device.DevicePath = new char[path.size() + 1];
+                std::memcpy(device.DevicePath, path.c_str(), path.size() + 1);
+            }
+
+            // Room was reserved above, so this cannot throw and lose the device
+            devices.push_back(device);
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        probe->OutOfMemory = true;
+    }
+}
+
+static bool OpenNodeDevices(
+    const std::vector<std::string>& Nodes,
+    const HID_DEVICE_FILTER*        Filter,
+    bool                            ListUnopened,
+    PHID_DEVICE*                    HidDevices,
+    PULONG                          NumberDevices
+)
+/*++
+RoutineDescription:
+   Probe every node in Nodes and hand back the collections that were found,
+   in the order of Nodes.
+--*/
+{
+    NODE_PROBE                  probe;
+    std::vector<HID_DEVICE>     devices;
+
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
+
+    probe.Filter = Filter;
+    probe.ListUnopened = ListUnopened;
+    probe.OutOfMemory = false;
+
+    try
+    {
+        for (const std::string& node : Nodes)
+        {
+            probe.Nodes.push_back(node.c_str());
+        }
+
+        probe.Devices.resize(Nodes.size());
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    if (!RunHidProbes(probe.Nodes.data(), (ULONG)probe.Nodes.size(), ProbeNode, &probe))
+    {
+        return false;
+    }
+
+    if (!probe.OutOfMemory)
+    {
+        try
+        {
+            for (std::vector<HID_DEVICE>& node : probe.Devices)
+            {
+                devices.insert(devices.end(), node.begin(), node.end());
+                node.clear();
+            }
+
+            if (!devices.empty())
+            {
+                *HidDevices = new HID_DEVICE[devices.size()];
+                std::memcpy(*HidDevices, devices.data(), devices.size() * sizeof(HID_DEVICE));
+            }
+
+            *NumberDevices = (ULONG)devices.size();
+            return true;
+        }
+        catch (const std::bad_alloc&)
+        {
+        }
+    }
+
+    CloseHidDevices(devices.data(), (ULONG)devices.size());
+
+    for (std::vector<HID_DEVICE>& node : probe.Devices)
+    {
+        CloseHidDevices(node.data(), (ULONG)node.size());
+    }
+    return false;
+}
+
+static bool ListHidrawNodes(
+    std::vector<std::string>&   Nodes
+)
+/*++
+RoutineDescription:
+   List every hidraw node in the system, simulated ones included.
+--*/
+{
+    DIR*                        classDir = nullptr;
+    struct dirent*              entry;
+
+    try
+    {
+        classDir = opendir(HIDRAW_CLASS_PATH);
+        if (classDir != nullptr)
+        {
+            while ((entry = readdir(classDir)) != nullptr)
+            {
+                if (std::strncmp(entry->d_name, "hidraw", 6) == 0)
+                {
+                    Nodes.push_back(std::string(HIDRAW_DEVICE_PATH) + entry->d_name);
+                }
+            }
+            closedir(classDir);
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        if (classDir != nullptr)
+        {
+            closedir(classDir);
+        }
+        return false;
+    }
+
+    //
+    // A host without hidraw (a container, say) can still have simulated
+    // nodes.
+    //
+    return ListSimulatedHidNodes(Nodes) && (classDir != nullptr || !Nodes.empty());
+}
+
+bool FindKnownHidDevices(
+    OUT PHID_DEVICE*    HidDevices,     // A array of struct _HID_DEVICE
+    OUT PULONG          NumberDevices   // the length of this array.
+)
+/*++
+Routine Description:
+   Find every hidraw node in the system and open each top level collection
+   with query access. Nodes that cannot be opened (usually permissions) are
+   still listed by path, as on Windows.
+--*/
+{
+    std::vector<std::string>    nodes;
+
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
+
+    if (!ListHidrawNodes(nodes))
+    {
+        return false;
+    }
+
+    return OpenNodeDevices(nodes, nullptr, true, HidDevices, NumberDevices);
+}
+
+bool FindHidDevices(
+    IN  const HID_DEVICE_FILTER* Filter,
+    OUT PHID_DEVICE*             HidDevices,
+    OUT PULONG                   NumberDevices
+)
+{
+    std::vector<std::string>    nodes;
+
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
+
+    if (!ListHidrawNodes(nodes))
+    {
+        return false;
+    }
+
+    return OpenNodeDevices(nodes, Filter, false, HidDevices, NumberDevices);
+}
+
+bool OpenHidDevice(
+    _In_     LPCSTR         DevicePath,
+    _In_     bool           HasReadAccess,
+    _In_     bool           HasWriteAccess,
+    _In_     bool           IsOverlapped,
+    _In_     bool           IsExclusive,
+    _Out_    PHID_DEVICE    HidDevice
+)
+/*++
+RoutineDescription:
+    Open the hidraw node behind DevicePath and fill in the HID_DEVICE for the
+    addressed top level collection. Query access still needs a readable
+    descriptor, so the node is opened read-only when no access is requested.
+    hidraw has no exclusive open; IsExclusive is accepted and ignored.
+--*/
+{
+    std::vector<UCHAR>  descriptor;
+    HIDD_ATTRIBUTES     attributes;
+    ULONG               collectionIndex;
+    HANDLE              handle;
+    int                 flags = O_CLOEXEC;
+
+    (void)IsExclusive;
+
+    std::memset(HidDevice, 0, sizeof(HID_DEVICE));
+    HidDevice->HidDevice = INVALID_HANDLE_VALUE;
+
+    if (DevicePath == nullptr)
+    {
+        return false;
+    }
+
+    if (HasReadAccess && HasWriteAccess)
+    {
+        flags |= O_RDWR;
+    }
+    else if (HasWriteAccess)
+    {
+        flags |= O_WRONLY;
+    }
+    else
+    {
+        flags |= O_RDONLY;
+    }
+
+    if (IsOverlapped)
+    {
+        flags |= O_NONBLOCK;
+    }
+
+    std::string node;
+    try
+    {
+        node = SplitDevicePath(DevicePath, &collectionIndex);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    if (IsSimulatedHidNode(node.c_str()))
+    {
+        //
+        // Only a read needs the report thread behind a simulated node;
+        // query access gets no handle at all.
+        //
+        if (!GetSimulatedHidDescriptor(node.c_str(), descriptor, &attributes))
+        {
+            return false;
+        }
+
+        handle = INVALID_HANDLE_VALUE;
+
+        if (HasReadAccess &&
+            (handle = ConnectSimulatedHidNode(DevicePath, collectionIndex, IsOverlapped)) == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        handle = open(node.c_str(), flags);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            return false;
+        }
+
+        try
+        {
+            if (!GetReportDescriptor(handle, descriptor) || !GetAttributes(handle, &attributes))
+            {
+                CloseHandle(handle);
+                return false;
+            }
+        }
+        catch (const std::bad_alloc&)
+        {
+            CloseHandle(handle);
+            return false;
+        }
+    }
+
+    if (!OpenHidDeviceFromDescriptor(DevicePath,
+                                     handle,
+                                     descriptor.data(),
+                                     (ULONG)descriptor.size(),
+                                     collectionIndex,
+                                     &attributes,
+                                     HidDevice))
+    {
+        return false;
+    }
+
+    HidDevice->OpenedForRead = HasReadAccess;
+    HidDevice->OpenedForWrite = HasWriteAccess;
+    HidDevice->OpenedExclusive = IsExclusive;
+    return true;
+}
+
+bool OpenHidDeviceFromDescriptor(
+    _In_     LPCSTR         DevicePath,
+    _In_     HANDLE         Handle,
+    _In_reads_bytes_(DescriptorLength) const UCHAR* Descriptor,
+    _In_     ULONG          DescriptorLength,
+    _In_     ULONG          CollectionIndex,
+    _In_     const HIDD_ATTRIBUTES* Attributes,
+    _Out_    PHID_DEVICE    HidDevice
+)
+/*++
+RoutineDescription:
+    Build a HID_DEVICE around an already open handle and a report descriptor
+    supplied by the caller. OpenHidDevice uses this for real hidraw nodes;
+    anything else that speaks the hidraw read/write protocol (a pipe or a
+    SOCK_SEQPACKET socketpair standing in for a keyboard) can be driven
+    through the same report pipeline with it. The device takes ownership of
+    Handle, including on failure.
+
+    Handle may be INVALID_HANDLE_VALUE for a device with no transport at
+    all, such as one replayed from a capture, whose reports the caller
+    places in InputReportBuffer itself.
+--*/
+{
+    ULONG       numberCollections;
+    size_t      devicePathSize;
+    int         flags;
+
+    std::memset(HidDevice, 0, sizeof(HID_DEVICE));
+    HidDevice->HidDevice = Handle;
+
+    if (DevicePath == nullptr)
+    {
+        CloseHidDevice(HidDevice);
+        return false;
+    }
+
+    devicePathSize = strnlen(DevicePath, MAX_PATH) + 1;
+
+    try
+    {
+        HidDevice->DevicePath = new char[devicePathSize];
+    }
+    catch (const std::bad_alloc&)
+    {
+        CloseHidDevice(HidDevice);
+        return false;
+    }
+
+    std::memcpy(HidDevice->DevicePath, DevicePath, devicePathSize - 1);
+    HidDevice->DevicePath[devicePathSize - 1] = '\0';
+
+    if (Handle != INVALID_HANDLE_VALUE)
+    {
+        flags = fcntl(Handle, F_GETFL);
+        if (flags < 0)
+        {
+            CloseHidDevice(HidDevice);
+            return false;
+        }
+
+        HidDevice->OpenedForRead = (flags & O_ACCMODE) != O_WRONLY;
+        HidDevice->OpenedForWrite = (flags & O_ACCMODE) != O_RDONLY;
+        HidDevice->OpenedOverlapped = (flags & O_NONBLOCK) != 0;
+    }
+    HidDevice->Attributes = *Attributes;
+    HidDevice->DescriptorHash = HashHidDescriptor(Descriptor, DescriptorLength);
+
+    if (!HidP_ParseReportDescriptor(Descriptor, DescriptorLength, CollectionIndex, &HidDevice->Ppd, &numberCollections) ||
+        HidP_GetCaps(HidDevice->Ppd, &HidDevice->Caps) != HIDP_STATUS_SUCCESS ||
+        !FillDeviceInfo(HidDevice))
+    {
+        CloseHidDevice(HidDevice);
+        return false;
+    }
+
+    return true;
+}
+
+bool GetHidReportDescriptor(
+    IN     PHID_DEVICE  HidDevice,
+    _Out_writes_bytes_(*DescriptorLength) PUCHAR Descriptor,
+    IN OUT PULONG       DescriptorLength,
+    OUT    PULONG       CollectionIndex
+)
+/*++
+RoutineDescription:
+    Fetch the report descriptor of the hidraw node behind HidDevice and the
+    index of the device's collection within it, so that
+    OpenHidDeviceFromDescriptor can rebuild the device elsewhere. Fails for
+    devices backed by neither a hidraw node nor a simulated one, and when
+    Descriptor is too small, in which case DescriptorLength is the size
+    required.
+--*/
+{
+    std::vector<UCHAR>  descriptor;
+
+    try
+    {
+        HIDD_ATTRIBUTES attributes;
+        std::string     node = SplitDevicePath(HidDevice->DevicePath, CollectionIndex);
+
+        if (IsSimulatedHidNode(node.c_str()) ?
+                !GetSimulatedHidDescriptor(node.c_str(), descriptor, &attributes) :
+                !GetReportDescriptor(HidDevice->HidDevice, descriptor))
+        {
+            *DescriptorLength = 0;
+            return false;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        *DescriptorLength = 0;
+        return false;
+    }
+
+    if (*DescriptorLength < descriptor.size())
+    {
+        *DescriptorLength = (ULONG)descriptor.size();
+        return false;
+    }
+
+    std::memcpy(Descriptor, descriptor.data(), descriptor.size());
+    *DescriptorLength = (ULONG)descriptor.size();
+    return true;
+}
+
+static bool ReadReport(
+    PHID_DEVICE    HidDevice,
+    PCHAR          Buffer,
+    PULONG         BytesRead
+)
+/*++
+RoutineDescription:
+   Read one input report into Buffer with a single read() call.
+   Short reports are zero padded to InputReportByteLength, which is what
+   Windows delivers. On a non-blocking handle the call fails with errno set
+   to EAGAIN when no report is queued.
+--*/
+{
+    PCHAR       buffer = Buffer;
+    ULONG       length = HidDevice->Caps.InputReportByteLength;
+    ssize_t     bytesRead;
+
+    if (length == 0)
+    {
+        return false;
+    }
+
+    if (UsesReportIds(HidDevice))
+    {
+        bytesRead = read(HidDevice->HidDevice, buffer, length);
+    }
+    else
+    {
+        buffer[0] = 0;
+        bytesRead = read(HidDevice->HidDevice, buffer + 1, length - 1);
+        if (bytesRead > 0)
+        {
+            bytesRead++;
+        }
+    }
+
+    if (bytesRead <= 0)
+    {
+        //
+        // End of file means the node went away.
+        //
+        if (bytesRead == 0)
+        {
+            errno = ENODEV;
+        }
+        return false;
+    }
+
+    if ((ULONG)bytesRead < length)
+    {
+        std::memset(buffer + bytesRead, 0, length - bytesRead);
+    }
+
+    *BytesRead = length;
+    return true;
+}
+
+bool ReadInputReport(
+    PHID_DEVICE    HidDevice,
+    PULONG         BytesRead
+)
+{
+    if (!ReadReport(HidDevice, HidDevice->InputReportBuffer, BytesRead))
+    {
+        return false;
+    }
+
+    HidDevice->InputReportTime = GetReportTime();
+    return true;
+}
+
+bool WriteOutputReport(
+    PHID_DEVICE    HidDevice
+)
+/*++
+RoutineDescription:
+   Send the packed OutputReportBuffer to the device.
+--*/
+{
+    PCHAR       buffer = HidDevice->OutputReportBuffer;
+    ULONG       length = HidDevice->Caps.OutputReportByteLength;
+
+    if (length == 0 || buffer == nullptr)
+    {
+        return false;
+    }
+
+    if (!UsesReportIds(HidDevice))
+    {
+        buffer++;
+        length--;
+    }
+
+    return write(HidDevice->HidDevice, buffer, length) == (ssize_t)length;
+}
+
+bool HidD_GetFeature(
+    IN  HANDLE  HidDeviceObject,
+    OUT void*   ReportBuffer,
+    IN  ULONG   ReportBufferLength
+)
+{
+    return ioctl(HidDeviceObject, HIDIOCGFEATURE(ReportBufferLength), ReportBuffer) >= 0;
+}
+
+bool HidD_SetFeature(
+    IN  HANDLE  HidDeviceObject,
+    IN  void*   ReportBuffer,
+    IN  ULONG   ReportBufferLength
+)
+{
+    return ioctl(HidDeviceObject, HIDIOCSFEATURE(ReportBufferLength), ReportBuffer) >= 0;
+}
+
+//
+// Event loop. Devices are registered edge triggered. Every wait first drains
+// each readable device into its ring of QueueDepth report buffers until
+// read() reports EAGAIN or the ring is full, which moves a burst out of the
+// kernel's hidraw queue promptly, then hands out the oldest queued report.
+// epoll_wait only runs when every ring is empty and every device is idle.
+// An eventfd registered next to the devices lets StopHidEventLoop wake an
+// indefinite wait from another thread or a signal handler.
+//
+// Arrivals come in as uevents, both from the netlink socket and from a
+// socketpair SendHidUevent writes to. The kernel's event is acted on at
+// once; the node may not be accessible yet before udev has applied its
+// rules, in which case udev's own event for the node a moment later is the
+// retry.
+//
+
+typedef struct _HIDRAW_ENTRY
+{
+    PHID_DEVICE             HidDevice;
+    bool                    Readable;
+    bool                    Failed;     // read() failed, reported once the ring drains
+    int                     Error;
+    std::vector<CHAR>       Ring;       // QueueDepth reports of InputReportByteLength
+    std::vector<ULONGLONG>  Times;      // GetReportTime() of each report in Ring
+    ULONG                   Head;
+    ULONG                   Count;
+    HID_READ_STATS          Stats;
+} HIDRAW_ENTRY;
+
+struct _HID_EVENT_LOOP
+{
+    int                         EpollHandle;
+    int                         StopHandle;     // eventfd, readable once stopped
+    std::atomic<bool>           Stopped;
+    std::vector<HIDRAW_ENTRY>   Devices;
+    size_t                      NextDevice;
+    bool                        Watching;
+    int                         UeventHandle;   // Netlink socket, -1 unless watching
+    int                         LocalUevent[2]; // SendHidUevent's socketpair, read end first
+    std::vector<std::string>    Arrivals;       // Nodes announced since the last GetHidArrivals
+};
+
+//
+// Loops that SendHidUevent delivers to.
+//
+static std::mutex                   watchingLock;
+static std::vector<PHID_EVENT_LOOP> watchingLoops;
+
+PHID_EVENT_LOOP CreateHidEventLoop(
+    void
+)
+{
+    PHID_EVENT_LOOP     eventLoop = new (std::nothrow) HID_EVENT_LOOP{};
+    struct epoll_event  event = {};
+
+    if (eventLoop == nullptr)
+    {
+        return nullptr;
+    }
+
+    eventLoop->UeventHandle = -1;
+    eventLoop->LocalUevent[0] = -1;
+    eventLoop->LocalUevent[1] = -1;
+    eventLoop->EpollHandle = epoll_create1(EPOLL_CLOEXEC);
+    eventLoop->StopHandle = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    //
+    // The stop handle is level triggered and never drained, so once stopped
+    // every later wait returns at once. A null data pointer identifies it.
+    //
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+
+    if (eventLoop->EpollHandle < 0 ||
+        eventLoop->StopHandle < 0 ||
+        epoll_ctl(eventLoop->EpollHandle, EPOLL_CTL_ADD, eventLoop->StopHandle, &event) < 0)
+    {
+        DestroyHidEventLoop(eventLoop);
+        return nullptr;
+    }
+
+    return eventLoop;
+}
+
+bool AttachHidDevice(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice,
+    IN  ULONG               QueueDepth
+)
+{
+    struct epoll_event  event = {};
+
+    if (!HidDevice->OpenedForRead || !HidDevice->OpenedOverlapped || QueueDepth == 0)
+    {
+        return false;
+    }
+
+    try
+    {
+        HIDRAW_ENTRY entry = {};
+
+        entry.HidDevice = HidDevice;
+        entry.Readable = true;
+        entry.Ring.resize((size_t)QueueDepth * HidDevice->Caps.InputReportByteLength);
+        entry.Times.resize(QueueDepth);
+        entry.Stats.QueueDepth = QueueDepth;
+
+        EventLoop->Devices.push_back(std::move(entry));
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = HidDevice;
+
+    if (epoll_ctl(EventLoop->EpollHandle, EPOLL_CTL_ADD, HidDevice->HidDevice, &event) < 0)
+    {
+        EventLoop->Devices.pop_back();
+        return false;
+    }
+
+    return true;
+}
+
+void DetachHidDevice(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice
+)
+{
+    for (size_t i = 0; i < EventLoop->Devices.size(); i++)
+    {
+        if (EventLoop->Devices[i].HidDevice == HidDevice)
+        {
+            epoll_ctl(EventLoop->EpollHandle, EPOLL_CTL_DEL, HidDevice->HidDevice, nullptr);
+            EventLoop->Devices.erase(EventLoop->Devices.begin() + i);
+
+            if (EventLoop->NextDevice > i)
+            {
+                EventLoop->NextDevice--;
+            }
+            return;
+        }
+    }
+}
+
+bool GetHidReadStats(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice,
+    OUT PHID_READ_STATS     Stats
+)
+{
+    for (const HIDRAW_ENTRY& entry : EventLoop->Devices)
+    {
+        if (entry.HidDevice == HidDevice)
+        {
+            *Stats = entry.Stats;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void FillRing(
+    HIDRAW_ENTRY&   Entry
+)
+/*++
+RoutineDescription:
+   Read queued reports into the free part of the ring, oldest first. Stops
+   at EAGAIN, at the first hard error, or when the ring is full. Filling the
+   ring with the device still readable counts as an overflow since the rest
+   of the burst is left waiting in the kernel's queue.
+--*/
+{
+    ULONG   depth = Entry.Stats.QueueDepth;
+    ULONG   length = Entry.HidDevice->Caps.InputReportByteLength;
+    ULONG   queued = Entry.Count;
+    ULONG   bytesRead;
+
+    while (Entry.Readable && Entry.Count < depth)
+    {
+        ULONG index = (Entry.Head + Entry.Count) % depth;
+        PCHAR slot = Entry.Ring.data() + (size_t)index * length;
+
+        if (ReadReport(Entry.HidDevice, slot, &bytesRead))
+        {
+            Entry.Times[index] = GetReportTime();
+            Entry.Count++;
+            continue;
+        }
+
+        if (errno == EINTR)
+        {
+            continue;
+        }
+
+        Entry.Readable = false;
+
+        if (errno != EAGAIN)
+        {
+            Entry.Failed = true;
+            Entry.Error = errno;
+        }
+    }
+
+    if (Entry.Readable && Entry.Count == depth && Entry.Count > queued)
+    {
+        Entry.Stats.Overflows++;
+    }
+}
+
+static bool ParseUevent(
+    const CHAR*     Uevent,
+    size_t          Length,
+    std::string&    Node
+)
+/*++
+RoutineDescription:
+   Pick the node out of a hidraw "add" uevent. Kernel events start with an
+   "action@devpath" line, udev's with a header giving the offset of the
+   properties; either way the properties are NUL separated KEY=value
+   strings. DEVNAME is relative to /dev for real nodes.
+--*/
+{
+    typedef struct _UDEV_MONITOR_HEADER
+    {
+        CHAR        Prefix[8];          // "libudev"
+        ULONG       Magic;
+        ULONG       HeaderSize;
+        ULONG       PropertiesOffset;
+        ULONG       PropertiesLength;
+    } UDEV_MONITOR_HEADER;
+
+    size_t      offset;
+    bool        added = false;
+    bool        hidraw = false;
+    std::string name;
+
+    if (Length >= sizeof(UDEV_MONITOR_HEADER) && std::memcmp(Uevent, "libudev", 8) == 0)
+    {
+        UDEV_MONITOR_HEADER header;
+
+        std::memcpy(&header, Uevent, sizeof(header));
+        offset = header.PropertiesOffset;
+        Length = std::min<size_t>(Length, (size_t)header.PropertiesOffset + header.PropertiesLength);
+    }
+    else
+    {
+        offset = strnlen(Uevent, Length) + 1;
+    }
+
+    while (offset < Length)
+    {
+        const CHAR* property = Uevent + offset;
+        size_t      propertyLength = strnlen(property, Length - offset);
+
+        if (propertyLength == 10 && std::memcmp(property, "ACTION=add", 10) == 0)
+        {
+            added = true;
+        }
+        else if (propertyLength == 16 && std::memcmp(property, "SUBSYSTEM=hidraw", 16) == 0)
+        {
+            hidraw = true;
+        }
+        else if (propertyLength > 8 && std::memcmp(property, "DEVNAME=", 8) == 0)
+        {
+            name.assign(property + 8, propertyLength - 8);
+        }
+
+        offset += propertyLength + 1;
+    }
+
+    if (!added || !hidraw || name.empty())
+    {
+        return false;
+    }
+
+    if (IsSimulatedHidNode(name.c_str()) || name.compare(0, sizeof(HIDRAW_DEVICE_PATH) - 1, HIDRAW_DEVICE_PATH) == 0)
+    {
+        Node = name;
+    }
+    else
+    {
+        Node = HIDRAW_DEVICE_PATH + name;
+    }
+
+    // Nothing below /dev is opened because of a uevent
+    return Node.find('/', sizeof(HIDRAW_DEVICE_PATH) - 1) == std::string::npos;
+}
+
+static void ReadUevents(
+    PHID_EVENT_LOOP EventLoop,
+    int             Handle
+)
+/*++
+RoutineDescription:
+   Drain the uevents queued on Handle and note the hidraw nodes that were
+   added.
+--*/
+{
+    std::vector<CHAR>   buffer(UEVENT_BUFFER_SIZE);
+    std::string         node;
+    ssize_t             length;
+
+    while ((length = recv(Handle, buffer.data(), buffer.size(), MSG_DONTWAIT)) > 0 || (length < 0 && errno == EINTR))
+    {
+        if (length > 0 &&
+            ParseUevent(buffer.data(), (size_t)length, node) &&
+            std::find(EventLoop->Arrivals.begin(), EventLoop->Arrivals.end(), node) == EventLoop->Arrivals.end())
+        {
+            EventLoop->Arrivals.push_back(node);
+        }
+    }
+}
+
+bool WatchHidArrivals(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+/*++
+RoutineDescription:
+   Subscribe to uevents. Without netlink (some containers) only the local
+   uevents of SendHidUevent arrive, which is still enough for simulated
+   devices, so only the socketpair is required.
+--*/
+{
+    struct sockaddr_nl  address = {};
+    struct epoll_event  event = {};
+
+    if (EventLoop->Watching)
+    {
+        return true;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, EventLoop->LocalUevent) < 0)
+    {
+        EventLoop->LocalUevent[0] = -1;
+        EventLoop->LocalUevent[1] = -1;
+        return false;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &EventLoop->LocalUevent;
+
+    if (epoll_ctl(EventLoop->EpollHandle, EPOLL_CTL_ADD, EventLoop->LocalUevent[0], &event) < 0)
+    {
+        return false;
+    }
+
+    address.nl_family = AF_NETLINK;
+    address.nl_groups = UEVENT_GROUP_KERNEL | UEVENT_GROUP_UDEV;
+
+    EventLoop->UeventHandle = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    event.data.ptr = &EventLoop->UeventHandle;
+
+    if (EventLoop->UeventHandle >= 0 &&
+        (bind(EventLoop->UeventHandle, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+         epoll_ctl(EventLoop->EpollHandle, EPOLL_CTL_ADD, EventLoop->UeventHandle, &event) < 0))
+    {
+        CloseHandle(EventLoop->UeventHandle);
+        EventLoop->UeventHandle = -1;
+    }
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(watchingLock);
+
+        watchingLoops.push_back(EventLoop);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    EventLoop->Watching = true;
+    return true;
+}
+
+bool GetHidArrivals(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    OUT PHID_DEVICE*        HidDevices,
+    OUT PULONG              NumberDevices
+)
+{
+    std::vector<std::string> arrivals;
+
+    arrivals.swap(EventLoop->Arrivals);
+    return OpenNodeDevices(arrivals, nullptr, false, HidDevices, NumberDevices);
+}
+
+bool SendHidUevent(
+    _In_reads_bytes_(Length) const CHAR* Uevent,
+    IN  ULONG               Length
+)
+{
+    std::lock_guard<std::mutex> lock(watchingLock);
+    bool                        sent = true;
+
+    for (PHID_EVENT_LOOP eventLoop : watchingLoops)
+    {
+        sent = send(eventLoop->LocalUevent[1], Uevent, Length, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)Length && sent;
+    }
+    return sent;
+}
+
+HID_WAIT_STATUS WaitForHidReport(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  ULONG               Timeout,
+    OUT PHID_DEVICE*        HidDevice,
+    OUT PULONG              BytesRead
+)
+{
+    struct epoll_event  events[16];
+    int                 numberEvents;
+
+    *HidDevice = nullptr;
+
+    while (true)
+    {
+        if (EventLoop->Stopped)
+        {
+            return HidWaitStopped;
+        }
+
+        if (!EventLoop->Arrivals.empty())
+        {
+            return HidWaitArrival;
+        }
+
+        if (EventLoop->Devices.empty() && !EventLoop->Watching)
+        {
+            return HidWaitError;
+        }
+
+        for (HIDRAW_ENTRY& entry : EventLoop->Devices)
+        {
+            FillRing(entry);
+        }
+
+        //
+        // Serve devices round robin so one chatty device cannot starve the
+        // others; within a device reports come out in arrival order.
+        //
+        for (size_t i = 0; i < EventLoop->Devices.size(); i++)
+        {
+            size_t          index = (EventLoop->NextDevice + i) % EventLoop->Devices.size();
+            HIDRAW_ENTRY&   entry = EventLoop->Devices[index];
+            ULONG           length = entry.HidDevice->Caps.InputReportByteLength;
+
+            if (entry.Count > 0)
+            {
+                std::memcpy(entry.HidDevice->InputReportBuffer,
+                            entry.Ring.data() + (size_t)entry.Head * length,
+                            length);
+                entry.HidDevice->InputReportTime = entry.Times[entry.Head];
+
+                entry.Head = (entry.Head + 1) % entry.Stats.QueueDepth;
+                entry.Count--;
+                entry.Stats.Reports++;
+
+                EventLoop->NextDevice = index + 1;
+                *HidDevice = entry.HidDevice;
+                *BytesRead = length;
+                return HidWaitReport;
+            }
+
+            if (entry.Failed)
+            {
+                errno = entry.Error;
+                *HidDevice = entry.HidDevice;
+                return HidWaitError;
+            }
+        }
+
+        numberEvents = epoll_wait(EventLoop->EpollHandle,
+                                  events,
+                                  sizeof(events) / sizeof(events[0]),
+                                  (Timeout == INFINITE) ? -1 : (int)Timeout);
+
+        if (numberEvents < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return HidWaitError;
+        }
+
+        if (numberEvents == 0)
+        {
+            return HidWaitTimeout;
+        }
+
+        for (int i = 0; i < numberEvents; i++)
+        {
+            if (events[i].data.ptr == nullptr)
+            {
+                EventLoop->Stopped = true;
+            }
+
+            if (events[i].data.ptr == &EventLoop->UeventHandle)
+            {
+                ReadUevents(EventLoop, EventLoop->UeventHandle);
+            }
+
+            if (events[i].data.ptr == &EventLoop->LocalUevent)
+            {
+                ReadUevents(EventLoop, EventLoop->LocalUevent[0]);
+            }
+
+            for (HIDRAW_ENTRY& entry : EventLoop->Devices)
+            {
+                if (entry.HidDevice == events[i].data.ptr)
+                {
+                    entry.Readable = true;
+                }
+            }
+        }
+    }
+}
+
+void StopHidEventLoop(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+/*++
+RoutineDescription:
+   Make the current and every later WaitForHidReport return HidWaitStopped.
+   Only touches an atomic and the eventfd, so it is safe to call from any
+   thread and from a signal handler.
+--*/
+{
+    uint64_t    value = 1;
+
+    EventLoop->Stopped = true;
+
+    if (write(EventLoop->StopHandle, &value, sizeof(value)) < 0)
+    {
+        // The counter cannot overflow from a handful of stop requests
+    }
+}
+
+void DestroyHidEventLoop(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+{
+    if (EventLoop == nullptr)
+    {
+        return;
+    }
+
+    if (EventLoop->Watching)
+    {
+        std::lock_guard<std::mutex> lock(watchingLock);
+
+        watchingLoops.erase(std::find(watchingLoops.begin(), watchingLoops.end(), EventLoop));
+    }
+
+    for (int handle : { EventLoop->UeventHandle, EventLoop->LocalUevent[0], EventLoop->LocalUevent[1] })
+    {
+        if (handle >= 0)
+        {
+            CloseHandle(handle);
+        }
+    }
+
+    if (EventLoop->EpollHandle >= 0)
+    {
+        CloseHandle(EventLoop->EpollHandle);
+    }
+
+    if (EventLoop->StopHandle >= 0)
+    {
+        CloseHandle(EventLoop->StopHandle);
+    }
+    delete EventLoop;
+}
+
+#endif // __linux__
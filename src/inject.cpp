@@ -0,0 +1,422 @@
+/*++
+
+Module Name:
+
+    inject.cpp
+
+Abstract:
+
+    Key sinks. Events are translated to the platform's key codes as they
+    are queued, into an array laid out the way the flushing call takes it,
+    so a flush is the one call and nothing else: SendInput with the INPUT
+    array on Windows, write with the input_event array on Linux. A sink
+    that fills up flushes itself before taking the next event. Every call
+    holds the sink's lock, which is only ever contended while the macro
+    player is running.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <cstring>
+#include <mutex>
+#include <new>
+#ifdef _WIN32
+#include <wtypes.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+#include "inject.h"
+
+#ifndef _WIN32
+#define UINPUT_PATH             "/dev/uinput"
+#define UINPUT_DEVICE_NAME      "Alien Macros"
+#endif
+
+struct _KEY_SINK
+{
+    std::mutex      Lock;
+    ULONG           Count;          // Key events queued
+#ifdef _WIN32
+    INPUT           Events[KEY_SINK_MAX_EVENTS];
+#else
+    int             Fd;
+    bool            IsUinput;       // Destroy the uinput device on close
+    input_event     Events[KEY_SINK_MAX_EVENTS * 2];    // Every key event is followed by a SYN_REPORT
+#endif
+};
+
+static USHORT TranslateKey(
+    USAGE       Key
+)
+/*++
+RoutineDescription:
+   The platform key code for a HID keyboard page usage, 0 for a key no
+   sink sends.
+--*/
+{
+#ifdef _WIN32
+    switch (Key)
+    {
+    case 0x27: return '0';
+    case 0x28: return VK_RETURN;
+    case 0x29: return VK_ESCAPE;
+    case 0x2A: return VK_BACK;
+    case 0x2B: return VK_TAB;
+    case 0x2C: return VK_SPACE;
+    case 0xE0: return VK_LCONTROL;
+    case 0xE1: return VK_LSHIFT;
+    case 0xE2: return VK_LMENU;
+    case 0xE3: return VK_LWIN;
+    case 0xE4: return VK_RCONTROL;
+    case 0xE5: return VK_RSHIFT;
+    case 0xE6: return VK_RMENU;
+    case 0xE7: return VK_RWIN;
+    }
+
+    if (Key >= 0x04 && Key <= 0x1D)
+    {
+        return (USHORT)('A' + (Key - 0x04));
+    }
+    if (Key >= 0x1E && Key <= 0x26)
+    {
+        return (USHORT)('1' + (Key - 0x1E));
+    }
+    if (Key >= 0x3A && Key <= 0x45)
+    {
+        return (USHORT)(VK_F1 + (Key - 0x3A));
+    }
+    if (Key >= KEY_USAGE_F13 && Key <= KEY_USAGE_F13 + 11)
+    {
+        return (USHORT)(VK_F13 + (Key - KEY_USAGE_F13));
+    }
+#else
+    static const USHORT letters[26] =
+    {
+        KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I,
+        KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R,
+        KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z
+    };
+
+    switch (Key)
+    {
+    case 0x27: return KEY_0;
+    case 0x28: return KEY_ENTER;
+    case 0x29: return KEY_ESC;
+    case 0x2A: return KEY_BACKSPACE;
+    case 0x2B: return KEY_TAB;
+    case 0x2C: return KEY_SPACE;
+    case 0x44: return KEY_F11;
+    case 0x45: return KEY_F12;
+    case 0xE0: return KEY_LEFTCTRL;
+    case 0xE1: return KEY_LEFTSHIFT;
+    case 0xE2: return KEY_LEFTALT;
+    case 0xE3: return KEY_LEFTMETA;
+    case 0xE4: return KEY_RIGHTCTRL;
+    case 0xE5: return KEY_RIGHTSHIFT;
+    case 0xE6: return KEY_RIGHTALT;
+    case 0xE7: return KEY_RIGHTMETA;
+    }
+
+    if (Key >= 0x04 && Key <= 0x1D)
+    {
+        return letters[Key - 0x04];
+    }
+    if (Key >= 0x1E && Key <= 0x26)
+    {
+        return (USHORT)(KEY_1 + (Key - 0x1E));
+    }
+    if (Key >= 0x3A && Key <= 0x43)
+    {
+        return (USHORT)(KEY_F1 + (Key - 0x3A));
+    }
+    if (Key >= KEY_USAGE_F13 && Key <= KEY_USAGE_F13 + 11)
+    {
+        return (USHORT)(KEY_F13 + (Key - KEY_USAGE_F13));
+    }
+#endif
+
+    return 0;
+}
+
+bool CanInjectKey(
+    IN  USAGE       Key
+)
+{
+    return TranslateKey(Key) != 0;
+}
+
+static PKEY_SINK AllocateKeySink(
+    void
+)
+{
+    PKEY_SINK sink = new (std::nothrow) KEY_SINK();
+
+#ifndef _WIN32
+    if (sink != nullptr)
+    {
+        sink->Fd = -1;
+    }
+#endif
+
+    return sink;
+}
+
+PKEY_SINK OpenKeySink(
+    void
+)
+/*++
+RoutineDescription:
+   On Linux, create a uinput keyboard that can send every key
+   TranslateKey knows.
+--*/
+{
+    PKEY_SINK sink = AllocateKeySink();
+
+    if (sink == nullptr)
+    {
+        return nullptr;
+    }
+
+#ifndef _WIN32
+    uinput_setup setup = {};
+
+    sink->Fd = open(UINPUT_PATH, O_WRONLY | O_CLOEXEC);
+
+    if (sink->Fd < 0 ||
+        ioctl(sink->Fd, UI_SET_EVBIT, EV_KEY) < 0 ||
+        ioctl(sink->Fd, UI_SET_EVBIT, EV_SYN) < 0)
+    {
+        CloseKeySink(sink);
+        return nullptr;
+    }
+
+    for (ULONG key = 0; key < 0x100; key++)
+    {
+        USHORT code = TranslateKey((USAGE)key);
+
+        if (code != 0 && ioctl(sink->Fd, UI_SET_KEYBIT, code) < 0)
+        {
+            CloseKeySink(sink);
+            return nullptr;
+        }
+    }
+
+    setup.id.bustype = BUS_VIRTUAL;
+    std::strncpy(setup.name, UINPUT_DEVICE_NAME, sizeof(setup.name) - 1);
+
+    if (ioctl(sink->Fd, UI_DEV_SETUP, &setup) < 0 ||
+        ioctl(sink->Fd, UI_DEV_CREATE) < 0)
+    {
+        CloseKeySink(sink);
+        return nullptr;
+    }
+
+    sink->IsUinput = true;
+#endif
+
+    return sink;
+}
+
+#ifndef _WIN32
+PKEY_SINK OpenKeySinkFile(
+    IN  LPCSTR      FileName
+)
+{
+    PKEY_SINK sink = AllocateKeySink();
+
+    if (sink == nullptr)
+    {
+        return nullptr;
+    }
+
+    sink->Fd = open(FileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (sink->Fd < 0)
+    {
+        CloseKeySink(sink);
+        return nullptr;
+    }
+
+    return sink;
+}
+#endif
+
+static bool FlushEvents(
+    PKEY_SINK   Sink
+);
+
+static bool QueueEvent(
+    PKEY_SINK   Sink,
+    USAGE       Key,
+    bool        Down
+)
+{
+    USHORT code = TranslateKey(Key);
+
+    if (code == 0)
+    {
+        return false;
+    }
+
+    if (Sink->Count == KEY_SINK_MAX_EVENTS && !FlushEvents(Sink))
+    {
+        return false;
+    }
+
+#ifdef _WIN32
+    PINPUT event = &Sink->Events[Sink->Count];
+
+    std::memset(event, 0, sizeof(INPUT));
+    event->type = INPUT_KEYBOARD;
+    event->ki.wVk = code;
+    event->ki.dwFlags = Down ? 0 : KEYEVENTF_KEYUP;
+
+    //
+    // Right Ctrl, right Alt and both GUI keys are extended keys, with E0
+    // prefixed scan codes; without the flag right Ctrl and right Alt
+    // arrive as the left ones.
+    //
+    if (code == VK_RCONTROL || code == VK_RMENU || code == VK_LWIN || code == VK_RWIN)
+    {
+        event->ki.dwFlags |= KEYEVENTF_EXTENDEDKEY;
+    }
+#else
+    input_event* event = &Sink->Events[Sink->Count * 2];
+
+    std::memset(event, 0, 2 * sizeof(input_event));
+    event[0].type = EV_KEY;
+    event[0].code = code;
+    event[0].value = Down ? 1 : 0;
+    event[1].type = EV_SYN;
+    event[1].code = SYN_REPORT;
+#endif
+
+    Sink->Count++;
+    return true;
+}
+
+bool QueueKeyEvent(
+    IN  PKEY_SINK   Sink,
+    IN  USAGE       Key,
+    IN  bool        Down
+)
+{
+    std::lock_guard<std::mutex> lock(Sink->Lock);
+
+    return QueueEvent(Sink, Key, Down);
+}
+
+bool QueueKeyPress(
+    IN  PKEY_SINK   Sink,
+    IN  USAGE       Key
+)
+{
+    std::lock_guard<std::mutex> lock(Sink->Lock);
+
+    if (TranslateKey(Key) == 0)
+    {
+        return false;
+    }
+
+    if (Sink->Count + 2 > KEY_SINK_MAX_EVENTS && !FlushEvents(Sink))
+    {
+        return false;
+    }
+
+    return QueueEvent(Sink, Key, true) && QueueEvent(Sink, Key, false);
+}
+
+ULONG GetQueuedKeyEvents(
+    IN  PKEY_SINK   Sink
+)
+{
+    std::lock_guard<std::mutex> lock(Sink->Lock);
+
+    return Sink->Count;
+}
+
+static bool FlushEvents(
+    PKEY_SINK   Sink
+)
+{
+    ULONG count = Sink->Count;
+
+    Sink->Count = 0;
+
+    if (count == 0)
+    {
+        return true;
+    }
+
+#ifdef _WIN32
+    return SendInput(count, Sink->Events, sizeof(INPUT)) == count;
+#else
+    const char* events = reinterpret_cast<const char*>(Sink->Events);
+    size_t      length = count * 2 * sizeof(input_event);
+
+    //
+    // uinput takes the whole array at once; only a file can come up short.
+    //
+    while (length > 0)
+    {
+        ssize_t written = write(Sink->Fd, events, length);
+
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+
+        events += written;
+        length -= (size_t)written;
+    }
+
+    return true;
+#endif
+}
+
+bool FlushKeySink(
+    IN  PKEY_SINK   Sink
+)
+{
+    std::lock_guard<std::mutex> lock(Sink->Lock);
+
+    return FlushEvents(Sink);
+}
+
+void CloseKeySink(
+    IN  PKEY_SINK   Sink
+)
+{
+    if (Sink == nullptr)
+    {
+        return;
+    }
+
+#ifndef _WIN32
+    if (Sink->Fd >= 0)
+    {
+        FlushKeySink(Sink);
+
+        if (Sink->IsUinput)
+        {
+            ioctl(Sink->Fd, UI_DEV_DESTROY);
+        }
+        close(Sink->Fd);
+    }
+#else
+    FlushKeySink(Sink);
+#endif
+
+    delete Sink;
+}
@@ -0,0 +1,261 @@
+/*++
+
+Module Name:
+
+    keyboards.cpp
+
+Abstract:
+
+    The known keyboard table. Built-in models sit in a constexpr array
+    whose vendor and product IDs are hashed into a table at compile time
+    with a seed chosen so that no two of them share a slot; a lookup is one
+    hash, one slot and one comparison. Models added at run time go into a
+    hash map that is consulted first, so they can override a built-in one.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <unordered_map>
+#include "keyboards.h"
+
+namespace
+{
+    //
+    // Add new models here. Per the file format in keyboards.h.
+    //
+    constexpr KNOWN_KEYBOARD builtinKeyboards[] =
+    {
+        { "Alienware m17 R4", 0x0d62, 0x1a1c, 0x0c, 0x01, 0x0c, 0x4c, 0x4f, 0 },
+    };
+
+    constexpr size_t numberBuiltinKeyboards = sizeof(builtinKeyboards) / sizeof(builtinKeyboards[0]);
+
+    //
+    // Twice as many slots as models keeps a collision free seed quick to
+    // find at compile time.
+    //
+    constexpr size_t numberHashSlots = std::bit_ceil(2 * numberBuiltinKeyboards);
+
+    constexpr ULONG KeyboardKey(
+        USHORT  VendorID,
+        USHORT  ProductID
+    )
+    {
+        return ((ULONG)VendorID << 16) | ProductID;
+    }
+
+    constexpr size_t HashSlot(
+        ULONG   Key,
+        ULONG   Seed
+    )
+    {
+        ULONGLONG hash = (ULONGLONG)(Key ^ Seed) * 0x9e3779b97f4a7c15ull;
+
+        return (size_t)(hash >> 32) & (numberHashSlots - 1);
+    }
+
+    typedef struct _KEYBOARD_HASH
+    {
+        ULONG       Seed;
+        USHORT      Slots[numberHashSlots];     // Index into builtinKeyboards plus one, 0 when empty
+    } KEYBOARD_HASH;
+
+    constexpr KEYBOARD_HASH BuildKeyboardHash()
+    {
+        for (ULONG seed = 0; seed < 0x10000; seed++)
+        {
+            KEYBOARD_HASH   hash = {};
+            bool            collided = false;
+
+            hash.Seed = seed;
+
+            for (size_t i = 0; i < numberBuiltinKeyboards && !collided; i++)
+            {
+                size_t slot = HashSlot(KeyboardKey(builtinKeyboards[i].VendorID, builtinKeyboards[i].ProductID), seed);
+
+                collided = hash.Slots[slot] != 0;
+                hash.Slots[slot] = (USHORT)(i + 1);
+            }
+
+            if (!collided)
+            {
+                return hash;
+            }
+        }
+
+        //
+        // Only a model listed twice gets here.
+        //
+        return KEYBOARD_HASH{ ~0u, {} };
+    }
+
+    constexpr KEYBOARD_HASH keyboardHash = BuildKeyboardHash();
+
+    static_assert(keyboardHash.Seed != ~0u, "builtinKeyboards lists a VID/PID twice");
+
+    std::unordered_map<ULONG, KNOWN_KEYBOARD>   addedKeyboards;
+}
+
+const KNOWN_KEYBOARD* FindKnownKeyboard(
+    IN  USHORT                  VendorID,
+    IN  USHORT                  ProductID
+)
+{
+    ULONG   key = KeyboardKey(VendorID, ProductID);
+    USHORT  slot;
+
+    if (!addedKeyboards.empty())
+    {
+        auto added = addedKeyboards.find(key);
+
+        if (added != addedKeyboards.end())
+        {
+            return &added->second;
+        }
+    }
+
+    slot = keyboardHash.Slots[HashSlot(key, keyboardHash.Seed)];
+
+    if (slot != 0 &&
+        builtinKeyboards[slot - 1].VendorID == VendorID &&
+        builtinKeyboards[slot - 1].ProductID == ProductID)
+    {
+        return &builtinKeyboards[slot - 1];
+    }
+
+    return nullptr;
+}
+
+bool LookupKnownKeyboard(
+    IN  USHORT                  VendorID,
+    IN  USHORT                  ProductID,
+    OUT PUSAGE                  UsagePage,
+    OUT PUSAGE                  Usage
+)
+{
+    const KNOWN_KEYBOARD* keyboard = FindKnownKeyboard(VendorID, ProductID);
+
+    if (keyboard == nullptr)
+    {
+        return false;
+    }
+
+    *UsagePage = keyboard->UsagePage;
+    *Usage = keyboard->Usage;
+    return true;
+}
+
+const KNOWN_KEYBOARD* GetDefaultKeyboard(
+    void
+)
+{
+    return &builtinKeyboards[0];
+}
+
+bool AddKnownKeyboard(
+    IN  const KNOWN_KEYBOARD*   Keyboard
+)
+{
+    if (Keyboard->VendorID == 0 ||
+        Keyboard->MacroUsageMin > Keyboard->MacroUsageMax ||
+        Keyboard->MacroUsageMax - Keyboard->MacroUsageMin >= KNOWN_KEYBOARD_MAX_MACROS)
+    {
+        return false;
+    }
+
+    try
+    {
+        addedKeyboards.insert_or_assign(KeyboardKey(Keyboard->VendorID, Keyboard->ProductID), *Keyboard);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool LoadKnownKeyboards(
+    IN  LPCSTR                  FileName,
+    OUT PULONG                  LineNumber
+)
+/*++
+RoutineDescription:
+   Add every model listed in FileName. Blank lines and lines starting with
+   # are skipped; the name is whatever follows the numbers, less trailing
+   spaces and tabs and truncated to fit.
+--*/
+{
+    FILE*   stream;
+    CHAR    line[256];
+    bool    loaded = true;
+
+    *LineNumber = 0;
+
+    stream = fopen(FileName, "r");
+    if (stream == nullptr)
+    {
+        return false;
+    }
+
+    while (fgets(line, sizeof(line), stream) != nullptr)
+    {
+        KNOWN_KEYBOARD  keyboard = {};
+        unsigned int    reportID;
+        int             nameOffset = -1;
+        size_t          length;
+        char            first = '\0';
+
+        (*LineNumber)++;
+
+        sscanf(line, " %c", &first);
+        if (first == '\0' || first == '#')
+        {
+            continue;
+        }
+
+        if (sscanf(line, "%hx %hx %hx %hx %hx %hx %hx %x %n",
+                   &keyboard.VendorID, &keyboard.ProductID,
+                   &keyboard.UsagePage, &keyboard.Usage,
+                   &keyboard.MacroUsagePage, &keyboard.MacroUsageMin, &keyboard.MacroUsageMax,
+                   &reportID, &nameOffset) != 8 ||
+            nameOffset < 0 ||
+            reportID > 0xff)
+        {
+            loaded = false;
+            break;
+        }
+
+        keyboard.MacroReportID = (UCHAR)reportID;
+
+        length = std::strcspn(line + nameOffset, "\r\n");
+        while (length > 0 && (line[nameOffset + length - 1] == ' ' || line[nameOffset + length - 1] == '\t'))
+        {
+            length--;
+        }
+
+        std::snprintf(keyboard.Name, sizeof(keyboard.Name), "%.*s", (int)length, line + nameOffset);
+
+        if (!AddKnownKeyboard(&keyboard))
+        {
+            loaded = false;
+            break;
+        }
+    }
+
+    if (loaded && ferror(stream))
+    {
+        *LineNumber = 0;
+        loaded = false;
+    }
+
+    fclose(stream);
+    return loaded;
+}
@@ -0,0 +1,179 @@
+/*++
+
+Module Name:
+
+    latency.cpp
+
+Abstract:
+
+    Fixed bucket latency histograms, cheap enough to stay enabled. Each
+    power of two range of nanoseconds is split into eight linear buckets,
+    so a percentile read from the histogram is within 12.5% of the true
+    value, and a sample costs a bit scan and a counter increment. Each
+    stage has one recording thread, so counters are bumped with plain
+    relaxed loads and stores rather than locked read-modify-writes; the
+    atomics only keep a concurrent PrintLatencyReport well defined.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+#include <iostream>
+#include "latency.h"
+
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS     (1u << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS         ((64 - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct _LATENCY_HISTOGRAM
+{
+    std::atomic<ULONGLONG>  Buckets[LATENCY_BUCKETS];
+    std::atomic<ULONGLONG>  Count;
+    std::atomic<ULONGLONG>  Max;
+} LATENCY_HISTOGRAM, * PLATENCY_HISTOGRAM;
+
+static LATENCY_HISTOGRAM    latencyHistograms[LatencyStageCount];
+
+static const char* const    latencyStageNames[LatencyStageCount] =
+{
+    "queue",
+    "decode",
+    "handoff",
+    "console",
+    "inject",
+    "total",
+};
+
+static inline ULONG LatencyBucket(
+    ULONGLONG   Nanoseconds
+)
+/*++
+RoutineDescription:
+   Values below LATENCY_SUB_BUCKETS get a bucket each. Above that the top
+   LATENCY_SUB_BUCKET_BITS + 1 significant bits pick the bucket.
+--*/
+{
+    ULONG   exponent;
+
+    if (Nanoseconds < LATENCY_SUB_BUCKETS)
+    {
+        return (ULONG)Nanoseconds;
+    }
+
+    exponent = (ULONG)std::bit_width(Nanoseconds) - 1;
+    return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+           (ULONG)((Nanoseconds >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static inline ULONGLONG LatencyBucketLimit(
+    ULONG       Bucket
+)
+/*++
+RoutineDescription:
+   Largest value that falls into Bucket.
+--*/
+{
+    ULONG       exponent;
+    ULONGLONG   lower;
+
+    if (Bucket < LATENCY_SUB_BUCKETS)
+    {
+        return Bucket;
+    }
+
+    exponent = Bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    lower = (ULONGLONG)(LATENCY_SUB_BUCKETS + Bucket % LATENCY_SUB_BUCKETS) << (exponent - LATENCY_SUB_BUCKET_BITS);
+    return lower + (1ull << (exponent - LATENCY_SUB_BUCKET_BITS)) - 1;
+}
+
+void RecordLatency(
+    IN  LATENCY_STAGE   Stage,
+    IN  ULONGLONG       Start,
+    IN  ULONGLONG       End
+)
+{
+    PLATENCY_HISTOGRAM      histogram = &latencyHistograms[Stage];
+    ULONGLONG               elapsed = (End > Start) ? End - Start : 0;
+    std::atomic<ULONGLONG>& bucket = histogram->Buckets[LatencyBucket(elapsed)];
+
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    histogram->Count.store(histogram->Count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+    if (elapsed > histogram->Max.load(std::memory_order_relaxed))
+    {
+        histogram->Max.store(elapsed, std::memory_order_relaxed);
+    }
+}
+
+static ULONGLONG LatencyPercentile(
+    PLATENCY_HISTOGRAM  Histogram,
+    ULONGLONG           Count,
+    ULONG               PerMille
+)
+/*++
+RoutineDescription:
+   Upper bound of the bucket holding the PerMille'th sample, capped at the
+   largest sample seen.
+--*/
+{
+    ULONGLONG   rank = (Count * PerMille + 999) / 1000;
+    ULONGLONG   seen = 0;
+    ULONGLONG   max = Histogram->Max.load(std::memory_order_relaxed);
+
+    for (ULONG i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += Histogram->Buckets[i].load(std::memory_order_relaxed);
+
+        if (seen >= rank)
+        {
+            return std::min(LatencyBucketLimit(i), max);
+        }
+    }
+    return max;
+}
+
+void PrintLatencyReport(
+    void
+)
+/*++
+RoutineDescription:
+   Print count, p50, p99, p99.9 and max of every stage that has samples, in
+   microseconds. Safe to call from another thread while samples are being
+   recorded; the figures are then a close snapshot rather than exact.
+--*/
+{
+    char    line[128];
+    bool    header = false;
+
+    for (ULONG stage = 0; stage < LatencyStageCount; stage++)
+    {
+        PLATENCY_HISTOGRAM  histogram = &latencyHistograms[stage];
+        ULONGLONG           count = histogram->Count.load(std::memory_order_relaxed);
+
+        if (count == 0)
+        {
+            continue;
+        }
+
+        if (!header)
+        {
+            std::cout << "Latency (us)        count        p50        p99      p99.9        max" << std::endl;
+            header = true;
+        }
+
+        snprintf(line, sizeof(line), "%-12s %12llu %10.1f %10.1f %10.1f %10.1f",
+                 latencyStageNames[stage],
+                 (unsigned long long)count,
+                 LatencyPercentile(histogram, count, 500) / 1000.0,
+                 LatencyPercentile(histogram, count, 990) / 1000.0,
+                 LatencyPercentile(histogram, count, 999) / 1000.0,
+                 histogram->Max.load(std::memory_order_relaxed) / 1000.0);
+        std::cout << line << std::endl;
+    }
+}
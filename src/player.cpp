@@ -0,0 +1,312 @@
+/*++
+
+Module Name:
+
+    player.cpp
+
+Abstract:
+
+    The macro player thread. A wait sleeps until PLAYER_SPIN_TIME before
+    its deadline and spins the rest, which is what gets the steps of a
+    macro within a fraction of a millisecond of where they belong: the
+    sleep on its own may overrun by a scheduler tick. On Linux the sleep
+    is clock_nanosleep underneath std::this_thread; on Windows it is a high
+    resolution waitable timer where the system has them (Windows 10 1803
+    on), since Sleep itself only wakes on the 15.6 ms timer tick.
+
+    Sleeps are cut into PLAYER_SLEEP_SLICE pieces so a player told to stop
+    does not wait out a long pause first.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <thread>
+#ifdef _WIN32
+#include <wtypes.h>
+#endif
+#include "player.h"
+
+#ifdef _WIN32
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION   0x00000002
+#endif
+#define PLAYER_SPIN_TIME        1000000ull      // Nanoseconds, covers the high resolution timer's slack
+#else
+#define PLAYER_SPIN_TIME        200000ull
+#endif
+
+#define PLAYER_SLEEP_SLICE      50000000ull
+
+struct _MACRO_PLAYER
+{
+    PKEY_SINK                           Sink;
+    std::thread                         Thread;
+    std::mutex                          Lock;
+    std::condition_variable             Wake;
+    std::deque<const MACRO_ACTION*>     Queue;          // Guarded by Lock
+    bool                                Stopping;       // Guarded by Lock
+    std::atomic<bool>                   Abandon;        // Stop without finishing the macro playing
+    bool                                Held[0x100];    // Keys the macros have down
+    MACRO_PLAYER_STATS                  Stats;          // Dropped is guarded by Lock, the rest is the thread's
+#ifdef _WIN32
+    HANDLE                              Timer;
+#endif
+};
+
+static void SleepFor(
+    PMACRO_PLAYER   Player,
+    ULONGLONG       Duration
+)
+{
+#ifdef _WIN32
+    if (Player->Timer != nullptr)
+    {
+        LARGE_INTEGER due;
+
+        due.QuadPart = -(LONGLONG)(Duration / 100);     // Relative, in 100 ns units
+
+        if (SetWaitableTimer(Player->Timer, &due, 0, nullptr, nullptr, FALSE))
+        {
+            WaitForSingleObject(Player->Timer, INFINITE);
+            return;
+        }
+    }
+#else
+    (void)Player;
+#endif
+
+    std::this_thread::sleep_for(std::chrono::nanoseconds(Duration));
+}
+
+static void WaitUntil(
+    PMACRO_PLAYER   Player,
+    ULONGLONG       Deadline            // GetReportTime() value
+)
+{
+    ULONGLONG now;
+
+    while ((now = GetReportTime()) < Deadline && !Player->Abandon)
+    {
+        ULONGLONG remaining = Deadline - now;
+
+        if (remaining > PLAYER_SPIN_TIME)
+        {
+            SleepFor(Player, std::min(remaining - PLAYER_SPIN_TIME, PLAYER_SLEEP_SLICE));
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+static void Play(
+    PMACRO_PLAYER           Player,
+    const MACRO_ACTION*     Action
+)
+{
+    ULONGLONG deadline = GetReportTime();
+
+    for (ULONG i = 0; i < Action->NumberSteps && !Player->Abandon; i++)
+    {
+        const MACRO_STEP* step = &Action->Steps[i];
+
+        switch (step->Type)
+        {
+        case MacroStepKeyDown:
+        case MacroStepKeyUp:
+            if (QueueKeyEvent(Player->Sink, step->Key, step->Type == MacroStepKeyDown))
+            {
+                Player->Held[step->Key & 0xFF] = step->Type == MacroStepKeyDown;
+            }
+            break;
+
+        case MacroStepWait:
+        {
+            ULONGLONG lateness;
+
+            FlushKeySink(Player->Sink);
+
+            //
+            // A macro that fell behind catches up rather than stretching
+            // every wait after the late one.
+            //
+            deadline += (ULONGLONG)step->Delay * 1000;
+            WaitUntil(Player, deadline);
+
+            if (Player->Abandon)
+            {
+                break;
+            }
+
+            lateness = GetReportTime() - deadline;
+            Player->Stats.Waits++;
+            Player->Stats.TotalLateness += lateness;
+            Player->Stats.MaxLateness = std::max(Player->Stats.MaxLateness, lateness);
+            break;
+        }
+        }
+    }
+
+    if (!Player->Abandon)
+    {
+        Player->Stats.Macros++;
+    }
+
+    FlushKeySink(Player->Sink);
+}
+
+static void PlayerThread(
+    PMACRO_PLAYER   Player
+)
+{
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#endif
+
+    for (;;)
+    {
+        const MACRO_ACTION* action;
+
+        {
+            std::unique_lock<std::mutex> lock(Player->Lock);
+
+            Player->Wake.wait(lock, [Player]() { return !Player->Queue.empty() || Player->Stopping; });
+
+            if (Player->Queue.empty() || Player->Abandon)
+            {
+                break;
+            }
+
+            action = Player->Queue.front();
+            Player->Queue.pop_front();
+        }
+
+        Play(Player, action);
+    }
+
+    //
+    // A macro may hold a key for a later one to let go of; whatever is
+    // still down when the player stops is released.
+    //
+    for (ULONG key = 0; key < 0x100; key++)
+    {
+        if (Player->Held[key])
+        {
+            QueueKeyEvent(Player->Sink, (USAGE)key, false);
+        }
+    }
+
+    FlushKeySink(Player->Sink);
+}
+
+PMACRO_PLAYER StartMacroPlayer(
+    IN  PKEY_SINK               Sink
+)
+{
+    PMACRO_PLAYER player = new (std::nothrow) MACRO_PLAYER();
+
+    if (player == nullptr)
+    {
+        return nullptr;
+    }
+
+    player->Sink = Sink;
+
+#ifdef _WIN32
+    player->Timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+#endif
+
+    try
+    {
+        player->Thread = std::thread(PlayerThread, player);
+    }
+    catch (const std::system_error&)
+    {
+#ifdef _WIN32
+        if (player->Timer != nullptr)
+        {
+            CloseHandle(player->Timer);
+        }
+#endif
+        delete player;
+        return nullptr;
+    }
+
+    return player;
+}
+
+bool PlayMacro(
+    IN  PMACRO_PLAYER           Player,
+    IN  const MACRO_ACTION*     Action
+)
+{
+    {
+        std::lock_guard<std::mutex> lock(Player->Lock);
+
+        if (Player->Queue.size() >= MACRO_PLAYER_MAX_QUEUED)
+        {
+            Player->Stats.Dropped++;
+            return false;
+        }
+
+        try
+        {
+            Player->Queue.push_back(Action);
+        }
+        catch (const std::bad_alloc&)
+        {
+            Player->Stats.Dropped++;
+            return false;
+        }
+    }
+
+    Player->Wake.notify_one();
+    return true;
+}
+
+void StopMacroPlayer(
+    IN  PMACRO_PLAYER           Player,
+    IN  bool                    Finish,
+    OUT PMACRO_PLAYER_STATS     Stats
+)
+{
+    if (Player == nullptr)
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(Player->Lock);
+
+        Player->Stopping = true;
+        Player->Abandon = !Finish;
+    }
+
+    Player->Wake.notify_one();
+    Player->Thread.join();
+
+#ifdef _WIN32
+    if (Player->Timer != nullptr)
+    {
+        CloseHandle(Player->Timer);
+    }
+#endif
+
+    if (Stats != nullptr)
+    {
+        *Stats = Player->Stats;
+    }
+
+    delete Player;
+}
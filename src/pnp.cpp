@@ -19,39 +19,62 @@ Environment:
 
 --*/
 
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <new>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
 #include <wtypes.h>
 #include <strsafe.h>
 #include <intsafe.h>
+#endif
 #include "hid.h"
+#include "devcache.h"
 
-bool FindKnownHidDevices(
-    OUT PHID_DEVICE*    HidDevices,     // A array of struct _HID_DEVICE
-    OUT PULONG          NumberDevices   // the length of this array.
+#ifdef _WIN32
+
+//
+// Device discovery and opening go through SetupDi and CreateFileA here. The
+// hidraw equivalents live in hidraw.cpp; everything from FillDeviceInfo on
+// is shared.
+//
+
+typedef struct _INTERFACE_PROBE
+{
+    std::vector<LPCSTR>         Paths;
+    const HID_DEVICE_FILTER*    Filter;
+    bool                        ListUnopened;
+    std::vector<HID_DEVICE>     Devices;    // One slot per path
+    std::vector<UCHAR>          Found;      // Set for the slots that hold a device
+    std::atomic<bool>           OutOfMemory;
+} INTERFACE_PROBE, * PINTERFACE_PROBE;
+
+static bool ListInterfacePaths(
+    std::vector<std::string>&   Paths
 )
 /*++
-Routine Description:
-   Do the required PnP things in order to find all the HID devices in
-   the system at this time.
+RoutineDescription:
+   Do the required PnP things in order to find all the HID interfaces in
+   the system at this time. Only the PnP database is consulted here, the
+   interfaces themselves are opened by the probes.
 --*/
 {
-    HDEVINFO                            hardwareDeviceInfo = INVALID_HANDLE_VALUE;
+    HDEVINFO                            hardwareDeviceInfo;
     SP_DEVICE_INTERFACE_DATA            deviceInfoData{};
-    ULONG                               i = 0;
-    bool                                done = false;
-    PHID_DEVICE                         hidDeviceInst = nullptr;
-    GUID                                hidGuid;
     PSP_DEVICE_INTERFACE_DETAIL_DATA_A  functionClassDeviceData = nullptr;
     ULONG                               requiredLength = 0;
-    PHID_DEVICE                         newHidDevices = nullptr;
+    GUID                                hidGuid;
 
     HidD_GetHidGuid(&hidGuid);
 
-    *HidDevices = nullptr;
-    *NumberDevices = 0;
-
     //
     // Open a handle to the plug and play dev node.
     //
@@ -66,167 +89,274 @@ Routine Description:
         return false;
     }
 
-    //
-    // Take a wild guess to start
-    //
-
-    *NumberDevices = 4;
-
     deviceInfoData.cbSize = sizeof(SP_DEVICE_INTERFACE_DATA);
 
-    while (!done)
+    try
     {
-        *NumberDevices *= 2;
-        try
+        for (ULONG i = 0; SetupDiEnumDeviceInterfaces(hardwareDeviceInfo, 0, &hidGuid, i, &deviceInfoData); i++)
         {
-            if (*HidDevices)
-            {
-                newHidDevices = new HID_DEVICE[*NumberDevices];
-                std::memset(newHidDevices, 0, *NumberDevices * sizeof(HID_DEVICE));
-
-                // Copy existing data to the new block
-                std::copy(*HidDevices, (*HidDevices + i), newHidDevices);
+            //
+            // Size the detail data first, then retrieve it.
+            //
+            SetupDiGetDeviceInterfaceDetailA(hardwareDeviceInfo, &deviceInfoData, nullptr, 0, &requiredLength, nullptr);
 
-                // Deallocate old block
-                delete[] *HidDevices;
+            functionClassDeviceData = reinterpret_cast<PSP_DEVICE_INTERFACE_DETAIL_DATA_A>(new CHAR[requiredLength]);
+            functionClassDeviceData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
 
-                *HidDevices = newHidDevices;
-            }
-            else
+            if (SetupDiGetDeviceInterfaceDetailA(hardwareDeviceInfo,
+                                                 &deviceInfoData,
+                                                 functionClassDeviceData,
+                                                 requiredLength,
+                                                 nullptr,
+                                                 nullptr))
             {
-                *HidDevices = new HID_DEVICE[*NumberDevices];
-                std::memset(*HidDevices, 0, *NumberDevices * sizeof(HID_DEVICE));
+                Paths.push_back(functionClassDeviceData->DevicePath);
             }
+
+            delete[] reinterpret_cast<PCHAR>(functionClassDeviceData);
+            functionClassDeviceData = nullptr;
         }
-        catch (const std::bad_alloc&)
-        {
-            if (newHidDevices != nullptr)
-            {
-                delete[] newHidDevices;
-                newHidDevices = nullptr;
-                hidDeviceInst = nullptr;
-            }
-            return false;
-        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        delete[] reinterpret_cast<PCHAR>(functionClassDeviceData);
+        SetupDiDestroyDeviceInfoList(hardwareDeviceInfo);
+        return false;
+    }
 
-        hidDeviceInst = *HidDevices + i;
+    SetupDiDestroyDeviceInfoList(hardwareDeviceInfo);
+    return true;
+}
 
-        for (; i < *NumberDevices; i++, hidDeviceInst++)
-        {
-            //
-            // Initialize an empty HID_DEVICE
-            //
-            std::memset(hidDeviceInst, 0, sizeof(HID_DEVICE));
+static bool ParseInterfaceIds(
+    _In_     LPCSTR         DevicePath,
+    _Out_    PUSHORT        VendorID,
+    _Out_    PUSHORT        ProductID
+)
+/*++
+RoutineDescription:
+    Read the vendor and product ID out of an interface path. USB and most
+    other buses name them "VID_0D62&PID_1A1C", Bluetooth "VID&00020D62"
+    (vendor ID source, then the ID) and "PID&1A1C". Returns false when the
+    path has neither form, in which case the device has to be asked.
+--*/
+{
+    CHAR        path[MAX_PATH];
+    LPCSTR      vid;
+    LPCSTR      pid;
+    size_t      length = strnlen(DevicePath, MAX_PATH - 1);
+
+    for (size_t i = 0; i < length; i++)
+    {
+        path[i] = (CHAR)tolower((UCHAR)DevicePath[i]);
+    }
+    path[length] = '\0';
 
-            hidDeviceInst->HidDevice = INVALID_HANDLE_VALUE;
+    if ((vid = strstr(path, "vid_")) != nullptr && (pid = strstr(path, "pid_")) != nullptr)
+    {
+        *VendorID = (USHORT)strtoul(vid + 4, nullptr, 16);
+        *ProductID = (USHORT)strtoul(pid + 4, nullptr, 16);
+        return true;
+    }
 
-            if (SetupDiEnumDeviceInterfaces(hardwareDeviceInfo,
-                                            0, // No care about specific PDOs
-                                            &hidGuid,
-                                            i,
-                                            &deviceInfoData))
-            {
-                //
-                // allocate a function class device data structure to receive the
-                // goods about this particular device.
-                //
-
-                SetupDiGetDeviceInterfaceDetailA(
-                    hardwareDeviceInfo,
-                    &deviceInfoData,
-                    nullptr, // probing so no output buffer yet
-                    0, // probing so output buffer length of zero
-                    &requiredLength,
-                    nullptr); // not interested in the specific dev-node
-
-                try
-                {
-                    functionClassDeviceData = new SP_DEVICE_INTERFACE_DETAIL_DATA_A[requiredLength];
-                    std::memset(functionClassDeviceData, 0, requiredLength * sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A));
+    if ((vid = strstr(path, "vid&")) != nullptr && (pid = strstr(path, "pid&")) != nullptr)
+    {
+        *VendorID = (USHORT)(strtoul(vid + 4, nullptr, 16) & 0xFFFF);
+        *ProductID = (USHORT)strtoul(pid + 4, nullptr, 16);
+        return true;
+    }
 
-                }
-                catch (const std::bad_alloc&)
-                {
-                    if (*HidDevices != nullptr)
-                    {
-                        delete[] *HidDevices;
-                        *HidDevices = nullptr;
-                    }
-                    return false;
-                }
+    return false;
+}
+
+static bool QueryInterfaceUsage(
+    _In_     LPCSTR         DevicePath,
+    _In_     const HID_DEVICE_FILTER* Filter
+)
+/*++
+RoutineDescription:
+    Open the interface with query access just long enough to check its IDs
+    and top level usage, without building any of the HID_DEVICE.
+--*/
+{
+    HANDLE                  handle;
+    HIDD_ATTRIBUTES         attributes = { sizeof(HIDD_ATTRIBUTES) };
+    PHIDP_PREPARSED_DATA    ppd = nullptr;
+    HIDP_CAPS               caps;
+    bool                    match = false;
+
+    handle = CreateFileA(DevicePath,
+                         0,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         nullptr,
+                         OPEN_EXISTING,
+                         0,
+                         nullptr);
+
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
 
-                functionClassDeviceData->cbSize = sizeof(SP_DEVICE_INTERFACE_DETAIL_DATA_A);
-                std::memset(functionClassDeviceData->DevicePath, 0, sizeof(functionClassDeviceData->DevicePath));
+    if (HidD_GetAttributes(handle, &attributes) &&
+        MatchHidDeviceIds(Filter, attributes.VendorID, attributes.ProductID) &&
+        HidD_GetPreparsedData(handle, &ppd))
+    {
+        match = HidP_GetCaps(ppd, &caps) == HIDP_STATUS_SUCCESS &&
+                MatchHidDeviceUsage(Filter, attributes.VendorID, attributes.ProductID, caps.UsagePage, caps.Usage);
+        HidD_FreePreparsedData(ppd);
+    }
 
-                //
-                // Retrieve the information from Plug and Play.
-                //
+    CloseHandle(handle);
+    return match;
+}
 
-                if (SetupDiGetDeviceInterfaceDetailA(
-                    hardwareDeviceInfo,
-                    &deviceInfoData,
-                    functionClassDeviceData,
-                    requiredLength,
-                    nullptr,
-                    nullptr))
-                {
-                    //
-                    // Open device with just generic query abilities to begin with
-                    //
-
-                    if (!OpenHidDevice(functionClassDeviceData->DevicePath,
-                                       false,      // ReadAccess - none
-                                       false,      // WriteAccess - none
-                                       false,       // Overlapped - no
-                                       false,       // Exclusive - no
-                                       hidDeviceInst))
-                    {
-                        //
-                        // Save the device path so it can be still listed.
-                        //
-                        int iDevicePathSize = static_cast<int>(strnlen(functionClassDeviceData->DevicePath, MAX_PATH) + 1);
-
-                        try
-                        {
-                            hidDeviceInst->DevicePath = new char[iDevicePathSize];
-                            std::memset(hidDeviceInst->DevicePath, 0, iDevicePathSize);
-                        }
-                        catch (const std::bad_alloc&)
-                        {
-                            return false;
-                        }
-
-                        StringCbCopyA(hidDeviceInst->DevicePath, iDevicePathSize, functionClassDeviceData->DevicePath);
-                    }
-                }
+static void ProbeInterface(
+    IN  ULONG       Index,
+    IN  PVOID       Context
+)
+/*++
+RoutineDescription:
+   Open one interface with query access into its slot. Runs on the probe
+   workers, so it touches nothing but the slot.
+--*/
+{
+    PINTERFACE_PROBE    probe = static_cast<PINTERFACE_PROBE>(Context);
+    LPCSTR              path = probe->Paths[Index];
+    PHID_DEVICE         device = &probe->Devices[Index];
+    size_t              pathSize;
 
-                delete[] functionClassDeviceData;
-                functionClassDeviceData = nullptr;
-            }
-            else
-            {
-                if (GetLastError() == ERROR_NO_MORE_ITEMS)
-                {
-                    done = true;
-                    break;
-                }
-            }
+    if (probe->Filter != nullptr && !QueryInterfaceUsage(path, probe->Filter))
+    {
+        return;
+    }
+
+    if (OpenHidDevice(path,
+                      false,      // ReadAccess - none
+                      false,      // WriteAccess - none
+                      false,      // Overlapped - no
+                      false,      // Exclusive - no
+                      device))
+    {
+        probe->Found[Index] = true;
+        return;
+    }
+
+    if (!probe->ListUnopened)
+    {
+        return;
+    }
+
+    //
+    // Save the device path so it can be still listed.
+    //
+    pathSize = strnlen(path, MAX_PATH) + 1;
+    device->DevicePath = new (std::nothrow) char[pathSize];
+
+    if (device->DevicePath == nullptr)
+    {
+        probe->OutOfMemory = true;
+        return;
+    }
+
+    StringCbCopyA(device->DevicePath, pathSize, path);
+    probe->Found[Index] = true;
+}
+
+static bool ProbeInterfaces(
+    const std::vector<std::string>& Paths,
+    const HID_DEVICE_FILTER*        Filter,
+    bool                            ListUnopened,
+    PHID_DEVICE*                    HidDevices,
+    PULONG                          NumberDevices
+)
+/*++
+RoutineDescription:
+   Probe every interface in Paths and hand back the ones that were found,
+   in the order of Paths.
+--*/
+{
+    INTERFACE_PROBE probe;
+    ULONG           numberFound = 0;
+
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
+
+    probe.Filter = Filter;
+    probe.ListUnopened = ListUnopened;
+    probe.OutOfMemory = false;
+
+    try
+    {
+        for (const std::string& path : Paths)
+        {
+            probe.Paths.push_back(path.c_str());
         }
+
+        probe.Devices.resize(Paths.size());
+        probe.Found.resize(Paths.size());
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    for (HID_DEVICE& device : probe.Devices)
+    {
+        std::memset(&device, 0, sizeof(HID_DEVICE));
+        device.HidDevice = INVALID_HANDLE_VALUE;
     }
 
-    *NumberDevices = i;
+    if (!RunHidProbes(probe.Paths.data(), (ULONG)probe.Paths.size(), ProbeInterface, &probe))
+    {
+        return false;
+    }
 
-    if (hardwareDeviceInfo != INVALID_HANDLE_VALUE)
+    for (size_t i = 0; i < probe.Devices.size(); i++)
     {
-        SetupDiDestroyDeviceInfoList(hardwareDeviceInfo);
-        hardwareDeviceInfo = INVALID_HANDLE_VALUE;
+        if (probe.Found[i])
+        {
+            probe.Devices[numberFound++] = probe.Devices[i];
+        }
     }
 
-    return done;
+    if (probe.OutOfMemory ||
+        (numberFound > 0 && (*HidDevices = new (std::nothrow) HID_DEVICE[numberFound]) == nullptr))
+    {
+        CloseHidDevices(probe.Devices.data(), numberFound);
+        return false;
+    }
+
+    std::copy_n(probe.Devices.begin(), numberFound, *HidDevices);
+    *NumberDevices = numberFound;
+    return true;
+}
+
+bool FindKnownHidDevices(
+    OUT PHID_DEVICE*    HidDevices,     // A array of struct _HID_DEVICE
+    OUT PULONG          NumberDevices   // the length of this array.
+)
+/*++
+Routine Description:
+   Find all the HID devices in the system at this time and open each with
+   query access. Interfaces that cannot be opened are still listed by path.
+--*/
+{
+    std::vector<std::string>    paths;
+
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
+
+    if (!ListInterfacePaths(paths))
+    {
+        return false;
+    }
+
+    return ProbeInterfaces(paths, nullptr, true, HidDevices, NumberDevices);
 }
 
 bool OpenHidDevice(
-    _In_     LPSTR          DevicePath,
+    _In_     LPCSTR         DevicePath,
     _In_     bool           HasReadAccess,
     _In_     bool           HasWriteAccess,
     _In_     bool           IsOverlapped,
@@ -350,385 +480,478 @@ RoutineDescription:
     return true;
 }
 
-bool FillDeviceInfo(
-    IN  PHID_DEVICE HidDevice
+bool FindHidDevices(
+    IN  const HID_DEVICE_FILTER* Filter,
+    OUT PHID_DEVICE*             HidDevices,
+    OUT PULONG                   NumberDevices
 )
 {
-    ULONG               numValues;
-    USHORT              numCaps;
-    PHIDP_BUTTON_CAPS   buttonCaps;
-    PHIDP_VALUE_CAPS    valueCaps;
-    PHID_DATA           data;
-    ULONG               i;
-    USAGE               usage;
-    UINT                dataIdx;
-    ULONG               newFeatureDataLength;
-    ULONG               tmpSum;
+    std::vector<std::string>    paths;
+    std::vector<std::string>    candidates;
 
-    //
-    // setup Input Data buffers.
-    //
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
 
-    //
-    // Allocate memory to hold on input report
-    //
+    if (!ListInterfacePaths(paths))
+    {
+        return false;
+    }
 
     try
     {
-        HidDevice->InputReportBuffer = new char[HidDevice->Caps.InputReportByteLength];
-        std::memset(HidDevice->InputReportBuffer, 0, HidDevice->Caps.InputReportByteLength);
-
-    //
-    // Allocate memory to hold the button and value capabilities.
-    // NumberXXCaps is in terms of array elements.
-    //
-        HidDevice->InputButtonCaps = buttonCaps = new HIDP_BUTTON_CAPS[HidDevice->Caps.NumberInputButtonCaps];
-        std::memset(HidDevice->InputButtonCaps, 0, HidDevice->Caps.NumberInputButtonCaps * sizeof(HIDP_BUTTON_CAPS));
+        for (std::string& path : paths)
+        {
+            USHORT  vendorID;
+            USHORT  productID;
 
-        HidDevice->InputValueCaps = valueCaps = new HIDP_VALUE_CAPS[HidDevice->Caps.NumberInputValueCaps];
-        std::memset(HidDevice->InputValueCaps, 0, HidDevice->Caps.NumberInputValueCaps * sizeof(HIDP_VALUE_CAPS));
+            if (!ParseInterfaceIds(path.c_str(), &vendorID, &productID) ||
+                MatchHidDeviceIds(Filter, vendorID, productID))
+            {
+                candidates.push_back(std::move(path));
+            }
+        }
     }
     catch (const std::bad_alloc&)
     {
         return false;
     }
 
-    //
-    // Have the HidP_X functions fill in the capability structure arrays.
-    //
+    return ProbeInterfaces(candidates, Filter, false, HidDevices, NumberDevices);
+}
 
-    numCaps = HidDevice->Caps.NumberInputButtonCaps;
+#endif // _WIN32
 
-    if (numCaps > 0)
-    {
-        if (HIDP_STATUS_SUCCESS != (HidP_GetButtonCaps(HidP_Input,
-                                                       buttonCaps,
-                                                       &numCaps,
-                                                       HidDevice->Ppd)))
-        {
-            return false;
-        }
-    }
+bool MatchHidDeviceIds(
+    IN  const HID_DEVICE_FILTER* Filter,
+    IN  USHORT                   VendorID,
+    IN  USHORT                   ProductID
+)
+{
+    USAGE   usagePage;
+    USAGE   usage;
 
-    numCaps = HidDevice->Caps.NumberInputValueCaps;
+    return Filter == nullptr ||
+           ((Filter->VendorID == 0 || Filter->VendorID == VendorID) &&
+            (Filter->ProductID == 0 || Filter->ProductID == ProductID) &&
+            (Filter->Lookup == nullptr || Filter->Lookup(VendorID, ProductID, &usagePage, &usage)));
+}
 
-    if (numCaps > 0)
+bool MatchHidDeviceUsage(
+    IN  const HID_DEVICE_FILTER* Filter,
+    IN  USHORT                   VendorID,
+    IN  USHORT                   ProductID,
+    IN  USAGE                    UsagePage,
+    IN  USAGE                    Usage
+)
+{
+    USAGE   usagePage;
+    USAGE   usage;
+
+    if (Filter == nullptr)
     {
-        if (HIDP_STATUS_SUCCESS != (HidP_GetValueCaps(HidP_Input,
-                                                      valueCaps,
-                                                      &numCaps,
-                                                      HidDevice->Ppd)))
-        {
-            return false;
-        }
+        return true;
     }
 
-
-    //
-    // Depending on the device, some value caps structures may represent more
-    // than one value.  (A range).  In the interest of being verbose, over
-    // efficient, we will expand these so that we have one and only one
-    // struct _HID_DATA for each value.
-    //
-    // To do this we need to count up the total number of values are listed
-    // in the value caps structure.  For each element in the array we test
-    // for range if it is a range then UsageMax and UsageMin describe the
-    // usages for this range INCLUSIVE.
-    //
-
-    numValues = 0;
-    for (i = 0; i < HidDevice->Caps.NumberInputValueCaps; i++, valueCaps++)
+    if (Filter->Lookup != nullptr &&
+        (!Filter->Lookup(VendorID, ProductID, &usagePage, &usage) || usagePage != UsagePage || usage != Usage))
     {
-        if (valueCaps->IsRange)
-        {
-            numValues += valueCaps->Range.UsageMax - valueCaps->Range.UsageMin + 1;
-            if (valueCaps->Range.UsageMin > valueCaps->Range.UsageMax)
-            {
-                return false;
-            }
-        }
-        else
-        {
-            numValues++;
-        }
+        return false;
     }
 
-    valueCaps = HidDevice->InputValueCaps;
-
-    //
-    // Allocate a buffer to hold the struct _HID_DATA structures.
-    // One element for each set of buttons, and one element for each value
-    // found.
-    //
+    return (Filter->UsagePage == 0 || Filter->UsagePage == UsagePage) &&
+           (Filter->Usage == 0 || Filter->Usage == Usage);
+}
 
-    HidDevice->InputDataLength = HidDevice->Caps.NumberInputButtonCaps
-        + numValues;
+//
+// Timing of the last probe phase, for GetHidEnumerationTiming.
+//
+static std::mutex                       probeTimingLock;
+static HID_ENUMERATION_TIMING           probeTiming;
+static std::vector<HID_PROBE_TIMING>    probeTimings;
+
+bool RunHidProbes(
+    IN  const LPCSTR*           DevicePaths,
+    IN  ULONG                   NumberPaths,
+    IN  PHID_PROBE_ROUTINE      Probe,
+    IN  PVOID                   Context
+)
+/*++
+RoutineDescription:
+   Call Probe once for every index into DevicePaths. The calling thread
+   works through the list together with up to HID_MAX_PROBE_WORKERS - 1
+   threads started for the purpose, each taking the next unprobed index
+   as it becomes free; a thread that cannot be started just leaves more
+   for the others. Fails only when out of memory before probing anything.
+--*/
+{
+    std::vector<ULONGLONG>      elapsed;
+    std::vector<std::thread>    workers;
+    std::atomic<ULONG>          next{ 0 };
+    ULONG                       numberWorkers = std::min<ULONG>(NumberPaths, HID_MAX_PROBE_WORKERS);
+    ULONGLONG                   start;
 
     try
     {
-        HidDevice->InputData = data = new HID_DATA[HidDevice->InputDataLength];
-        std::memset(HidDevice->InputData, 0, HidDevice->InputDataLength * sizeof(HID_DATA));
+        elapsed.resize(NumberPaths);
+        workers.reserve(numberWorkers);
     }
     catch (const std::bad_alloc&)
     {
         return false;
     }
 
-    //
-    // Fill in the button data
-    //
-    dataIdx = 0;
-    for (i = 0;
-         i < HidDevice->Caps.NumberInputButtonCaps;
-         i++, data++, buttonCaps++, dataIdx++)
+    auto worker = [&]()
     {
-        data->IsButtonData = true;
-        data->Status = HIDP_STATUS_SUCCESS;
-        data->UsagePage = buttonCaps->UsagePage;
-        if (buttonCaps->IsRange)
-        {
-            data->ButtonData.UsageMin = buttonCaps->Range.UsageMin;
-            data->ButtonData.UsageMax = buttonCaps->Range.UsageMax;
-        }
-        else
+        ULONG index;
+
+        while ((index = next.fetch_add(1)) < NumberPaths)
         {
-            data->ButtonData.UsageMin = data->ButtonData.UsageMax = buttonCaps->NotRange.Usage;
+            ULONGLONG probeStart = GetReportTime();
+
+            Probe(index, Context);
+            elapsed[index] = GetReportTime() - probeStart;
         }
+    };
 
-        data->ButtonData.MaxUsageLength = HidP_MaxUsageListLength(
-            HidP_Input,
-            buttonCaps->UsagePage,
-            HidDevice->Ppd);
+    start = GetReportTime();
 
+    for (ULONG i = 1; i < numberWorkers; i++)
+    {
         try
         {
-            data->ButtonData.Usages = new USAGE[data->ButtonData.MaxUsageLength];
-            std::memset(data->ButtonData.Usages, 0, data->ButtonData.MaxUsageLength * sizeof(USAGE));
+            workers.emplace_back(worker);
         }
-        catch (const std::bad_alloc&)
+        catch (const std::system_error&)
         {
-            return false;
+            break;
         }
-
-        data->ReportID = buttonCaps->ReportID;
     }
 
-    //
-    // Fill in the value data
-    //
+    worker();
 
-    for (i = 0; i < HidDevice->Caps.NumberInputValueCaps; i++, valueCaps++)
+    for (std::thread& thread : workers)
     {
-        if (valueCaps->IsRange)
-        {
-            for (usage = valueCaps->Range.UsageMin;
-                 usage <= valueCaps->Range.UsageMax;
-                 usage++)
-            {
-                if (dataIdx >= (HidDevice->InputDataLength))
-                {
-                    return false;
-                }
-                data->IsButtonData = false;
-                data->Status = HIDP_STATUS_SUCCESS;
-                data->UsagePage = valueCaps->UsagePage;
-                data->ValueData.Usage = usage;
-                data->ReportID = valueCaps->ReportID;
-                data++;
-                dataIdx++;
-            }
-        }
-        else
-        {
-            if (dataIdx >= (HidDevice->InputDataLength))
-            {
-                return false;
-            }
-            data->IsButtonData = false;
-            data->Status = HIDP_STATUS_SUCCESS;
-            data->UsagePage = valueCaps->UsagePage;
-            data->ValueData.Usage = valueCaps->NotRange.Usage;
-            data->ReportID = valueCaps->ReportID;
-            data++;
-            dataIdx++;
-        }
+        thread.join();
     }
 
-    //
-    // setup Output Data buffers.
-    //
+    std::lock_guard<std::mutex> lock(probeTimingLock);
+
+    probeTiming.Elapsed = GetReportTime() - start;
+    probeTiming.ProbeTotal = 0;
+    probeTiming.Workers = (ULONG)workers.size() + 1;
+    probeTiming.NumberProbes = NumberPaths;
 
     try
     {
-        HidDevice->OutputReportBuffer = new char[HidDevice->Caps.OutputReportByteLength];
-        std::memset(HidDevice->OutputReportBuffer, 0, HidDevice->Caps.OutputReportByteLength);
-
-        HidDevice->OutputButtonCaps = buttonCaps = new HIDP_BUTTON_CAPS[HidDevice->Caps.NumberOutputButtonCaps];
-        std::memset(HidDevice->OutputButtonCaps, 0, HidDevice->Caps.NumberOutputButtonCaps * sizeof(HIDP_BUTTON_CAPS));
-
-        HidDevice->OutputValueCaps = valueCaps = new HIDP_VALUE_CAPS[HidDevice->Caps.NumberOutputValueCaps];
-        std::memset(HidDevice->OutputValueCaps, 0, HidDevice->Caps.NumberOutputValueCaps * sizeof(HIDP_VALUE_CAPS));
+        probeTimings.resize(NumberPaths);
     }
     catch (const std::bad_alloc&)
     {
-        return false;
+        probeTimings.clear();
     }
 
-    numCaps = HidDevice->Caps.NumberOutputButtonCaps;
-    if (numCaps > 0)
+    for (ULONG i = 0; i < NumberPaths; i++)
     {
-        if (HIDP_STATUS_SUCCESS != (HidP_GetButtonCaps(HidP_Output,
-                                                       buttonCaps,
-                                                       &numCaps,
-                                                       HidDevice->Ppd)))
+        probeTiming.ProbeTotal += elapsed[i];
+
+        if (i < probeTimings.size())
         {
-            return false;
+            std::snprintf(probeTimings[i].DevicePath, sizeof(probeTimings[i].DevicePath), "%s", DevicePaths[i]);
+            probeTimings[i].Elapsed = elapsed[i];
         }
     }
 
-    numCaps = HidDevice->Caps.NumberOutputValueCaps;
-    if (numCaps > 0)
+    std::stable_sort(probeTimings.begin(),
+                     probeTimings.end(),
+                     [](const HID_PROBE_TIMING& Left, const HID_PROBE_TIMING& Right)
+                     {
+                         return Left.Elapsed > Right.Elapsed;
+                     });
+
+    return true;
+}
+
+bool GetHidEnumerationTiming(
+    OUT PHID_ENUMERATION_TIMING Timing,
+    _Out_writes_opt_(MaxProbes) PHID_PROBE_TIMING Probes,
+    IN  ULONG                   MaxProbes
+)
+{
+    std::lock_guard<std::mutex> lock(probeTimingLock);
+
+    *Timing = probeTiming;
+
+    if (Probes != nullptr)
     {
-        if (HIDP_STATUS_SUCCESS != (HidP_GetValueCaps(HidP_Output,
-                                                      valueCaps,
-                                                      &numCaps,
-                                                      HidDevice->Ppd)))
-        {
+        std::copy_n(probeTimings.begin(), std::min<size_t>(MaxProbes, probeTimings.size()), Probes);
+    }
+
+    return probeTiming.Workers > 0;
+}
+
+//
+// Where the fields of one report type live in a HID_DEVICE, so input,
+// output and feature are laid out by the same code.
+//
+typedef struct _HID_REPORT_STATE
+{
+    PCHAR*              ReportBuffer;
+    USHORT              ReportLength;
+    PHIDP_BUTTON_CAPS*  ButtonCaps;
+    USHORT              NumberButtonCaps;
+    PHIDP_VALUE_CAPS*   ValueCaps;
+    USHORT              NumberValueCaps;
+    PHID_DATA*          Data;
+    PULONG              DataLength;
+    PHID_ARENA          Arena;
+} HID_REPORT_STATE, * PHID_REPORT_STATE;
+
+//
+// Caps are read onto the stack to size the arena; only devices with more
+// of either than this need a temporary heap copy.
+//
+#define REPORT_STACK_CAPS       32
+
+//
+// Every part of an arena starts on a boundary any of its types is happy
+// with, which new[] guarantees for the block itself.
+//
+#define ARENA_ALIGNMENT         16
+
+static bool GetReportState(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType,
+    OUT PHID_REPORT_STATE   State
+)
+{
+    switch (ReportType)
+    {
+        case HidP_Input:
+            *State = { &HidDevice->InputReportBuffer, HidDevice->Caps.InputReportByteLength,
+                       &HidDevice->InputButtonCaps, HidDevice->Caps.NumberInputButtonCaps,
+                       &HidDevice->InputValueCaps, HidDevice->Caps.NumberInputValueCaps,
+                       &HidDevice->InputData, &HidDevice->InputDataLength, &HidDevice->InputArena };
+            return true;
+
+        case HidP_Output:
+            *State = { &HidDevice->OutputReportBuffer, HidDevice->Caps.OutputReportByteLength,
+                       &HidDevice->OutputButtonCaps, HidDevice->Caps.NumberOutputButtonCaps,
+                       &HidDevice->OutputValueCaps, HidDevice->Caps.NumberOutputValueCaps,
+                       &HidDevice->OutputData, &HidDevice->OutputDataLength, &HidDevice->OutputArena };
+            return true;
+
+        case HidP_Feature:
+            *State = { &HidDevice->FeatureReportBuffer, HidDevice->Caps.FeatureReportByteLength,
+                       &HidDevice->FeatureButtonCaps, HidDevice->Caps.NumberFeatureButtonCaps,
+                       &HidDevice->FeatureValueCaps, HidDevice->Caps.NumberFeatureValueCaps,
+                       &HidDevice->FeatureData, &HidDevice->FeatureDataLength, &HidDevice->FeatureArena };
+            return true;
+
+        default:
             return false;
-        }
     }
+}
 
-    numValues = 0;
-    for (i = 0; i < HidDevice->Caps.NumberOutputValueCaps; i++, valueCaps++)
+static ULONGLONG AlignArena(
+    IN  ULONGLONG   Offset
+)
+{
+    return (Offset + ARENA_ALIGNMENT - 1) & ~(ULONGLONG)(ARENA_ALIGNMENT - 1);
+}
+
+bool AllocateHidReportState(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType,
+    IN  ULONG               DataLength,
+    IN  ULONG               UsageLength
+)
+{
+    HID_REPORT_STATE    state;
+    ULONGLONG           dataOffset;
+    ULONGLONG           usageOffset;
+    ULONGLONG           indexOffset;
+    ULONGLONG           buttonCapsOffset;
+    ULONGLONG           valueCapsOffset;
+    ULONGLONG           length;
+    PUCHAR              base;
+
+    if (!GetReportState(HidDevice, ReportType, &state))
     {
-        if (valueCaps->IsRange)
-        {
-            numValues += valueCaps->Range.UsageMax
-                - valueCaps->Range.UsageMin + 1;
-        }
-        else
-        {
-            numValues++;
-        }
+        return false;
     }
-    valueCaps = HidDevice->OutputValueCaps;
 
-    HidDevice->OutputDataLength = HidDevice->Caps.NumberOutputButtonCaps
-        + numValues;
+    dataOffset = AlignArena(state.ReportLength);
+    usageOffset = AlignArena(dataOffset + (ULONGLONG)DataLength * sizeof(HID_DATA));
+    indexOffset = AlignArena(usageOffset + (ULONGLONG)UsageLength * sizeof(USAGE));
+    buttonCapsOffset = AlignArena(indexOffset + (ReportType == HidP_Input ? sizeof(HID_REPORT_INDEX) : 0));
+    valueCapsOffset = AlignArena(buttonCapsOffset + (ULONGLONG)state.NumberButtonCaps * sizeof(HIDP_BUTTON_CAPS));
+    length = valueCapsOffset + (ULONGLONG)state.NumberValueCaps * sizeof(HIDP_VALUE_CAPS);
 
-    try
+    //
+    // Anything this size comes from a descriptor that is lying.
+    //
+    if (length > 0x7FFFFFFF)
     {
-        HidDevice->OutputData = data = new HID_DATA[HidDevice->OutputDataLength];
-        std::memset(HidDevice->OutputData, 0, HidDevice->OutputDataLength * sizeof(HID_DATA));
+        return false;
     }
-    catch (const std::bad_alloc&)
+
+    base = new (std::nothrow) UCHAR[(size_t)length];
+    if (base == nullptr)
     {
         return false;
     }
 
-    for (i = 0;
-         i < HidDevice->Caps.NumberOutputButtonCaps;
-         i++, data++, buttonCaps++)
+    std::memset(base, 0, (size_t)length);
+
+    state.Arena->Base = base;
+    state.Arena->Length = (ULONG)length;
+    state.Arena->UsageOffset = (ULONG)usageOffset;
+    state.Arena->UsageLength = UsageLength;
+
+    *state.ReportBuffer = reinterpret_cast<PCHAR>(base);
+    *state.Data = reinterpret_cast<PHID_DATA>(base + dataOffset);
+    *state.DataLength = DataLength;
+    *state.ButtonCaps = reinterpret_cast<PHIDP_BUTTON_CAPS>(base + buttonCapsOffset);
+    *state.ValueCaps = reinterpret_cast<PHIDP_VALUE_CAPS>(base + valueCapsOffset);
+
+    if (ReportType == HidP_Input)
     {
-        if (i >= HidDevice->OutputDataLength)
-        {
-            return false;
-        }
+        HidDevice->InputReportIndex = reinterpret_cast<PHID_REPORT_INDEX>(base + indexOffset);
+    }
 
-        if (FAILED(ULongAdd((HidDevice->Caps).NumberOutputButtonCaps,
-                            (valueCaps->Range).UsageMax, &tmpSum)))
-        {
-            return false;
-        }
+    return true;
+}
 
-        if ((valueCaps->Range).UsageMin == tmpSum)
-        {
-            return false;
-        }
+bool AssignHidUsageBuffers(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+)
+{
+    HID_REPORT_STATE    state;
+    PUSAGE              usages;
+    ULONG               remaining;
 
-        data->IsButtonData = true;
-        data->Status = HIDP_STATUS_SUCCESS;
-        data->UsagePage = buttonCaps->UsagePage;
+    if (!GetReportState(HidDevice, ReportType, &state) || state.Arena->Base == nullptr)
+    {
+        return false;
+    }
 
-        if (buttonCaps->IsRange)
-        {
-            data->ButtonData.UsageMin = buttonCaps->Range.UsageMin;
-            data->ButtonData.UsageMax = buttonCaps->Range.UsageMax;
-        }
-        else
-        {
-            data->ButtonData.UsageMin = data->ButtonData.UsageMax = buttonCaps->NotRange.Usage;
-        }
+    usages = reinterpret_cast<PUSAGE>(state.Arena->Base + state.Arena->UsageOffset);
+    remaining = state.Arena->UsageLength;
 
-        data->ButtonData.MaxUsageLength = HidP_MaxUsageListLength(
-            HidP_Output,
-            buttonCaps->UsagePage,
-            HidDevice->Ppd);
+    for (ULONG i = 0; i < *state.DataLength; i++)
+    {
+        PHID_DATA data = &(*state.Data)[i];
 
-        try
+        if (!data->IsButtonData)
         {
-            data->ButtonData.Usages = new USAGE[data->ButtonData.MaxUsageLength];
-            std::memset(data->ButtonData.Usages, 0, data->ButtonData.MaxUsageLength * sizeof(USAGE));
+            continue;
         }
-        catch (const std::bad_alloc&)
+
+        if (data->ButtonData.MaxUsageLength > remaining)
         {
             return false;
         }
 
-        data->ReportID = buttonCaps->ReportID;
+        data->ButtonData.Usages = usages;
+        usages += data->ButtonData.MaxUsageLength;
+        remaining -= data->ButtonData.MaxUsageLength;
     }
 
-    for (i = 0; i < HidDevice->Caps.NumberOutputValueCaps; i++, valueCaps++)
+    return true;
+}
+
+void FreeHidReportState(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+)
+{
+    HID_REPORT_STATE    state;
+
+    if (!GetReportState(HidDevice, ReportType, &state))
     {
-        if (valueCaps->IsRange)
-        {
-            for (usage = valueCaps->Range.UsageMin;
-                 usage <= valueCaps->Range.UsageMax;
-                 usage++)
-            {
-                data->IsButtonData = false;
-                data->Status = HIDP_STATUS_SUCCESS;
-                data->UsagePage = valueCaps->UsagePage;
-                data->ValueData.Usage = usage;
-                data->ReportID = valueCaps->ReportID;
-                data++;
-            }
-        }
-        else
-        {
-            data->IsButtonData = false;
-            data->Status = HIDP_STATUS_SUCCESS;
-            data->UsagePage = valueCaps->UsagePage;
-            data->ValueData.Usage = valueCaps->NotRange.Usage;
-            data->ReportID = valueCaps->ReportID;
-            data++;
-        }
+        return;
     }
 
-    //
-    // setup Feature Data buffers.
-    //
+    delete[] state.Arena->Base;
 
-    try
+    *state.Arena = {};
+    *state.ReportBuffer = nullptr;
+    *state.Data = nullptr;
+    *state.DataLength = 0;
+    *state.ButtonCaps = nullptr;
+    *state.ValueCaps = nullptr;
+
+    if (ReportType == HidP_Input)
     {
-        HidDevice->FeatureReportBuffer = new char[HidDevice->Caps.FeatureReportByteLength];
-        std::memset(HidDevice->FeatureReportBuffer, 0, HidDevice->Caps.FeatureReportByteLength);
+        HidDevice->InputReportIndex = nullptr;
+    }
+}
 
-        HidDevice->FeatureButtonCaps = buttonCaps = new HIDP_BUTTON_CAPS[HidDevice->Caps.NumberFeatureButtonCaps];
-        std::memset(HidDevice->FeatureButtonCaps, 0, HidDevice->Caps.NumberFeatureButtonCaps * sizeof(HIDP_BUTTON_CAPS));
+static bool FillReportInfo(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+)
+/*++
+RoutineDescription:
+   Lay out one report type of a device from its preparsed data: one
+   HID_DATA for each set of buttons and, ranges expanded, one for each
+   value. The caps are read twice, once onto the stack to find out how
+   big the arena has to be and once more into it, which is cheaper than
+   allocating anything beyond the arena itself. On failure the caller
+   frees whatever was allocated with FreeHidReportState.
+--*/
+{
+    HID_REPORT_STATE                state;
+    HIDP_BUTTON_CAPS                stackButtonCaps[REPORT_STACK_CAPS];
+    HIDP_VALUE_CAPS                 stackValueCaps[REPORT_STACK_CAPS];
+    std::vector<HIDP_BUTTON_CAPS>   heapButtonCaps;
+    std::vector<HIDP_VALUE_CAPS>    heapValueCaps;
+    PHIDP_BUTTON_CAPS               buttonCaps = stackButtonCaps;
+    PHIDP_VALUE_CAPS                valueCaps = stackValueCaps;
+    PHID_DATA                       data;
+    USHORT                          numCaps;
+    ULONG                           numValues;
+    ULONG                           dataLength;
+    ULONG                           usageLength;
+    ULONG                           tmpSum;
+    ULONG                           i;
+    USAGE                           usage;
+    UINT                            dataIdx;
+
+    if (!GetReportState(HidDevice, ReportType, &state))
+    {
+        return false;
+    }
 
-        HidDevice->FeatureValueCaps = valueCaps = new HIDP_VALUE_CAPS[HidDevice->Caps.NumberFeatureValueCaps];
-        std::memset(HidDevice->FeatureValueCaps, 0, HidDevice->Caps.NumberFeatureValueCaps * sizeof(HIDP_VALUE_CAPS));
+    try
+    {
+        if (state.NumberButtonCaps > REPORT_STACK_CAPS)
+        {
+            heapButtonCaps.resize(state.NumberButtonCaps);
+            buttonCaps = heapButtonCaps.data();
+        }
+
+        if (state.NumberValueCaps > REPORT_STACK_CAPS)
+        {
+            heapValueCaps.resize(state.NumberValueCaps);
+            valueCaps = heapValueCaps.data();
+        }
     }
     catch (const std::bad_alloc&)
     {
         return false;
     }
 
-    numCaps = HidDevice->Caps.NumberFeatureButtonCaps;
+    //
+    // Have the HidP_X functions fill in the capability structure arrays.
+    //
+
+    numCaps = state.NumberButtonCaps;
+
     if (numCaps > 0)
     {
-        if (HIDP_STATUS_SUCCESS != (HidP_GetButtonCaps(HidP_Feature,
+        if (HIDP_STATUS_SUCCESS != (HidP_GetButtonCaps(ReportType,
                                                        buttonCaps,
                                                        &numCaps,
                                                        HidDevice->Ppd)))
@@ -737,10 +960,11 @@ bool FillDeviceInfo(
         }
     }
 
-    numCaps = HidDevice->Caps.NumberFeatureValueCaps;
+    numCaps = state.NumberValueCaps;
+
     if (numCaps > 0)
     {
-        if (HIDP_STATUS_SUCCESS != (HidP_GetValueCaps(HidP_Feature,
+        if (HIDP_STATUS_SUCCESS != (HidP_GetValueCaps(ReportType,
                                                       valueCaps,
                                                       &numCaps,
                                                       HidDevice->Ppd)))
@@ -749,48 +973,92 @@ bool FillDeviceInfo(
         }
     }
 
+    //
+    // Depending on the device, some value caps structures may represent more
+    // than one value.  (A range).  In the interest of being verbose, over
+    // efficient, we will expand these so that we have one and only one
+    // struct _HID_DATA for each value.
+    //
+    // To do this we need to count up the total number of values are listed
+    // in the value caps structure.  For each element in the array we test
+    // for range if it is a range then UsageMax and UsageMin describe the
+    // usages for this range INCLUSIVE.
+    //
+
     numValues = 0;
-    for (i = 0; i < HidDevice->Caps.NumberFeatureValueCaps; i++, valueCaps++)
+    for (i = 0; i < state.NumberValueCaps; i++)
     {
-        if (valueCaps->IsRange)
+        if (valueCaps[i].IsRange)
         {
-            numValues += valueCaps->Range.UsageMax
-                - valueCaps->Range.UsageMin + 1;
+            if (valueCaps[i].Range.UsageMin > valueCaps[i].Range.UsageMax)
+            {
+                return false;
+            }
+            numValues += valueCaps[i].Range.UsageMax - valueCaps[i].Range.UsageMin + 1;
         }
         else
         {
             numValues++;
         }
     }
-    valueCaps = HidDevice->FeatureValueCaps;
 
-    if (FAILED(ULongAdd(HidDevice->Caps.NumberFeatureButtonCaps,
-                        numValues, &newFeatureDataLength)))
+    //
+    // One element for each set of buttons, and one element for each value
+    // found, and as many usages as the button sets can report at once.
+    //
+
+    if (FAILED(ULongAdd(state.NumberButtonCaps, numValues, &dataLength)))
     {
         return false;
     }
 
-    HidDevice->FeatureDataLength = newFeatureDataLength;
+    usageLength = 0;
+    for (i = 0; i < state.NumberButtonCaps; i++)
+    {
+        if (FAILED(ULongAdd(usageLength,
+                            HidP_MaxUsageListLength(ReportType, buttonCaps[i].UsagePage, HidDevice->Ppd),
+                            &usageLength)))
+        {
+            return false;
+        }
+    }
 
-    try
+    //
+    // The output layout has always been refused when the first value range
+    // ends where the buttons' own count would put it.
+    //
+    if (ReportType == HidP_Output && state.NumberButtonCaps > 0 && state.NumberValueCaps > 0)
     {
-        HidDevice->FeatureData = data = new HID_DATA[HidDevice->FeatureDataLength];
-        std::memset(HidDevice->FeatureData, 0, HidDevice->FeatureDataLength * sizeof(HID_DATA));
+        if (FAILED(ULongAdd(state.NumberButtonCaps, valueCaps->Range.UsageMax, &tmpSum)) ||
+            valueCaps->Range.UsageMin == tmpSum)
+        {
+            return false;
+        }
     }
-    catch (const std::bad_alloc&)
+
+    if (!AllocateHidReportState(HidDevice, ReportType, dataLength, usageLength))
     {
         return false;
     }
 
+    std::copy(buttonCaps, buttonCaps + state.NumberButtonCaps, *state.ButtonCaps);
+    std::copy(valueCaps, valueCaps + state.NumberValueCaps, *state.ValueCaps);
+
+    buttonCaps = *state.ButtonCaps;
+    valueCaps = *state.ValueCaps;
+    data = *state.Data;
+
+    //
+    // Fill in the button data
+    //
     dataIdx = 0;
     for (i = 0;
-         i < HidDevice->Caps.NumberFeatureButtonCaps;
+         i < state.NumberButtonCaps;
          i++, data++, buttonCaps++, dataIdx++)
     {
         data->IsButtonData = true;
         data->Status = HIDP_STATUS_SUCCESS;
         data->UsagePage = buttonCaps->UsagePage;
-
         if (buttonCaps->IsRange)
         {
             data->ButtonData.UsageMin = buttonCaps->Range.UsageMin;
@@ -802,23 +1070,18 @@ bool FillDeviceInfo(
         }
 
         data->ButtonData.MaxUsageLength = HidP_MaxUsageListLength(
-            HidP_Feature,
+            ReportType,
             buttonCaps->UsagePage,
             HidDevice->Ppd);
-        try
-        {
-            data->ButtonData.Usages = new USAGE[data->ButtonData.MaxUsageLength];
-            std::memset(data->ButtonData.Usages, 0, data->ButtonData.MaxUsageLength * sizeof(USAGE));
-        }
-        catch (const std::bad_alloc&)
-        {
-            return false;
-        }
 
         data->ReportID = buttonCaps->ReportID;
     }
 
-    for (i = 0; i < HidDevice->Caps.NumberFeatureValueCaps; i++, valueCaps++)
+    //
+    // Fill in the value data
+    //
+
+    for (i = 0; i < state.NumberValueCaps; i++, valueCaps++)
     {
         if (valueCaps->IsRange)
         {
@@ -826,7 +1089,7 @@ bool FillDeviceInfo(
                  usage <= valueCaps->Range.UsageMax;
                  usage++)
             {
-                if (dataIdx >= (HidDevice->FeatureDataLength))
+                if (dataIdx >= dataLength)
                 {
                     return false;
                 }
@@ -841,7 +1104,7 @@ bool FillDeviceInfo(
         }
         else
         {
-            if (dataIdx >= (HidDevice->FeatureDataLength))
+            if (dataIdx >= dataLength)
             {
                 return false;
             }
@@ -855,116 +1118,162 @@ bool FillDeviceInfo(
         }
     }
 
-    return true;
+    return AssignHidUsageBuffers(HidDevice, ReportType);
 }
 
-void CloseHidDevices(
-    IN  PHID_DEVICE HidDevices,
-    IN  ULONG       NumberDevices
+bool FillDeviceInfo(
+    IN  PHID_DEVICE HidDevice
 )
 {
-    for (unsigned int Index = 0; Index < NumberDevices; Index++)
-    {
-        CloseHidDevice(HidDevices + Index);
-    }
+    bool                restored;
 
-    return;
-}
-
-void CloseHidDevice(
-    IN PHID_DEVICE HidDevice
-)
-{
-    if (HidDevice->DevicePath != nullptr)
+    //
+    // A device seen before with the same descriptor and caps gets its
+    // layout from the cache rather than from the preparsed data.
+    //
+    if (!RestoreHidDeviceLayout(HidDevice, &restored))
     {
-        delete[] HidDevice->DevicePath;
-        HidDevice->DevicePath = nullptr;
+        return false;
     }
 
-    if (INVALID_HANDLE_VALUE != HidDevice->HidDevice)
+    if (restored)
     {
-        CloseHandle(HidDevice->HidDevice);
-        HidDevice->HidDevice = INVALID_HANDLE_VALUE;
+        return true;
     }
 
-    if (HidDevice->Ppd != nullptr)
+    if (!FillReportInfo(HidDevice, HidP_Input))
     {
-        HidD_FreePreparsedData(HidDevice->Ppd);
-        HidDevice->Ppd = nullptr;
+        return false;
     }
 
-    if (HidDevice->InputReportBuffer != nullptr)
-    {
-        delete[] HidDevice->InputReportBuffer;
-        HidDevice->InputReportBuffer = nullptr;
-    }
+    //
+    // Group the input data by report ID, then compile the input layout once
+    // so reports can be decoded without going through the preparsed data.
+    // Either step failing only leaves UnpackInputReport on the slower path.
+    //
+    BuildInputReportIndex(HidDevice);
+    CompileInputDecoder(HidDevice);
 
-    if (HidDevice->InputData != nullptr)
-    {
-        delete[] HidDevice->InputData;
-        HidDevice->InputData = nullptr;
-    }
+    //
+    // Output and feature state is left to PrepareHidReports, for callers
+    // that actually write or query them.
+    //
+    StoreHidDeviceLayout(HidDevice);
+    return true;
+}
+
+bool PrepareHidReports(
+    IN  PHID_DEVICE         HidDevice,
+    IN  HIDP_REPORT_TYPE    ReportType
+)
+/*++
+RoutineDescription:
+   Lay out the output or feature state of a device the first time it is
+   needed. The arena is only kept once the layout is complete, so its
+   presence marks the work as done and a failed attempt is simply tried
+   again next time.
+--*/
+{
+    HID_REPORT_STATE    state;
 
-    if (HidDevice->InputButtonCaps != nullptr)
+    if (!GetReportState(HidDevice, ReportType, &state))
     {
-        delete[] HidDevice->InputButtonCaps;
-        HidDevice->InputButtonCaps = nullptr;
+        return false;
     }
 
-    if (HidDevice->InputValueCaps != nullptr)
+    if (state.Arena->Base != nullptr || ReportType == HidP_Input)
     {
-        delete[] HidDevice->InputValueCaps;
-        HidDevice->InputValueCaps = nullptr;
+        return state.Arena->Base != nullptr;
     }
 
-    if (HidDevice->OutputReportBuffer != nullptr)
+    if (!FillReportInfo(HidDevice, ReportType))
     {
-        delete[] HidDevice->OutputReportBuffer;
-        HidDevice->OutputReportBuffer = nullptr;
+        FreeHidReportState(HidDevice, ReportType);
+        return false;
     }
 
-    if (HidDevice->OutputData != nullptr)
+    return true;
+}
+
+SIZE_T GetHidDeviceFootprint(
+    IN  PHID_DEVICE HidDevice
+)
+/*++
+RoutineDescription:
+   Bytes of per device state this module allocated for HidDevice: the
+   path, the arenas of the report types laid out and the input decoder.
+   The preparsed data belongs to the HID stack and is left out.
+--*/
+{
+    SIZE_T  footprint = 0;
+    ULONG   decoderLength = 0;
+
+    if (HidDevice->DevicePath != nullptr)
     {
-        delete[] HidDevice->OutputData;
-        HidDevice->OutputData = nullptr;
+        footprint += std::strlen(HidDevice->DevicePath) + 1;
     }
 
-    if (HidDevice->OutputButtonCaps != nullptr)
+    footprint += HidDevice->InputArena.Length +
+                 HidDevice->OutputArena.Length +
+                 HidDevice->FeatureArena.Length;
+
+    //
+    // The decoder's image is its two tables and a small header, near
+    // enough what it holds in memory.
+    //
+    if (HidDevice->InputDecoder != nullptr)
     {
-        delete[] HidDevice->OutputButtonCaps;
-        HidDevice->OutputButtonCaps = nullptr;
+        SaveReportDecoder(HidDevice->InputDecoder, nullptr, &decoderLength);
+        footprint += decoderLength;
     }
 
-    if (HidDevice->OutputValueCaps != nullptr)
+    return footprint;
+}
+
+void CloseHidDevices(
+    IN  PHID_DEVICE HidDevices,
+    IN  ULONG       NumberDevices
+)
+{
+    for (unsigned int Index = 0; Index < NumberDevices; Index++)
     {
-        delete[] HidDevice->OutputValueCaps;
-        HidDevice->OutputValueCaps = nullptr;
+        CloseHidDevice(HidDevices + Index);
     }
 
-    if (HidDevice->FeatureReportBuffer != nullptr)
+    return;
+}
+
+void CloseHidDevice(
+    IN PHID_DEVICE HidDevice
+)
+{
+    if (HidDevice->DevicePath != nullptr)
     {
-        delete[] HidDevice->FeatureReportBuffer;
-        HidDevice->FeatureReportBuffer = nullptr;
+        delete[] HidDevice->DevicePath;
+        HidDevice->DevicePath = nullptr;
     }
 
-    if (HidDevice->FeatureData != nullptr)
+    if (INVALID_HANDLE_VALUE != HidDevice->HidDevice)
     {
-        delete[] HidDevice->FeatureData;
-        HidDevice->FeatureData = nullptr;
+        CloseHandle(HidDevice->HidDevice);
+        HidDevice->HidDevice = INVALID_HANDLE_VALUE;
     }
 
-    if (HidDevice->FeatureButtonCaps != nullptr)
+    if (HidDevice->Ppd != nullptr)
     {
-        delete[] HidDevice->FeatureButtonCaps;
-        HidDevice->FeatureButtonCaps = nullptr;
+        HidD_FreePreparsedData(HidDevice->Ppd);
+        HidDevice->Ppd = nullptr;
     }
 
-    if (HidDevice->FeatureValueCaps != nullptr)
+    if (HidDevice->InputDecoder != nullptr)
     {
-        delete[] HidDevice->FeatureValueCaps;
-        HidDevice->FeatureValueCaps = nullptr;
+        FreeReportDecoder(HidDevice->InputDecoder);
+        HidDevice->InputDecoder = nullptr;
     }
 
+    FreeHidReportState(HidDevice, HidP_Input);
+    FreeHidReportState(HidDevice, HidP_Output);
+    FreeHidReportState(HidDevice, HidP_Feature);
+
     return;
 }
-
@@ -18,17 +18,33 @@ Environment:
 --*/
 
 #include <stdlib.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#ifdef _WIN32
 #include <wtypes.h>
+#include <cfgmgr32.h>
 #include "hidsdi.h"
+#endif
 #include "hid.h"
 
-bool Read(
-    PHID_DEVICE    HidDevice
+#ifdef _WIN32
+
+//
+// Report I/O on Windows handles. hidraw.cpp provides the same primitives
+// and event loop for hidraw file descriptors.
+//
+
+bool ReadInputReport(
+    PHID_DEVICE    HidDevice,
+    PULONG         BytesRead
 )
 /*++
 RoutineDescription:
-   Given a struct _HID_DEVICE, obtain a read report and unpack the values
-   into the InputData array.
+   Synchronously read one input report into InputReportBuffer.
 --*/
 {
     DWORD       bytesRead;
@@ -42,18 +58,26 @@ RoutineDescription:
         return false;
     }
 
-    ASSERT(bytesRead == HidDevice->Caps.InputReportByteLength);
-    if (bytesRead != HidDevice->Caps.InputReportByteLength)
-    {
-        return false;
-    }
+    *BytesRead = bytesRead;
+    HidDevice->InputReportTime = GetReportTime();
+    return true;
+}
+
+bool WriteOutputReport(
+    PHID_DEVICE    HidDevice
+)
+/*++
+RoutineDescription:
+   Send the packed OutputReportBuffer to the device.
+--*/
+{
+    DWORD       bytesWritten;
 
-    return UnpackReport(HidDevice->InputReportBuffer,
-                        HidDevice->Caps.InputReportByteLength,
-                        HidP_Input,
-                        HidDevice->InputData,
-                        HidDevice->InputDataLength,
-                        HidDevice->Ppd);
+    return WriteFile(HidDevice->HidDevice,
+                     HidDevice->OutputReportBuffer,
+                     HidDevice->Caps.OutputReportByteLength,
+                     &bytesWritten,
+                     NULL) && (bytesWritten == HidDevice->Caps.OutputReportByteLength);
 }
 
 bool ReadOverlapped(
@@ -119,6 +143,591 @@ RoutineDescription:
     }
 }
 
+//
+// Event loop. Every attached device keeps a ring of QueueDepth overlapped
+// reads outstanding, each with its own report buffer, and all of them
+// complete through a single I/O completion port, so any number of devices is
+// served by the calling thread alone. Completed slots are handed out oldest
+// first, which is the order the HID class driver fills them in.
+// StopHidEventLoop posts a packet with a null OVERLAPPED to the same port to
+// wake an indefinite wait.
+//
+// Arrivals are device interface notifications for the HID class. They are
+// delivered on a thread pool thread, which queues the interface path and
+// posts a packet with HID_ARRIVAL_KEY to wake the wait.
+//
+
+#define HID_ARRIVAL_KEY     ((ULONG_PTR)1)
+
+typedef struct _HID_READ_CONTEXT* PHID_READ_CONTEXT;
+
+typedef struct _HID_READ_SLOT
+{
+    OVERLAPPED          Overlap;        // Must stay first, the port hands back &Overlap
+    PHID_READ_CONTEXT   Context;
+    PCHAR               ReportBuffer;
+    DWORD               BytesRead;
+    ULONGLONG           CompletionTime; // GetReportTime() when the completion was dequeued
+    bool                ReadPending;    // Queued in the driver
+    bool                Completed;      // Finished, waiting to be handed out
+    bool                Failed;
+} HID_READ_SLOT, * PHID_READ_SLOT;
+
+typedef struct _HID_READ_CONTEXT
+{
+    PHID_DEVICE                 HidDevice;
+    std::vector<HID_READ_SLOT>  Slots;      // Sized once, OVERLAPPED addresses must not move
+    ULONG                       Head;       // Oldest slot, the next one handed out
+    bool                        Full;       // Every slot completed, none queued in the driver
+    HID_READ_STATS              Stats;
+} HID_READ_CONTEXT;
+
+struct _HID_EVENT_LOOP
+{
+    HANDLE                          CompletionPort;
+    std::vector<PHID_READ_CONTEXT>  Devices;
+    std::vector<PHID_READ_CONTEXT>  Retired;    // Detached, completions may still be queued
+    size_t                          NextDevice;
+    std::atomic<bool>               Stopped;
+    HCMNOTIFICATION                 Notification;   // Null unless watching for arrivals
+    std::mutex                      ArrivalLock;
+    std::vector<std::string>        Arrivals;       // Interface paths, guarded by ArrivalLock
+};
+
+static void FreeReadContext(
+    PHID_READ_CONTEXT   Context
+)
+{
+    for (HID_READ_SLOT& slot : Context->Slots)
+    {
+        delete[] slot.ReportBuffer;
+    }
+    delete Context;
+}
+
+static bool BeginRead(
+    PHID_READ_SLOT      Slot
+)
+/*++
+RoutineDescription:
+   Issue the overlapped read for one slot. Completion, synchronous or not,
+   is always reported through the completion port. A read that cannot be
+   issued is marked as a failed completion so it is reported in order.
+--*/
+{
+    PHID_DEVICE hidDevice = Slot->Context->HidDevice;
+
+    memset(&Slot->Overlap, 0, sizeof(OVERLAPPED));
+
+    if (!ReadFile(hidDevice->HidDevice,
+                  Slot->ReportBuffer,
+                  hidDevice->Caps.InputReportByteLength,
+                  nullptr,
+                  &Slot->Overlap) &&
+        GetLastError() != ERROR_IO_PENDING)
+    {
+        Slot->Completed = true;
+        Slot->Failed = true;
+        return false;
+    }
+
+    Slot->ReadPending = true;
+    return true;
+}
+
+static void CancelReads(
+    PHID_READ_CONTEXT   Context
+)
+{
+    DWORD       bytesTransferred;
+
+    CancelIoEx(Context->HidDevice->HidDevice, nullptr);
+
+    for (HID_READ_SLOT& slot : Context->Slots)
+    {
+        if (slot.ReadPending)
+        {
+            GetOverlappedResult(Context->HidDevice->HidDevice, &slot.Overlap, &bytesTransferred, true);
+            slot.ReadPending = false;
+        }
+    }
+}
+
+PHID_EVENT_LOOP CreateHidEventLoop(
+    void
+)
+{
+    PHID_EVENT_LOOP eventLoop = new (std::nothrow) HID_EVENT_LOOP{};
+
+    if (eventLoop == nullptr)
+    {
+        return nullptr;
+    }
+
+    eventLoop->CompletionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+
+    if (eventLoop->CompletionPort == nullptr)
+    {
+        delete eventLoop;
+        return nullptr;
+    }
+
+    return eventLoop;
+}
+
+bool AttachHidDevice(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice,
+    IN  ULONG               QueueDepth
+)
+{
+    PHID_READ_CONTEXT   context = nullptr;
+    ULONG               numberBuffers;
+
+    if (!HidDevice->OpenedOverlapped || QueueDepth == 0)
+    {
+        return false;
+    }
+
+    try
+    {
+        context = new HID_READ_CONTEXT{};
+        context->HidDevice = HidDevice;
+        context->Stats.QueueDepth = QueueDepth;
+        context->Slots.resize(QueueDepth);
+
+        for (HID_READ_SLOT& slot : context->Slots)
+        {
+            slot.Context = context;
+            slot.ReportBuffer = new CHAR[HidDevice->Caps.InputReportByteLength];
+        }
+
+        EventLoop->Devices.push_back(context);
+    }
+    catch (const std::bad_alloc&)
+    {
+        if (context != nullptr)
+        {
+            FreeReadContext(context);
+        }
+        return false;
+    }
+
+    if (CreateIoCompletionPort(HidDevice->HidDevice, EventLoop->CompletionPort, (ULONG_PTR)context, 0) == nullptr)
+    {
+        EventLoop->Devices.pop_back();
+        FreeReadContext(context);
+        return false;
+    }
+
+    //
+    // Make sure the driver's own ring can hold at least as many reports as we
+    // keep reads outstanding for, it is what absorbs a burst when ours is full.
+    //
+    if (HidD_GetNumInputBuffers(HidDevice->HidDevice, &numberBuffers) && numberBuffers < QueueDepth)
+    {
+        HidD_SetNumInputBuffers(HidDevice->HidDevice, QueueDepth);
+    }
+
+    for (HID_READ_SLOT& slot : context->Slots)
+    {
+        if (!BeginRead(&slot))
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+void DetachHidDevice(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice
+)
+/*++
+RoutineDescription:
+   Cancel the device's reads and stop serving it. The cancelled reads still
+   post packets to the completion port, so the context is kept until the
+   loop is destroyed and its packets are ignored.
+--*/
+{
+    for (size_t i = 0; i < EventLoop->Devices.size(); i++)
+    {
+        PHID_READ_CONTEXT context = EventLoop->Devices[i];
+
+        if (context->HidDevice == HidDevice)
+        {
+            CancelReads(context);
+            context->HidDevice = nullptr;
+            try
+            {
+                EventLoop->Retired.push_back(context);
+            }
+            catch (const std::bad_alloc&)
+            {
+                // Leak the context rather than free memory a queued packet points at
+            }
+            EventLoop->Devices.erase(EventLoop->Devices.begin() + i);
+
+            if (EventLoop->NextDevice > i)
+            {
+                EventLoop->NextDevice--;
+            }
+            return;
+        }
+    }
+}
+
+bool GetHidReadStats(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  PHID_DEVICE         HidDevice,
+    OUT PHID_READ_STATS     Stats
+)
+{
+    for (PHID_READ_CONTEXT context : EventLoop->Devices)
+    {
+        if (context->HidDevice == HidDevice)
+        {
+            *Stats = context->Stats;
+            return true;
+        }
+    }
+    return false;
+}
+
+static PHID_READ_CONTEXT NextCompletedDevice(
+    PHID_EVENT_LOOP     EventLoop
+)
+/*++
+RoutineDescription:
+   Find the next device, round robin, whose oldest slot has completed.
+--*/
+{
+    for (size_t i = 0; i < EventLoop->Devices.size(); i++)
+    {
+        size_t              index = (EventLoop->NextDevice + i) % EventLoop->Devices.size();
+        PHID_READ_CONTEXT   context = EventLoop->Devices[index];
+
+        if (context->Slots[context->Head].Completed)
+        {
+            EventLoop->NextDevice = index + 1;
+            return context;
+        }
+    }
+    return nullptr;
+}
+
+HID_WAIT_STATUS WaitForHidReport(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    IN  ULONG               Timeout,
+    OUT PHID_DEVICE*        HidDevice,
+    OUT PULONG              BytesRead
+)
+/*++
+RoutineDescription:
+   Hand out the oldest completed report of the next device that has one,
+   waiting up to Timeout milliseconds for a completion if none has. The
+   report is copied to InputReportBuffer and its slot is re-armed at once,
+   so the ring stays full while the caller processes the report.
+--*/
+{
+    DWORD               bytesTransferred = 0;
+    ULONG_PTR           completionKey = 0;
+    LPOVERLAPPED        overlap = nullptr;
+    PHID_READ_CONTEXT   context;
+    PHID_READ_SLOT      slot;
+
+    *HidDevice = nullptr;
+
+    while (true)
+    {
+        if (EventLoop->Stopped)
+        {
+            return HidWaitStopped;
+        }
+
+        if (EventLoop->Devices.empty() && EventLoop->Notification == nullptr)
+        {
+            return HidWaitError;
+        }
+
+        if ((context = NextCompletedDevice(EventLoop)) != nullptr)
+        {
+            break;
+        }
+
+        BOOL completed = GetQueuedCompletionStatus(EventLoop->CompletionPort,
+                                                   &bytesTransferred,
+                                                   &completionKey,
+                                                   &overlap,
+                                                   Timeout);
+
+        if (overlap == nullptr)
+        {
+            if (completed && completionKey == HID_ARRIVAL_KEY)
+            {
+                return HidWaitArrival;
+            }
+
+            if (completed)
+            {
+                continue;   // Stop packet, Stopped is already set
+            }
+            return (GetLastError() == WAIT_TIMEOUT) ? HidWaitTimeout : HidWaitError;
+        }
+
+        context = reinterpret_cast<PHID_READ_CONTEXT>(completionKey);
+        slot = CONTAINING_RECORD(overlap, HID_READ_SLOT, Overlap);
+
+        if (context->HidDevice == nullptr)
+        {
+            continue;
+        }
+
+        slot->ReadPending = false;
+        slot->Completed = true;
+        slot->Failed = !completed;
+        slot->BytesRead = bytesTransferred;
+        slot->CompletionTime = GetReportTime();
+
+        //
+        // With every slot completed and none queued in the driver, further
+        // reports pile up in the driver's buffer and are lost once it fills.
+        // Whether any came in is only known once a read is queued again.
+        //
+        bool anyPending = false;
+
+        for (const HID_READ_SLOT& other : context->Slots)
+        {
+            anyPending = anyPending || other.ReadPending;
+        }
+
+        context->Full = context->Full || !anyPending;
+    }
+
+    slot = &context->Slots[context->Head];
+    *HidDevice = context->HidDevice;
+
+    if (slot->Failed)
+    {
+        return HidWaitError;
+    }
+
+    memcpy(context->HidDevice->InputReportBuffer, slot->ReportBuffer, slot->BytesRead);
+    context->HidDevice->InputReportTime = slot->CompletionTime;
+    *BytesRead = slot->BytesRead;
+    context->Stats.Reports++;
+
+    slot->Completed = false;
+    context->Head = (context->Head + 1) % context->Slots.size();
+    BeginRead(slot);
+
+    //
+    // A read that is done as soon as it is queued found a report waiting in
+    // the driver, one that came in while the ring was full. That is what
+    // the hidraw backend counts as well; a full ring on its own is not.
+    //
+    if (context->Full)
+    {
+        context->Full = false;
+
+        if (slot->ReadPending && HasOverlappedIoCompleted(&slot->Overlap))
+        {
+            context->Stats.Overflows++;
+        }
+    }
+
+    return HidWaitReport;
+}
+
+static DWORD CALLBACK ArrivalCallback(
+    HCMNOTIFICATION         Notification,
+    PVOID                   Context,
+    CM_NOTIFY_ACTION        Action,
+    PCM_NOTIFY_EVENT_DATA   EventData,
+    DWORD                   EventDataSize
+)
+{
+    PHID_EVENT_LOOP eventLoop = static_cast<PHID_EVENT_LOOP>(Context);
+    CHAR            devicePath[MAX_PATH];
+
+    (void)Notification;
+    (void)EventDataSize;
+
+    if (Action != CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL ||
+        WideCharToMultiByte(CP_ACP, 0, EventData->u.DeviceInterface.SymbolicLink, -1,
+                            devicePath, sizeof(devicePath), nullptr, nullptr) == 0)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    try
+    {
+        std::lock_guard<std::mutex> lock(eventLoop->ArrivalLock);
+
+        eventLoop->Arrivals.push_back(devicePath);
+    }
+    catch (const std::bad_alloc&)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    PostQueuedCompletionStatus(eventLoop->CompletionPort, 0, HID_ARRIVAL_KEY, nullptr);
+    return ERROR_SUCCESS;
+}
+
+bool WatchHidArrivals(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+{
+    CM_NOTIFY_FILTER    filter = {};
+
+    if (EventLoop->Notification != nullptr)
+    {
+        return true;
+    }
+
+    filter.cbSize = sizeof(filter);
+    filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+    HidD_GetHidGuid(&filter.u.DeviceInterface.ClassGuid);
+
+    if (CM_Register_Notification(&filter, EventLoop, ArrivalCallback, &EventLoop->Notification) != CR_SUCCESS)
+    {
+        EventLoop->Notification = nullptr;
+        return false;
+    }
+    return true;
+}
+
+bool GetHidArrivals(
+    IN  PHID_EVENT_LOOP     EventLoop,
+    OUT PHID_DEVICE*        HidDevices,
+    OUT PULONG              NumberDevices
+)
+/*++
+RoutineDescription:
+   Open every interface announced since the last call with query access.
+   Interfaces that are already gone again or cannot be opened are left out.
+--*/
+{
+    std::vector<std::string>    arrivals;
+    std::vector<HID_DEVICE>     devices;
+
+    *HidDevices = nullptr;
+    *NumberDevices = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(EventLoop->ArrivalLock);
+
+        arrivals.swap(EventLoop->Arrivals);
+    }
+
+    try
+    {
+        for (const std::string& devicePath : arrivals)
+        {
+            HID_DEVICE device;
+
+            if (OpenHidDevice(devicePath.c_str(), false, false, false, false, &device))
+            {
+                devices.push_back(device);
+            }
+        }
+
+        if (!devices.empty())
+        {
+            *HidDevices = new HID_DEVICE[devices.size()];
+            memcpy(*HidDevices, devices.data(), devices.size() * sizeof(HID_DEVICE));
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        CloseHidDevices(devices.data(), (ULONG)devices.size());
+        return false;
+    }
+
+    *NumberDevices = (ULONG)devices.size();
+    return true;
+}
+
+void StopHidEventLoop(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+/*++
+RoutineDescription:
+   Make the current and every later WaitForHidReport return HidWaitStopped.
+   Safe to call from any thread, including a console control handler.
+--*/
+{
+    EventLoop->Stopped = true;
+    PostQueuedCompletionStatus(EventLoop->CompletionPort, 0, 0, nullptr);
+}
+
+void DestroyHidEventLoop(
+    IN  PHID_EVENT_LOOP     EventLoop
+)
+{
+    if (EventLoop == nullptr)
+    {
+        return;
+    }
+
+    // Waits for a callback still running, none can touch the loop afterwards
+    if (EventLoop->Notification != nullptr)
+    {
+        CM_Unregister_Notification(EventLoop->Notification);
+    }
+
+    for (PHID_READ_CONTEXT context : EventLoop->Devices)
+    {
+        CancelReads(context);
+        FreeReadContext(context);
+    }
+
+    for (PHID_READ_CONTEXT context : EventLoop->Retired)
+    {
+        FreeReadContext(context);
+    }
+
+    CloseHandle(EventLoop->CompletionPort);
+    delete EventLoop;
+}
+
+#endif // _WIN32
+
+ULONGLONG GetReportTime(
+    void
+)
+{
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool Read(
+    PHID_DEVICE    HidDevice
+)
+/*++
+RoutineDescription:
+   Given a struct _HID_DEVICE, obtain a read report and unpack the values
+   into the InputData array.
+--*/
+{
+    ULONG       bytesRead;
+
+    if (!ReadInputReport(HidDevice, &bytesRead))
+    {
+        return false;
+    }
+
+    ASSERT(bytesRead == HidDevice->Caps.InputReportByteLength);
+    if (bytesRead != HidDevice->Caps.InputReportByteLength)
+    {
+        return false;
+    }
+
+    return UnpackInputReport(HidDevice);
+}
+
 bool Write(
     PHID_DEVICE    HidDevice
 )
@@ -128,12 +737,16 @@ RoutineDescription:
    pack it into multiple write reports and send each report to the HID device
 --*/
 {
-    DWORD       bytesWritten;
     PHID_DATA   pData;
     ULONG       Index;
     bool        Status;
     bool        WriteStatus;
 
+    if (!PrepareHidReports(HidDevice, HidP_Output))
+    {
+        return false;
+    }
+
     /*
     // Begin by looping through the HID_DEVICE's HID_DATA structure and setting
     //   the IsDataSet field to false to indicate that each structure has
@@ -179,11 +792,7 @@ RoutineDescription:
             // Now a report has been packaged up...Send it down to the device
             */
 
-            WriteStatus = WriteFile(HidDevice->HidDevice,
-                                    HidDevice->OutputReportBuffer,
-                                    HidDevice->Caps.OutputReportByteLength,
-                                    &bytesWritten,
-                                    NULL) && (bytesWritten == HidDevice->Caps.OutputReportByteLength);
+            WriteStatus = WriteOutputReport(HidDevice);
 
             Status = Status && WriteStatus;
         }
@@ -204,6 +813,12 @@ pack it into multiple reports and send it to the hid device via HidD_SetFeature(
     ULONG       Index;
     bool        Status;
     bool        FeatureStatus;
+
+    if (!PrepareHidReports(HidDevice, HidP_Feature))
+    {
+        return false;
+    }
+
     /*
     // Begin by looping through the HID_DEVICE's HID_DATA structure and setting
     //   the IsDataSet field to false to indicate that each structure has
@@ -273,6 +888,11 @@ RoutineDescription:
     bool        FeatureStatus;
     bool        Status;
 
+    if (!PrepareHidReports(HidDevice, HidP_Feature))
+    {
+        return false;
+    }
+
     /*
     // As with writing data, the IsDataSet value in all the structures should be
     //    set to false to indicate that the value has yet to have been set
@@ -337,7 +957,6 @@ RoutineDescription:
     return (Status);
 }
 
-
 bool UnpackReport(
     _In_reads_bytes_(ReportBufferLength) PCHAR ReportBuffer,
     IN       USHORT               ReportBufferLength,
@@ -509,6 +1128,13 @@ Routine Description:
 
     CurrReportID = Data->ReportID;
 
+    /*
+    // A report with every button up sets no usage at all, so the ID is
+    //   put in here rather than left to the HidP_Set calls
+    */
+
+    ReportBuffer[0] = (CHAR)CurrReportID;
+
     for (i = 0; i < DataLength; i++, Data++)
     {
         /*
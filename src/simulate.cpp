@@ -0,0 +1,677 @@
+/*++
+
+Module Name:
+
+    simulate.cpp
+
+Abstract:
+
+    Simulated HID devices. Each simulated node is described by a report
+    descriptor, either read from a file or the Alienware consumer control
+    collection built in below. Opening one of its collections for read
+    creates a SOCK_SEQPACKET socketpair, which keeps report boundaries just
+    like a hidraw node, hands one end to the caller and starts a thread that
+    writes input reports into the other: the configured usages pressed in
+    turn, each press followed by a release, in bursts of BurstLength at an
+    average of ReportsPerSecond.
+
+    The reports are packed with PackReport once, when the device is opened,
+    so the writer only has to send them and can keep up with well over 10k
+    reports per second. A report that finds the socket full is dropped and
+    counted, as the kernel drops reports when a hidraw reader falls behind;
+    the socket buffer holds a few hundred small reports. When ReportCount
+    reports have been generated, or the simulation is stopped, the writer
+    closes its end and the reader sees end of file, as on device removal.
+    With a ReplugDelay the writer then announces the node again with an
+    "add" uevent, which a loop watching for arrivals treats like the
+    kernel's.
+
+    The simulated devices go through the hidraw backend's open path and its
+    descriptor parser, so this is only available on Linux.
+
+Environment:
+
+    User mode
+
+--*/
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <sys/socket.h>
+#include "simulate.h"
+
+//
+// Pauses between bursts are cut into slices of this length so
+// StopHidSimulation is noticed at low rates.
+//
+#define SIMULATE_SLEEP_SLICE    std::chrono::milliseconds(50)
+
+//
+// Upper bound on the usages pressed in turn, which bounds the number of
+// reports prepared when a device is opened.
+//
+#define SIMULATE_MAX_USAGES     64
+
+//
+// Room for the largest descriptor hidraw hands out.
+//
+#define SIMULATE_DESCRIPTOR_SIZE 4096
+
+//
+// The Alienware consumer control collection: report ID 2, one 16 bit array
+// slot over the consumer page, macro keys at 0x4c-0x4f.
+//
+static const UCHAR consumerDescriptor[] =
+{
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02,
+    0x19, 0x00, 0x2A, 0x3C, 0x02, 0x15, 0x00, 0x26, 0x3C, 0x02,
+    0x95, 0x01, 0x75, 0x10, 0x81, 0x00,
+    0xC0
+};
+
+typedef struct _SIMULATED_STREAM
+{
+    std::string         Node;
+    HANDLE              Handle;         // Writer end of the socketpair
+    std::vector<CHAR>   Reports;        // Prepared reports as written, ReportLength bytes each
+    ULONG               ReportLength;
+} SIMULATED_STREAM, * PSIMULATED_STREAM;
+
+//
+// Kept in a list so Finished stays put while its thread runs. Writers that
+// have finished are joined whenever another device is opened, so a device
+// that is replugged over and over does not pile up threads.
+//
+typedef struct _SIMULATED_WRITER
+{
+    std::thread         Thread;
+    std::atomic<bool>   Finished;
+} SIMULATED_WRITER, * PSIMULATED_WRITER;
+
+static std::mutex                   simulationLock;
+static HID_SIMULATION               simulation;
+static std::vector<UCHAR>           simulationDescriptor;
+static bool                         simulationStarted;
+static std::list<SIMULATED_WRITER>  simulationWriters;
+static std::atomic<bool>            simulationStopped;
+
+static std::atomic<ULONGLONG>       simulatedReports;
+static std::atomic<ULONGLONG>       droppedReports;
+static std::atomic<ULONGLONG>       firstReportTime;
+static std::atomic<ULONGLONG>       lastReportTime;
+
+static bool LoadDescriptor(
+    LPCSTR              FileName,
+    std::vector<UCHAR>& Descriptor
+)
+{
+    FILE*   file;
+    size_t  length;
+
+    Descriptor.resize(SIMULATE_DESCRIPTOR_SIZE + 1);
+
+    file = fopen(FileName, "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+
+    length = fread(Descriptor.data(), 1, Descriptor.size(), file);
+    fclose(file);
+
+    if (length == 0 || length > SIMULATE_DESCRIPTOR_SIZE)
+    {
+        return false;
+    }
+
+    Descriptor.resize(length);
+    return true;
+}
+
+bool StartHidSimulation(
+    IN  const HID_SIMULATION*   Simulation
+)
+/*++
+RoutineDescription:
+   Check the descriptor and make the simulated nodes visible to
+   FindKnownHidDevices. Nothing is generated until a node is opened.
+--*/
+{
+    std::lock_guard<std::mutex> lock(simulationLock);
+    std::vector<UCHAR>          descriptor;
+    PHIDP_PREPARSED_DATA        ppd = nullptr;
+    ULONG                       numberCollections;
+
+    if (simulationStarted || Simulation->Instances == 0 || Simulation->BurstLength == 0)
+    {
+        return false;
+    }
+
+    try
+    {
+        if (Simulation->DescriptorFile == nullptr)
+        {
+            descriptor.assign(consumerDescriptor, consumerDescriptor + sizeof(consumerDescriptor));
+        }
+        else if (!LoadDescriptor(Simulation->DescriptorFile, descriptor))
+        {
+            return false;
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    if (!HidP_ParseReportDescriptor(descriptor.data(), (ULONG)descriptor.size(), 0, &ppd, &numberCollections))
+    {
+        return false;
+    }
+    HidD_FreePreparsedData(ppd);
+
+    simulation = *Simulation;
+    simulation.DescriptorFile = nullptr;
+    simulationDescriptor = std::move(descriptor);
+    simulationStopped = false;
+    simulationStarted = true;
+
+    simulatedReports = 0;
+    droppedReports = 0;
+    firstReportTime = 0;
+    lastReportTime = 0;
+    return true;
+}
+
+void StopHidSimulation(
+    void
+)
+{
+    std::list<SIMULATED_WRITER> writers;
+
+    {
+        std::lock_guard<std::mutex> lock(simulationLock);
+
+        simulationStopped = true;
+        simulationStarted = false;
+        writers.swap(simulationWriters);
+    }
+
+    for (SIMULATED_WRITER& writer : writers)
+    {
+        writer.Thread.join();
+    }
+}
+
+void GetHidSimulationStats(
+    OUT PHID_SIMULATION_STATS   Stats
+)
+{
+    ULONGLONG first = firstReportTime;
+    ULONGLONG last = lastReportTime;
+
+    Stats->Reports = simulatedReports;
+    Stats->Dropped = droppedReports;
+    Stats->Elapsed = (first != 0 && last > first) ? last - first : 0;
+}
+
+bool IsSimulatedHidNode(
+    IN  LPCSTR                  Node
+)
+{
+    return std::strncmp(Node, HID_SIMULATED_NODE, sizeof(HID_SIMULATED_NODE) - 1) == 0;
+}
+
+static bool FindSimulatedNode(
+    LPCSTR  Node
+)
+/*++
+RoutineDescription:
+   True if Node names one of the instances of the running simulation.
+   Called with simulationLock held.
+--*/
+{
+    const char*     number;
+    char*           end;
+    unsigned long   instance;
+
+    if (!simulationStarted || !IsSimulatedHidNode(Node))
+    {
+        return false;
+    }
+
+    number = Node + sizeof(HID_SIMULATED_NODE) - 1;
+    if (*number < '0' || *number > '9')
+    {
+        return false;
+    }
+
+    instance = std::strtoul(number, &end, 10);
+    return *end == '\0' && instance < simulation.Instances;
+}
+
+bool ListSimulatedHidNodes(
+    IN OUT std::vector<std::string>& Nodes
+)
+{
+    std::lock_guard<std::mutex> lock(simulationLock);
+
+    if (!simulationStarted)
+    {
+        return true;
+    }
+
+    try
+    {
+        for (ULONG instance = 0; instance < simulation.Instances; instance++)
+        {
+            Nodes.push_back(HID_SIMULATED_NODE + std::to_string(instance));
+        }
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool GetSimulatedHidDescriptor(
+    IN  LPCSTR                  Node,
+    OUT std::vector<UCHAR>&     Descriptor,
+    OUT PHIDD_ATTRIBUTES        Attributes
+)
+{
+    std::lock_guard<std::mutex> lock(simulationLock);
+
+    if (!FindSimulatedNode(Node))
+    {
+        return false;
+    }
+
+    try
+    {
+        Descriptor = simulationDescriptor;
+    }
+    catch (const std::bad_alloc&)
+    {
+        return false;
+    }
+
+    std::memset(Attributes, 0, sizeof(HIDD_ATTRIBUTES));
+    Attributes->Size = sizeof(HIDD_ATTRIBUTES);
+    Attributes->VendorID = simulation.VendorID;
+    Attributes->ProductID = simulation.ProductID;
+    return true;
+}
+
+static bool PrepareReports(
+    PHID_DEVICE         HidDevice,
+    PSIMULATED_STREAM   Stream
+)
+/*++
+RoutineDescription:
+   Pack the reports the writer cycles through: a press and a release for
+   each of the simulated usages the device has a button for. A device
+   without those usages has the usages of its first button data pressed
+   instead, and a device without buttons sends idle reports. Devices
+   without report IDs leave the ID byte out, as hidraw does.
+--*/
+{
+    ULONG       length = HidDevice->Caps.InputReportByteLength;
+    PHID_DATA   target = nullptr;
+    ULONG       first = 0;
+    ULONG       last = 0;
+    ULONG       start = 0;
+    ULONG       skip;
+
+    if (length == 0 || HidDevice->InputDataLength == 0)
+    {
+        return false;
+    }
+
+    for (ULONG i = 0; i < HidDevice->InputDataLength && target == nullptr; i++)
+    {
+        PHID_DATA data = &HidDevice->InputData[i];
+
+        if (data->IsButtonData &&
+            data->UsagePage == simulation.UsagePage &&
+            data->ButtonData.UsageMin <= simulation.UsageMax &&
+            data->ButtonData.UsageMax >= simulation.UsageMin)
+        {
+            target = data;
+            first = std::max<ULONG>(data->ButtonData.UsageMin, simulation.UsageMin);
+            last = std::min<ULONG>(data->ButtonData.UsageMax, simulation.UsageMax);
+        }
+    }
+
+    for (ULONG i = 0; i < HidDevice->InputDataLength && target == nullptr; i++)
+    {
+        PHID_DATA data = &HidDevice->InputData[i];
+
+        if (data->IsButtonData)
+        {
+            target = data;
+            first = data->ButtonData.UsageMin;
+            last = data->ButtonData.UsageMax;
+        }
+    }
+
+    for (ULONG i = 0; i < HidDevice->InputDataLength; i++)
+    {
+        PHID_DATA data = &HidDevice->InputData[i];
+
+        if (data->IsButtonData)
+        {
+            std::memset(data->ButtonData.Usages, 0, data->ButtonData.MaxUsageLength * sizeof(USAGE));
+        }
+        else
+        {
+            data->ValueData.Value = 0;
+        }
+    }
+
+    // PackReport fills in the report of the first entry it is handed
+    while (target != nullptr && HidDevice->InputData[start].ReportID != target->ReportID)
+    {
+        start++;
+    }
+
+    skip = HidDevice->InputData[start].ReportID == 0 ? 1 : 0;
+    Stream->ReportLength = length - skip;
+
+    // HidP_SetUsages stops at usage 0, so it can never be pressed
+    first = std::max<ULONG>(first, 1);
+    last = std::min<ULONG>(last, first + SIMULATE_MAX_USAGES - 1);
+
+    for (ULONG usage = first; ; usage++)
+    {
+        if (target != nullptr && usage <= last)
+        {
+            target->ButtonData.Usages[0] = (USAGE)usage;
+        }
+
+        for (ULONG release = 0; release < 2; release++)
+        {
+            if (!PackReport(HidDevice->InputReportBuffer,
+                            (USHORT)length,
+                            HidP_Input,
+                            &HidDevice->InputData[start],
+                            HidDevice->InputDataLength - start,
+                            HidDevice->Ppd))
+            {
+                return false;
+            }
+
+            Stream->Reports.insert(Stream->Reports.end(),
+                                   HidDevice->InputReportBuffer + skip,
+                                   HidDevice->InputReportBuffer + length);
+
+            if (target != nullptr)
+            {
+                target->ButtonData.Usages[0] = 0;
+            }
+        }
+
+        if (target == nullptr || usage >= last)
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+static void RecordSent(
+    ULONGLONG   Now
+)
+{
+    ULONGLONG expected = 0;
+    ULONGLONG last = lastReportTime;
+
+    simulatedReports.fetch_add(1, std::memory_order_relaxed);
+    firstReportTime.compare_exchange_strong(expected, Now);
+
+    while (last < Now && !lastReportTime.compare_exchange_weak(last, Now))
+    {
+    }
+}
+
+static void AnnounceNode(
+    const std::string&  Node,
+    ULONG               Delay
+)
+/*++
+RoutineDescription:
+   Wait Delay milliseconds, unless the simulation stops first, and send the
+   uevent the kernel would for a new hidraw node.
+--*/
+{
+    std::chrono::steady_clock::time_point   due = std::chrono::steady_clock::now() + std::chrono::milliseconds(Delay);
+    std::string                             uevent;
+
+    while (!simulationStopped && std::chrono::steady_clock::now() < due)
+    {
+        std::this_thread::sleep_until(std::min(due, std::chrono::steady_clock::now() + SIMULATE_SLEEP_SLICE));
+    }
+
+    if (simulationStopped)
+    {
+        return;
+    }
+
+    try
+    {
+        uevent = "add@/devices/virtual/simulated/" + Node;
+        uevent += '\0';
+        uevent += "ACTION=add";
+        uevent += '\0';
+        uevent += "SUBSYSTEM=hidraw";
+        uevent += '\0';
+        uevent += "DEVNAME=" + Node;
+        uevent += '\0';
+    }
+    catch (const std::bad_alloc&)
+    {
+        return;
+    }
+
+    SendHidUevent(uevent.data(), (ULONG)uevent.size());
+}
+
+static void GenerateReports(
+    SIMULATED_STREAM    Stream,
+    ULONG               ReportsPerSecond,
+    ULONG               BurstLength,
+    ULONGLONG           ReportCount,
+    ULONG               ReplugDelay,
+    std::atomic<bool>*  Finished
+)
+/*++
+RoutineDescription:
+   Writer thread of one opened device. Bursts are scheduled against
+   absolute deadlines, so a late wakeup is made up by the next burst and the
+   average rate holds. Ends when the reader closes its end, or after
+   ReportCount reports, optionally announcing the node again.
+--*/
+{
+    std::chrono::steady_clock::time_point   deadline = std::chrono::steady_clock::now();
+    std::chrono::nanoseconds                interval(0);
+    ULONG                                   numberReports = (ULONG)(Stream.Reports.size() / Stream.ReportLength);
+    ULONG                                   next = 0;
+    ULONGLONG                               generated = 0;
+    bool                                    connected = true;
+
+    if (ReportsPerSecond > 0)
+    {
+        interval = std::chrono::nanoseconds(1000000000ull * BurstLength / ReportsPerSecond);
+    }
+
+    while (connected && !simulationStopped && (ReportCount == 0 || generated < ReportCount))
+    {
+        for (ULONG i = 0; i < BurstLength && (ReportCount == 0 || generated < ReportCount); i++)
+        {
+            const CHAR* report = Stream.Reports.data() + (size_t)next * Stream.ReportLength;
+            ssize_t     written = send(Stream.Handle, report, Stream.ReportLength, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+            if (written == (ssize_t)Stream.ReportLength)
+            {
+                RecordSent(GetReportTime());
+            }
+            else if (errno == EAGAIN)
+            {
+                droppedReports.fetch_add(1, std::memory_order_relaxed);
+            }
+            else if (errno != EINTR)
+            {
+                // The reader closed the device
+                connected = false;
+                break;
+            }
+
+            generated++;
+            next = (next + 1) % numberReports;
+        }
+
+        if (interval.count() == 0)
+        {
+            continue;
+        }
+
+        deadline += interval;
+
+        while (!simulationStopped && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_until(std::min(deadline, std::chrono::steady_clock::now() + SIMULATE_SLEEP_SLICE));
+        }
+    }
+
+    CloseHandle(Stream.Handle);
+
+    if (connected && ReplugDelay > 0 && ReportCount != 0 && generated == ReportCount)
+    {
+        AnnounceNode(Stream.Node, ReplugDelay);
+    }
+
+    *Finished = true;
+}
+
+HANDLE ConnectSimulatedHidNode(
+    IN  LPCSTR                  DevicePath,
+    IN  ULONG                   CollectionIndex,
+    IN  bool                    IsOverlapped
+)
+/*++
+RoutineDescription:
+   Prepare the reports of the addressed collection, start its writer and
+   return the reader end of the socketpair, non-blocking when IsOverlapped.
+   DevicePath is the node with its collection suffix, if any.
+--*/
+{
+    std::lock_guard<std::mutex> lock(simulationLock);
+    SIMULATED_STREAM            stream;
+    PSIMULATED_WRITER           writer = nullptr;
+    HID_DEVICE                  hidDevice;
+    HIDD_ATTRIBUTES             attributes = {};
+    int                         sockets[2];
+    bool                        prepared;
+    std::string                 node;
+
+    try
+    {
+        node = DevicePath;
+        node = node.substr(0, node.rfind('&'));
+    }
+    catch (const std::bad_alloc&)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    if (!FindSimulatedNode(node.c_str()))
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    attributes.Size = sizeof(HIDD_ATTRIBUTES);
+    attributes.VendorID = simulation.VendorID;
+    attributes.ProductID = simulation.ProductID;
+
+    if (!OpenHidDeviceFromDescriptor(DevicePath,
+                                     INVALID_HANDLE_VALUE,
+                                     simulationDescriptor.data(),
+                                     (ULONG)simulationDescriptor.size(),
+                                     CollectionIndex,
+                                     &attributes,
+                                     &hidDevice))
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    try
+    {
+        prepared = PrepareReports(&hidDevice, &stream);
+    }
+    catch (const std::bad_alloc&)
+    {
+        prepared = false;
+    }
+    CloseHidDevice(&hidDevice);
+
+    if (!prepared ||
+        socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | (IsOverlapped ? SOCK_NONBLOCK : 0), 0, sockets) < 0)
+    {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    stream.Handle = sockets[1];
+    stream.Node = std::move(node);
+
+    for (auto finished = simulationWriters.begin(); finished != simulationWriters.end(); )
+    {
+        if (finished->Finished)
+        {
+            finished->Thread.join();
+            finished = simulationWriters.erase(finished);
+        }
+        else
+        {
+            finished++;
+        }
+    }
+
+    try
+    {
+        writer = &simulationWriters.emplace_back();
+        writer->Thread = std::thread(GenerateReports,
+                                     std::move(stream),
+                                     simulation.ReportsPerSecond,
+                                     simulation.BurstLength,
+                                     simulation.ReportCount,
+                                     simulation.ReplugDelay,
+                                     &writer->Finished);
+    }
+    catch (const std::exception&)
+    {
+        if (writer != nullptr)
+        {
+            simulationWriters.pop_back();
+        }
+        CloseHandle(sockets[0]);
+        CloseHandle(sockets[1]);
+        return INVALID_HANDLE_VALUE;
+    }
+
+    return sockets[0];
+}
+
+#endif // __linux__